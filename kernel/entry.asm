@@ -19,6 +19,16 @@ multiboot2_header:
     dd multiboot2_header_end - multiboot2_header ; header length
     dd -(0xE85250D6 + 0 + (multiboot2_header_end - multiboot2_header)) ; checksum
 
+    ; Framebuffer request: a linear 32 bpp mode if the firmware has one.
+    ; Optional, so GRUB stays in text mode when it cannot set it.
+    dw 5                       ; type
+    dw 1                       ; flags: optional
+    dd 20                      ; size
+    dd 1024                    ; width
+    dd 768                     ; height
+    dd 32                      ; depth
+    align 8, db 0
+
     ; End tag
     dw 0
     dw 0
@@ -31,10 +41,22 @@ multiboot2_header_end:
 section .text
 global _start
 extern kmain
+extern boot_tsc_entry          ; boot timeline stamps (src/boottime.c)
+extern boot_tsc_long_mode
 
 _start:
     cli
 
+    ; GRUB hands us the magic in EAX and the info structure in EBX.
+    mov [mb_magic], eax
+    mov [mb_info_ptr], ebx
+    mov dword [mb_info_ptr + 4], 0
+
+    ; First stamp of the boot timeline.
+    rdtsc
+    mov [boot_tsc_entry], eax
+    mov [boot_tsc_entry + 4], edx
+
     ; Set up a temporary stack in 32-bit mode.
     mov esp, stack32_top
 
@@ -69,6 +91,10 @@ _start:
 ; -------------------------
 BITS 64
 long_mode_start:
+    rdtsc
+    mov [rel boot_tsc_long_mode], eax
+    mov [rel boot_tsc_long_mode + 4], edx
+
     ; Load data segments (mostly ignored in long mode, but set them sane).
     mov ax, 0x10
     mov ds, ax
@@ -78,6 +104,16 @@ long_mode_start:
     mov gs, ax
     cld                    ; Ensure direction flag is clear for C code
 
+    ; SSE on (CR0.EM = 0, CR0.MP = 1, CR4.OSFXSR | OSXMMEXCPT). XSAVE and
+    ; AVX depend on CPUID and are enabled later by fpu_init().
+    mov rax, cr0
+    and rax, ~(1 << 2)
+    or rax, 1 << 1
+    mov cr0, rax
+    mov rax, cr4
+    or rax, (1 << 9) | (1 << 10)
+    mov cr4, rax
+
     ; Set up 64-bit stack (16-byte aligned).
     lea rsp, [rel stack64_top]
     and rsp, -16
@@ -111,7 +147,10 @@ gdt64_ptr:
     dd gdt64
 
 ; -------------------------
-; Page tables (identity map first 2 MiB using a 2 MiB page)
+; Page tables (identity map first 1 GiB using 2 MiB pages)
+;
+; The PMM places its bitmap and buddy metadata right after the kernel image,
+; which outgrows a single 2 MiB page on multi-GiB guests.
 ; -------------------------
 align 4096
 pml4:
@@ -125,8 +164,11 @@ pdpt:
 
 align 4096
 pd:
-    dq 0x00000000 + 0x083       ; 2 MiB page: present+writable+PS
-    times 511 dq 0
+%assign i 0
+%rep 512
+    dq (i << 21) + 0x083        ; 2 MiB page: present+writable+PS
+%assign i i + 1
+%endrep
 
 ; -------------------------
 ; Stacks
@@ -0,0 +1,189 @@
+#include "acpi.h"
+#include "multiboot2.h"
+#include "vmm.h"
+#include <stddef.h>
+
+struct __attribute__((packed)) acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_addr;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+};
+
+struct __attribute__((packed)) madt_header {
+    struct acpi_sdt_header sdt;
+    uint32_t lapic_addr;
+    uint32_t flags;
+};
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_ISO            2
+#define MADT_LAPIC_OVERRIDE 5
+#define MADT_X2APIC         9
+
+#define MADT_PCAT_COMPAT    (1u << 0)
+#define MADT_CPU_ENABLED    (1u << 0)
+#define MADT_CPU_ONLINE_CAP (1u << 1)
+
+static const struct acpi_sdt_header *root;  // RSDT or XSDT
+static int root_is_xsdt;
+static struct acpi_madt_info madt;
+static int madt_valid;
+
+static int checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += b[i];
+    return sum == 0;
+}
+
+static int sig_eq(const char *a, const char *b, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a[i] != b[i]) return 0;
+    }
+    return 1;
+}
+
+// Map a table in two steps: the header to learn its length, then the rest.
+static const struct acpi_sdt_header *map_table(uint64_t phys) {
+    const struct acpi_sdt_header *h = vmm_map_mmio(phys, sizeof(*h), 0);
+    if (!h || h->length < sizeof(*h)) return NULL;
+    if (!vmm_map_mmio(phys, h->length, 0)) return NULL;
+    return checksum_ok(h, h->length) ? h : NULL;
+}
+
+static const struct acpi_rsdp *rsdp_check(const struct acpi_rsdp *r) {
+    if (!sig_eq(r->signature, "RSD PTR ", 8) || !checksum_ok(r, 20)) return NULL;
+    if (r->revision >= 2 && !checksum_ok(r, r->length)) return NULL;
+    return r;
+}
+
+static const struct acpi_rsdp *rsdp_scan(uint64_t phys, uint64_t len) {
+    const uint8_t *p = vmm_map_mmio(phys, len, 0);
+    if (!p) return NULL;
+    for (uint64_t off = 0; off + sizeof(struct acpi_rsdp) <= len; off += 16) {
+        const struct acpi_rsdp *r = rsdp_check((const struct acpi_rsdp *)(p + off));
+        if (r) return r;
+    }
+    return NULL;
+}
+
+static const struct acpi_rsdp *find_rsdp(uint64_t mb_info_addr) {
+    // GRUB passes a copy of the RSDP; prefer the ACPI 2.0+ one.
+    const struct acpi_rsdp *found = NULL;
+    struct multiboot2_info_header *hdr = vmm_phys_to_virt(mb_info_addr);
+    uint8_t *tag_ptr = (uint8_t *)(hdr + 1);
+    uint8_t *end     = (uint8_t *)hdr + hdr->total_size;
+    while (tag_ptr < end) {
+        struct multiboot2_tag *tag = (struct multiboot2_tag *)tag_ptr;
+        if (tag->type == MULTIBOOT2_TAG_TYPE_END) break;
+        if (tag->type == MULTIBOOT2_TAG_TYPE_ACPI_NEW ||
+            (tag->type == MULTIBOOT2_TAG_TYPE_ACPI_OLD && !found)) {
+            const struct acpi_rsdp *r =
+                rsdp_check((const struct acpi_rsdp *)((struct multiboot2_tag_acpi *)tag + 1));
+            if (r) found = r;
+        }
+        tag_ptr += (tag->size + 7) & ~7u;
+    }
+    if (found) return found;
+
+    // Otherwise the first KiB of the EBDA, then the BIOS ROM area.
+    const uint16_t *ebda_seg = vmm_map_mmio(0x40E, sizeof(uint16_t), 0);
+    if (ebda_seg && *ebda_seg) {
+        found = rsdp_scan((uint64_t)*ebda_seg << 4, 1024);
+        if (found) return found;
+    }
+    return rsdp_scan(0xE0000, 0x20000);
+}
+
+static void parse_madt(const struct madt_header *m) {
+    madt.lapic_addr = m->lapic_addr;
+    madt.pcat_compat = (m->flags & MADT_PCAT_COMPAT) != 0;
+
+    const uint8_t *p = (const uint8_t *)(m + 1);
+    const uint8_t *end = (const uint8_t *)m + m->sdt.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        switch (p[0]) {
+        case MADT_LAPIC: {
+            uint32_t flags = *(const uint32_t *)(p + 4);
+            if ((flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAP)) &&
+                madt.cpu_count < ACPI_MAX_CPUS)
+                madt.cpu_apic_ids[madt.cpu_count++] = p[3];
+            break;
+        }
+        case MADT_X2APIC: {
+            uint32_t id = *(const uint32_t *)(p + 4);
+            uint32_t flags = *(const uint32_t *)(p + 8);
+            if ((flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAP)) &&
+                madt.cpu_count < ACPI_MAX_CPUS)
+                madt.cpu_apic_ids[madt.cpu_count++] = id;
+            break;
+        }
+        case MADT_IOAPIC:
+            if (madt.ioapic_count < ACPI_MAX_IOAPICS) {
+                struct acpi_ioapic *io = &madt.ioapics[madt.ioapic_count++];
+                io->id = p[2];
+                io->addr = *(const uint32_t *)(p + 4);
+                io->gsi_base = *(const uint32_t *)(p + 8);
+            }
+            break;
+        case MADT_ISO:
+            if (madt.override_count < ACPI_MAX_OVERRIDES) {
+                struct acpi_irq_override *o = &madt.overrides[madt.override_count++];
+                o->source = p[3];
+                o->gsi = *(const uint32_t *)(p + 4);
+                o->flags = *(const uint16_t *)(p + 8);
+            }
+            break;
+        case MADT_LAPIC_OVERRIDE:
+            madt.lapic_addr = *(const uint64_t *)(p + 4);
+            break;
+        }
+        p += p[1];
+    }
+}
+
+int acpi_init(uint64_t mb_info_addr) {
+    const struct acpi_rsdp *rsdp = find_rsdp(mb_info_addr);
+    if (!rsdp) return -1;
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_addr) {
+        root = map_table(rsdp->xsdt_addr);
+        root_is_xsdt = root != NULL;
+    }
+    if (!root) root = map_table(rsdp->rsdt_addr);
+    if (!root) return -1;
+
+    const struct acpi_sdt_header *m = acpi_find_table("APIC");
+    if (!m) return -1;
+    parse_madt((const struct madt_header *)m);
+    madt_valid = 1;
+    return 0;
+}
+
+const struct acpi_sdt_header *acpi_find_table(const char *signature) {
+    if (!root) return NULL;
+    uint32_t entry_size = root_is_xsdt ? 8 : 4;
+    uint32_t count = (root->length - sizeof(*root)) / entry_size;
+    const uint8_t *entries = (const uint8_t *)(root + 1);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t phys = root_is_xsdt ? *(const uint64_t *)(entries + i * 8)
+                                     : *(const uint32_t *)(entries + i * 4);
+        const struct acpi_sdt_header *h = vmm_map_mmio(phys, sizeof(*h), 0);
+        if (!h || !sig_eq(h->signature, signature, 4)) continue;
+        h = map_table(phys);
+        if (h) return h;
+    }
+    return NULL;
+}
+
+const struct acpi_madt_info *acpi_madt(void) {
+    return madt_valid ? &madt : NULL;
+}
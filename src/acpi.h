@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+// Minimal ACPI support: locate the RSDP, look tables up by signature and
+// decode the MADT into the interrupt-controller layout.
+
+struct __attribute__((packed)) acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+
+#define ACPI_MAX_CPUS      64
+#define ACPI_MAX_IOAPICS   4
+#define ACPI_MAX_OVERRIDES 16
+
+struct acpi_ioapic {
+    uint8_t id;
+    uint32_t addr;
+    uint32_t gsi_base;
+};
+
+// ISA IRQ `source` is wired to `gsi`. `flags` holds the MPS INTI polarity
+// (bits 0-1) and trigger mode (bits 2-3); 0 means "bus default".
+struct acpi_irq_override {
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+};
+
+struct acpi_madt_info {
+    uint64_t lapic_addr;
+    int pcat_compat;  // legacy 8259s are present
+    uint32_t cpu_count;
+    uint32_t cpu_apic_ids[ACPI_MAX_CPUS];
+    uint32_t ioapic_count;
+    struct acpi_ioapic ioapics[ACPI_MAX_IOAPICS];
+    uint32_t override_count;
+    struct acpi_irq_override overrides[ACPI_MAX_OVERRIDES];
+};
+
+// Find the RSDP (Multiboot2 ACPI tags, else the BIOS areas) and parse the
+// MADT. Needs vmm_init(). Returns 0 if a MADT was found.
+int acpi_init(uint64_t mb_info_addr);
+// Mapped, checksummed table with the given signature, or NULL.
+const struct acpi_sdt_header *acpi_find_table(const char *signature);
+const struct acpi_madt_info *acpi_madt(void);
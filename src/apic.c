@@ -0,0 +1,180 @@
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "pic.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define IA32_APIC_BASE      0x1B
+#define APIC_BASE_ENABLE    (1ULL << 11)
+#define APIC_BASE_X2APIC    (1ULL << 10)
+#define X2APIC_MSR_BASE     0x800
+
+#define APIC_SVR_ENABLE     (1u << 8)
+#define APIC_DELIVERY_NMI   (4u << 8)
+#define APIC_ICR_PENDING    (1u << 12)
+
+// IO-APIC: an index/data register pair, redirection entries from 0x10.
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WIN          0x10
+#define IOAPIC_REG_VER      0x01
+#define IOAPIC_REDTBL(n)    (0x10 + 2 * (n))
+#define IOAPIC_ACTIVE_LOW   (1u << 13)
+#define IOAPIC_LEVEL        (1u << 15)
+#define IOAPIC_MASKED       (1u << 16)
+
+struct ioapic {
+    volatile uint32_t *regs;
+    uint32_t gsi_base;
+    uint32_t count;  // redirection entries
+};
+
+static volatile uint32_t *lapic_regs;
+static int x2apic_mode;
+static int enabled;
+static struct ioapic ioapics[ACPI_MAX_IOAPICS];
+static uint32_t ioapic_count;
+
+uint32_t apic_read(uint32_t reg) {
+    if (x2apic_mode) return (uint32_t)rdmsr(X2APIC_MSR_BASE + (reg >> 4));
+    return lapic_regs[reg / 4];
+}
+
+void apic_write(uint32_t reg, uint32_t value) {
+    if (x2apic_mode) wrmsr(X2APIC_MSR_BASE + (reg >> 4), value);
+    else lapic_regs[reg / 4] = value;
+}
+
+// One WRMSR in x2APIC mode; a single uncached store otherwise.
+void apic_eoi(void) {
+    apic_write(APIC_EOI, 0);
+}
+
+uint32_t apic_id(void) {
+    uint32_t id = apic_read(APIC_ID);
+    return x2apic_mode ? id : id >> 24;
+}
+
+int apic_enabled(void) {
+    return enabled;
+}
+
+int apic_x2apic(void) {
+    return x2apic_mode;
+}
+
+static uint32_t ioapic_read(struct ioapic *io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(struct ioapic *io, uint32_t reg, uint32_t value) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WIN / 4] = value;
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].count)
+            return &ioapics[i];
+    }
+    return NULL;
+}
+
+int ioapic_route_legacy(uint8_t irq, uint8_t vector) {
+    // ISA defaults: active high, edge triggered, GSI == IRQ.
+    uint32_t gsi = irq;
+    uint16_t flags = 0;
+    const struct acpi_madt_info *madt = acpi_madt();
+    for (uint32_t i = 0; i < madt->override_count; i++) {
+        if (madt->overrides[i].source == irq) {
+            gsi = madt->overrides[i].gsi;
+            flags = madt->overrides[i].flags;
+            break;
+        }
+    }
+
+    struct ioapic *io = ioapic_for_gsi(gsi);
+    if (!io) return -1;
+
+    uint32_t low = vector;
+    if ((flags & 0x3) == 0x3) low |= IOAPIC_ACTIVE_LOW;
+    if (((flags >> 2) & 0x3) == 0x3) low |= IOAPIC_LEVEL;
+    uint32_t pin = gsi - io->gsi_base;
+    // Destination first so the entry is never live with a stale target.
+    ioapic_write(io, IOAPIC_REDTBL(pin) + 1, apic_id() << 24);
+    ioapic_write(io, IOAPIC_REDTBL(pin), low);
+    return 0;
+}
+
+// Local side, identical on every CPU. Devices come through the IO-APIC:
+// the 8259 path on LINT0 is masked and LINT1 carries NMI as on every PC.
+static void lapic_setup(void) {
+    apic_write(APIC_TPR, 0);
+    apic_write(APIC_LVT_LINT0, APIC_LVT_MASKED);
+    apic_write(APIC_LVT_LINT1, APIC_DELIVERY_NMI);
+    apic_write(APIC_LVT_ERROR, APIC_LVT_MASKED);
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+int apic_init(void) {
+    const struct acpi_madt_info *madt = acpi_madt();
+    if (!madt || !madt->ioapic_count) return -1;
+
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!((d >> 9) & 1)) return -1;
+
+    uint64_t base = rdmsr(IA32_APIC_BASE);
+    if ((c >> 21) & 1) {
+        // xAPIC must be enabled before EXTD can be set.
+        wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+        wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+        x2apic_mode = 1;
+    } else {
+        uint64_t phys = madt->lapic_addr ? madt->lapic_addr : (base & ~0xFFFULL);
+        lapic_regs = vmm_map_mmio(phys, 0x1000, VMM_NO_CACHE | VMM_WRITE_THROUGH);
+        if (!lapic_regs) return -1;
+        wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+    }
+
+    for (uint32_t i = 0; i < madt->ioapic_count; i++) {
+        struct ioapic *io = &ioapics[ioapic_count];
+        io->regs = vmm_map_mmio(madt->ioapics[i].addr, 0x20, VMM_NO_CACHE | VMM_WRITE_THROUGH);
+        if (!io->regs) continue;
+        io->gsi_base = madt->ioapics[i].gsi_base;
+        io->count = ((ioapic_read(io, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+        for (uint32_t pin = 0; pin < io->count; pin++)
+            ioapic_write(io, IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+        ioapic_count++;
+    }
+    if (!ioapic_count) return -1;
+
+    pic_mask_all();
+    lapic_setup();
+    apic_eoi();  // drop anything accepted while the 8259 was in charge
+
+    enabled = 1;
+    return 0;
+}
+
+void apic_init_ap(void) {
+    uint64_t base = rdmsr(IA32_APIC_BASE) | APIC_BASE_ENABLE;
+    wrmsr(IA32_APIC_BASE, base);
+    if (x2apic_mode) wrmsr(IA32_APIC_BASE, base | APIC_BASE_X2APIC);
+    lapic_setup();
+}
+
+void apic_send_ipi(uint32_t dest, uint32_t icr) {
+    if (x2apic_mode) {
+        // One 64-bit write; no delivery status to poll.
+        wrmsr(X2APIC_MSR_BASE + (APIC_ICR >> 4), ((uint64_t)dest << 32) | icr);
+        return;
+    }
+    uint64_t flags = irq_save();
+    lapic_regs[APIC_ICR_HIGH / 4] = dest << 24;
+    lapic_regs[APIC_ICR / 4] = icr;
+    while (lapic_regs[APIC_ICR / 4] & APIC_ICR_PENDING)
+        __asm__ __volatile__("pause");
+    irq_restore(flags);
+}
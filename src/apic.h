@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+
+// Local APIC register offsets (xAPIC MMIO layout). In x2APIC mode the same
+// register is MSR 0x800 + (offset >> 4).
+#define APIC_ID          0x020
+#define APIC_VERSION     0x030
+#define APIC_TPR         0x080
+#define APIC_EOI         0x0B0
+#define APIC_SVR         0x0F0
+#define APIC_ESR         0x280
+#define APIC_ICR         0x300
+#define APIC_ICR_HIGH    0x310
+#define APIC_LVT_TIMER   0x320
+#define APIC_LVT_LINT0   0x350
+#define APIC_LVT_LINT1   0x360
+#define APIC_LVT_ERROR   0x370
+#define APIC_TIMER_INIT  0x380
+#define APIC_TIMER_COUNT 0x390
+#define APIC_TIMER_DIV   0x3E0
+
+#define APIC_LVT_MASKED  (1u << 16)
+
+// ICR low word: delivery mode, level and the vector (SIPI: start page).
+#define APIC_IPI_FIXED   0x00000u
+#define APIC_IPI_INIT    0x04500u   // INIT, level assert
+#define APIC_IPI_SIPI    0x04600u   // start-up, level assert
+
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// Bring up the local APIC (x2APIC if supported) and the IO-APICs described
+// by the MADT, then mask the 8259s. Needs acpi_init(). Returns 0 on success;
+// on failure the 8259 stays in charge.
+int apic_init(void);
+int apic_enabled(void);
+int apic_x2apic(void);
+
+uint32_t apic_read(uint32_t reg);
+void apic_write(uint32_t reg, uint32_t value);
+void apic_eoi(void);
+uint32_t apic_id(void);
+
+// Enable this application processor's local APIC in the mode apic_init()
+// chose for the boot CPU.
+void apic_init_ap(void);
+// Send `icr` (APIC_IPI_* | vector) to the CPU with local APIC id `dest`.
+void apic_send_ipi(uint32_t dest, uint32_t icr);
+
+// Route ISA IRQ `irq` (after MADT overrides) to `vector` on this CPU.
+int ioapic_route_legacy(uint8_t irq, uint8_t vector);
@@ -0,0 +1,238 @@
+#include "bench.h"
+#include "apic.h"
+#include "console.h"
+#include "cpu.h"
+#include "irq.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096ULL
+
+#define PMM_SAMPLES     1024
+#define VMM_SAMPLES     1024
+#define IRQ_SAMPLES     1024
+#define CONSOLE_SAMPLES 128
+
+struct bench_ctx {
+    struct bench_result *out;
+    int max;
+    int count;
+    uint64_t *samples;  // PMM_SAMPLES entries, the largest suite
+};
+
+static volatile uint64_t irq_hits;
+static volatile int irq_needs_eoi;
+
+static int str_eq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// Shell sort; sample counts are small and the kernel has no qsort.
+static void sort(uint64_t *v, uint32_t n) {
+    for (uint32_t gap = n / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            uint64_t x = v[i];
+            uint32_t j = i;
+            for (; j >= gap && v[j - gap] > x; j -= gap) v[j] = v[j - gap];
+            v[j] = x;
+        }
+    }
+}
+
+static void report(struct bench_ctx *b, const char *name, uint64_t *v, uint32_t n) {
+    if (b->count >= b->max || n == 0) return;
+    sort(v, n);
+    uint32_t p99 = n * 99 / 100;
+    struct bench_result *r = &b->out[b->count++];
+    r->name = name;
+    r->samples = n;
+    r->min = v[0];
+    r->median = v[n / 2];
+    r->p99 = v[p99 < n ? p99 : n - 1];
+    r->max = v[n - 1];
+}
+
+// Take free memory down to `pct` percent of what it was, in the biggest
+// blocks available. The blocks are chained through their first two words
+// (next block, order) so no bookkeeping memory is needed.
+static uint64_t *fill_memory(uint32_t pct) {
+    uint64_t target = pmm_free_bytes() * (100 - pct) / 100;
+    uint64_t *head = NULL;
+    int order = PMM_MAX_ORDER;
+    while (order >= 0 && pmm_free_bytes() > target) {
+        if ((PAGE_SIZE << order) > pmm_free_bytes() - target) {
+            order--;
+            continue;
+        }
+        void *p = pmm_alloc_pages((unsigned)order);
+        if (!p) {
+            order--;
+            continue;
+        }
+        uint64_t *blk = vmm_phys_to_virt((uint64_t)(uintptr_t)p);
+        blk[0] = (uint64_t)(uintptr_t)head;
+        blk[1] = (uint64_t)order;
+        head = blk;
+    }
+    return head;
+}
+
+static void release_memory(uint64_t *head) {
+    while (head) {
+        uint64_t *next = (uint64_t *)(uintptr_t)head[0];
+        pmm_free_pages((void *)(uintptr_t)vmm_virt_to_phys(head), (unsigned)head[1]);
+        head = next;
+    }
+}
+
+static int bench_pmm(struct bench_ctx *b) {
+    static const uint32_t fills[] = { 0, 50, 90 };
+    static const char *const alloc_names[] = { "pmm_alloc.fill0", "pmm_alloc.fill50", "pmm_alloc.fill90" };
+    static const char *const free_names[] = { "pmm_free.fill0", "pmm_free.fill50", "pmm_free.fill90" };
+    void **pages = kmalloc(PMM_SAMPLES * sizeof(void *));
+    if (!pages) return -1;
+
+    for (uint32_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        uint64_t *held = fill_memory(fills[f]);
+        uint32_t n = 0;
+        for (; n < PMM_SAMPLES; n++) {
+            uint64_t t0 = rdtsc();
+            pages[n] = pmm_alloc();
+            b->samples[n] = rdtsc() - t0;
+            if (!pages[n]) break;
+        }
+        report(b, alloc_names[f], b->samples, n);
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t t0 = rdtsc();
+            pmm_free(pages[i]);
+            b->samples[i] = rdtsc() - t0;
+        }
+        report(b, free_names[f], b->samples, n);
+        release_memory(held);
+    }
+    kfree(pages);
+    return 0;
+}
+
+// Both run in a scratch address space that is never loaded, so only the
+// page-table updates are measured. Table allocations every 2 MiB show up
+// in the tail.
+static int bench_vmm(struct bench_ctx *b) {
+    struct vmm_space as;
+    if (vmm_space_create(&as) < 0) return -1;
+    void *frame = pmm_alloc();
+    if (!frame) {
+        vmm_space_destroy(&as);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < VMM_SAMPLES; i++) {
+        uint64_t t0 = rdtsc();
+        vmm_map_page(as.pml4, VMM_USER_BASE + i * PAGE_SIZE, (uint64_t)(uintptr_t)frame,
+                     VMM_PRESENT | VMM_WRITABLE);
+        b->samples[i] = rdtsc() - t0;
+    }
+    report(b, "vmm_map_page", b->samples, VMM_SAMPLES);
+
+    // Identity mappings in the private lower half point above physical
+    // memory; they are never walked, and unmanaged frames are left alone
+    // when the space is destroyed.
+    uint64_t base = VMM_USER_BASE + 0x40000000ULL;
+    for (uint32_t i = 0; i < VMM_SAMPLES; i++) {
+        uint64_t t0 = rdtsc();
+        vmm_identity_map(as.pml4, base + i * PAGE_SIZE, PAGE_SIZE, VMM_PRESENT | VMM_WRITABLE);
+        b->samples[i] = rdtsc() - t0;
+    }
+    report(b, "vmm_identity_map", b->samples, VMM_SAMPLES);
+
+    vmm_space_destroy(&as);
+    pmm_free(frame);
+    return 0;
+}
+
+static void bench_irq_handler(struct isr_context *frame, void *ctx) {
+    (void)ctx;
+    irq_hits++;
+    if (irq_needs_eoi) irq_eoi((uint8_t)frame->vector);
+}
+
+static int bench_irq(struct bench_ctx *b) {
+    if (irq_register(BENCH_VECTOR, bench_irq_handler, NULL) < 0) return -1;
+
+    // Software interrupt: stub, isr_common, dispatch and iretq, no
+    // controller involved.
+    irq_needs_eoi = 0;
+    for (uint32_t i = 0; i < IRQ_SAMPLES; i++) {
+        uint64_t t0 = rdtsc();
+        __asm__ __volatile__("int %0" : : "i"(BENCH_VECTOR) : "memory");
+        b->samples[i] = rdtsc() - t0;
+    }
+    report(b, "irq_int", b->samples, IRQ_SAMPLES);
+
+    // Self-IPI: adds delivery through the local APIC and the EOI.
+    if (apic_enabled()) {
+        irq_needs_eoi = 1;
+        uint32_t self = apic_id();
+        for (uint32_t i = 0; i < IRQ_SAMPLES; i++) {
+            uint64_t seen = irq_hits;
+            uint64_t t0 = rdtsc();
+            apic_send_ipi(self, APIC_IPI_FIXED | BENCH_VECTOR);
+            while (irq_hits == seen) __asm__ __volatile__("pause");
+            b->samples[i] = rdtsc() - t0;
+        }
+        report(b, "irq_ipi", b->samples, IRQ_SAMPLES);
+    }
+
+    irq_unregister(BENCH_VECTOR);
+    return 0;
+}
+
+// Once the screen is full every line scrolls it, and the flush rewrites
+// all rows.
+static int bench_console(struct bench_ctx *b) {
+    for (uint32_t i = 0; i < console_rows(); i++) console_write("\n");
+    console_flush();
+    for (uint32_t i = 0; i < CONSOLE_SAMPLES; i++) {
+        uint64_t t0 = rdtsc();
+        console_write("bench: console scroll\n");
+        console_flush();
+        b->samples[i] = rdtsc() - t0;
+    }
+    report(b, "console_scroll", b->samples, CONSOLE_SAMPLES);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(struct bench_ctx *b);
+} suites[] = {
+    { "pmm", bench_pmm },
+    { "vmm", bench_vmm },
+    { "irq", bench_irq },
+    { "console", bench_console },
+};
+
+int bench_run(const char *suite, struct bench_result *out, int max) {
+    uint32_t nsuites = sizeof(suites) / sizeof(suites[0]);
+    uint32_t i = 0;
+    if (suite) {
+        while (i < nsuites && !str_eq(suite, suites[i].name)) i++;
+        if (i == nsuites) return -1;
+    }
+
+    struct bench_ctx b = { out, max, 0, kmalloc(PMM_SAMPLES * sizeof(uint64_t)) };
+    if (!b.samples) return -1;
+    int rc = 0;
+    for (; i < nsuites && rc == 0; i++) {
+        rc = suites[i].run(&b);
+        if (suite) break;
+    }
+    kfree(b.samples);
+    return rc < 0 ? -1 : b.count;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+// Microbenchmarks of the kernel's own hot paths. Each one times many
+// single operations with rdtsc and reduces the samples to a distribution,
+// so runs on different builds can be compared directly.
+//
+// Suites: "pmm" (page alloc/free with 0/50/90% of free memory taken),
+// "vmm" (vmm_map_page and vmm_identity_map per 4 KiB page), "irq" (entry
+// and exit through isr_common, by software interrupt and by self-IPI) and
+// "console" (a line that scrolls the screen, flushed).
+
+#define BENCH_VECTOR      0xF2
+#define BENCH_MAX_RESULTS 16
+
+struct bench_result {
+    const char *name;
+    uint32_t samples;
+    uint64_t min;     // cycles
+    uint64_t median;
+    uint64_t p99;
+    uint64_t max;
+};
+
+// Run `suite` (NULL: all of them) and store up to `max` results. Returns
+// the number stored, or -1 for an unknown suite or if memory ran out.
+int bench_run(const char *suite, struct bench_result *out, int max);
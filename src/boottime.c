@@ -0,0 +1,75 @@
+#include "boottime.h"
+#include "cpu.h"
+#include "timer.h"
+
+uint64_t boot_tsc_entry;
+uint64_t boot_tsc_long_mode;
+
+static struct boot_phase phases[BOOT_MAX_PHASES] = {
+    { "entry", 0 },
+    { "long mode", 0 },
+};
+static uint32_t phase_count = 2;
+
+void boot_mark(const char *name) {
+    if (phase_count == BOOT_MAX_PHASES) return;
+    phases[phase_count].name = name;
+    phases[phase_count].tsc = rdtsc();
+    phase_count++;
+}
+
+const struct boot_phase *boot_phases(uint32_t *count) {
+    phases[0].tsc = boot_tsc_entry;
+    phases[1].tsc = boot_tsc_long_mode;
+    *count = phase_count;
+    return phases;
+}
+
+// Right-aligned decimal in `width` columns, with `frac` digits after a
+// decimal point taken from the low end of `val`.
+static void write_num(void (*write)(const char *), uint64_t val, int frac, int width) {
+    char buf[32];
+    int i = 31;
+    buf[i] = 0;
+    int digits = 0;
+    do {
+        if (frac && digits == frac) buf[--i] = '.';
+        buf[--i] = (char)('0' + val % 10);
+        val /= 10;
+        digits++;
+    } while (val || digits <= frac);
+    while (31 - i < width) buf[--i] = ' ';
+    write(&buf[i]);
+}
+
+static void write_pad(void (*write)(const char *), const char *s, int width) {
+    int len = 0;
+    while (s[len]) len++;
+    write(s);
+    while (len++ < width) write(" ");
+}
+
+void boot_timeline_write(void (*write)(const char *s)) {
+    uint32_t count;
+    const struct boot_phase *p = boot_phases(&count);
+    // ns per cycle in 32.32 fixed point; 0 until timer_init() calibrates.
+    uint64_t mult = ktime_ns_mult;
+
+    write(mult ? "PHASE         START(us)   TIME(us)      CYCLES\n"
+             : "PHASE        START(cyc)  TIME(cyc)      CYCLES\n");
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t since = p[i].tsc - p[0].tsc;
+        uint64_t took = i ? p[i].tsc - p[i - 1].tsc : 0;
+        write_pad(write, p[i].name, 10);
+        if (mult) {
+            // Nanoseconds, printed as microseconds with three decimals.
+            write_num(write, (uint64_t)(((unsigned __int128)since * mult) >> 32), 3, 13);
+            write_num(write, (uint64_t)(((unsigned __int128)took * mult) >> 32), 3, 11);
+        } else {
+            write_num(write, since, 0, 13);
+            write_num(write, took, 0, 11);
+        }
+        write_num(write, took, 0, 12);
+        write("\n");
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Boot timeline: a TSC stamp at the end of each boot phase. The first two
+// come from kernel/entry.asm (GRUB handing over, and the first 64-bit
+// instruction); kmain marks the rest. The `boottime` shell command prints
+// it, and kmain writes it to serial once boot is done.
+
+#define BOOT_MAX_PHASES 32
+
+// Written by kernel/entry.asm.
+extern uint64_t boot_tsc_entry;
+extern uint64_t boot_tsc_long_mode;
+
+struct boot_phase {
+    const char *name;
+    uint64_t tsc;  // when the phase ended
+};
+
+// End the current phase; the next one starts now. `name` must be static.
+void boot_mark(const char *name);
+const struct boot_phase *boot_phases(uint32_t *count);
+
+// The timeline as a table, one '\n'-terminated line per write(); times
+// in microseconds once the TSC is calibrated, cycles before that.
+void boot_timeline_write(void (*write)(const char *s));
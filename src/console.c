@@ -0,0 +1,240 @@
+#include "console.h"
+#include "cpu.h"
+#include "fb.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define LINE_MASK (CONSOLE_LINES - 1)
+#define BLANK     ((uint16_t)(' ' | (CONSOLE_ATTR << 8)))
+
+// Time-based flushing while output streams: often enough to look live,
+// rarely enough that a long listing costs one screen copy per interval
+// instead of one per line.
+#define CONSOLE_FLUSH_NS 20000000ULL  // 20 ms
+
+// CRT controller: index/data pair, cursor location and shape registers.
+#define CRTC_INDEX       0x3D4
+#define CRTC_DATA        0x3D5
+#define CRTC_CURSOR_START 0x0A
+#define CRTC_CURSOR_END   0x0B
+#define CRTC_CURSOR_HIGH  0x0E
+#define CRTC_CURSOR_LOW   0x0F
+
+#define TEXT_COLS 80
+#define TEXT_ROWS 25
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static uint16_t lines[CONSOLE_LINES][CONSOLE_MAX_COLS];
+static uint32_t cols = TEXT_COLS, rows = TEXT_ROWS;
+static int use_fb;
+static uint32_t top;         // ring index of screen row 0 (live view)
+static uint32_t history;     // lines above `top` that are still in the ring
+static uint32_t view_back;   // lines the view is scrolled back by
+static uint32_t row, col;
+static uint32_t dirty_lo = CONSOLE_MAX_ROWS, dirty_hi;  // screen rows, [lo, hi)
+static uint32_t hw_cursor = ~0u;  // rows * cols: hidden
+static uint64_t last_flush_ns;
+static struct spinlock lock = SPINLOCK_INIT;
+static struct console_stats stats;
+
+static volatile uint16_t *screen(void) {
+    return vmm_framebuffer ? vmm_framebuffer : (volatile uint16_t *)(uintptr_t)0xB8000;
+}
+
+static uint16_t *line(uint32_t screen_row) {
+    return lines[(top + screen_row) & LINE_MASK];
+}
+
+static void fill_line(uint16_t *l) {
+    uint64_t pattern = BLANK * 0x0001000100010001ULL;
+    void *d = l;
+    uint64_t n = CONSOLE_MAX_COLS / 4;
+    __asm__ __volatile__("rep stosq" : "+D"(d), "+c"(n) : "a"(pattern) : "memory");
+}
+
+static void mark_dirty(uint32_t lo, uint32_t hi) {
+    if (lo < dirty_lo) dirty_lo = lo;
+    if (hi > dirty_hi) dirty_hi = hi;
+}
+
+static void crtc_write(uint8_t reg, uint8_t val) {
+    outb(CRTC_INDEX, reg);
+    outb(CRTC_DATA, val);
+}
+
+static void crtc_set_cursor(uint32_t pos) {
+    if (pos == hw_cursor) return;
+    hw_cursor = pos;
+    crtc_write(CRTC_CURSOR_HIGH, (uint8_t)(pos >> 8));
+    crtc_write(CRTC_CURSOR_LOW, (uint8_t)pos);
+}
+
+static void flush_locked(void) {
+    uint64_t t0 = rdtsc();
+    uint32_t cursor = view_back ? rows * cols : row * cols + col;
+    // A drawn cursor lives in the pixels of its row, so both the row it
+    // leaves and the one it moves to are redrawn.
+    if (use_fb && cursor != hw_cursor) {
+        if (hw_cursor < rows * cols) mark_dirty(hw_cursor / cols, hw_cursor / cols + 1);
+        if (cursor < rows * cols) mark_dirty(cursor / cols, cursor / cols + 1);
+    }
+    if (dirty_lo < dirty_hi) {
+        volatile uint16_t *fb = screen();
+        for (uint32_t r = dirty_lo; r < dirty_hi; r++) {
+            const uint16_t *src = lines[(top - view_back + r) & LINE_MASK];
+            if (use_fb) {
+                fb_draw_row(r, src, cols, cursor / cols == r ? (int)(cursor % cols) : -1);
+                continue;
+            }
+            void *d = (void *)(uintptr_t)&fb[r * cols];
+            uint64_t n = cols / 4;
+            __asm__ __volatile__("rep movsq" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+        }
+        stats.rows_flushed += dirty_hi - dirty_lo;
+        dirty_lo = CONSOLE_MAX_ROWS;
+        dirty_hi = 0;
+    }
+    if (use_fb) hw_cursor = cursor;
+    else crtc_set_cursor(cursor);
+    stats.flushes++;
+    stats.flush_cycles += rdtsc() - t0;
+    last_flush_ns = ktime_ns();
+}
+
+static void newline(void) {
+    col = 0;
+    if (row + 1 < rows) {
+        row++;
+        return;
+    }
+    // Scroll: the old top line becomes history, the recycled one the new
+    // bottom row. Every screen row now shows a different line.
+    top = (top + 1) & LINE_MASK;
+    if (history < CONSOLE_LINES - rows) history++;
+    fill_line(line(rows - 1));
+    mark_dirty(0, rows);
+    stats.scrolls++;
+}
+
+static void putc_locked(char c) {
+    if (view_back) {
+        view_back = 0;
+        mark_dirty(0, rows);
+    }
+    stats.chars++;
+    if (c == '\n') {
+        newline();
+        return;
+    }
+    line(row)[col] = (uint16_t)((uint8_t)c | (CONSOLE_ATTR << 8));
+    mark_dirty(row, row + 1);
+    if (++col == cols) newline();
+}
+
+void console_init(uint32_t start_row) {
+    for (uint32_t i = 0; i < CONSOLE_LINES; i++) fill_line(lines[i]);
+    if (fb_active()) {
+        struct fb_info fi;
+        fb_get_info(&fi);
+        use_fb = 1;
+        cols = fi.cols < CONSOLE_MAX_COLS ? fi.cols : CONSOLE_MAX_COLS;
+        rows = fi.rows < CONSOLE_MAX_ROWS ? fi.rows : CONSOLE_MAX_ROWS;
+        row = col = 0;
+        mark_dirty(0, rows);
+        console_flush();
+        return;
+    }
+
+    volatile uint16_t *fb = screen();
+    for (uint32_t r = 0; r < rows; r++) {
+        for (uint32_t c = 0; c < cols; c++) lines[r][c] = fb[r * cols + c];
+    }
+    row = start_row < rows ? start_row : rows - 1;
+    col = 0;
+    // Underline cursor (scan lines 14-15), keeping the reserved bits.
+    outb(CRTC_INDEX, CRTC_CURSOR_START);
+    crtc_write(CRTC_CURSOR_START, (uint8_t)((inb(CRTC_DATA) & 0xC0) | 14));
+    outb(CRTC_INDEX, CRTC_CURSOR_END);
+    crtc_write(CRTC_CURSOR_END, (uint8_t)((inb(CRTC_DATA) & 0xE0) | 15));
+    console_flush();
+}
+
+void console_write(const char *s) {
+    uint64_t flags = spin_lock_irqsave(&lock);
+    while (*s) putc_locked(*s++);
+    if (ktime_ns() - last_flush_ns >= CONSOLE_FLUSH_NS) flush_locked();
+    spin_unlock_irqrestore(&lock, flags);
+}
+
+void console_putc(char c) {
+    char s[2] = { c, 0 };
+    console_write(s);
+}
+
+void console_backspace(void) {
+    uint64_t flags = spin_lock_irqsave(&lock);
+    if (col > 0) {
+        col--;
+        line(row)[col] = BLANK;
+        mark_dirty(row, row + 1);
+    }
+    spin_unlock_irqrestore(&lock, flags);
+}
+
+void console_clear(void) {
+    uint64_t flags = spin_lock_irqsave(&lock);
+    for (uint32_t r = 0; r < rows; r++) fill_line(line(r));
+    row = col = 0;
+    view_back = 0;
+    mark_dirty(0, rows);
+    flush_locked();
+    spin_unlock_irqrestore(&lock, flags);
+}
+
+uint32_t console_col(void) {
+    return col;
+}
+
+uint32_t console_cols(void) {
+    return cols;
+}
+
+uint32_t console_rows(void) {
+    return rows;
+}
+
+void console_flush(void) {
+    uint64_t flags = spin_lock_irqsave(&lock);
+    flush_locked();
+    spin_unlock_irqrestore(&lock, flags);
+}
+
+void console_scroll_view(int n) {
+    uint64_t flags = spin_lock_irqsave(&lock);
+    int64_t back = (int64_t)view_back + n;
+    if (back < 0) back = 0;
+    if (back > (int64_t)history) back = history;
+    if ((uint32_t)back != view_back) {
+        view_back = (uint32_t)back;
+        mark_dirty(0, rows);
+    }
+    flush_locked();
+    spin_unlock_irqrestore(&lock, flags);
+}
+
+void console_get_stats(struct console_stats *out) {
+    uint64_t flags = spin_lock_irqsave(&lock);
+    *out = stats;
+    spin_unlock_irqrestore(&lock, flags);
+}
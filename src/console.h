@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+
+// Text console on the VGA text buffer or, when the bootloader set up a
+// linear framebuffer, on that (fb.c). Output goes into a RAM ring of
+// lines; scrolling just advances the ring, and console_flush() copies the
+// rows that changed to the screen in bulk and moves the cursor. Lines that
+// scroll off stay in the ring as scrollback.
+
+#define CONSOLE_MAX_COLS 256
+#define CONSOLE_MAX_ROWS 128
+#define CONSOLE_LINES    256  // ring size, screen included; power of two
+#define CONSOLE_ATTR     0x0F // white on black
+
+// On VGA text mode, adopt what is already on screen and put the cursor on
+// `row`; a framebuffer console starts out blank. Call after vmm_init()
+// and fb_init().
+void console_init(uint32_t row);
+
+// Write to the shadow buffer. Flushes on its own at most every
+// CONSOLE_FLUSH_NS while output streams; call console_flush() when done.
+void console_write(const char *s);
+void console_putc(char c);
+// Step the cursor back one column and blank that cell.
+void console_backspace(void);
+void console_clear(void);
+uint32_t console_col(void);
+// Screen size in text cells.
+uint32_t console_cols(void);
+uint32_t console_rows(void);
+
+void console_flush(void);
+
+// Move the view `lines` back into the scrollback (negative: forward).
+// The next write returns to the live screen.
+void console_scroll_view(int lines);
+
+struct console_stats {
+    uint64_t chars;
+    uint64_t scrolls;
+    uint64_t flushes;
+    uint64_t rows_flushed;
+    uint64_t flush_cycles;
+};
+void console_get_stats(struct console_stats *out);
@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+
+// Small wrappers around x86_64 instructions shared by several subsystems.
+
+#ifdef KERNEL_HOSTED
+// Host test build (tests/host): user-mode stand-ins for the privileged
+// instructions.
+#include "host_cpu.h"
+#else
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+static inline void invlpg(uint64_t virt) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t v;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr3(uint64_t v) {
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+// INVPCID type 1: drop all non-global entries tagged with `pcid`.
+static inline void invpcid_single(uint16_t pcid) {
+    struct { uint64_t pcid, addr; } desc = { pcid, 0 };
+    __asm__ __volatile__("invpcid %0, %1" : : "m"(desc), "r"(1ULL) : "memory");
+}
+
+// Disable interrupts, returning the previous RFLAGS for irq_restore().
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ __volatile__("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1ULL << 9)) __asm__ __volatile__("sti" ::: "memory");
+}
+
+static inline uint64_t read_cr2(void) {
+    uint64_t v;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)v), "d"((uint32_t)(v >> 32))
+                         : "memory");
+}
+
+// Clear CR0.TS without a read-modify-write of CR0.
+static inline void clts(void) {
+    __asm__ __volatile__("clts" ::: "memory");
+}
+
+static inline uint64_t xgetbv(uint32_t index) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void xsetbv(uint32_t index, uint64_t v) {
+    __asm__ __volatile__("xsetbv" : : "c"(index), "a"((uint32_t)v), "d"((uint32_t)(v >> 32))
+                         : "memory");
+}
+
+// Arm address monitoring on the cache line holding `addr`.
+static inline void monitor(const volatile void *addr) {
+    __asm__ __volatile__("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+}
+
+// Enable interrupts and wait for a store to the monitored line or an
+// interrupt. STI's one-instruction shadow covers the MWAIT.
+static inline void sti_mwait(uint32_t hint) {
+    __asm__ __volatile__("sti; mwait" : : "a"(hint), "c"(0) : "memory");
+}
+
+#endif // KERNEL_HOSTED
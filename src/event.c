@@ -0,0 +1,174 @@
+#include "event.h"
+#include "cpu.h"
+#include "idle.h"
+#include "timer.h"
+#include <stddef.h>
+
+static struct event *all_events;
+
+static struct work *work_head;
+static struct work *work_tail;
+static struct wait_queue work_waiters = WAIT_QUEUE_INIT;
+static struct work_stats wstats;
+
+static void lat_record(uint64_t *min, uint64_t *max, uint64_t *total, uint64_t lat) {
+    if (!*min || lat < *min) *min = lat;
+    if (lat > *max) *max = lat;
+    *total += lat;
+}
+
+void event_init(struct event *ev, const char *name) {
+    ev->signaled = 0;
+    ev->waiters.head = ev->waiters.tail = NULL;
+    ev->stats = (struct event_stats){ .name = name };
+    uint64_t flags = irq_save();
+    ev->next = all_events;
+    all_events = ev;
+    irq_restore(flags);
+}
+
+void event_signal(struct event *ev) {
+    uint64_t flags = irq_save();
+    if (!ev->signaled) {
+        ev->signaled = 1;
+        ev->signal_tsc = rdtsc();
+    }
+    ev->stats.signals++;
+    sched_wake_all(&ev->waiters);
+    irq_restore(flags);
+}
+
+void event_wait(struct event *ev) {
+    uint64_t flags = irq_save();
+    if (!ev->signaled) {
+        while (!ev->signaled) sched_wait(&ev->waiters);
+        ev->stats.wakeups++;
+        lat_record(&ev->stats.lat_min, &ev->stats.lat_max, &ev->stats.lat_total,
+                   rdtsc() - ev->signal_tsc);
+    }
+    ev->signaled = 0;
+    irq_restore(flags);
+}
+
+void work_init(struct work *w, work_fn fn, void *arg) {
+    w->next = NULL;
+    w->fn = fn;
+    w->arg = arg;
+    w->queued = 0;
+}
+
+int work_post(struct work *w) {
+    uint64_t flags = irq_save();
+    if (w->queued) {
+        irq_restore(flags);
+        return 0;
+    }
+    w->queued = 1;
+    w->next = NULL;
+    w->post_tsc = rdtsc();
+    if (work_tail) work_tail->next = w;
+    else work_head = w;
+    work_tail = w;
+    wstats.posted++;
+    sched_wake_one(&work_waiters);
+    irq_restore(flags);
+    return 1;
+}
+
+// Items run with interrupts enabled and may re-post themselves.
+static void events_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        irq_save();
+        while (!work_head) sched_wait(&work_waiters);
+        struct work *w = work_head;
+        work_head = w->next;
+        if (!work_head) work_tail = NULL;
+        w->queued = 0;
+        lat_record(&wstats.lat_min, &wstats.lat_max, &wstats.lat_total, rdtsc() - w->post_tsc);
+        wstats.run++;
+        __asm__ __volatile__("sti" ::: "memory");
+        w->fn(w->arg);
+    }
+}
+
+static struct event bench_event;
+
+void events_init(void) {
+    event_init(&bench_event, "wakebench");
+    thread_create("events", events_thread, NULL, EVENTS_THREAD_PRIO);
+}
+
+int event_get_stats(uint32_t index, struct event_stats *out) {
+    uint64_t flags = irq_save();
+    struct event *ev = all_events;
+    while (ev && index--) ev = ev->next;
+    if (ev) *out = ev->stats;
+    irq_restore(flags);
+    return ev ? 0 : -1;
+}
+
+void work_get_stats(struct work_stats *out) {
+    uint64_t flags = irq_save();
+    *out = wstats;
+    irq_restore(flags);
+}
+
+// Wake-up benchmark. The timer callback stamps how late it ran and then
+// either signals bench_event or posts bench_work; the consumer stamps how
+// long the hand-off took.
+#define BENCH_DELAY_NS 200000
+
+static struct work bench_work;
+static struct event bench_done;
+static uint64_t bench_irq_late_ns;
+static uint64_t bench_work_cycles;
+
+static void bench_work_fn(void *arg) {
+    (void)arg;
+    bench_work_cycles = rdtsc() - bench_work.post_tsc;
+    event_signal(&bench_done);
+}
+
+static void bench_timer_fn(struct timer *t, void *ctx) {
+    bench_irq_late_ns = ktime_ns() - t->expires;
+    if (ctx) work_post(&bench_work);
+    else event_signal(&bench_event);
+}
+
+int wake_bench(uint32_t iterations, int mwait, struct wake_bench *out) {
+    if (!iterations) return -1;
+    struct timer t;
+    uint64_t irq_total = 0, ev_total = 0, work_total = 0;
+    *out = (struct wake_bench){ .iterations = iterations };
+    work_init(&bench_work, bench_work_fn, NULL);
+    bench_done = (struct event){ 0 };
+    bench_event.signaled = 0;
+    int old = idle_set_mwait(mwait);
+
+    for (uint32_t i = 0; i < 2 * iterations; i++) {
+        int use_work = i >= iterations;
+        timer_setup(&t, bench_timer_fn, use_work ? &bench_work : NULL);
+        timer_arm(&t, ktime_ns() + BENCH_DELAY_NS);
+        uint64_t lat;
+        if (use_work) {
+            event_wait(&bench_done);
+            lat = bench_work_cycles;
+            work_total += lat;
+            if (lat > out->work_cycles_max) out->work_cycles_max = lat;
+        } else {
+            event_wait(&bench_event);
+            lat = rdtsc() - bench_event.signal_tsc;
+            ev_total += lat;
+            if (lat > out->event_cycles_max) out->event_cycles_max = lat;
+        }
+        irq_total += bench_irq_late_ns;
+        if (bench_irq_late_ns > out->irq_ns_max) out->irq_ns_max = bench_irq_late_ns;
+    }
+
+    idle_set_mwait(old);
+    out->irq_ns_avg = irq_total / (2 * iterations);
+    out->event_cycles_avg = ev_total / iterations;
+    out->work_cycles_avg = work_total / iterations;
+    return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include "sched.h"
+
+// Events and deferred work, so interrupt handlers can hand off to threads
+// instead of being polled for.
+//
+// An event is a sticky flag plus waiters: event_signal() sets it and wakes
+// them, event_wait() blocks until it is set and clears it. A signal with
+// nobody waiting is kept, so no wake-up is lost.
+//
+// Work items run in the "events" thread, above every regular priority, for
+// anything too long or too lock-happy for the handler itself.
+//
+// Both are for the boot CPU: its interrupt handlers and threads.
+
+struct event_stats {
+    const char *name;
+    uint64_t signals;
+    uint64_t wakeups;    // waits that blocked and were woken by a signal
+    uint64_t lat_min;    // cycles from signal to the waiter running again
+    uint64_t lat_max;
+    uint64_t lat_total;
+};
+
+struct event {
+    volatile uint32_t signaled;
+    uint64_t signal_tsc;
+    struct wait_queue waiters;
+    struct event *next;  // registered events, for event_get_stats()
+    struct event_stats stats;
+};
+
+void event_init(struct event *ev, const char *name);
+void event_signal(struct event *ev);
+void event_wait(struct event *ev);
+
+typedef void (*work_fn)(void *arg);
+
+struct work {
+    struct work *next;
+    work_fn fn;
+    void *arg;
+    uint64_t post_tsc;
+    uint8_t queued;
+};
+
+void work_init(struct work *w, work_fn fn, void *arg);
+// Queue `w` unless it already is (returns 0 then). Safe from interrupts.
+int work_post(struct work *w);
+
+#define EVENTS_THREAD_PRIO 1
+
+// Start the events thread. Needs sched_init().
+void events_init(void);
+
+// Fill `out` for the index-th event; returns 0, or -1 past the last one.
+int event_get_stats(uint32_t index, struct event_stats *out);
+
+struct work_stats {
+    uint64_t posted;
+    uint64_t run;
+    uint64_t lat_min;    // cycles from work_post() to the item running
+    uint64_t lat_max;
+    uint64_t lat_total;
+};
+void work_get_stats(struct work_stats *out);
+
+// Timer interrupt to consumer, repeated `iterations` times with the CPU
+// idle in between, sleeping with MWAIT (`mwait` set) or HLT.
+struct wake_bench {
+    uint32_t iterations;
+    uint64_t irq_ns_avg;       // timer deadline -> handler
+    uint64_t irq_ns_max;
+    uint64_t event_cycles_avg; // handler -> thread blocked in event_wait
+    uint64_t event_cycles_max;
+    uint64_t work_cycles_avg;  // handler -> work item
+    uint64_t work_cycles_max;
+};
+int wake_bench(uint32_t iterations, int mwait, struct wake_bench *out);
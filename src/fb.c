@@ -0,0 +1,130 @@
+#include "fb.h"
+#include "font.h"
+#include "kmalloc.h"
+#include "multiboot2.h"
+#include "simd.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define GLYPHS 128  // ASCII; anything else draws as '?'
+
+// Cursor: the bottom two scan lines of the cell, as in text mode.
+#define CURSOR_TOP (FB_GLYPH_HEIGHT - 2)
+
+static struct fb_info info;
+static int active;
+static uint8_t *fb;
+static uint32_t fg, bg;
+
+// Every glyph rendered in the console colours: one 32-byte scan line per
+// row, so drawing a cell is four 8-byte stores per line.
+static uint32_t glyphs[GLYPHS][FB_GLYPH_HEIGHT][FB_GLYPH_WIDTH] __attribute__((aligned(64)));
+
+// One text row of pixels, composed here before a single copy to the
+// framebuffer. Write-combining memory is fast only for sequential stores.
+static uint32_t *stage;
+static uint64_t stage_pitch;
+
+static uint32_t pack(const struct multiboot2_tag_framebuffer *t, uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t)(r >> (8 - t->red_size)) << t->red_position) |
+           ((uint32_t)(g >> (8 - t->green_size)) << t->green_position) |
+           ((uint32_t)(b >> (8 - t->blue_size)) << t->blue_position);
+}
+
+static const struct multiboot2_tag_framebuffer *find_tag(uint64_t mb_info_addr) {
+    struct multiboot2_info_header *hdr = vmm_phys_to_virt(mb_info_addr);
+    uint8_t *tag_ptr = (uint8_t *)(hdr + 1);
+    uint8_t *end     = (uint8_t *)hdr + hdr->total_size;
+    while (tag_ptr < end) {
+        struct multiboot2_tag *tag = (struct multiboot2_tag *)tag_ptr;
+        if (tag->type == MULTIBOOT2_TAG_TYPE_END) break;
+        if (tag->type == MULTIBOOT2_TAG_TYPE_FRAMEBUFFER)
+            return (const struct multiboot2_tag_framebuffer *)tag;
+        tag_ptr += (tag->size + 7) & ~7u;
+    }
+    return NULL;
+}
+
+// Font rows are doubled to fill the 16-line cell.
+static void build_glyphs(void) {
+    for (uint32_t ch = 0; ch < GLYPHS; ch++) {
+        for (uint32_t y = 0; y < FB_GLYPH_HEIGHT; y++) {
+            uint8_t bits = 0;
+            if (ch >= FONT_FIRST && ch <= FONT_LAST)
+                bits = font8x8[ch - FONT_FIRST][y * FONT_HEIGHT / FB_GLYPH_HEIGHT];
+            for (uint32_t x = 0; x < FB_GLYPH_WIDTH; x++)
+                glyphs[ch][y][x] = (bits & (0x80 >> x)) ? fg : bg;
+        }
+    }
+}
+
+int fb_init(uint64_t mb_info_addr) {
+    const struct multiboot2_tag_framebuffer *t = find_tag(mb_info_addr);
+    if (!t || t->fb_type != MULTIBOOT2_FRAMEBUFFER_TYPE_RGB || t->bpp != 32) return -1;
+    if (t->width < FB_GLYPH_WIDTH || t->height < FB_GLYPH_HEIGHT) return -1;
+
+    info.phys = t->addr;
+    info.width = t->width;
+    info.height = t->height;
+    info.pitch = t->pitch;
+    info.bpp = t->bpp;
+    info.cols = t->width / FB_GLYPH_WIDTH;
+    info.rows = t->height / FB_GLYPH_HEIGHT;
+
+    stage_pitch = (uint64_t)info.cols * FB_GLYPH_WIDTH * 4;
+    stage = kmalloc(stage_pitch * FB_GLYPH_HEIGHT);
+    if (!stage) return -1;
+    fb = vmm_map_mmio(info.phys, (uint64_t)info.pitch * info.height, VMM_WRITE_COMBINING);
+    if (!fb) {
+        kfree(stage);
+        return -1;
+    }
+    info.write_combining = (uint8_t)vmm_pat_enabled();
+
+    fg = pack(t, 0xFF, 0xFF, 0xFF);
+    bg = pack(t, 0x00, 0x00, 0x00);
+    build_glyphs();
+
+    // The margins right of and below the text grid are never drawn again.
+    for (uint32_t y = 0; y < info.height; y++)
+        simd_fill32((uint32_t *)(fb + (uint64_t)y * info.pitch), bg, info.width);
+    active = 1;
+    return 0;
+}
+
+int fb_active(void) {
+    return active;
+}
+
+void fb_get_info(struct fb_info *out) {
+    *out = info;
+}
+
+void fb_draw_row(uint32_t row, const uint16_t *cells, uint32_t count, int cursor) {
+    if (!active || row >= info.rows) return;
+    if (count > info.cols) count = info.cols;
+
+    // Scan line by scan line, so the stores into `stage` stay sequential.
+    for (uint32_t y = 0; y < FB_GLYPH_HEIGHT; y++) {
+        uint64_t *dst = (uint64_t *)((uint8_t *)stage + y * stage_pitch);
+        for (uint32_t c = 0; c < count; c++, dst += 4) {
+            uint8_t ch = (uint8_t)cells[c];
+            const uint64_t *src = (const uint64_t *)glyphs[ch < GLYPHS ? ch : '?'][y];
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = src[3];
+        }
+    }
+    if (cursor >= 0 && (uint32_t)cursor < count) {
+        for (uint32_t y = CURSOR_TOP; y < FB_GLYPH_HEIGHT; y++) {
+            uint32_t *p = (uint32_t *)((uint8_t *)stage + y * stage_pitch) + cursor * FB_GLYPH_WIDTH;
+            for (uint32_t x = 0; x < FB_GLYPH_WIDTH; x++) p[x] = fg;
+        }
+    }
+
+    simd_blit(fb + (uint64_t)row * FB_GLYPH_HEIGHT * info.pitch, info.pitch, stage, stage_pitch,
+              (uint64_t)count * FB_GLYPH_WIDTH * 4, FB_GLYPH_HEIGHT);
+    // Drain the write-combining buffers so the row shows up now.
+    __asm__ __volatile__("sfence" ::: "memory");
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+// Linear framebuffer console backend. The bootloader sets the mode (see
+// the framebuffer request in entry.asm); we map it write-combining and
+// draw text rows from a cache of pre-rendered glyphs, each row composed in
+// RAM and sent to the framebuffer as one sequential copy.
+
+#define FB_GLYPH_WIDTH  8
+#define FB_GLYPH_HEIGHT 16
+
+struct fb_info {
+    uint64_t phys;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+    uint32_t cols;   // text cells
+    uint32_t rows;
+    uint8_t  bpp;
+    uint8_t  write_combining;
+};
+
+// Use the Multiboot2 framebuffer tag if it describes a 32 bpp RGB mode.
+// Returns 0 on success, -1 to stay on VGA text mode. Call after
+// kmalloc_init() and fpu_init().
+int fb_init(uint64_t mb_info_addr);
+int fb_active(void);
+void fb_get_info(struct fb_info *out);
+
+// Draw `count` text cells (character in the low byte) as text row `row`,
+// with an underline cursor at column `cursor` (-1: none).
+void fb_draw_row(uint32_t row, const uint16_t *cells, uint32_t count, int cursor);
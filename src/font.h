@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+
+// Built-in bitmap font for printable ASCII, FONT_FIRST to FONT_LAST. One
+// byte per scan line, most significant bit leftmost. Glyphs are 5 pixels
+// wide with a one-pixel left margin; rows 0-6 sit on the baseline and row
+// 7 holds descenders.
+
+#define FONT_FIRST  0x20
+#define FONT_LAST   0x7E
+#define FONT_WIDTH  8
+#define FONT_HEIGHT 8
+
+extern const uint8_t font8x8[FONT_LAST - FONT_FIRST + 1][FONT_HEIGHT];
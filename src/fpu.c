@@ -0,0 +1,246 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "idt.h"
+#include "irq.h"
+#include "kmalloc.h"
+#include "percpu.h"
+#include <stddef.h>
+
+#define CR0_MP (1ULL << 1)
+#define CR0_EM (1ULL << 2)
+#define CR0_TS (1ULL << 3)
+#define CR0_NE (1ULL << 5)
+#define CR4_OSXSAVE (1ULL << 18)
+
+#define MSR_IA32_XSS 0xDA0
+
+// Reset values loaded into fresh states.
+#define FCW_DEFAULT   0x037F
+#define MXCSR_DEFAULT 0x1F80
+
+enum save_mode { SAVE_FXSAVE, SAVE_XSAVE, SAVE_XSAVEOPT, SAVE_XSAVES };
+
+static const char *const save_names[] = { "fxsave", "xsave", "xsaveopt", "xsaves" };
+
+struct fpu_state {
+    uint8_t area[1];  // area_size bytes, 64-byte aligned
+};
+
+static enum save_mode save_mode = SAVE_FXSAVE;
+static uint64_t xcr0;
+static uint32_t area_size = 512;
+static struct fpu_stats stats;
+static struct kmem_cache *state_cache;
+static int use_xss;
+
+static uint8_t init_area[FPU_AREA_MAX] __attribute__((aligned(64)));
+
+static void fpu_save(void *area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    switch (save_mode) {
+    case SAVE_XSAVES:
+        __asm__ __volatile__("xsaves64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case SAVE_XSAVEOPT:
+        __asm__ __volatile__("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case SAVE_XSAVE:
+        __asm__ __volatile__("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    default:
+        __asm__ __volatile__("fxsave64 (%0)" : : "r"(area) : "memory");
+        break;
+    }
+    stats.saves++;
+}
+
+static void fpu_restore(const void *area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    switch (save_mode) {
+    case SAVE_XSAVES:
+        __asm__ __volatile__("xrstors64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case SAVE_XSAVEOPT:
+    case SAVE_XSAVE:
+        __asm__ __volatile__("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    default:
+        __asm__ __volatile__("fxrstor64 (%0)" : : "r"(area) : "memory");
+        break;
+    }
+    stats.restores++;
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+// First vector instruction after fpu_switch_to() left CR0.TS set: move the
+// registers to their owner's area and load the running context's state.
+static void nm_handler(struct isr_context *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    struct fpu_cpu *fc = &this_cpu()->fpu;
+    clts();
+    stats.nm_traps++;
+    if (fc->owner == fc->current) return;
+    if (fc->owner) fpu_save(fc->owner);
+    if (fc->current) fpu_restore(fc->current);
+    fc->owner = fc->current;
+}
+
+// Size of the save area for the enabled components.
+static uint32_t xsave_area_size(void) {
+    uint32_t a, b, c, d;
+    cpuid(0xD, save_mode == SAVE_XSAVES ? 1 : 0, &a, &b, &c, &d);
+    return b;
+}
+
+// Control registers and XCR0 for the chosen components, on this CPU.
+static void fpu_setup_cpu(void) {
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    if (!xcr0) return;
+    write_cr4(read_cr4() | CR4_OSXSAVE);
+    xsetbv(0, xcr0);
+    // No supervisor components: XSAVES is used for its compacted format
+    // and init/modified optimizations only.
+    if (use_xss) wrmsr(MSR_IA32_XSS, 0);
+}
+
+void fpu_init(void) {
+    uint32_t a, b, c, d;
+    uint32_t max_leaf;
+    cpuid(0, 0, &max_leaf, &b, &c, &d);
+    cpuid(1, 0, &a, &b, &c, &d);
+    int has_xsave = (c >> 26) & 1;
+    int has_avx = (c >> 28) & 1;
+    uint32_t ext_b = 0;
+    if (max_leaf >= 7) cpuid(7, 0, &a, &ext_b, &c, &d);
+
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+    if (has_xsave && max_leaf >= 0xD) {
+        write_cr4(read_cr4() | CR4_OSXSAVE);
+
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        uint64_t supported = ((uint64_t)d << 32) | a;
+        uint64_t want = XFEATURE_X87 | XFEATURE_SSE;
+        if (has_avx) want |= XFEATURE_AVX;
+        if (has_avx && ((ext_b >> 16) & 1)) want |= XFEATURE_AVX512;  // AVX512F
+        xcr0 = want & supported;
+        if ((xcr0 & XFEATURE_AVX512) != XFEATURE_AVX512) xcr0 &= ~XFEATURE_AVX512;
+        xsetbv(0, xcr0);
+
+        cpuid(0xD, 1, &a, &b, &c, &d);
+        if (a & (1u << 3)) {
+            use_xss = 1;
+            wrmsr(MSR_IA32_XSS, 0);
+            save_mode = SAVE_XSAVES;
+        } else if (a & 1u) {
+            save_mode = SAVE_XSAVEOPT;
+        } else {
+            save_mode = SAVE_XSAVE;
+        }
+
+        area_size = xsave_area_size();
+        if (area_size > FPU_AREA_MAX) {
+            xcr0 &= ~XFEATURE_AVX512;
+            xsetbv(0, xcr0);
+            area_size = xsave_area_size();
+        }
+    }
+
+    stats.save_insn = save_names[save_mode];
+    stats.xcr0 = xcr0;
+    stats.area_size = area_size;
+    stats.avx = (xcr0 & XFEATURE_AVX) != 0;
+    stats.avx2 = stats.avx && ((ext_b >> 5) & 1);
+    stats.avx512 = (xcr0 & XFEATURE_AVX512) != 0;
+
+    // Capture the reset state once; fresh states are copies of it.
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    uint16_t fcw = FCW_DEFAULT;
+    __asm__ __volatile__("fninit; fldcw %0; ldmxcsr %1" : : "m"(fcw), "m"(mxcsr));
+    fpu_save(init_area);
+
+    irq_register(FPU_NM_VECTOR, nm_handler, NULL);
+}
+
+void fpu_init_ap(void) {
+    fpu_setup_cpu();
+    uint32_t mxcsr = MXCSR_DEFAULT;
+    uint16_t fcw = FCW_DEFAULT;
+    __asm__ __volatile__("fninit; fldcw %0; ldmxcsr %1" : : "m"(fcw), "m"(mxcsr));
+}
+
+struct fpu_state *fpu_state_alloc(void) {
+    struct fpu_state *s;
+    if (area_size <= KMALLOC_MAX_SMALL) {
+        if (!state_cache) state_cache = kmem_cache_create("fpu_state", area_size, 64, NULL);
+        s = state_cache ? kmem_cache_alloc(state_cache) : NULL;
+    } else {
+        s = kmalloc(area_size);  // whole pages, so already aligned
+    }
+    if (s) {
+        void *dst = s;
+        const void *src = init_area;
+        uint64_t n = area_size;
+        __asm__ __volatile__("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+    }
+    return s;
+}
+
+// States belong to threads, which only run on the boot CPU.
+void fpu_state_free(struct fpu_state *state) {
+    if (!state) return;
+    uint64_t flags = irq_save();
+    struct fpu_cpu *fc = &this_cpu()->fpu;
+    // Registers belonging to a dead state need not be saved.
+    if (fc->owner == state) fc->owner = NULL;
+    if (fc->current == state) fc->current = NULL;
+    irq_restore(flags);
+    kfree(state);
+}
+
+void fpu_switch_to(struct fpu_state *next) {
+    struct fpu_cpu *fc = &this_cpu()->fpu;
+    fc->current = next;
+    if (fc->owner == next) clts();
+    else stts();
+}
+
+void kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    struct fpu_cpu *fc = &this_cpu()->fpu;
+    clts();
+    if (fc->depth > FPU_NEST_MAX) __builtin_trap();
+    if (fc->depth > 0) {
+        // Interrupted another section: its registers are live.
+        fpu_save(fc->nest[fc->depth - 1]);
+        stats.nested_sections++;
+    } else if (fc->owner) {
+        // Send the owner's state home; #NM brings it back on next use.
+        fpu_save(fc->owner);
+        fc->owner = NULL;
+    }
+    fc->depth++;
+    stats.kernel_sections++;
+    irq_restore(flags);
+}
+
+void kernel_fpu_end(void) {
+    uint64_t flags = irq_save();
+    struct fpu_cpu *fc = &this_cpu()->fpu;
+    fc->depth--;
+    if (fc->depth > 0) fpu_restore(fc->nest[fc->depth - 1]);
+    else if (fc->current) stts();
+    irq_restore(flags);
+}
+
+int kernel_fpu_active(void) {
+    return this_cpu()->fpu.depth != 0;
+}
+
+void fpu_get_stats(struct fpu_stats *out) {
+    *out = stats;
+}
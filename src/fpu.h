@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+
+// x87/SSE/AVX state management. Kernel C is built with -mgeneral-regs-only,
+// so vector registers only change inside kernel_fpu_begin/end sections
+// (see simd.c) or in code that owns a struct fpu_state.
+//
+// State is switched lazily: fpu_switch_to() sets CR0.TS when the incoming
+// state is not the one in the registers, and the #NM trap on first use
+// saves the previous owner and restores the new one.
+
+#define FPU_NM_VECTOR 7
+
+// XSAVE state components (XCR0 bits).
+#define XFEATURE_X87       (1ULL << 0)
+#define XFEATURE_SSE       (1ULL << 1)
+#define XFEATURE_AVX       (1ULL << 2)
+#define XFEATURE_OPMASK    (1ULL << 5)
+#define XFEATURE_ZMM_HI256 (1ULL << 6)
+#define XFEATURE_HI16_ZMM  (1ULL << 7)
+#define XFEATURE_AVX512    (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+// Opaque XSAVE/FXSAVE area, 64-byte aligned.
+struct fpu_state;
+
+// Largest area we are prepared to handle. x87 through AVX-512 needs about
+// 2.7 KiB; anything bigger (AMX tiles) is left disabled in XCR0.
+#define FPU_AREA_MAX 4096
+// Saved contexts for interrupted kernel_fpu sections, so up to
+// FPU_NEST_MAX + 1 sections can be open at once.
+#define FPU_NEST_MAX 2
+
+// Per-CPU register ownership (lives in struct percpu). The registers hold
+// `owner`'s values; `current` is what the running context expects. They
+// differ only while CR0.TS is set or inside a kernel_fpu section.
+struct fpu_cpu {
+    uint8_t nest[FPU_NEST_MAX][FPU_AREA_MAX] __attribute__((aligned(64)));
+    struct fpu_state *owner;
+    struct fpu_state *current;
+    uint32_t depth;
+};
+
+// Enable XSAVE and the supported components in XCR0, pick the save
+// instruction and install the #NM handler. SSE itself is already on
+// (entry.asm). Needs kmalloc only for fpu_state_alloc().
+void fpu_init(void);
+// Same register setup on an application processor, after fpu_init().
+void fpu_init_ap(void);
+
+// A fresh state in the reset configuration; free with fpu_state_free().
+struct fpu_state *fpu_state_alloc(void);
+void fpu_state_free(struct fpu_state *state);
+
+// Make `next` the state of the running context (NULL: none, kernel only).
+// Called with interrupts disabled on every context switch.
+void fpu_switch_to(struct fpu_state *next);
+
+// Bracket kernel code that touches vector registers. Saves whatever the
+// registers hold only if someone actually owns them, nests up to
+// FPU_NEST_MAX + 1 sections deep (e.g. an interrupt inside a section) and
+// may be used with interrupts enabled.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+int kernel_fpu_active(void);
+
+struct fpu_stats {
+    const char *save_insn;  // "xsaves", "xsaveopt", "xsave" or "fxsave"
+    uint64_t xcr0;
+    uint32_t area_size;
+    uint8_t avx;
+    uint8_t avx2;
+    uint8_t avx512;
+    uint64_t nm_traps;
+    uint64_t saves;
+    uint64_t restores;
+    uint64_t kernel_sections;
+    uint64_t nested_sections;
+};
+void fpu_get_stats(struct fpu_stats *out);
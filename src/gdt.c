@@ -1,4 +1,5 @@
 #include "gdt.h"
+#include "acpi.h"
 
 // GDT entry format (8 bytes).
 struct __attribute__((packed)) gdt_entry {
@@ -15,8 +16,23 @@ struct __attribute__((packed)) gdt_ptr {
     uint64_t base;
 };
 
-static struct gdt_entry gdt[3];
+// 64-bit TSS: only RSP0 (the stack for ring 3 -> ring 0 transitions) is used.
+struct __attribute__((packed)) tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+};
+
+// One TSS per CPU, so each has its own RSP0. A TSS descriptor is 16 bytes
+// and takes two slots; CPU n's starts at GDT_TSS_SEL + 16 * n.
+#define GDT_TSS_SLOT 5
+static struct gdt_entry gdt[GDT_TSS_SLOT + 2 * ACPI_MAX_CPUS];
 static struct gdt_ptr gdtr;
+static struct tss tss[ACPI_MAX_CPUS] __attribute__((aligned(16)));
 
 static struct gdt_entry gdt_make_entry(uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     struct gdt_entry e;
@@ -29,6 +45,8 @@ static struct gdt_entry gdt_make_entry(uint32_t base, uint32_t limit, uint8_t ac
     return e;
 }
 
+static void gdt_load(void);
+
 void gdt_init(void) {
     // Null descriptor.
     gdt[0] = gdt_make_entry(0, 0, 0, 0);
@@ -43,10 +61,37 @@ void gdt_init(void) {
     // segments used as SS/DS/ES. We'll keep G=1 for a conventional limit field.
     gdt[2] = gdt_make_entry(0, 0xFFFFF, 0x92, 0x80); // 0x80 => G=1
 
+    // User data then user code, in the order SYSRET expects: it loads
+    // SS = STAR[63:48] + 8 and CS = STAR[63:48] + 16.
+    gdt[3] = gdt_make_entry(0, 0xFFFFF, 0xF2, 0x80); // ring3 data
+    gdt[4] = gdt_make_entry(0, 0xFFFFF, 0xFA, 0xA0); // ring3 64-bit code
+
+    // TSS: present, type 9 (available 64-bit TSS); the second slot holds
+    // base bits 63:32. No I/O bitmap.
+    for (uint32_t cpu = 0; cpu < ACPI_MAX_CPUS; cpu++) {
+        struct gdt_entry *e = &gdt[GDT_TSS_SLOT + 2 * cpu];
+        uint64_t tss_base = (uint64_t)(uintptr_t)&tss[cpu];
+        tss[cpu].iomap_base = (uint16_t)sizeof(tss[cpu]);
+        e[0] = gdt_make_entry((uint32_t)tss_base, sizeof(tss[cpu]) - 1, 0x89, 0x00);
+        e[1] = gdt_make_entry(0, 0, 0, 0);
+        e[1].limit_low = (uint16_t)(tss_base >> 32);
+        e[1].base_low  = (uint16_t)(tss_base >> 48);
+    }
+
     gdtr.limit = (uint16_t)(sizeof(gdt) - 1);
     gdtr.base  = (uint64_t)(uintptr_t)&gdt[0];
 
-    // Load the new GDT.
+    gdt_load();
+    __asm__ __volatile__("ltr %0" : : "r"((uint16_t)GDT_TSS_SEL) : "memory");
+}
+
+void gdt_init_ap(uint32_t cpu) {
+    gdt_load();
+    uint16_t sel = (uint16_t)(GDT_TSS_SEL + 16 * cpu);
+    __asm__ __volatile__("ltr %0" : : "r"(sel) : "memory");
+}
+
+static void gdt_load(void) {
     __asm__ __volatile__("lgdt %0" : : "m"(gdtr) : "memory");
 
     // Reload data segment registers. CS reload would require a far jump/iret;
@@ -65,3 +110,7 @@ void gdt_init(void) {
     );
 }
 
+void gdt_set_kernel_stack(uint32_t cpu, uint64_t rsp0) {
+    tss[cpu].rsp[0] = rsp0;
+}
+
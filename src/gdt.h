@@ -8,10 +8,19 @@
 // data descriptor.
 
 void gdt_init(void);
+// Load the same GDT on application processor `cpu` (its percpu id) along
+// with that CPU's own TSS. Clears the GS base.
+void gdt_init_ap(uint32_t cpu);
 
 // Segment selectors (must match the GDT we build).
 enum {
     GDT_KERNEL_CODE_SEL = 0x08,
     GDT_KERNEL_DATA_SEL = 0x10,
+    GDT_USER_DATA_SEL   = 0x18,
+    GDT_USER_CODE_SEL   = 0x20,
+    GDT_TSS_SEL         = 0x28,  // boot CPU; CPU n uses GDT_TSS_SEL + 16 * n
 };
 
+// Stack CPU `cpu` switches to when an interrupt arrives in ring 3.
+void gdt_set_kernel_stack(uint32_t cpu, uint64_t rsp0);
+
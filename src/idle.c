@@ -0,0 +1,81 @@
+#include "idle.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "smp.h"
+
+// MWAIT hint 0: C1, the shallowest state; deeper ones need per-model
+// tables and buy little in a VM.
+#define MWAIT_HINT_C1 0
+
+static int mwait_supported;
+static volatile int use_mwait;
+
+void idle_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a < 5) return;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!((c >> 3) & 1)) return;
+    // Leaf 5: the monitor line must cover our 64-byte idle word.
+    cpuid(5, 0, &a, &b, &c, &d);
+    if ((b & 0xFFFF) < 64 && (b & 0xFFFF) != 0) return;
+    mwait_supported = 1;
+    use_mwait = 1;
+}
+
+int idle_mwait_supported(void) {
+    return mwait_supported;
+}
+
+int idle_mwait_enabled(void) {
+    return use_mwait;
+}
+
+int idle_set_mwait(int on) {
+    int old = use_mwait;
+    use_mwait = on && mwait_supported;
+    return old;
+}
+
+// The kicker needs to know how we sleep, so the mode goes into the word
+// itself; the fence orders it before the caller's last look for work.
+void idle_prepare(struct percpu *cpu) {
+    __atomic_store_n(&cpu->idle, use_mwait ? IDLE_MWAIT : IDLE_HLT, __ATOMIC_SEQ_CST);
+}
+
+void idle_cancel(struct percpu *cpu) {
+    __atomic_store_n(&cpu->idle, IDLE_BUSY, __ATOMIC_RELAXED);
+}
+
+void idle_wait(struct percpu *cpu) {
+    uint64_t t0 = rdtsc();
+    cpu->idle_stats.entries++;
+    if (cpu->idle == IDLE_MWAIT) {
+        monitor(&cpu->idle);
+        // A kick between prepare and MONITOR is not seen by the monitor.
+        if (cpu->idle != IDLE_BUSY) sti_mwait(MWAIT_HINT_C1);
+        else __asm__ __volatile__("sti" ::: "memory");
+    } else if (cpu->idle == IDLE_HLT) {
+        __asm__ __volatile__("sti; hlt" ::: "memory");
+    } else {
+        __asm__ __volatile__("sti" ::: "memory");
+    }
+    if (__atomic_exchange_n(&cpu->idle, IDLE_BUSY, __ATOMIC_RELAXED) == IDLE_BUSY)
+        cpu->idle_stats.kicks++;
+    cpu->idle_stats.cycles += rdtsc() - t0;
+}
+
+int idle_kick(struct percpu *cpu) {
+    if (cpu->idle == IDLE_BUSY) return 0;
+    uint32_t mode = __atomic_exchange_n(&cpu->idle, IDLE_BUSY, __ATOMIC_SEQ_CST);
+    // Under MWAIT the store above is the wake-up.
+    if (mode == IDLE_HLT) smp_wake(cpu);
+    return mode != IDLE_BUSY;
+}
+
+int idle_get_cpu_stats(uint32_t id, struct idle_cpu_stats *out) {
+    struct percpu *cpu = smp_cpu(id);
+    if (!cpu) return -1;
+    *out = cpu->idle_stats;
+    return 0;
+}
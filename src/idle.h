@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+
+// What a CPU does when it has nothing to run. With MONITOR/MWAIT the CPU
+// watches its own idle word and a plain store to it (idle_kick) wakes it;
+// without, it halts and the kick becomes an IPI. Interrupts wake it
+// either way.
+//
+// Usage, with interrupts disabled:
+//     idle_prepare(cpu);
+//     if (work_pending) idle_cancel(cpu);
+//     else idle_wait(cpu);     // returns with interrupts enabled
+
+struct percpu;
+
+enum { IDLE_BUSY = 0, IDLE_HLT = 1, IDLE_MWAIT = 2 };
+
+struct idle_cpu_stats {
+    uint64_t entries;
+    uint64_t kicks;    // woken through idle_kick rather than an interrupt
+    uint64_t cycles;   // in idle_wait(), wake-up handlers included
+};
+
+// Probe CPUID for MONITOR/MWAIT and use it if present.
+void idle_init(void);
+int idle_mwait_supported(void);
+int idle_mwait_enabled(void);
+// Switch between MWAIT (1) and HLT (0); returns the previous setting.
+int idle_set_mwait(int on);
+
+void idle_prepare(struct percpu *cpu);
+void idle_cancel(struct percpu *cpu);
+void idle_wait(struct percpu *cpu);
+// Wake `cpu` if it is in idle_wait() or about to be. Returns 1 if it was.
+int idle_kick(struct percpu *cpu);
+
+// Fill `out` for CPU `id`; returns -1 if there is no such CPU.
+int idle_get_cpu_stats(uint32_t id, struct idle_cpu_stats *out);
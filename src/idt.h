@@ -5,6 +5,8 @@
 // IDT gate types.
 // 0x8E = present | ring0 | interrupt gate (type 0xE)
 #define IDT_TYPE_INT_GATE 0x8E
+// 0xEE = same, but reachable with `int` from ring 3 (DPL 3)
+#define IDT_TYPE_USER_INT_GATE 0xEE
 
 struct __attribute__((packed)) idt_entry {
     uint16_t offset_low;
@@ -22,16 +24,20 @@ struct __attribute__((packed)) idt_ptr {
 };
 
 void idt_init(void);
+// Load the shared IDT on an application processor.
+void idt_init_ap(void);
+// Let ring-3 code raise `vec` with a software `int`.
+void idt_allow_user(int vec);
 
 // C handler called from assembly stubs.
 struct __attribute__((packed)) isr_context {
     // Must match the exact push order in `src/interrupts.asm` where RSP is
-    // passed to C.
-    uint64_t rax, rbx, rcx, rdx, rbp, rdi, rsi;
-    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+    // passed to C: RAX is pushed first and R15 last, so R15 comes first.
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rsi, rdi, rbp, rdx, rcx, rbx, rax;
     uint64_t vector;
     uint64_t error;
-    uint64_t rip, cs, rflags;
+    uint64_t rip, cs, rflags, rsp, ss;
 };
 
 void isr_handler(struct isr_context *ctx);
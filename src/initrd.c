@@ -0,0 +1,223 @@
+#include "initrd.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "multiboot2.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define TAR_BLOCK 512
+
+// The parts of a ustar header we use; all numbers are octal text.
+#define TAR_NAME     0    // 100 bytes
+#define TAR_SIZE     124  // 12 bytes
+#define TAR_CHKSUM   148  // 8 bytes
+#define TAR_TYPE     156
+#define TAR_MAGIC    257  // "ustar"
+#define TAR_PREFIX   345  // 155 bytes
+
+struct module {
+    const uint8_t *data;
+    uint64_t size;
+    const char *cmdline;
+};
+
+static struct module modules[INITRD_MAX_MODULES];
+static uint32_t module_count;
+static struct initrd_file *files;
+static uint32_t file_count;
+static struct initrd_stats stats;
+
+static size_t str_len(const char *s, size_t max) {
+    size_t n = 0;
+    while (n < max && s[n]) n++;
+    return n;
+}
+
+static int str_cmp(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (int)(uint8_t)*a - (int)(uint8_t)*b;
+}
+
+// Octal field, terminated by NUL or space. -1 if it holds anything else.
+static int64_t octal(const uint8_t *p, size_t len) {
+    uint64_t v = 0;
+    size_t i = 0;
+    while (i < len && p[i] == ' ') i++;
+    for (; i < len && p[i] && p[i] != ' '; i++) {
+        if (p[i] < '0' || p[i] > '7') return -1;
+        v = v * 8 + (uint64_t)(p[i] - '0');
+    }
+    return (int64_t)v;
+}
+
+static int is_tar(const uint8_t *data, uint64_t size) {
+    if (size < TAR_BLOCK) return 0;
+    const uint8_t *m = data + TAR_MAGIC;
+    return m[0] == 'u' && m[1] == 's' && m[2] == 't' && m[3] == 'a' && m[4] == 'r';
+}
+
+// Header checksum: byte sum with the checksum field counted as spaces.
+static int header_ok(const uint8_t *h) {
+    uint64_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= TAR_CHKSUM && i < TAR_CHKSUM + 8) ? ' ' : h[i];
+    return octal(h + TAR_CHKSUM, 8) == (int64_t)sum;
+}
+
+// Walk the regular files of one archive. With `out` NULL only count them
+// and the bytes their names need; otherwise fill `out` and the name pool.
+static void scan_tar(const struct module *m, struct initrd_file *out, uint32_t *count,
+                     char **names, uint64_t *name_bytes) {
+    uint64_t off = 0;
+    while (off + TAR_BLOCK <= m->size) {
+        const uint8_t *h = m->data + off;
+        if (h[0] == 0 || !header_ok(h)) break;  // end of archive (or garbage)
+        int64_t size = octal(h + TAR_SIZE, 12);
+        if (size < 0 || (uint64_t)size > m->size - off - TAR_BLOCK) break;
+        uint64_t data = off + TAR_BLOCK;
+        off = data + (((uint64_t)size + TAR_BLOCK - 1) & ~(uint64_t)(TAR_BLOCK - 1));
+        if (h[TAR_TYPE] != '0' && h[TAR_TYPE] != 0) continue;  // directories, links...
+
+        const char *prefix = (const char *)h + TAR_PREFIX;
+        const char *name = (const char *)h + TAR_NAME;
+        size_t plen = str_len(prefix, 155);
+        size_t nlen = str_len(name, 100);
+        if (!plen) {
+            // "./a/b" and "/a/b" are both "a/b".
+            for (;;) {
+                size_t skip = (nlen && name[0] == '/') ? 1 : (nlen > 1 && name[0] == '.' && name[1] == '/') ? 2 : 0;
+                if (!skip) break;
+                name += skip;
+                nlen -= skip;
+            }
+            if (!nlen) continue;
+        }
+        uint64_t len = (plen ? plen + 1 : 0) + nlen + 1;
+
+        if (out) {
+            char *dst = *names;
+            size_t i = 0;
+            for (size_t j = 0; j < plen; j++) dst[i++] = prefix[j];
+            if (plen) dst[i++] = '/';
+            for (size_t j = 0; j < nlen; j++) dst[i++] = name[j];
+            dst[i] = 0;
+            out[*count].name = dst;
+            out[*count].data = m->data + data;
+            out[*count].size = (uint64_t)size;
+            *names += len;
+        } else {
+            *name_bytes += len;
+        }
+        (*count)++;
+    }
+}
+
+// A module that is not an archive is one file, named by its command line
+// (pointing into the boot information, which stays reserved).
+static void scan_module(const struct module *m, struct initrd_file *out, uint32_t *count,
+                        char **names, uint64_t *name_bytes) {
+    if (is_tar(m->data, m->size)) {
+        scan_tar(m, out, count, names, name_bytes);
+        return;
+    }
+    if (out) {
+        out[*count].name = m->cmdline[0] ? m->cmdline : "module";
+        out[*count].data = m->data;
+        out[*count].size = m->size;
+    }
+    (void)name_bytes;
+    (*count)++;
+}
+
+// Shell sort by name: the index is built once and searched many times.
+static void sort_files(void) {
+    static const uint32_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+    for (uint32_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        uint32_t gap = gaps[g];
+        for (uint32_t i = gap; i < file_count; i++) {
+            struct initrd_file f = files[i];
+            uint32_t j = i;
+            while (j >= gap && str_cmp(files[j - gap].name, f.name) > 0) {
+                files[j] = files[j - gap];
+                j -= gap;
+            }
+            files[j] = f;
+        }
+    }
+}
+
+int initrd_init(uint64_t mb_info_addr) {
+    uint64_t t0 = rdtsc();
+    struct multiboot2_info_header *hdr = vmm_phys_to_virt(mb_info_addr);
+    uint8_t *tag_ptr = (uint8_t *)(hdr + 1);
+    uint8_t *end     = (uint8_t *)hdr + hdr->total_size;
+    module_count = 0;
+
+    while (tag_ptr < end && module_count < INITRD_MAX_MODULES) {
+        struct multiboot2_tag *tag = (struct multiboot2_tag *)tag_ptr;
+        if (tag->type == MULTIBOOT2_TAG_TYPE_END) break;
+        if (tag->type == MULTIBOOT2_TAG_TYPE_MODULE) {
+            struct multiboot2_tag_module *mod = (struct multiboot2_tag_module *)tag;
+            uint64_t start = mod->mod_start, len = mod->mod_end - mod->mod_start;
+            if (mod->mod_end > mod->mod_start) {
+                // pmm_init reserved these frames. Drop write access in the
+                // direct map and, if it reaches this far, the identity map.
+                // That can fail splitting a large page without memory for
+                // the table: the data is still fine, but say so.
+                if (vmm_protect_range(vmm_kernel_space(), VMM_DIRECT_MAP_BASE + start, len, 0) < 0 ||
+                    vmm_protect_range(vmm_kernel_space(), start, len, 0) < 0)
+                    stats.writable++;
+                modules[module_count].data = vmm_phys_to_virt(start);
+                modules[module_count].size = len;
+                modules[module_count].cmdline = mod->cmdline;
+                module_count++;
+                stats.bytes += len;
+            }
+        }
+        tag_ptr += (tag->size + 7) & ~7u;
+    }
+    if (!module_count) return -1;
+
+    // Count, then fill an index and a pool for the names in one allocation.
+    uint32_t count = 0;
+    uint64_t name_bytes = 0;
+    for (uint32_t i = 0; i < module_count; i++) scan_module(&modules[i], NULL, &count, NULL, &name_bytes);
+    if (count) {
+        files = kmalloc(count * sizeof(*files) + name_bytes);
+        if (!files) return -1;
+        char *names = (char *)(files + count);
+        for (uint32_t i = 0; i < module_count; i++)
+            scan_module(&modules[i], files, &file_count, &names, NULL);
+        sort_files();
+    }
+
+    stats.modules = module_count;
+    stats.files = file_count;
+    stats.index_cycles = rdtsc() - t0;
+    return (int)file_count;
+}
+
+const struct initrd_file *initrd_find(const char *path) {
+    while (*path == '/') path++;
+    uint32_t lo = 0, hi = file_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = str_cmp(files[mid].name, path);
+        if (c == 0) return &files[mid];
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+const struct initrd_file *initrd_files(uint32_t *count) {
+    *count = file_count;
+    return files;
+}
+
+void initrd_get_stats(struct initrd_stats *out) {
+    *out = stats;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+// Initial ramdisk: ustar archives loaded by GRUB as Multiboot2 modules
+// (module2 lines in grub.cfg). pmm_init keeps the module frames out of the
+// allocator; initrd_init maps them read-only and indexes the archives once.
+// File data is served in place from module memory, never copied. A module
+// that is not a tar archive shows up as a single file named by its
+// command line.
+
+#define INITRD_MAX_MODULES 8
+
+struct initrd_file {
+    const char *name;     // path inside the archive, without a leading "./"
+    const uint8_t *data;  // read-only, in module memory
+    uint64_t size;
+};
+
+// Run after kmalloc_init(). Returns the number of files, -1 without modules.
+int initrd_init(uint64_t mb_info_addr);
+
+// Lookup by path (a leading '/' is ignored); NULL if there is no such file.
+const struct initrd_file *initrd_find(const char *path);
+// All files, sorted by name.
+const struct initrd_file *initrd_files(uint32_t *count);
+
+struct initrd_stats {
+    uint32_t modules;
+    uint32_t files;
+    uint64_t bytes;         // module memory
+    uint32_t writable;      // modules vmm_protect_range could not make read-only
+    uint64_t index_cycles;  // parsing, sorting and mapping at boot
+};
+void initrd_get_stats(struct initrd_stats *out);
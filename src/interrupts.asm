@@ -1,47 +1,45 @@
 ; interrupts.asm - x86_64 ISR stubs for our IDT
 ;
-; We implement:
-; - isr0: Divide-by-zero exception (#DE, vector 0)
-; - isr13: General Protection Fault (#GP, vector 13)
-; - isr14: Page Fault (#PF, vector 14)
-; - isr_common: saves registers, calls C isr_handler(ctx), restores, iretq
+; One stub per vector (0-255), generated below:
+; - vectors where the CPU pushes an error code push only the vector number;
+;   all others push a dummy 0 first, so isr_common always sees
+;   [error][vector] on top of the iretq frame
+; - isr_common: saves registers, calls C isr_handler(ctx), restores, iretq;
+;   swapgs around it when the interrupted code was ring 3
+; - isr_stub_table: stub addresses indexed by vector, used by idt_init
 
 BITS 64
 
-global isr0, isr13, isr14, isr33
+global isr_stub_table
 extern isr_handler
-extern keyboard_irq_handler
 
 section .text
 
-isr0:
-    ; Exceptions without an error code: push a dummy error code
-    push qword 0          ; error
-    push qword 0          ; vector
-    jmp isr_common
-
-isr13:
-    ; General Protection Fault - has error code pushed by CPU
-    push qword 13         ; vector
-    jmp isr_common_with_error
+; Exceptions that push an error code: #DF, #TS, #NP, #SS, #GP, #PF, #AC,
+; #CP, #VC, #SX.
+%define HAS_ERROR_CODE(v) ((v) == 8 || ((v) >= 10 && (v) <= 14) || (v) == 17 || \
+                           (v) == 21 || (v) == 29 || (v) == 30)
 
-isr14:
-    ; Page Fault - has error code pushed by CPU
-    push qword 14         ; vector
-    jmp isr_common_with_error
-
-isr33:
-    ; IRQ 1 (Keyboard) - no error code
+%assign i 0
+%rep 256
+isr%[i]:
+%if HAS_ERROR_CODE(i)
+    push qword i          ; vector (error code already pushed by CPU)
+%else
     push qword 0          ; error
-    push qword 33         ; vector
-    jmp isr_common
-
-; For exceptions that already push an error code
-isr_common_with_error:
-    ; stack: ... [error][vector]
+    push qword i          ; vector
+%endif
     jmp isr_common
+%assign i i+1
+%endrep
 
 isr_common:
+    ; From ring 3 (saved CS RPL 3, above vector + error + RIP), GS still
+    ; holds the user base: swap in the per-CPU one.
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
     ; Save general purpose registers.
     push rax
     push rbx
@@ -61,6 +59,7 @@ isr_common:
 
     ; Pass pointer to struct isr_context in RDI (SysV ABI).
     mov rdi, rsp
+    cld
 
     ; Call C handler.
     call isr_handler
@@ -85,5 +84,19 @@ isr_common:
     ; Drop vector + error code.
     add rsp, 16
 
+    ; Back to ring 3: restore the user GS base last, with interrupts still
+    ; off (interrupt gates).
+    test qword [rsp + 8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
 
+section .rodata
+align 8
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr%[i]
+%assign i i+1
+%endrep
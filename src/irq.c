@@ -0,0 +1,66 @@
+#include "irq.h"
+#include "cpu.h"
+#include "apic.h"
+#include "pic.h"
+#include "sched.h"
+#include "trace.h"
+#include <stddef.h>
+
+// 32 bytes per vector; dispatch touches only the slot being serviced.
+struct irq_desc {
+    irq_handler_t handler;
+    void *ctx;
+    uint64_t hits;
+    uint64_t cycles;
+};
+
+static struct irq_desc irq_table[256] __attribute__((aligned(64)));
+
+int irq_register(uint8_t vector, irq_handler_t handler, void *ctx) {
+    uint64_t flags = irq_save();
+    int ret = -1;
+    if (!irq_table[vector].handler) {
+        irq_table[vector].ctx = ctx;
+        irq_table[vector].handler = handler;
+        ret = 0;
+    }
+    irq_restore(flags);
+    return ret;
+}
+
+void irq_unregister(uint8_t vector) {
+    uint64_t flags = irq_save();
+    irq_table[vector].handler = NULL;
+    irq_table[vector].ctx = NULL;
+    irq_restore(flags);
+}
+
+void irq_eoi(uint8_t vector) {
+    if (apic_enabled()) apic_eoi();
+    else pic_send_eoi((uint8_t)(vector - IRQ_BASE_VECTOR));
+}
+
+void irq_enable_legacy(uint8_t irq) {
+    if (apic_enabled()) ioapic_route_legacy(irq, IRQ_BASE_VECTOR + irq);
+    else pic_unmask(irq);
+}
+
+void irq_get_stats(uint8_t vector, struct irq_stats *out) {
+    out->hits = irq_table[vector].hits;
+    out->cycles = irq_table[vector].cycles;
+    out->registered = irq_table[vector].handler != NULL;
+}
+
+// Called from isr_common in interrupts.asm. Vectors without a handler are
+// counted and ignored. The scheduler may switch threads on the way out;
+// this frame is then resumed when the thread next runs.
+void isr_handler(struct isr_context *frame) {
+    struct irq_desc *d = &irq_table[frame->vector & 0xFF];
+    uint64_t t0 = rdtsc();
+    if (d->handler) d->handler(frame, d->ctx);
+    uint64_t cycles = rdtsc() - t0;
+    d->hits++;
+    d->cycles += cycles;
+    trace(TRACE_IRQ, (uint32_t)frame->vector, cycles, frame->rip);
+    sched_irq_exit(frame);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include "idt.h"
+
+// Vector-indexed interrupt dispatch. isr_handler looks the vector up in a
+// 256-entry table and calls the registered handler with its context.
+
+// Legacy PIC lines are remapped to start here (see pic_init in kmain).
+#define IRQ_BASE_VECTOR 0x20
+
+typedef void (*irq_handler_t)(struct isr_context *frame, void *ctx);
+
+// Returns -1 if the vector already has a handler.
+int irq_register(uint8_t vector, irq_handler_t handler, void *ctx);
+void irq_unregister(uint8_t vector);
+
+// Acknowledge the interrupt being serviced: a LAPIC EOI once the APIC is
+// up, otherwise the 8259(s) owning `vector`.
+void irq_eoi(uint8_t vector);
+// Deliver ISA IRQ `irq` at IRQ_BASE_VECTOR + irq, via the IO-APIC when
+// enabled, otherwise by unmasking it on the 8259.
+void irq_enable_legacy(uint8_t irq);
+
+struct irq_stats {
+    uint64_t hits;
+    uint64_t cycles;  // total spent in the handler
+    int registered;
+};
+void irq_get_stats(uint8_t vector, struct irq_stats *out);
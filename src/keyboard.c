@@ -1,8 +1,13 @@
 #include "keyboard.h"
-#include "pic.h"
+#include "irq.h"
+#include "cpu.h"
+#include "event.h"
+#include "trace.h"
 
 #define KEYBOARD_DATA_PORT 0x60
 #define KEYBOARD_STATUS_PORT 0x64
+#define KEYBOARD_STATUS_FULL 0x01
+#define KEYBOARD_STATUS_AUX  0x20  // byte is from the mouse
 
 static inline uint8_t inb(uint16_t port) {
     uint8_t ret;
@@ -10,88 +15,190 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
-static inline void outb(uint16_t port, uint8_t val) {
-    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+// Raw scancodes, filled by the IRQ handler and drained by keyboard_read().
+// Single producer and single consumer, so the two indices are the only
+// shared state: each side publishes its index with a release store after
+// touching the slots and reads the other's with an acquire load.
+#define RING_SIZE 256
+#define RING_MASK (RING_SIZE - 1)
+
+static uint8_t ring[RING_SIZE];
+static uint32_t ring_head;  // written by the IRQ handler
+static uint32_t ring_tail;  // written by the consumer
+static uint64_t scancodes_seen;
+static uint64_t scancodes_dropped;
+static uint64_t chars_decoded;
+static struct event *ready_event;
+
+// Scancode set 1, make codes 0x00-0x3A.
+static const char keymap_normal[0x3B] = {
+    0,   0x1B, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
+    'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n', 0,  'a', 's',
+    'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', 0,  '\\', 'z', 'x', 'c', 'v',
+    'b', 'n', 'm', ',', '.', '/', 0,   '*', 0,   ' ', 0
+};
+static const char keymap_shifted[0x3B] = {
+    0,   0x1B, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b', '\t',
+    'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', 0,  'A', 'S',
+    'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', 0,  '|', 'Z', 'X', 'C', 'V',
+    'B', 'N', 'M', '<', '>', '?', 0,   '*', 0,   ' ', 0
+};
+
+#define SC_LSHIFT   0x2A
+#define SC_RSHIFT   0x36
+#define SC_CTRL     0x1D
+#define SC_ALT      0x38
+#define SC_CAPSLOCK 0x3A
+
+#define MOD_LSHIFT (1u << 0)
+#define MOD_RSHIFT (1u << 1)
+#define MOD_CTRL   (1u << 2)  // either side
+#define MOD_RCTRL  (1u << 3)
+#define MOD_ALT    (1u << 4)
+#define MOD_RALT   (1u << 5)
+#define MOD_CAPS   (1u << 6)
+
+// Decoder state, only touched by the consumer.
+static uint32_t modifiers;
+static int extended;      // previous byte was 0xE0
+static int pause_skip;    // bytes left of the 6-byte Pause sequence
+
+static uint32_t irq_drain(void) {
+    // Take everything the controller has buffered, not just one byte.
+    uint32_t head = ring_head;
+    uint32_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < 16; i++) {
+        uint8_t status = inb(KEYBOARD_STATUS_PORT);
+        if (!(status & KEYBOARD_STATUS_FULL)) break;
+        uint8_t scancode = inb(KEYBOARD_DATA_PORT);
+        if (status & KEYBOARD_STATUS_AUX) continue;
+        scancodes_seen++;
+        if (head - tail == RING_SIZE) {
+            scancodes_dropped++;
+            continue;
+        }
+        ring[head & RING_MASK] = scancode;
+        head++;
+    }
+    uint32_t taken = head - ring_head;
+    __atomic_store_n(&ring_head, head, __ATOMIC_RELEASE);
+    return taken;
+}
+
+static void keyboard_irq_handler(struct isr_context *frame, void *ctx) {
+    (void)ctx;
+    uint32_t taken = irq_drain();
+    trace(TRACE_KBD_IRQ, taken, ring_head - ring_tail, 0);
+    irq_eoi(frame->vector);
+    if (ready_event) event_signal(ready_event);
 }
 
-// PS/2 scancode set 1 to ASCII (simplified, only common keys)
-static char scancode_to_ascii(uint8_t scancode, int shift) {
-    if (scancode >= 0x02 && scancode <= 0x0B) {
-        const char *normal = "1234567890";
-        const char *shifted = "!@#$%^&*()";
-        return shift ? shifted[scancode - 0x02] : normal[scancode - 0x02];
+static char decode_extended(uint8_t code) {
+    switch (code) {
+    case 0x1C: return '\n';  // keypad Enter
+    case 0x35: return '/';   // keypad /
+    case 0x47: return (char)KEY_HOME;
+    case 0x48: return (char)KEY_UP;
+    case 0x49: return (char)KEY_PGUP;
+    case 0x4B: return (char)KEY_LEFT;
+    case 0x4D: return (char)KEY_RIGHT;
+    case 0x4F: return (char)KEY_END;
+    case 0x50: return (char)KEY_DOWN;
+    case 0x51: return (char)KEY_PGDN;
+    case 0x53: return (char)KEY_DELETE;
     }
-    if (scancode >= 0x10 && scancode <= 0x19) {
-        const char *normal = "qwertyuiop";
-        const char *shifted = "QWERTYUIOP";
-        return shift ? shifted[scancode - 0x10] : normal[scancode - 0x10];
+    return 0;
+}
+
+// Feed one scancode through the decoder; returns a character or 0.
+static char decode(uint8_t scancode) {
+    if (pause_skip) {
+        pause_skip--;
+        return 0;
     }
-    if (scancode >= 0x1E && scancode <= 0x26) {
-        const char *normal = "asdfghjkl";
-        const char *shifted = "ASDFGHJKL";
-        return shift ? shifted[scancode - 0x1E] : normal[scancode - 0x1E];
+    if (scancode == 0xE1) {
+        pause_skip = 5;
+        return 0;
     }
-    if (scancode >= 0x2C && scancode <= 0x32) {
-        const char *normal = "zxcvbnm";
-        const char *shifted = "ZXCVBNM";
-        return shift ? shifted[scancode - 0x2C] : normal[scancode - 0x2C];
+    if (scancode == 0xE0) {
+        extended = 1;
+        return 0;
     }
-    if (scancode == 0x39) return ' ';
-    if (scancode == 0x0E) return '\b'; // Backspace
-    if (scancode == 0x1C) return '\n'; // Enter
-    return 0;
-}
 
-static volatile int keyboard_has_char = 0;
-static volatile char keyboard_char = 0;
-static volatile int keyboard_shift = 0;
+    int ext = extended;
+    extended = 0;
+    int release = scancode & 0x80;
+    uint8_t code = scancode & 0x7F;
 
-void keyboard_irq_handler(void) {
-    uint8_t status = inb(KEYBOARD_STATUS_PORT);
-    if (status & 0x01) {
-        uint8_t scancode = inb(KEYBOARD_DATA_PORT);
-        
-        // Handle key release (0x80+)
-        if (scancode & 0x80) {
-            uint8_t key = scancode & 0x7F;
-            if (key == 0x2A || key == 0x36) {
-                keyboard_shift = 0;
-            }
-            return;
-        }
-        
-        // Handle key press
-        if (scancode == 0x2A || scancode == 0x36) {
-            keyboard_shift = 1;
-            return;
-        }
-        
-        char c = scancode_to_ascii(scancode, keyboard_shift);
-        if (c) {
-            keyboard_char = c;
-            keyboard_has_char = 1;
-        }
+    uint32_t mod = 0;
+    if (code == SC_LSHIFT && !ext) mod = MOD_LSHIFT;
+    else if (code == SC_RSHIFT && !ext) mod = MOD_RSHIFT;
+    else if (code == SC_CTRL) mod = ext ? MOD_RCTRL : MOD_CTRL;
+    else if (code == SC_ALT) mod = ext ? MOD_RALT : MOD_ALT;
+    if (mod) {
+        if (release) modifiers &= ~mod;
+        else modifiers |= mod;
+        return 0;
+    }
+    if (release) return 0;
+    if (code == SC_CAPSLOCK) {
+        modifiers ^= MOD_CAPS;
+        return 0;
     }
-    
-    // Send EOI to PIC
-    outb(0x20, 0x20); // PIC1 EOI
+    if (ext) return decode_extended(code);
+    if (code >= sizeof(keymap_normal)) return 0;
+
+    int shift = (modifiers & (MOD_LSHIFT | MOD_RSHIFT)) != 0;
+    char c = shift ? keymap_shifted[code] : keymap_normal[code];
+    if ((modifiers & MOD_CAPS) && c >= 'a' && c <= 'z') c -= 'a' - 'A';
+    else if ((modifiers & MOD_CAPS) && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    if ((modifiers & (MOD_CTRL | MOD_RCTRL)) && ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+        c &= 0x1F;
+    return c;
 }
 
-void keyboard_init(void) {
-    // Enable keyboard interrupt (IRQ 1)
-    uint8_t mask = inb(0x21);
-    mask &= ~(1 << 1); // Clear bit 1 (keyboard IRQ)
-    outb(0x21, mask);
+size_t keyboard_read(char *buf, size_t max) {
+    uint32_t tail = ring_tail;
+    uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (tail != head && n < max) {
+        char c = decode(ring[tail & RING_MASK]);
+        tail++;
+        if (c) buf[n++] = c;
+    }
+    // One release store frees the whole batch for the producer.
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+    chars_decoded += n;
+    return n;
 }
 
+// Characters decoded ahead of keyboard_get_char().
+static char pending[32];
+static size_t pending_pos;
+static size_t pending_len;
+
 char keyboard_get_char(void) {
-    if (keyboard_has_char) {
-        keyboard_has_char = 0;
-        return keyboard_char;
+    if (pending_pos == pending_len) {
+        pending_pos = 0;
+        pending_len = keyboard_read(pending, sizeof(pending));
+        if (!pending_len) return 0;
     }
-    return 0;
+    return pending[pending_pos++];
 }
 
 int keyboard_has_data(void) {
-    return keyboard_has_char;
+    return pending_pos != pending_len ||
+           __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) != ring_tail;
+}
+
+void keyboard_get_stats(struct keyboard_stats *out) {
+    out->scancodes = scancodes_seen;
+    out->dropped = scancodes_dropped;
+    out->chars = chars_decoded;
+}
+
+void keyboard_init(struct event *ready) {
+    ready_event = ready;
+    irq_register(IRQ_BASE_VECTOR + 1, keyboard_irq_handler, NULL);
+    irq_enable_legacy(1);
 }
@@ -1,6 +1,30 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
-void keyboard_init(void);
+// Non-ASCII keys are reported as these codes (as unsigned char).
+#define KEY_UP     0x80
+#define KEY_DOWN   0x81
+#define KEY_LEFT   0x82
+#define KEY_RIGHT  0x83
+#define KEY_HOME   0x84
+#define KEY_END    0x85
+#define KEY_PGUP   0x86
+#define KEY_PGDN   0x87
+#define KEY_DELETE 0x88
+
+struct event;
+
+// `ready` (may be NULL) is signaled from the IRQ whenever scancodes arrive.
+void keyboard_init(struct event *ready);
+// Decode pending scancodes into up to `max` characters; returns the count.
+size_t keyboard_read(char *buf, size_t max);
 char keyboard_get_char(void);
 int keyboard_has_data(void);
+
+struct keyboard_stats {
+    uint64_t scancodes;  // bytes taken from the controller
+    uint64_t dropped;    // lost because the ring was full
+    uint64_t chars;      // characters produced by the decoder
+};
+void keyboard_get_stats(struct keyboard_stats *out);
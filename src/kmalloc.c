@@ -0,0 +1,304 @@
+#include "kmalloc.h"
+#include "spinlock.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define PAGE_SIZE 4096ULL
+
+// Frame tags tell kfree how a block was allocated. Every frame of a block
+// carries the tag, so any interior pointer finds the block's first frame.
+#define TAG_SLAB  0x80  // | order: slab of 2^order pages, header at its start
+#define TAG_LARGE 0x40  // | order: kmalloc of 2^order whole pages
+#define TAG_ORDER 0x0F
+
+// Slabs are sized to hold at least this many objects.
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_ORDER   3
+
+// Lives at the start of each slab; objects follow. Free objects are chained
+// through a link word stored inside the object (or just past it when the
+// cache has a constructor, so constructed state survives being free).
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    struct kmem_cache *cache;
+    void *free;
+    uint32_t inuse;
+};
+
+struct kmem_cache {
+    struct spinlock lock;  // slab lists and counters
+    const char *name;
+    uint32_t obj_size;
+    uint32_t stride;     // distance between objects
+    uint32_t link_off;   // free-list link offset within an object slot
+    uint32_t first_off;  // offset of the first object from the slab start
+    uint32_t per_slab;
+    uint8_t order;
+    kmem_ctor_t ctor;
+
+    struct slab *partial;  // some objects free
+    struct slab *full;
+    struct slab *empty;    // at most one, kept to absorb alloc/free churn
+
+    uint64_t slabs;
+    uint64_t active;
+    uint64_t allocs;
+    uint64_t frees;
+    struct kmem_cache *next_cache;
+};
+
+static const uint32_t class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 1024, 2048
+};
+static const char *const class_names[] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-48", "kmalloc-64",
+    "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256",
+    "kmalloc-384", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+#define CLASS_COUNT (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+static struct kmem_cache kmalloc_caches[CLASS_COUNT];
+// Size class for requests up to 512 bytes, indexed by (size + 15) / 16.
+static uint8_t small_class[512 / 16 + 1];
+
+static struct kmem_cache *cache_list;
+static struct kmem_cache **cache_tail = &cache_list;
+static struct kmem_cache meta_cache;  // backs kmem_cache_create
+static struct kmalloc_large_stats large_stats;
+static struct spinlock cache_list_lock = SPINLOCK_INIT;
+static struct spinlock large_lock = SPINLOCK_INIT;
+
+static inline uint32_t align_up(uint32_t v, uint32_t a) {
+    return (v + a - 1) & ~(a - 1);
+}
+
+static inline void **obj_link(struct kmem_cache *c, void *obj) {
+    return (void **)((uint8_t *)obj + c->link_off);
+}
+
+static void list_push(struct slab **head, struct slab *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void list_remove(struct slab **head, struct slab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+static void cache_setup(struct kmem_cache *c, const char *name, uint32_t size,
+                        uint32_t align, kmem_ctor_t ctor) {
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (size == 0) size = 1;
+
+    c->lock = (struct spinlock)SPINLOCK_INIT;
+    c->name = name;
+    c->obj_size = size;
+    c->ctor = ctor;
+    if (ctor) {
+        c->link_off = align_up(size, sizeof(void *));
+        c->stride = align_up(c->link_off + sizeof(void *), align);
+    } else {
+        c->link_off = 0;
+        c->stride = align_up(size < sizeof(void *) ? sizeof(void *) : size, align);
+    }
+    c->first_off = align_up(sizeof(struct slab), align);
+
+    c->order = 0;
+    while (c->order < SLAB_MAX_ORDER &&
+           (PAGE_SIZE << c->order) - c->first_off < (uint64_t)c->stride * SLAB_MIN_OBJECTS)
+        c->order++;
+    c->per_slab = (uint32_t)(((PAGE_SIZE << c->order) - c->first_off) / c->stride);
+
+    c->partial = c->full = c->empty = NULL;
+    c->slabs = c->active = c->allocs = c->frees = 0;
+    c->next_cache = NULL;
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    *cache_tail = c;
+    cache_tail = &c->next_cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+static struct slab *slab_create(struct kmem_cache *c) {
+    void *block = pmm_alloc_pages(c->order);
+    if (!block) return NULL;
+    uint64_t phys = (uint64_t)(uintptr_t)block;
+    pmm_set_page_tag(phys, 1ULL << c->order, TAG_SLAB | c->order);
+
+    struct slab *s = (struct slab *)vmm_phys_to_virt(phys);
+    s->cache = c;
+    s->inuse = 0;
+
+    // Chain objects in address order so early allocations stay together.
+    uint8_t *obj = (uint8_t *)s + c->first_off;
+    s->free = obj;
+    for (uint32_t i = 0; i < c->per_slab; i++, obj += c->stride) {
+        if (c->ctor) c->ctor(obj);
+        *obj_link(c, obj) = i + 1 < c->per_slab ? obj + c->stride : NULL;
+    }
+    c->slabs++;
+    return s;
+}
+
+static void slab_destroy(struct kmem_cache *c, struct slab *s) {
+    uint64_t phys = vmm_virt_to_phys(s);
+    pmm_set_page_tag(phys, 1ULL << c->order, 0);
+    pmm_free_pages((void *)(uintptr_t)phys, c->order);
+    c->slabs--;
+}
+
+void kmalloc_init(void) {
+    for (uint32_t i = 0; i < CLASS_COUNT; i++)
+        cache_setup(&kmalloc_caches[i], class_names[i], class_sizes[i], 16, NULL);
+
+    uint32_t cls = 0;
+    for (uint32_t i = 0; i < sizeof(small_class); i++) {
+        while (class_sizes[cls] < i * 16) cls++;
+        small_class[i] = (uint8_t)cls;
+    }
+
+    cache_setup(&meta_cache, "kmem_cache", sizeof(struct kmem_cache), 8, NULL);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                                     kmem_ctor_t ctor) {
+    if (size > KMALLOC_MAX_SMALL || (align & (align - 1))) return NULL;
+    struct kmem_cache *c = kmem_cache_alloc(&meta_cache);
+    if (!c) return NULL;
+    cache_setup(c, name, size, align, ctor);
+    return c;
+}
+
+static void *cache_alloc(struct kmem_cache *c) {
+    struct slab *s = c->partial;
+    if (!s) {
+        s = c->empty;
+        if (s) c->empty = NULL;
+        else if (!(s = slab_create(c))) return NULL;
+        list_push(&c->partial, s);
+    }
+
+    void *obj = s->free;
+    s->free = *obj_link(c, obj);
+    s->inuse++;
+    if (!s->free) {
+        list_remove(&c->partial, s);
+        list_push(&c->full, s);
+    }
+    c->active++;
+    c->allocs++;
+    return obj;
+}
+
+static void cache_free(struct kmem_cache *c, void *obj) {
+    uint64_t slab_bytes = PAGE_SIZE << c->order;
+    struct slab *s = (struct slab *)((uintptr_t)obj & ~(uintptr_t)(slab_bytes - 1));
+
+    if (!s->free) {
+        list_remove(&c->full, s);
+        list_push(&c->partial, s);
+    }
+    *obj_link(c, obj) = s->free;
+    s->free = obj;
+    s->inuse--;
+    c->active--;
+    c->frees++;
+
+    if (s->inuse == 0) {
+        list_remove(&c->partial, s);
+        if (c->empty) slab_destroy(c, s);
+        else c->empty = s;
+    }
+}
+
+// Caches are shared by all CPUs and may be used from interrupt handlers:
+// slab lists change under the cache lock with interrupts off.
+void *kmem_cache_alloc(struct kmem_cache *c) {
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    void *obj = cache_alloc(c);
+    spin_unlock_irqrestore(&c->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *obj) {
+    if (!obj) return;
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    cache_free(c, obj);
+    spin_unlock_irqrestore(&c->lock, flags);
+}
+
+void *kmalloc(uint64_t size) {
+    if (size == 0) return NULL;
+    if (size <= 512) return kmem_cache_alloc(&kmalloc_caches[small_class[(size + 15) / 16]]);
+    if (size <= 1024) return kmem_cache_alloc(&kmalloc_caches[CLASS_COUNT - 2]);
+    if (size <= KMALLOC_MAX_SMALL) return kmem_cache_alloc(&kmalloc_caches[CLASS_COUNT - 1]);
+
+    unsigned order = 0;
+    while ((PAGE_SIZE << order) < size) {
+        if (++order > PMM_MAX_ORDER) return NULL;
+    }
+    void *block = pmm_alloc_pages(order);
+    if (!block) return NULL;
+    uint64_t phys = (uint64_t)(uintptr_t)block;
+    pmm_set_page_tag(phys, 1ULL << order, TAG_LARGE | order);
+    uint64_t flags = spin_lock_irqsave(&large_lock);
+    large_stats.allocs++;
+    large_stats.pages += 1ULL << order;
+    spin_unlock_irqrestore(&large_lock, flags);
+    return vmm_phys_to_virt(phys);
+}
+
+void *kzalloc(uint64_t size) {
+    void *p = kmalloc(size);
+    if (p) {
+        void *dst = p;
+        uint64_t n = size;
+        __asm__ __volatile__("rep stosb" : "+D"(dst), "+c"(n) : "a"(0) : "memory");
+    }
+    return p;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) return;
+    uint64_t phys = vmm_virt_to_phys(ptr);
+    uint8_t tag = pmm_page_tag(phys);
+    unsigned order = tag & TAG_ORDER;
+
+    if (tag & TAG_SLAB) {
+        uint64_t base = phys & ~((PAGE_SIZE << order) - 1);
+        struct slab *s = (struct slab *)vmm_phys_to_virt(base);
+        kmem_cache_free(s->cache, ptr);
+    } else if (tag & TAG_LARGE) {
+        if (phys & ((PAGE_SIZE << order) - 1)) return;  // not the block start
+        pmm_set_page_tag(phys, 1ULL << order, 0);
+        pmm_free_pages((void *)(uintptr_t)phys, order);
+        uint64_t flags = spin_lock_irqsave(&large_lock);
+        large_stats.frees++;
+        large_stats.pages -= 1ULL << order;
+        spin_unlock_irqrestore(&large_lock, flags);
+    }
+}
+
+int kmem_cache_get_stats(uint32_t index, struct kmem_cache_stats *out) {
+    struct kmem_cache *c = cache_list;
+    while (c && index--) c = c->next_cache;
+    if (!c) return -1;
+    out->name = c->name;
+    out->obj_size = c->obj_size;
+    out->per_slab = c->per_slab;
+    out->slab_pages = 1u << c->order;
+    out->slabs = c->slabs;
+    out->active = c->active;
+    out->allocs = c->allocs;
+    out->frees = c->frees;
+    return 0;
+}
+
+void kmalloc_get_large_stats(struct kmalloc_large_stats *out) {
+    *out = large_stats;
+}
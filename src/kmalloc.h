@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+
+// Slab allocator on top of the PMM. Objects are reached through the direct
+// map, so kmalloc_init() must run after vmm_init().
+
+// Largest request served from a size class; bigger ones get whole pages.
+#define KMALLOC_MAX_SMALL 2048
+
+struct kmem_cache;
+
+// Called once per object when its slab is created. Objects of a cache with
+// a constructor must be freed back in their constructed state.
+typedef void (*kmem_ctor_t)(void *obj);
+
+void kmalloc_init(void);
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                                     kmem_ctor_t ctor);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void *kmalloc(uint64_t size);
+void *kzalloc(uint64_t size);
+void kfree(void *ptr);
+
+struct kmem_cache_stats {
+    const char *name;
+    uint32_t obj_size;
+    uint32_t per_slab;    // objects per slab
+    uint32_t slab_pages;  // pages per slab
+    uint64_t slabs;
+    uint64_t active;      // objects handed out
+    uint64_t allocs;
+    uint64_t frees;
+};
+// Fill `out` for the index-th cache; returns 0, or -1 past the last one.
+int kmem_cache_get_stats(uint32_t index, struct kmem_cache_stats *out);
+
+// Requests above KMALLOC_MAX_SMALL.
+struct kmalloc_large_stats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t pages;  // currently held
+};
+void kmalloc_get_large_stats(struct kmalloc_large_stats *out);
@@ -1,14 +1,33 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "cpu.h"
 #include "gdt.h"
 #include "idt.h"
+#include "acpi.h"
+#include "apic.h"
+#include "timer.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "irq.h"
 #include "multiboot2.h"
 #include "pic.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "kmalloc.h"
 #include "keyboard.h"
+#include "sched.h"
+#include "percpu.h"
+#include "smp.h"
+#include "event.h"
+#include "idle.h"
 #include "shell.h"
+#include "serial.h"
+#include "trace.h"
+#include "console.h"
+#include "fb.h"
+#include "boottime.h"
+#include "initrd.h"
 
 // Very small VGA text-mode writer (white on black).
 // Note: After VMM init, we'll use vmm_framebuffer instead
@@ -29,38 +48,6 @@ static void vga_write_at(size_t row, size_t col, const char *s) {
     }
 }
 
-// Optional serial output (useful when running QEMU headless with -nographic).
-static inline void outb(uint16_t port, uint8_t val) {
-    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
-}
-
-static inline uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
-}
-
-static void serial_init(void) {
-    // COM1 = 0x3F8
-    outb(0x3F8 + 1, 0x00); // Disable interrupts
-    outb(0x3F8 + 3, 0x80); // Enable DLAB
-    outb(0x3F8 + 0, 0x03); // Divisor low  (38400 baud)
-    outb(0x3F8 + 1, 0x00); // Divisor high
-    outb(0x3F8 + 3, 0x03); // 8 bits, no parity, one stop bit
-    outb(0x3F8 + 2, 0xC7); // Enable FIFO, clear, 14-byte threshold
-    outb(0x3F8 + 4, 0x0B); // IRQs enabled, RTS/DSR set
-}
-
-static void serial_write_char(char c) {
-    // Wait for transmitter holding register empty.
-    while ((inb(0x3F8 + 5) & 0x20) == 0) {}
-    outb(0x3F8, (uint8_t)c);
-}
-
-static void serial_write(const char *s) {
-    while (*s) serial_write_char(*s++);
-}
-
 static void print_hex64(uint64_t val) {
     char buf[17];
     const char *hex = "0123456789ABCDEF";
@@ -73,14 +60,9 @@ static void print_hex64(uint64_t val) {
     serial_write(buf);
 }
 
-void isr_handler(struct isr_context *ctx) {
-    if (ctx->vector == 33) {
-        // Keyboard IRQ
-        extern void keyboard_irq_handler(void);
-        keyboard_irq_handler();
-        return; // Don't halt, continue execution
-    }
-    
+// Fatal CPU exceptions: report and halt.
+static void exception_handler(struct isr_context *ctx, void *unused) {
+    (void)unused;
     if (ctx->vector == 0) {
         vga_clear();
         vga_write_at(0, 0, "EXCEPTION CAUGHT");
@@ -101,16 +83,37 @@ void isr_handler(struct isr_context *ctx) {
         vga_write_at(1, 0, "Page Fault");
         serial_write("#PF: error=");
         print_hex64(ctx->error);
+        serial_write(" CR2=");
+        print_hex64(read_cr2());
+        serial_write(" RIP=");
+        print_hex64(ctx->rip);
+        serial_write("\r\n");
+    } else {
+        vga_clear();
+        vga_write_at(0, 0, "EXCEPTION CAUGHT");
+        serial_write("Exception: vector=");
+        print_hex64(ctx->vector);
+        serial_write(" error=");
+        print_hex64(ctx->error);
         serial_write(" RIP=");
         print_hex64(ctx->rip);
         serial_write("\r\n");
     }
 
+    serial_flush();
     for (;;) {
         __asm__ __volatile__("cli; hlt");
     }
 }
 
+static void page_fault_handler(struct isr_context *ctx, void *unused) {
+    // Address spaces are the boot CPU's (vmm.h): on an AP it is a bug.
+    if (this_cpu()->id == 0 && vmm_handle_fault(read_cr2(), ctx->error)) {
+        return; // demand-zero or copy-on-write fault resolved
+    }
+    exception_handler(ctx, unused);
+}
+
 static void print_hex(uint64_t val) {
     char buf[17];
     const char *hex = "0123456789ABCDEF";
@@ -124,35 +127,125 @@ static void print_hex(uint64_t val) {
     vga_write_at(2, 24, " bytes");
 }
 
+static struct event input_ready;
+
 // Called from kernel/entry.asm after long mode is enabled.
 void kmain(uint64_t mb_info_addr, uint32_t mb_magic) {
-    serial_init();
+    // Each boot_mark() ends a phase of the boot timeline (see boottime.h).
+    serial_init(SERIAL_BAUD);
     vga_clear();
     vga_write_at(0, 0, "Hello, OS World!");
+    boot_mark("serial");
 
     gdt_init();
+    smp_init_bsp();
+    boot_mark("gdt");
     idt_init();
+    for (uint8_t vec = 0; vec < 32; vec++) {
+        if (vec == FPU_NM_VECTOR) continue;  // owned by fpu_init
+        irq_register(vec, vec == 14 ? page_fault_handler : exception_handler, NULL);
+    }
+    boot_mark("idt");
+    fpu_init();
+    idle_init();
+    syscall_init();
+    boot_mark("cpu");
     pic_init(0x20, 0x28);  // Remap PIC to IRQ 0x20-0x2F
+    boot_mark("pic");
 
     if (mb_magic == MULTIBOOT2_MAGIC) {
         pmm_init(mb_info_addr);
+        boot_mark("pmm");
+        serial_write("PMM: init cycles=");
+        print_hex64(pmm_init_cycles());
+        serial_write("\r\n");
+        if (pmm_unmanaged_bytes()) {
+            serial_write("PMM: warning: unmanaged bytes=");
+            print_hex64(pmm_unmanaged_bytes());
+            serial_write("\r\n");
+        }
         uint64_t free = pmm_free_bytes();
         print_hex(free);
         
         // Initialize VMM (paging)
         vmm_init();
+        boot_mark("vmm");
+        kmalloc_init();
+        boot_mark("kmalloc");
+
+        int files = initrd_init(mb_info_addr);
+        if (files >= 0) {
+            serial_write("INITRD: files=");
+            print_hex64((uint64_t)files);
+            serial_write("\r\n");
+        }
+        struct initrd_stats initrd_st;
+        initrd_get_stats(&initrd_st);
+        if (initrd_st.writable) {
+            serial_write("INITRD: warning: modules left writable=");
+            print_hex64(initrd_st.writable);
+            serial_write("\r\n");
+        }
+        boot_mark("initrd");
+
+        // Interrupt controllers: LAPIC + IO-APIC when the MADT describes
+        // them, the 8259 otherwise.
+        if (acpi_init(mb_info_addr) == 0 && apic_init() == 0) {
+            serial_write(apic_x2apic() ? "APIC: x2APIC mode\r\n" : "APIC: xAPIC mode\r\n");
+        } else {
+            serial_write("APIC: not available, using 8259 PIC\r\n");
+        }
+        boot_mark("apic");
+
+        timer_init();
+        boot_mark("timer");
+        struct timer_stats ts;
+        timer_get_stats(&ts);
+        serial_write("Timer: TSC Hz=");
+        print_hex64(ts.tsc_hz);
+        serial_write(" events=");
+        serial_write(ts.event_source);
+        serial_write("\r\n");
+
+        // From here on kmain is the "main" thread; the idle thread takes
+        // over the zero-pool refill.
+        sched_init();
+        events_init();
+        boot_mark("sched");
+
+        uint32_t cpus = smp_init();
+        boot_mark("smp");
+        serial_write("SMP: CPUs online=");
+        print_hex64(cpus);
+        serial_write("\r\n");
+        trace_init();
+        boot_mark("trace");
         
-        // Switch to virtual framebuffer
+        // Switch to virtual framebuffer; a linear framebuffer from the
+        // bootloader takes over the console if there is one.
         VGA = vmm_framebuffer;
-        
-        // Initialize keyboard and shell
-        keyboard_init();
+        if (fb_init(mb_info_addr) == 0) {
+            struct fb_info fi;
+            fb_get_info(&fi);
+            serial_write("FB: ");
+            print_hex64(fi.width);
+            serial_write("x");
+            print_hex64(fi.height);
+            serial_write(fi.write_combining ? " WC\r\n" : " UC\r\n");
+        }
+        console_init(3);  // below the boot messages
+        boot_mark("console");
+
+        // Input devices signal input_ready; the shell drains them all.
+        event_init(&input_ready, "input");
+        keyboard_init(&input_ready);
+        serial_enable_irq(&input_ready);
+        boot_mark("input");
         shell_init();
-        
-        // Unmask keyboard IRQ only
-        uint8_t mask = inb(0x21);
-        mask &= ~(1 << 1); // Enable keyboard IRQ
-        outb(0x21, mask);
+        boot_mark("shell");
+
+        serial_write("Boot timeline:\r\n");
+        boot_timeline_write(serial_write_text);
     } else {
         vga_write_at(1, 0, "Bad Multiboot2 magic");
     }
@@ -160,10 +253,9 @@ void kmain(uint64_t mb_info_addr, uint32_t mb_magic) {
     // Enable interrupts
     __asm__ __volatile__("sti");
 
-    // Main loop: process shell input
+    // Main loop: process shell input, then block until more arrives.
     for (;;) {
         shell_run();
-        __asm__ __volatile__("hlt");
+        while (!keyboard_has_data() && !serial_has_data()) event_wait(&input_ready);
     }
 }
-
@@ -9,10 +9,23 @@ struct multiboot2_tag {
 };
 
 #define MULTIBOOT2_TAG_TYPE_END         0
+#define MULTIBOOT2_TAG_TYPE_MODULE      3
 #define MULTIBOOT2_TAG_TYPE_MMAP        6
+#define MULTIBOOT2_TAG_TYPE_FRAMEBUFFER 8
+#define MULTIBOOT2_TAG_TYPE_ACPI_OLD    14
+#define MULTIBOOT2_TAG_TYPE_ACPI_NEW    15
 
 #define MULTIBOOT2_MEMORY_AVAILABLE     1
 
+// One per module2 line in grub.cfg, loaded page-aligned into RAM.
+struct multiboot2_tag_module {
+    uint32_t type;      // 3
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;   // exclusive
+    char cmdline[];     // NUL-terminated
+};
+
 struct multiboot2_tag_mmap {
     uint32_t type;      // 6
     uint32_t size;
@@ -28,6 +41,38 @@ struct multiboot2_mmap_entry {
     uint32_t reserved;
 };
 
+// Types 14/15: a copy of the ACPI 1.0 / 2.0+ RSDP follows the header.
+struct multiboot2_tag_acpi {
+    uint32_t type;
+    uint32_t size;
+    // uint8_t rsdp[];
+};
+
+// Type 8: the video mode the bootloader set up. For RGB framebuffers the
+// colour layout follows the common part.
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_INDEXED  0
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_RGB      1
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_EGA_TEXT 2
+
+struct __attribute__((packed)) multiboot2_tag_framebuffer {
+    uint32_t type;      // 8
+    uint32_t size;
+    uint64_t addr;
+    uint32_t pitch;     // bytes per scan line
+    uint32_t width;
+    uint32_t height;
+    uint8_t  bpp;
+    uint8_t  fb_type;
+    uint16_t reserved;
+    // MULTIBOOT2_FRAMEBUFFER_TYPE_RGB only:
+    uint8_t  red_position;
+    uint8_t  red_size;
+    uint8_t  green_position;
+    uint8_t  green_size;
+    uint8_t  blue_position;
+    uint8_t  blue_size;
+};
+
 struct multiboot2_info_header {
     uint32_t total_size;
     uint32_t reserved;
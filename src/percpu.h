@@ -0,0 +1,61 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "fpu.h"
+#include "idle.h"
+#include "task.h"
+#include "trace.h"
+
+// Per-CPU data, reached through the GS base. Slot 0 points back at the
+// structure so this_cpu() is a single load. In ring 3 the user GS base is
+// live and the per-CPU pointer waits in KERNEL_GS_BASE; every entry from
+// and exit to ring 3 does SWAPGS.
+
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+// Offsets used by syscall.asm.
+#define PERCPU_ENTRY_RSP       32
+#define PERCPU_USER_RSP        40
+#define PERCPU_USER_RETURN_RSP 48
+
+struct percpu {
+    struct percpu *self;        // must stay first (%gs:0)
+    uint32_t id;                // 0 is the boot CPU
+    uint32_t apic_id;
+    volatile uint32_t online;
+    uint64_t stack_top;
+    // Ring 3 support (syscall.c/syscall.asm).
+    uint64_t entry_rsp;        // top of this CPU's ring 3 -> ring 0 stack
+    uint64_t user_rsp;         // user RSP while a SYSCALL runs
+    uint64_t user_return_rsp;  // user_enter's saved frame
+    // IDLE_* (idle.c). Alone on its line: it is the MWAIT monitor target
+    // and other writes there would wake the CPU for nothing.
+    volatile uint32_t idle __attribute__((aligned(64)));
+    uint8_t idle_pad[60];
+    struct idle_cpu_stats idle_stats;
+    struct task_deque tasks;
+    struct task_cpu_stats task_stats;
+    struct trace_rec *trace_ring;  // NULL until trace_init()
+    uint64_t trace_head;           // records ever written
+    struct fpu_cpu fpu;
+};
+
+_Static_assert(offsetof(struct percpu, entry_rsp) == PERCPU_ENTRY_RSP, "syscall.asm");
+_Static_assert(offsetof(struct percpu, user_rsp) == PERCPU_USER_RSP, "syscall.asm");
+_Static_assert(offsetof(struct percpu, user_return_rsp) == PERCPU_USER_RETURN_RSP,
+               "syscall.asm");
+
+static inline struct percpu *this_cpu(void) {
+    struct percpu *p;
+    __asm__ __volatile__("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+// Point GS at `p` on the calling CPU; ring 3 starts with a zero GS base.
+static inline void percpu_install(struct percpu *p) {
+    p->self = p;
+    __asm__ __volatile__("wrmsr" : : "c"(MSR_GS_BASE), "a"((uint32_t)(uint64_t)p),
+                         "d"((uint32_t)((uint64_t)p >> 32)) : "memory");
+    __asm__ __volatile__("wrmsr" : : "c"(MSR_KERNEL_GS_BASE), "a"(0), "d"(0) : "memory");
+}
@@ -35,6 +35,19 @@ void pic_init(uint8_t offset_master, uint8_t offset_slave) {
     outb(PIC2_DATA, a2);
 }
 
+void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8) outb(PIC2_CMD, PIC_EOI);
+    outb(PIC1_CMD, PIC_EOI);
+}
+
+void pic_unmask(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = 2; // cascade
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
 void pic_mask_all(void) {
     outb(PIC1_DATA, 0xFF);
     outb(PIC2_DATA, 0xFF);
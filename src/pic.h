@@ -2,4 +2,6 @@
 #include <stdint.h>
 
 void pic_init(uint8_t offset_master, uint8_t offset_slave);
+void pic_send_eoi(uint8_t irq);
+void pic_unmask(uint8_t irq);
 void pic_mask_all(void);
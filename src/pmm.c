@@ -1,38 +1,239 @@
 #include <stdint.h>
 #include <stddef.h>
+#include "cpu.h"
+#include "spinlock.h"
+#include "trace.h"
 #include "multiboot2.h"
 #include "pmm.h"
+#include "vmm.h"
 
 extern uint8_t _kernel_end;
 
-static uint8_t *bitmap;
-static uint64_t bitmap_bytes;
+static uint64_t *bitmap;        // 1 bit per page, set = used
+static uint16_t *page_refs;     // mappings of VM-managed frames, 0 = unmanaged
+static uint8_t *page_tags;      // owner tag per frame, 0 = none
+static uint64_t bitmap_words;
 static uint64_t total_pages;
 static uint64_t used_pages;
+static uint64_t init_cycles;
+static uint64_t meta_end;
+static uint64_t unmanaged_bytes;
+
+static struct pmm_region regions[PMM_MAX_REGIONS];
+static uint32_t region_count;
+
+// Page-frame ranges [start, end) that must never be handed out: sorted,
+// disjoint and not touching each other.
+struct pfn_range {
+    uint64_t start, end;
+};
+
+#define MAX_RESERVED 16
+static struct pfn_range reserved[MAX_RESERVED];
+static uint32_t reserved_count;
 
 #define PAGE_SIZE 4096
 
-static inline void set_bit(uint64_t idx)   { bitmap[idx >> 3] |=  (1u << (idx & 7)); }
-static inline void clear_bit(uint64_t idx) { bitmap[idx >> 3] &= ~(1u << (idx & 7)); }
-static inline int  test_bit(uint64_t idx)  { return (bitmap[idx >> 3] >> (idx & 7)) & 1u; }
-
-static void mark_range_used(uint64_t addr, uint64_t len) {
-    uint64_t start_page = addr / PAGE_SIZE;
-    uint64_t end_page   = (addr + len + PAGE_SIZE - 1) / PAGE_SIZE;
-    if (end_page > total_pages) end_page = total_pages;
-    for (uint64_t p = start_page; p < end_page; ++p) {
-        if (!test_bit(p)) {
-            set_bit(p);
-            used_pages++;
+// Frames zeroed ahead of time for pmm_alloc_zeroed(). Filled from the idle
+// loop so page-table allocation does not pay for clearing inline.
+#define ZERO_POOL_SIZE 64
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count;
+static uint64_t zero_pool_hits;
+static uint64_t zero_pool_misses;
+static uint64_t zero_pool_refilled;
+
+// Set or clear bits [start, end) of a word array. Only the two edge words
+// need masking; everything in between is a plain 64-bit store.
+static void bits_fill(uint64_t *words, uint64_t start, uint64_t end, int value) {
+    if (start >= end) return;
+    uint64_t first = start >> 6;
+    uint64_t last  = (end - 1) >> 6;
+    uint64_t head  = ~0ULL << (start & 63);
+    uint64_t tail  = ~0ULL >> (63 - ((end - 1) & 63));
+
+    if (first == last) head &= tail;
+    if (value) words[first] |= head; else words[first] &= ~head;
+    if (first == last) return;
+
+    uint64_t fill = value ? ~0ULL : 0;
+    for (uint64_t w = first + 1; w < last; ++w) words[w] = fill;
+    if (value) words[last] |= tail; else words[last] &= ~tail;
+}
+
+// Non-zero if every bit in [start, end) is set.
+static int bits_all_set(const uint64_t *words, uint64_t start, uint64_t end) {
+    uint64_t first = start >> 6;
+    uint64_t last  = (end - 1) >> 6;
+    uint64_t head  = ~0ULL << (start & 63);
+    uint64_t tail  = ~0ULL >> (63 - ((end - 1) & 63));
+
+    if (first == last) return (words[first] & (head & tail)) == (head & tail);
+    if ((words[first] & head) != head) return 0;
+    for (uint64_t w = first + 1; w < last; ++w) {
+        if (words[w] != ~0ULL) return 0;
+    }
+    return (words[last] & tail) == tail;
+}
+
+// Buddy free sets.
+//
+// For every order k there is one bit per naturally aligned block of 2^k
+// pages; the bit is set when that block is free *as a whole* at order k.
+// Each set is a small tree of 64-bit words: a bit in level L+1 says "word
+// N of level L is non-zero", so finding the lowest free block is one ctz
+// per level and set/clear only walk upwards while a word changes between
+// empty and non-empty. Five levels cover 2^30 pages (4 TiB).
+#define FREE_SET_LEVELS 5
+
+struct free_set {
+    uint64_t *level[FREE_SET_LEVELS];
+    uint32_t depth;
+};
+
+static struct free_set free_sets[PMM_MAX_ORDER + 1];
+static uint32_t nonempty_orders; // bit k set => free_sets[k] has a block
+
+static uint64_t free_set_layout(struct free_set *fs, uint64_t nbits, uint64_t *storage) {
+    uint64_t words_total = 0;
+    uint64_t words = (nbits + 63) / 64;
+    if (words == 0) words = 1;
+    fs->depth = 0;
+    for (;;) {
+        if (storage) {
+            fs->level[fs->depth] = storage + words_total;
+            bits_fill(storage + words_total, 0, words * 64, 0);
         }
+        fs->depth++;
+        words_total += words;
+        if (words == 1 || fs->depth == FREE_SET_LEVELS) break;
+        words = (words + 63) / 64;
     }
+    return words_total;
 }
 
-static void parse_mmap(uint64_t mb_info_addr, uint64_t *out_highest) {
+static inline int free_set_test(const struct free_set *fs, uint64_t bit) {
+    return (fs->level[0][bit >> 6] >> (bit & 63)) & 1u;
+}
+
+static void free_set_insert(unsigned order, uint64_t bit) {
+    struct free_set *fs = &free_sets[order];
+    for (uint32_t l = 0; l < fs->depth; ++l) {
+        uint64_t *w = &fs->level[l][bit >> 6];
+        int was_empty = (*w == 0);
+        *w |= 1ULL << (bit & 63);
+        if (!was_empty) break;
+        bit >>= 6;
+    }
+    nonempty_orders |= 1u << order;
+}
+
+// Mark blocks [first, end) free at `order`. Every summary bit covering the
+// range is set too, so each level is a single word-wide fill.
+static void free_set_fill(unsigned order, uint64_t first, uint64_t end) {
+    struct free_set *fs = &free_sets[order];
+    if (first >= end) return;
+    for (uint32_t l = 0; l < fs->depth; ++l) {
+        bits_fill(fs->level[l], first, end, 1);
+        first >>= 6;
+        end = ((end - 1) >> 6) + 1;
+    }
+    nonempty_orders |= 1u << order;
+}
+
+static void free_set_remove(unsigned order, uint64_t bit) {
+    struct free_set *fs = &free_sets[order];
+    for (uint32_t l = 0; l < fs->depth; ++l) {
+        uint64_t *w = &fs->level[l][bit >> 6];
+        *w &= ~(1ULL << (bit & 63));
+        if (*w != 0) return;
+        bit >>= 6;
+    }
+    nonempty_orders &= ~(1u << order);
+}
+
+static uint64_t free_set_first(unsigned order) {
+    const struct free_set *fs = &free_sets[order];
+    uint64_t idx = 0;
+    for (int l = (int)fs->depth - 1; l >= 0; --l) {
+        idx = (idx << 6) | (uint64_t)__builtin_ctzll(fs->level[l][idx]);
+    }
+    return idx;
+}
+
+// Insert [start, end) as maximal aligned buddy blocks, one at a time.
+static void buddy_add_blocks(uint64_t start, uint64_t end) {
+    while (start < end) {
+        unsigned order = start ? (unsigned)__builtin_ctzll(start) : PMM_MAX_ORDER;
+        if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+        while (start + (1ULL << order) > end) order--;
+        free_set_insert(order, start >> order);
+        start += 1ULL << order;
+    }
+}
+
+// Hand the free page run [start, end) to the buddy allocator. The unaligned
+// head and tail take at most PMM_MAX_ORDER blocks each; the aligned middle
+// is a word fill of the top-order set.
+static void buddy_add_range(uint64_t start, uint64_t end) {
+    const uint64_t max_block = 1ULL << PMM_MAX_ORDER;
+    uint64_t mid_start = (start + max_block - 1) & ~(max_block - 1);
+    uint64_t mid_end   = end & ~(max_block - 1);
+
+    if (mid_start >= mid_end) {
+        buddy_add_blocks(start, end);
+        return;
+    }
+    buddy_add_blocks(start, mid_start);
+    free_set_fill(PMM_MAX_ORDER, mid_start >> PMM_MAX_ORDER, mid_end >> PMM_MAX_ORDER);
+    buddy_add_blocks(mid_end, end);
+}
+
+// Add a byte range to the reserved list, merging it with the ranges it
+// overlaps or touches. With the list full it also absorbs the nearest
+// range: the frames in between are lost, but a reservation never is.
+static void reserve_range(uint64_t addr, uint64_t len) {
+    if (len == 0) return;
+    struct pfn_range r = {
+        addr / PAGE_SIZE,
+        (addr + len + PAGE_SIZE - 1) / PAGE_SIZE,
+    };
+    // Entries [i, j) get replaced by r.
+    uint32_t i = 0;
+    while (i < reserved_count && reserved[i].end < r.start) ++i;
+    uint32_t j = i;
+    while (j < reserved_count && reserved[j].start <= r.end) {
+        if (reserved[j].start < r.start) r.start = reserved[j].start;
+        if (reserved[j].end > r.end) r.end = reserved[j].end;
+        ++j;
+    }
+    if (i == j && reserved_count == MAX_RESERVED) {
+        if (i == reserved_count ||
+            (i > 0 && r.start - reserved[i - 1].end < reserved[i].start - r.end))
+            r.start = reserved[--i].start;
+        else
+            r.end = reserved[j++].end;
+    }
+
+    if (i == j) {
+        for (uint32_t k = reserved_count; k > i; --k) reserved[k] = reserved[k - 1];
+        ++reserved_count;
+    } else {
+        uint32_t removed = j - i - 1;
+        for (uint32_t k = j; k < reserved_count; ++k) reserved[k - removed] = reserved[k];
+        reserved_count -= removed;
+    }
+    reserved[i] = r;
+}
+
+// Single pass over the Multiboot2 tags: copy the memory map into the
+// region table, sorted by base address, and reserve every module (the
+// initrd) like the kernel image.
+static void parse_mmap(uint64_t mb_info_addr) {
     struct multiboot2_info_header *hdr = (struct multiboot2_info_header *)(uintptr_t)mb_info_addr;
     uint8_t *tag_ptr = (uint8_t *)(hdr + 1);
     uint8_t *end     = (uint8_t *)hdr + hdr->total_size;
-    *out_highest = 0;
+    region_count = 0;
 
     while (tag_ptr < end) {
         struct multiboot2_tag *tag = (struct multiboot2_tag *)tag_ptr;
@@ -43,105 +244,362 @@ static void parse_mmap(uint64_t mb_info_addr, uint64_t *out_highest) {
             uint8_t *entry_ptr = (uint8_t *)(mmap_tag + 1);
             uint8_t *entry_end = (uint8_t *)tag + tag->size;
 
-            while (entry_ptr < entry_end) {
+            while (entry_ptr < entry_end && region_count < PMM_MAX_REGIONS) {
                 struct multiboot2_mmap_entry *e = (struct multiboot2_mmap_entry *)entry_ptr;
-                uint64_t last = e->addr + e->len;
-                if (last > *out_highest)
-                    *out_highest = last;
+                struct pmm_region r = { e->addr, e->len, e->type };
+                uint32_t i = region_count++;
+                while (i > 0 && regions[i - 1].base > r.base) {
+                    regions[i] = regions[i - 1];
+                    --i;
+                }
+                regions[i] = r;
                 entry_ptr += mmap_tag->entry_size;
             }
         }
 
+        if (tag->type == MULTIBOOT2_TAG_TYPE_MODULE) {
+            struct multiboot2_tag_module *mod = (struct multiboot2_tag_module *)tag;
+            if (mod->mod_end > mod->mod_start)
+                reserve_range(mod->mod_start, mod->mod_end - mod->mod_start);
+        }
+
         tag_ptr += (tag->size + 7) & ~7u;
     }
 }
 
+// pmm_init() runs before vmm_init() and writes its metadata through the
+// boot identity map, which covers the first 1 GiB (kernel/entry.asm).
+#define BOOT_MAP_LIMIT 0x40000000ULL
+
+// Words of metadata for `pages` frames: the bitmap, the buddy free sets,
+// then the per-frame reference counts and owner tags.
+static uint64_t metadata_words(uint64_t pages) {
+    uint64_t words = (pages + 63) / 64 + (pages * sizeof(uint16_t) + 7) / 8 + (pages + 7) / 8;
+    for (unsigned k = 0; k <= PMM_MAX_ORDER; ++k) {
+        words += free_set_layout(&free_sets[k], pages >> k, NULL);
+    }
+    return words;
+}
+
+// First page-aligned spot inside an available region and below
+// BOOT_MAP_LIMIT that does not collide with anything reserved (the
+// multiboot info usually sits right after the kernel). 0 if none fits.
+static uint64_t place_metadata(uint64_t bytes) {
+    uint64_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (uint32_t i = 0; i < region_count; ++i) {
+        if (regions[i].type != MULTIBOOT2_MEMORY_AVAILABLE) continue;
+        uint64_t start = (regions[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end   = (regions[i].base + regions[i].len) / PAGE_SIZE;
+        if (end > BOOT_MAP_LIMIT / PAGE_SIZE) end = BOOT_MAP_LIMIT / PAGE_SIZE;
+        // The list is sorted and disjoint: one pass moves past every
+        // collision.
+        for (uint32_t r = 0; r < reserved_count; ++r) {
+            if (reserved[r].start < start + pages && reserved[r].end > start)
+                start = reserved[r].end;
+        }
+        if (start + pages <= end) return start * PAGE_SIZE;
+    }
+    return 0;
+}
+
 void pmm_init(uint64_t mb_info_addr) {
-    uint64_t highest;
-    parse_mmap(mb_info_addr, &highest);
-    total_pages = (highest + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t t0 = rdtsc();
 
-    bitmap_bytes = (total_pages + 7) / 8;
-    uintptr_t bitmap_start = ((uintptr_t)&_kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    bitmap = (uint8_t *)bitmap_start;
+    reserved_count = 0;
+    parse_mmap(mb_info_addr);
 
-    // Initially mark all pages used
-    for (uint64_t i = 0; i < bitmap_bytes; ++i) bitmap[i] = 0xFF;
-    used_pages = total_pages;
+    uint64_t highest = 0;
+    for (uint32_t i = 0; i < region_count; ++i) {
+        if (regions[i].type != MULTIBOOT2_MEMORY_AVAILABLE) continue;
+        if (regions[i].base + regions[i].len > highest)
+            highest = regions[i].base + regions[i].len;
+    }
+    total_pages = highest / PAGE_SIZE;
+    if (total_pages > (1ULL << (6 * FREE_SET_LEVELS)))
+        total_pages = 1ULL << (6 * FREE_SET_LEVELS);
 
-    // Walk mmap again and mark AVAILABLE pages free
-    struct multiboot2_info_header *hdr = (struct multiboot2_info_header *)(uintptr_t)mb_info_addr;
-    uint8_t *tag_ptr = (uint8_t *)(hdr + 1);
-    uint8_t *end     = (uint8_t *)hdr + hdr->total_size;
+    // Low memory (<1 MiB), the kernel image and the multiboot info; the
+    // modules were reserved by parse_mmap().
+    uint64_t kernel_start = 0x00100000; // we link at 1M
+    reserve_range(0, kernel_start);
+    reserve_range(kernel_start, (uintptr_t)&_kernel_end - kernel_start);
+    reserve_range(mb_info_addr, ((struct multiboot2_info_header *)(uintptr_t)mb_info_addr)->total_size);
 
-    while (tag_ptr < end) {
-        struct multiboot2_tag *tag = (struct multiboot2_tag *)tag_ptr;
-        if (tag->type == MULTIBOOT2_TAG_TYPE_END) break;
+    // With no room for the metadata below the boot map limit, manage less
+    // memory: the frames above total_pages are left unused and reported.
+    uint64_t meta_words = metadata_words(total_pages);
+    uint64_t meta_start = place_metadata(meta_words * sizeof(uint64_t));
+    while (!meta_start && total_pages) {
+        total_pages -= total_pages / 8 ? total_pages / 8 : total_pages;
+        meta_words = metadata_words(total_pages);
+        meta_start = place_metadata(meta_words * sizeof(uint64_t));
+    }
+    unmanaged_bytes = 0;
+    for (uint32_t i = 0; i < region_count; ++i) {
+        uint64_t lo = regions[i].base, hi = regions[i].base + regions[i].len;
+        if (regions[i].type != MULTIBOOT2_MEMORY_AVAILABLE || hi <= total_pages * PAGE_SIZE) continue;
+        if (lo < total_pages * PAGE_SIZE) lo = total_pages * PAGE_SIZE;
+        unmanaged_bytes += hi - lo;
+    }
+    reserve_range(meta_start, meta_words * sizeof(uint64_t));
+    meta_end = meta_start + meta_words * sizeof(uint64_t);
 
-        if (tag->type == MULTIBOOT2_TAG_TYPE_MMAP) {
-            struct multiboot2_tag_mmap *mmap_tag = (struct multiboot2_tag_mmap *)tag;
-            uint8_t *entry_ptr = (uint8_t *)(mmap_tag + 1);
-            uint8_t *entry_end = (uint8_t *)tag + tag->size;
+    bitmap_words = (total_pages + 63) / 64;
+    uint64_t ref_words = (total_pages * sizeof(uint16_t) + 7) / 8;
+    uint64_t tag_words = (total_pages + 7) / 8;
 
-            while (entry_ptr < entry_end) {
-                struct multiboot2_mmap_entry *e = (struct multiboot2_mmap_entry *)entry_ptr;
-                if (e->type == MULTIBOOT2_MEMORY_AVAILABLE) {
-                    // Mark this range free
-                    uint64_t start_page = e->addr / PAGE_SIZE;
-                    uint64_t end_page   = (e->addr + e->len) / PAGE_SIZE;
-                    if (end_page > total_pages) end_page = total_pages;
-                    for (uint64_t p = start_page; p < end_page; ++p) {
-                        if (test_bit(p)) {
-                            clear_bit(p);
-                            used_pages--;
-                        }
-                    }
-                }
-                entry_ptr += mmap_tag->entry_size;
+    bitmap = (uint64_t *)(uintptr_t)meta_start;
+    uint64_t *sets = bitmap + bitmap_words;
+    for (unsigned k = 0; k <= PMM_MAX_ORDER; ++k) {
+        sets += free_set_layout(&free_sets[k], total_pages >> k, sets);
+    }
+    nonempty_orders = 0;
+    bits_fill(sets, 0, (ref_words + tag_words) * 64, 0);
+    page_refs = (uint16_t *)sets;
+    page_tags = (uint8_t *)(sets + ref_words);
+
+    // Everything starts out used; available regions minus the reserved
+    // ranges are then cleared and handed to the buddy allocator in runs.
+    bits_fill(bitmap, 0, bitmap_words * 64, 1);
+    uint64_t free_pages = 0;
+    uint64_t covered = 0; // tolerate overlapping map entries
+    for (uint32_t i = 0; i < region_count; ++i) {
+        if (regions[i].type != MULTIBOOT2_MEMORY_AVAILABLE) continue;
+        uint64_t start = (regions[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end   = (regions[i].base + regions[i].len) / PAGE_SIZE;
+        if (start < covered) start = covered;
+        if (end > total_pages) end = total_pages;
+        if (start >= end) continue;
+        covered = end;
+
+        for (uint32_t r = 0; r <= reserved_count && start < end; ++r) {
+            uint64_t stop = end;
+            if (r < reserved_count) {
+                if (reserved[r].end <= start) continue;
+                if (reserved[r].start < stop) stop = reserved[r].start;
+            }
+            if (start < stop) {
+                bits_fill(bitmap, start, stop, 0);
+                buddy_add_range(start, stop);
+                free_pages += stop - start;
             }
+            if (r < reserved_count && reserved[r].end > start)
+                start = reserved[r].end;
         }
+    }
+    used_pages = total_pages - free_pages;
 
-        tag_ptr += (tag->size + 7) & ~7u;
+    init_cycles = rdtsc() - t0;
+}
+
+static struct spinlock pmm_lock = SPINLOCK_INIT;
+
+static void *buddy_alloc(unsigned order) {
+    uint32_t candidates = nonempty_orders >> order;
+    if (!candidates) return NULL;
+    unsigned k = order + (unsigned)__builtin_ctz(candidates);
+
+    uint64_t block = free_set_first(k);
+    free_set_remove(k, block);
+
+    // Split down to the requested order, returning upper halves.
+    while (k > order) {
+        k--;
+        block <<= 1;
+        free_set_insert(k, block | 1);
     }
 
-    // Reserve low memory (<1 MiB)
-    mark_range_used(0, 0x100000);
+    uint64_t first = block << order;
+    uint64_t count = 1ULL << order;
+    bits_fill(bitmap, first, first + count, 1);
+    used_pages += count;
+    return (void *)(uintptr_t)(first * PAGE_SIZE);
+}
+
+static void buddy_free(uint64_t p, unsigned order) {
+    uint64_t count = 1ULL << order;
+    if (p & (count - 1)) return;
+    if (p + count > total_pages) return;
+
+    // Ignore frees of pages that are not currently allocated.
+    if (!bits_all_set(bitmap, p, p + count)) return;
+    bits_fill(bitmap, p, p + count, 0);
+    used_pages -= count;
 
-    // Reserve kernel + bitmap region
-    uintptr_t kernel_start = 0x00100000; // we link at 1M
-    uintptr_t kernel_end   = (uintptr_t)bitmap + bitmap_bytes;
-    mark_range_used(kernel_start, kernel_end - kernel_start);
+    // Coalesce with free buddies as far as possible.
+    uint64_t block = p >> order;
+    unsigned k = order;
+    while (k < PMM_MAX_ORDER && free_set_test(&free_sets[k], block ^ 1)) {
+        free_set_remove(k, block ^ 1);
+        block >>= 1;
+        k++;
+    }
+    free_set_insert(k, block);
+}
 
-    // Reserve multiboot info structure
-    uint64_t mbi_size = ((struct multiboot2_info_header *)(uintptr_t)mb_info_addr)->total_size;
-    mark_range_used(mb_info_addr, mbi_size);
+// Every update of the buddy state, the zero pool and the refcounts holds
+// pmm_lock with interrupts off: other CPUs and preempting threads allocate
+// too.
+void *pmm_alloc_pages(unsigned order) {
+    if (order > PMM_MAX_ORDER) return NULL;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    void *block = buddy_alloc(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    trace(TRACE_PMM_ALLOC, order, (uint64_t)(uintptr_t)block,
+          (uint64_t)(uintptr_t)__builtin_return_address(0));
+    return block;
+}
+
+void pmm_free_pages(void *addr, unsigned order) {
+    if (order > PMM_MAX_ORDER) return;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    buddy_free((uintptr_t)addr / PAGE_SIZE, order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    trace(TRACE_PMM_FREE, order, (uint64_t)(uintptr_t)addr,
+          (uint64_t)(uintptr_t)__builtin_return_address(0));
 }
 
 void *pmm_alloc(void) {
-    for (uint64_t p = 0; p < total_pages; ++p) {
-        if (!test_bit(p)) {
-            set_bit(p);
-            used_pages++;
-            return (void *)(uintptr_t)(p * PAGE_SIZE);
+    return pmm_alloc_pages(0);
+}
+
+void pmm_free(void *page) {
+    pmm_free_pages(page, 0);
+}
+
+// Inline path: the caller is about to use the page, so keep it in cache.
+static void zero_page_cached(void *page) {
+    uint64_t count = PAGE_SIZE / 8;
+    __asm__ __volatile__("rep stosq"
+                         : "+D"(page), "+c"(count)
+                         : "a"(0ULL)
+                         : "memory");
+}
+
+// Background path: non-temporal stores so refilling the pool does not
+// evict the working set.
+static void zero_page_nt(void *page) {
+    uint64_t *p = (uint64_t *)page;
+    for (uint64_t i = 0; i < PAGE_SIZE / 8; i += 8) {
+        __asm__ __volatile__(
+            "movnti %1, 0(%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)\n"
+            "movnti %1, 32(%0)\n"
+            "movnti %1, 40(%0)\n"
+            "movnti %1, 48(%0)\n"
+            "movnti %1, 56(%0)\n"
+            :
+            : "r"(p + i), "r"(0ULL)
+            : "memory");
+    }
+    __asm__ __volatile__("sfence" ::: "memory");
+}
+
+void *pmm_alloc_zeroed(void) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (zero_pool_count) {
+        zero_pool_hits++;
+        void *page = (void *)(uintptr_t)zero_pool[--zero_pool_count];
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return page;
+    }
+    zero_pool_misses++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    void *page = pmm_alloc();
+    if (page) zero_page_cached(vmm_phys_to_virt((uint64_t)(uintptr_t)page));
+    return page;
+}
+
+uint32_t pmm_zero_pool_refill(uint32_t max) {
+    uint32_t done = 0;
+    while (done < max && zero_pool_count < ZERO_POOL_SIZE) {
+        void *page = pmm_alloc();
+        if (!page) break;
+        zero_page_nt(vmm_phys_to_virt((uint64_t)(uintptr_t)page));
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        int full = zero_pool_count >= ZERO_POOL_SIZE;
+        if (!full) {
+            zero_pool[zero_pool_count++] = (uintptr_t)page;
+            zero_pool_refilled++;
+            done++;
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (full) {
+            pmm_free(page);  // another thread topped the pool up meanwhile
+            break;
         }
     }
-    return NULL;
+    return done;
 }
 
-void pmm_free(void *page) {
-    uintptr_t addr = (uintptr_t)page;
-    uint64_t p = addr / PAGE_SIZE;
-    if (p >= total_pages) return;
-    if (test_bit(p)) {
-        clear_bit(p);
-        used_pages--;
+void pmm_zero_pool_stats(struct pmm_zero_stats *out) {
+    out->hits     = zero_pool_hits;
+    out->misses   = zero_pool_misses;
+    out->refilled = zero_pool_refilled;
+    out->count    = zero_pool_count;
+    out->capacity = ZERO_POOL_SIZE;
+}
+
+void pmm_page_ref(uint64_t phys) {
+    uint64_t p = phys / PAGE_SIZE;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (p < total_pages && page_refs[p] != UINT16_MAX) page_refs[p]++;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint32_t pmm_page_unref(uint64_t phys) {
+    uint64_t p = phys / PAGE_SIZE;
+    if (p >= total_pages) return 0;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t refs = page_refs[p];
+    if (refs != 0 && refs != UINT16_MAX) { // saturated: pinned
+        refs = --page_refs[p];
+        if (refs == 0) buddy_free(p, 0);
     }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return refs;
+}
+
+uint32_t pmm_page_refcount(uint64_t phys) {
+    uint64_t p = phys / PAGE_SIZE;
+    return p < total_pages ? page_refs[p] : 0;
+}
+
+void pmm_set_page_tag(uint64_t phys, uint64_t pages, uint8_t tag) {
+    uint64_t p = phys / PAGE_SIZE;
+    if (p >= total_pages) return;
+    if (pages > total_pages - p) pages = total_pages - p;
+    for (uint64_t i = 0; i < pages; ++i) page_tags[p + i] = tag;
+}
+
+uint8_t pmm_page_tag(uint64_t phys) {
+    uint64_t p = phys / PAGE_SIZE;
+    return p < total_pages ? page_tags[p] : 0;
 }
 
 uint64_t pmm_total_bytes(void) {
     return total_pages * PAGE_SIZE;
 }
 
+uint64_t pmm_unmanaged_bytes(void) {
+    return unmanaged_bytes;
+}
+
 uint64_t pmm_free_bytes(void) {
     return (total_pages - used_pages) * PAGE_SIZE;
 }
+
+const struct pmm_region *pmm_regions(uint32_t *count) {
+    *count = region_count;
+    return regions;
+}
+
+uint64_t pmm_metadata_end(void) {
+    return meta_end;
+}
+
+uint64_t pmm_init_cycles(void) {
+    return init_cycles;
+}
@@ -1,9 +1,61 @@
 #pragma once
 #include <stdint.h>
 
+// Largest buddy block: 2^PMM_MAX_ORDER pages (4 MiB).
+#define PMM_MAX_ORDER 10
+
+// Memory map as reported by the bootloader, parsed once at init.
+#define PMM_MAX_REGIONS 64
+
+struct pmm_region {
+    uint64_t base;
+    uint64_t len;
+    uint32_t type; // MULTIBOOT2_MEMORY_*
+};
+
 void pmm_init(uint64_t mb_info_addr);
 void *pmm_alloc(void);
 void pmm_free(void *page);
 
+// Physically contiguous, naturally aligned blocks of 2^order pages.
+void *pmm_alloc_pages(unsigned order);
+void pmm_free_pages(void *addr, unsigned order);
+
+// Zero-filled page, taken from the pre-zeroed pool when possible.
+void *pmm_alloc_zeroed(void);
+// Zero up to `max` frames into the pool; returns how many were added.
+uint32_t pmm_zero_pool_refill(uint32_t max);
+
+struct pmm_zero_stats {
+    uint64_t hits;      // pmm_alloc_zeroed served from the pool
+    uint64_t misses;    // pool empty, page cleared inline
+    uint64_t refilled;  // frames zeroed in the background
+    uint32_t count;
+    uint32_t capacity;
+};
+void pmm_zero_pool_stats(struct pmm_zero_stats *out);
+
+// Per-frame reference counts for frames mapped by the VM layer. A count of
+// 0 means the frame is not VM-managed; dropping the last reference frees it.
+void pmm_page_ref(uint64_t phys);
+uint32_t pmm_page_unref(uint64_t phys);
+uint32_t pmm_page_refcount(uint64_t phys);
+
+// One byte per frame for the current owner's use (e.g. the slab allocator
+// records how a block was carved up). Not cleared on free.
+void pmm_set_page_tag(uint64_t phys, uint64_t pages, uint8_t tag);
+uint8_t pmm_page_tag(uint64_t phys);
+
 uint64_t pmm_total_bytes(void);
 uint64_t pmm_free_bytes(void);
+// Available memory above pmm_total_bytes() that the PMM leaves unused: it
+// manages at most 4 TiB, and only as many as it has room to track
+// below the 1 GiB boot identity map.
+uint64_t pmm_unmanaged_bytes(void);
+
+const struct pmm_region *pmm_regions(uint32_t *count);
+// First byte past the PMM's own metadata, which lives in the first
+// available memory above the kernel image with room for it (below 1 GiB).
+// Everything under it must stay identity mapped.
+uint64_t pmm_metadata_end(void);
+uint64_t pmm_init_cycles(void);
@@ -0,0 +1,439 @@
+#include "sched.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "idle.h"
+#include "idt.h"
+#include "kmalloc.h"
+#include "percpu.h"
+#include "pmm.h"
+#include "timer.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define THREAD_STACK_SIZE 16384
+#define RFLAGS_IF (1ULL << 9)
+
+enum thread_state { THREAD_RUNNING, THREAD_READY, THREAD_BLOCKED, THREAD_DEAD };
+static const char *const state_names[] = { "run", "ready", "blocked", "dead" };
+
+struct thread {
+    uint64_t rsp;  // saved by context_switch
+    struct thread *rq_next;
+    struct thread *rq_prev;
+    struct thread *wait_next;
+    struct thread *all_next;
+    const char *name;
+    uint32_t id;
+    uint8_t prio;
+    uint8_t state;
+    void *stack;               // NULL for the boot thread
+    struct vmm_space *space;   // address space to run in
+    struct fpu_state *fpu;     // NULL: kernel only, uses kernel_fpu sections
+    struct timer sleep_timer;
+    uint64_t switches;
+    uint64_t run_cycles;
+    uint64_t run_start;
+};
+
+// Defined in switch.asm.
+extern void context_switch(uint64_t *prev_rsp, uint64_t next_rsp);
+extern void thread_trampoline(void);
+void sched_thread_start(thread_fn fn, void *arg);
+
+// Circular list per priority; bit p of rq_bitmap is set iff rq_head[p].
+static struct thread *rq_head[SCHED_PRIORITIES];
+static uint32_t rq_bitmap;
+
+static struct thread boot_thread;
+static struct thread *current;
+static struct thread *idle_thread;
+static struct thread *switched_from;  // reaped by the thread switched to
+static struct thread *all_threads;
+static uint32_t next_id;
+
+static struct timer slice_timer;
+static uint64_t slice_end;
+static volatile int need_resched;
+static volatile uint32_t preempt_count;
+static struct sched_stats stats;
+
+// Append `t` to its queue, or put it first (`front`) to keep its turn.
+static void rq_push(struct thread *t, int front) {
+    struct thread *head = rq_head[t->prio];
+    if (head) {
+        t->rq_next = head;
+        t->rq_prev = head->rq_prev;
+        head->rq_prev->rq_next = t;
+        head->rq_prev = t;
+        if (front) rq_head[t->prio] = t;
+    } else {
+        t->rq_next = t->rq_prev = t;
+        rq_head[t->prio] = t;
+        rq_bitmap |= 1u << t->prio;
+    }
+}
+
+static struct thread *rq_pop(unsigned prio) {
+    struct thread *t = rq_head[prio];
+    if (t->rq_next == t) {
+        rq_head[prio] = NULL;
+        rq_bitmap &= ~(1u << prio);
+    } else {
+        t->rq_prev->rq_next = t->rq_next;
+        t->rq_next->rq_prev = t->rq_prev;
+        rq_head[prio] = t->rq_next;
+    }
+    return t;
+}
+
+// Slice bookkeeping is lazy: switches only move slice_end, and the timer,
+// once armed, is left pending and re-checks on expiry. This keeps timer
+// reprogramming off the switch path.
+static uint32_t slice_rivals(void) {
+    if (current == idle_thread) return 0;
+    return rq_bitmap & ((2u << current->prio) - 1);
+}
+
+static void slice_update(void) {
+    if (slice_rivals() && !slice_timer.pprev) timer_arm(&slice_timer, slice_end);
+}
+
+static void slice_expired(struct timer *t, void *ctx) {
+    (void)ctx;
+    if (!slice_rivals()) return;
+    if (ktime_ns() < slice_end) {
+        timer_arm(t, slice_end);
+        return;
+    }
+    stats.slices++;
+    need_resched = 1;
+}
+
+static void make_ready(struct thread *t) {
+    t->state = THREAD_READY;
+    rq_push(t, 0);
+    if (current == idle_thread || t->prio < current->prio) need_resched = 1;
+    else slice_update();
+}
+
+static void thread_free(struct thread *t) {
+    for (struct thread **pp = &all_threads; *pp; pp = &(*pp)->all_next) {
+        if (*pp == t) {
+            *pp = t->all_next;
+            break;
+        }
+    }
+    kfree(t->stack);
+    kfree(t);
+}
+
+// A dead thread's stack can only go once we are off it.
+static void finish_switch(void) {
+    struct thread *prev = switched_from;
+    switched_from = NULL;
+    if (prev && prev->state == THREAD_DEAD) thread_free(prev);
+}
+
+// Pick the next thread and switch to it. Interrupts must be off; they stay
+// off until the resumed thread restores its own flags.
+static void schedule(void) {
+    struct thread *prev = current;
+    need_resched = 0;
+    if (prev->state == THREAD_RUNNING && prev != idle_thread) {
+        // Preempted by a higher priority: resume before its peers.
+        prev->state = THREAD_READY;
+        rq_push(prev, (rq_bitmap & ((1u << prev->prio) - 1)) != 0);
+    }
+    struct thread *next = rq_bitmap ? rq_pop((unsigned)__builtin_ctz(rq_bitmap)) : idle_thread;
+    if (next == prev) {
+        prev->state = THREAD_RUNNING;
+        slice_end = ktime_ns() + SCHED_SLICE_NS;
+        slice_update();
+        return;
+    }
+
+    uint64_t now = rdtsc();
+    prev->run_cycles += now - prev->run_start;
+    next->run_start = now;
+    next->state = THREAD_RUNNING;
+    next->switches++;
+    stats.switches++;
+
+    prev->space = vmm_current_space();
+    if (next->space != prev->space) vmm_space_switch(next->space);
+    fpu_switch_to(next->fpu);
+
+    current = next;
+    slice_end = ktime_ns() + SCHED_SLICE_NS;
+    slice_update();
+    switched_from = prev;
+    context_switch(&prev->rsp, next->rsp);
+    finish_switch();
+}
+
+// Leave an irq_save() section, switching first if a wake-up asked for it
+// and the caller was preemptible anyway.
+static void resched_restore(uint64_t flags) {
+    if (need_resched && (flags & RFLAGS_IF) && !preempt_count && !kernel_fpu_active())
+        schedule();
+    irq_restore(flags);
+}
+
+void sched_thread_start(thread_fn fn, void *arg) {
+    finish_switch();
+    __asm__ __volatile__("sti" ::: "memory");
+    fn(arg);
+    thread_exit();
+}
+
+static void sleep_expired(struct timer *tm, void *ctx) {
+    (void)tm;
+    struct thread *t = ctx;
+    if (t->state == THREAD_BLOCKED) make_ready(t);
+}
+
+static struct thread *thread_alloc(const char *name, thread_fn fn, void *arg, int prio) {
+    if (prio < 0 || prio >= SCHED_PRIORITIES) return NULL;
+    struct thread *t = kzalloc(sizeof(*t));
+    void *stack = kmalloc(THREAD_STACK_SIZE);
+    if (!t || !stack) {
+        kfree(t);
+        kfree(stack);
+        return NULL;
+    }
+
+    // Frame popped by context_switch, returning into thread_trampoline.
+    uint64_t *sp = (uint64_t *)((uint8_t *)stack + THREAD_STACK_SIZE);
+    *--sp = (uint64_t)(uintptr_t)thread_trampoline;
+    *--sp = 0;                          // rbp
+    *--sp = 0;                          // rbx
+    *--sp = (uint64_t)(uintptr_t)fn;    // r12
+    *--sp = (uint64_t)(uintptr_t)arg;   // r13
+    *--sp = 0;                          // r14
+    *--sp = 0;                          // r15
+    t->rsp = (uint64_t)(uintptr_t)sp;
+
+    t->name = name;
+    t->prio = (uint8_t)prio;
+    t->stack = stack;
+    t->space = vmm_kernel_space();
+    timer_setup(&t->sleep_timer, sleep_expired, t);
+
+    uint64_t flags = irq_save();
+    t->id = next_id++;
+    t->all_next = all_threads;
+    all_threads = t;
+    irq_restore(flags);
+    return t;
+}
+
+static void idle_loop(void *arg) {
+    (void)arg;
+    for (;;) {
+        // Spare cycles pre-zero frames; wake-ups preempt us at IRQ exit.
+        if (pmm_zero_pool_refill(8)) continue;
+        struct percpu *cpu = this_cpu();
+        __asm__ __volatile__("cli" ::: "memory");
+        idle_prepare(cpu);
+        if (rq_bitmap) {
+            idle_cancel(cpu);
+            __asm__ __volatile__("sti" ::: "memory");
+            sched_yield();
+        } else {
+            idle_wait(cpu);
+        }
+    }
+}
+
+void sched_init(void) {
+    boot_thread.name = "main";
+    boot_thread.prio = SCHED_PRIO_DEFAULT;
+    boot_thread.state = THREAD_RUNNING;
+    boot_thread.space = vmm_current_space();
+    boot_thread.id = next_id++;
+    boot_thread.run_start = rdtsc();
+    timer_setup(&boot_thread.sleep_timer, sleep_expired, &boot_thread);
+    all_threads = &boot_thread;
+    timer_setup(&slice_timer, slice_expired, NULL);
+
+    idle_thread = thread_alloc("idle", idle_loop, NULL, SCHED_PRIORITIES - 1);
+    current = &boot_thread;
+}
+
+struct thread *thread_create(const char *name, thread_fn fn, void *arg, int prio) {
+    struct thread *t = thread_alloc(name, fn, arg, prio);
+    if (!t) return NULL;
+    uint64_t flags = irq_save();
+    make_ready(t);
+    resched_restore(flags);
+    return t;
+}
+
+void thread_exit(void) {
+    irq_save();
+    current->state = THREAD_DEAD;
+    schedule();
+    __builtin_unreachable();
+}
+
+void sched_yield(void) {
+    uint64_t flags = irq_save();
+    stats.yields++;
+    schedule();
+    irq_restore(flags);
+}
+
+void sched_sleep_ns(uint64_t ns) {
+    if (!current) {
+        ksleep_ns(ns);
+        return;
+    }
+    uint64_t flags = irq_save();
+    current->state = THREAD_BLOCKED;
+    timer_arm(&current->sleep_timer, ktime_ns() + ns);
+    schedule();
+    irq_restore(flags);
+}
+
+void sched_wait(struct wait_queue *wq) {
+    if (!current) {
+        __asm__ __volatile__("sti; hlt; cli" ::: "memory");
+        return;
+    }
+    current->state = THREAD_BLOCKED;
+    current->wait_next = NULL;
+    if (wq->tail) wq->tail->wait_next = current;
+    else wq->head = current;
+    wq->tail = current;
+    schedule();
+}
+
+static int wake(struct wait_queue *wq, int all) {
+    uint64_t flags = irq_save();
+    int woken = 0;
+    while (wq->head && (all || !woken)) {
+        struct thread *t = wq->head;
+        wq->head = t->wait_next;
+        if (!wq->head) wq->tail = NULL;
+        make_ready(t);
+        woken++;
+    }
+    resched_restore(flags);
+    return woken;
+}
+
+int sched_wake_one(struct wait_queue *wq) {
+    return wake(wq, 0);
+}
+
+int sched_wake_all(struct wait_queue *wq) {
+    return wake(wq, 1);
+}
+
+void sched_preempt_disable(void) {
+    preempt_count++;
+}
+
+void sched_preempt_enable(void) {
+    uint64_t flags = irq_save();
+    preempt_count--;
+    resched_restore(flags);
+}
+
+void sched_irq_exit(struct isr_context *frame) {
+    if (!need_resched || !current) return;
+    // Threads live on the boot CPU; the others only run tasks (task.c).
+    if (this_cpu()->id != 0) return;
+    // Not from ring 3 (the entry stack is shared), not out of a section
+    // that had interrupts off, and not inside a kernel_fpu section.
+    if ((frame->cs & 3) || !(frame->rflags & RFLAGS_IF)) return;
+    if (preempt_count || kernel_fpu_active()) return;
+    stats.preemptions++;
+    schedule();
+}
+
+void sched_get_stats(struct sched_stats *out) {
+    *out = stats;
+}
+
+int sched_get_thread_info(uint32_t index, struct thread_info *out) {
+    uint64_t flags = irq_save();
+    struct thread *t = all_threads;
+    while (t && index--) t = t->all_next;
+    if (t) {
+        out->id = t->id;
+        out->name = t->name;
+        out->prio = t->prio;
+        out->state = state_names[t->state];
+        out->switches = t->switches;
+        out->run_cycles = t->run_cycles;
+        if (t == current) out->run_cycles += rdtsc() - t->run_start;
+    }
+    irq_restore(flags);
+    return t ? 0 : -1;
+}
+
+// Context-switch benchmark: two threads at priority 0 hand the CPU back
+// and forth, first with sched_yield(), then by waking each other and
+// blocking.
+static struct {
+    uint32_t iterations;
+    volatile uint32_t turn;
+    volatile uint32_t done;
+    struct wait_queue turn_wq[2];
+    struct wait_queue done_wq;
+} bench;
+
+static void bench_finish(void) {
+    uint64_t flags = irq_save();
+    if (++bench.done == 2) sched_wake_all(&bench.done_wq);
+    irq_restore(flags);
+}
+
+static void bench_yield(void *arg) {
+    (void)arg;
+    for (uint32_t i = 0; i < bench.iterations; i++) sched_yield();
+    bench_finish();
+}
+
+static void bench_pingpong(void *arg) {
+    uint32_t me = (uint32_t)(uintptr_t)arg;
+    for (uint32_t i = 0; i < bench.iterations; i++) {
+        uint64_t flags = irq_save();
+        while (bench.turn != me) sched_wait(&bench.turn_wq[me]);
+        bench.turn = !me;
+        sched_wake_one(&bench.turn_wq[!me]);
+        irq_restore(flags);
+    }
+    bench_finish();
+}
+
+static int bench_run(thread_fn fn, uint64_t *cycles) {
+    bench.turn = 0;
+    bench.done = 0;
+    struct thread *a = thread_alloc("bench0", fn, (void *)0, 0);
+    struct thread *b = thread_alloc("bench1", fn, (void *)1, 0);
+    uint64_t flags = irq_save();
+    if (!a || !b) {
+        if (a) thread_free(a);
+        if (b) thread_free(b);
+        irq_restore(flags);
+        return -1;
+    }
+    // Both outrank the caller: they run until done, then wake us.
+    uint64_t t0 = rdtsc();
+    make_ready(a);
+    make_ready(b);
+    while (bench.done < 2) sched_wait(&bench.done_wq);
+    irq_restore(flags);
+    *cycles = (rdtsc() - t0) / (2ULL * bench.iterations);
+    return 0;
+}
+
+int sched_bench(uint32_t iterations, struct sched_bench *out) {
+    if (!current || iterations == 0) return -1;
+    bench.iterations = iterations;
+    out->iterations = iterations;
+    if (bench_run(bench_yield, &out->yield_cycles)) return -1;
+    return bench_run(bench_pingpong, &out->wake_cycles);
+}
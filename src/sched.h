@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+
+// Preemptive kernel threads. Priority 0 is the highest; each priority has a
+// FIFO run queue and a bitmap of non-empty queues gives the next thread in
+// O(1). A wake-up of a higher-priority thread preempts at interrupt exit;
+// threads of equal priority share the CPU in SCHED_SLICE_NS slices, timed
+// by a one-shot timer armed only while someone is waiting for the CPU.
+
+#define SCHED_PRIORITIES   32
+#define SCHED_PRIO_DEFAULT 16
+#define SCHED_SLICE_NS     10000000ULL  // 10 ms
+
+struct thread;
+typedef void (*thread_fn)(void *arg);
+
+// Threads blocked on an event, woken in FIFO order.
+struct wait_queue {
+    struct thread *head;
+    struct thread *tail;
+};
+#define WAIT_QUEUE_INIT { 0, 0 }
+
+// Adopt the running boot context as thread "main" and create the idle
+// thread. Needs kmalloc and timer_init().
+void sched_init(void);
+
+// New thread, runnable immediately. Returns NULL on bad priority or OOM.
+struct thread *thread_create(const char *name, thread_fn fn, void *arg, int prio);
+// Returning from a thread function does the same.
+void thread_exit(void) __attribute__((noreturn));
+
+void sched_yield(void);
+void sched_sleep_ns(uint64_t ns);
+
+// Block on `wq`. Call with interrupts disabled, after finding the wake-up
+// condition false; re-check it on return (wake-ups may be spurious).
+// Before sched_init() this just waits for the next interrupt.
+void sched_wait(struct wait_queue *wq);
+// Safe from interrupt handlers. Return the number of threads woken.
+int sched_wake_one(struct wait_queue *wq);
+int sched_wake_all(struct wait_queue *wq);
+
+// Keep the current thread on the CPU; nests. Blocking is still allowed.
+void sched_preempt_disable(void);
+void sched_preempt_enable(void);
+
+// Called by isr_handler: switch threads if a wake-up or slice expiry asked
+// for it and the interrupted code was preemptible.
+struct isr_context;
+void sched_irq_exit(struct isr_context *frame);
+
+struct sched_stats {
+    uint64_t switches;
+    uint64_t preemptions;  // switches forced at interrupt exit
+    uint64_t yields;
+    uint64_t slices;       // slice timer expiries
+};
+void sched_get_stats(struct sched_stats *out);
+
+struct thread_info {
+    uint32_t id;
+    const char *name;
+    uint8_t prio;
+    const char *state;
+    uint64_t switches;     // times switched in
+    uint64_t run_cycles;
+};
+// Fill `out` for the index-th thread; returns 0, or -1 past the last one.
+int sched_get_thread_info(uint32_t index, struct thread_info *out);
+
+struct sched_bench {
+    uint32_t iterations;
+    uint64_t yield_cycles;  // avg per sched_yield() switch
+    uint64_t wake_cycles;   // avg per wake-up + block hand-off
+};
+// Ping-pong two top-priority threads; the caller blocks until they finish.
+int sched_bench(uint32_t iterations, struct sched_bench *out);
@@ -0,0 +1,232 @@
+#include "serial.h"
+#include "cpu.h"
+#include "event.h"
+#include "irq.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+#define COM1 0x3F8
+
+// Register offsets from the base port.
+#define UART_DATA 0  // RBR/THR; divisor low with DLAB
+#define UART_IER  1  // divisor high with DLAB
+#define UART_IIR  2  // read
+#define UART_FCR  2  // write
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define IER_RDA   0x01  // received data available (and timeout)
+#define IER_THRE  0x02  // transmit holding register empty
+#define FCR_ENABLE_CLEAR_14 0xC7  // FIFOs on, both cleared, RX trigger at 14
+#define LCR_DLAB  0x80
+#define LCR_8N1   0x03
+#define MCR_DTR_RTS_OUT2 0x0B  // OUT2 gates the IRQ line on PCs
+#define LSR_DR    0x01
+#define LSR_THRE  0x20
+#define IIR_NO_INT 0x01
+
+#define UART_FIFO 16
+#define SERIAL_IRQ 4
+
+#define TX_MASK (SERIAL_TX_RING - 1)
+#define RX_MASK (SERIAL_RX_RING - 1)
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// TX: writers (any CPU, serialized by tx_lock) produce at tx_head; the
+// pump (the THRE interrupt, or a writer that found the ring full) consumes
+// at tx_tail under pump_lock. The interrupt never waits for a writer.
+//
+// tx_active says the THRE interrupt is enabled and will keep draining.
+// Whoever sets it enables the interrupt; the pump disables it before
+// clearing the flag, then looks again, so a byte queued in between always
+// has an owner.
+static char tx_ring[SERIAL_TX_RING];
+static uint32_t tx_head;
+static uint32_t tx_tail;
+static volatile uint32_t tx_active;
+static struct spinlock tx_lock = SPINLOCK_INIT;
+static struct spinlock pump_lock = SPINLOCK_INIT;
+
+// RX: the interrupt produces, the reader consumes.
+static char rx_ring[SERIAL_RX_RING];
+static uint32_t rx_head;
+static uint32_t rx_tail;
+
+static int irq_mode;
+static struct event *rx_event;
+static struct serial_stats stats;
+
+static void put_polled(char c) {
+    while (!(inb(COM1 + UART_LSR) & LSR_THRE)) __asm__ __volatile__("pause");
+    outb(COM1 + UART_DATA, (uint8_t)c);
+}
+
+// Move up to one FIFO-load from the ring into the UART if it has room.
+// Caller holds pump_lock. Returns the number of bytes moved.
+static uint32_t pump(void) {
+    if (!(inb(COM1 + UART_LSR) & LSR_THRE)) return 0;
+    uint32_t tail = tx_tail;
+    uint32_t head = __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE);
+    uint32_t n = 0;
+    while (tail != head && n < UART_FIFO) {
+        outb(COM1 + UART_DATA, (uint8_t)tx_ring[tail & TX_MASK]);
+        tail++;
+        n++;
+    }
+    __atomic_store_n(&tx_tail, tail, __ATOMIC_RELEASE);
+    stats.tx_bytes += n;
+    return n;
+}
+
+static int tx_empty(void) {
+    return __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE) == __atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE);
+}
+
+static void tx_kick(void) {
+    if (!__atomic_exchange_n(&tx_active, 1, __ATOMIC_SEQ_CST))
+        outb(COM1 + UART_IER, IER_RDA | IER_THRE);  // THR empty: fires at once
+}
+
+static void rx_drain(void) {
+    uint32_t head = rx_head;
+    uint32_t tail = __atomic_load_n(&rx_tail, __ATOMIC_ACQUIRE);
+    while (inb(COM1 + UART_LSR) & LSR_DR) {
+        char c = (char)inb(COM1 + UART_DATA);
+        if (head - tail == SERIAL_RX_RING) {
+            stats.rx_dropped++;
+            continue;
+        }
+        rx_ring[head & RX_MASK] = c;
+        head++;
+        stats.rx_bytes++;
+    }
+    __atomic_store_n(&rx_head, head, __ATOMIC_RELEASE);
+}
+
+static void serial_irq_handler(struct isr_context *frame, void *ctx) {
+    (void)ctx;
+    stats.interrupts++;
+    uint32_t old_rx = rx_head;
+    // Reading IIR acknowledges a THRE interrupt; LSR and RBR clear the rest.
+    while (!(inb(COM1 + UART_IIR) & IIR_NO_INT)) {
+        rx_drain();
+        spin_lock(&pump_lock);
+        pump();
+        if (tx_empty() && tx_active) {
+            outb(COM1 + UART_IER, IER_RDA);
+            __atomic_store_n(&tx_active, 0, __ATOMIC_SEQ_CST);
+            if (!tx_empty()) tx_kick();
+        }
+        spin_unlock(&pump_lock);
+    }
+    irq_eoi(frame->vector);
+    if (rx_head != old_rx && rx_event) event_signal(rx_event);
+}
+
+void serial_init(uint32_t baud) {
+    uint16_t divisor = (uint16_t)(115200 / (baud ? baud : SERIAL_BAUD));
+    if (!divisor) divisor = 1;
+    outb(COM1 + UART_IER, 0x00);
+    outb(COM1 + UART_LCR, LCR_DLAB);
+    outb(COM1 + UART_DATA, (uint8_t)divisor);
+    outb(COM1 + UART_IER, (uint8_t)(divisor >> 8));
+    outb(COM1 + UART_LCR, LCR_8N1);
+    outb(COM1 + UART_FCR, FCR_ENABLE_CLEAR_14);
+    outb(COM1 + UART_MCR, MCR_DTR_RTS_OUT2);
+    stats.baud = 115200 / divisor;
+}
+
+void serial_enable_irq(struct event *rx_ready) {
+    rx_event = rx_ready;
+    if (irq_register(IRQ_BASE_VECTOR + SERIAL_IRQ, serial_irq_handler, NULL) != 0) return;
+    irq_mode = 1;
+    stats.irq_mode = 1;
+    outb(COM1 + UART_IER, IER_RDA);
+    irq_enable_legacy(SERIAL_IRQ);
+    if (!tx_empty()) tx_kick();
+}
+
+void serial_write_buf(const char *buf, size_t len) {
+    if (!irq_mode) {
+        for (size_t i = 0; i < len; i++) put_polled(buf[i]);
+        stats.tx_bytes += len;
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&tx_lock);
+    uint32_t head = tx_head;
+    for (size_t i = 0; i < len; i++) {
+        if (head - __atomic_load_n(&tx_tail, __ATOMIC_ACQUIRE) == SERIAL_TX_RING) {
+            // Full: publish what we have and drain by hand. The interrupt
+            // may be off (or on this CPU with interrupts disabled).
+            __atomic_store_n(&tx_head, head, __ATOMIC_RELEASE);
+            stats.tx_stalls++;
+            spin_lock(&pump_lock);
+            while (!pump()) __asm__ __volatile__("pause");
+            spin_unlock(&pump_lock);
+        }
+        tx_ring[head & TX_MASK] = buf[i];
+        head++;
+    }
+    __atomic_store_n(&tx_head, head, __ATOMIC_RELEASE);
+    tx_kick();
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+void serial_write(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    serial_write_buf(s, n);
+}
+
+void serial_write_text(const char *s) {
+    const char *start = s;
+    for (; *s; s++) {
+        if (*s != '\n') continue;
+        serial_write_buf(start, (size_t)(s - start));
+        serial_write_buf("\r\n", 2);
+        start = s + 1;
+    }
+    serial_write_buf(start, (size_t)(s - start));
+}
+
+void serial_flush(void) {
+    if (!irq_mode) return;
+    uint64_t flags = spin_lock_irqsave(&pump_lock);
+    while (!tx_empty()) {
+        if (!pump()) __asm__ __volatile__("pause");
+    }
+    spin_unlock_irqrestore(&pump_lock, flags);
+}
+
+size_t serial_read(char *buf, size_t max) {
+    uint32_t tail = rx_tail;
+    uint32_t head = __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+    while (tail != head && n < max) {
+        char c = rx_ring[tail & RX_MASK];
+        tail++;
+        if (c == '\r') c = '\n';
+        else if (c == 0x7F) c = '\b';
+        buf[n++] = c;
+    }
+    __atomic_store_n(&rx_tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+int serial_has_data(void) {
+    return __atomic_load_n(&rx_head, __ATOMIC_ACQUIRE) != rx_tail;
+}
+
+void serial_get_stats(struct serial_stats *out) {
+    *out = stats;
+}
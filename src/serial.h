@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// 16550 UART on COM1. Output goes into a TX ring that the THRE interrupt
+// drains a FIFO-load at a time, so writers return as soon as their bytes
+// are queued; input is collected by the receive interrupt into an RX ring.
+// Until serial_enable_irq() everything is polled.
+
+#define SERIAL_BAUD 115200
+#define SERIAL_TX_RING 16384  // power of two
+#define SERIAL_RX_RING 256    // power of two
+
+struct event;
+
+// Program `baud` (a divisor of 115200), 8N1 and the FIFOs. Polled mode.
+void serial_init(uint32_t baud);
+// Switch to interrupt-driven TX and RX on ISA IRQ 4; `rx_ready` (may be
+// NULL) is signaled when input arrives. Needs the interrupt controller.
+void serial_enable_irq(struct event *rx_ready);
+
+// Queue `len` bytes. Blocks only while the ring is full.
+void serial_write_buf(const char *buf, size_t len);
+// Same for a string, as is...
+void serial_write(const char *s);
+// ...or with '\n' sent as "\r\n".
+void serial_write_text(const char *s);
+// Wait until everything queued has reached the UART. For panic paths,
+// where the interrupt may never come; safe with interrupts disabled.
+void serial_flush(void);
+
+// Received bytes: '\r' comes back as '\n' and DEL as '\b'.
+size_t serial_read(char *buf, size_t max);
+int serial_has_data(void);
+
+struct serial_stats {
+    uint32_t baud;
+    int irq_mode;
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;  // RX ring full
+    uint64_t tx_stalls;   // writers that found the TX ring full
+    uint64_t interrupts;
+};
+void serial_get_stats(struct serial_stats *out);
@@ -1,66 +1,258 @@
 #include "shell.h"
+#include "bench.h"
+#include "boottime.h"
+#include "console.h"
+#include "fb.h"
+#include "initrd.h"
+#include "serial.h"
+#include "trace.h"
 #include "keyboard.h"
 #include "vmm.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "irq.h"
+#include "apic.h"
+#include "timer.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "simd.h"
+#include "sched.h"
+#include "smp.h"
+#include "task.h"
+#include "idle.h"
+#include "event.h"
+#include "cpu.h"
 #include <stdint.h>
 #include <stddef.h>
 
-// VGA buffer (uses virtual framebuffer after VMM init)
-extern volatile uint16_t *vmm_framebuffer;
-static volatile uint16_t *vga_buffer = (volatile uint16_t *)(uintptr_t)0xB8000;
-static const uint8_t VGA_ATTR = 0x0F;
-
-static size_t cursor_row = 3;
-static size_t cursor_col = 0;
 static char input_buffer[256];
 static size_t input_pos = 0;
 
-static void vga_put_char(size_t row, size_t col, char c) {
-    if (row < 25 && col < 80) {
-        volatile uint16_t *buf = vmm_framebuffer ? vmm_framebuffer : vga_buffer;
-        buf[row * 80 + col] = (uint16_t)((uint8_t)c | ((uint16_t)VGA_ATTR << 8));
+// Output goes to the screen and, for headless sessions, the serial port.
+static void shell_print(const char *s) {
+    console_write(s);
+    serial_write_text(s);
+}
+
+static void shell_print_dec(uint64_t val) {
+    char buf[21];
+    int i = 20;
+    buf[i] = 0;
+    do {
+        buf[--i] = (char)('0' + val % 10);
+        val /= 10;
+    } while (val);
+    shell_print(&buf[i]);
+}
+
+// Print `val` right-aligned in a field of `width` columns.
+static void shell_print_dec_w(uint64_t val, int width) {
+    uint64_t v = val;
+    int digits = 1;
+    while (v >= 10) {
+        v /= 10;
+        digits++;
     }
+    while (width-- > digits) shell_print(" ");
+    shell_print_dec(val);
 }
 
-static void vga_scroll(void) {
-    volatile uint16_t *buf = vmm_framebuffer ? vmm_framebuffer : vga_buffer;
-    for (size_t row = 0; row < 24; row++) {
-        for (size_t col = 0; col < 80; col++) {
-            buf[row * 80 + col] = buf[(row + 1) * 80 + col];
-        }
+static void shell_print_hex(uint64_t val) {
+    char buf[19];
+    const char *hex = "0123456789abcdef";
+    int i = 18;
+    buf[i] = 0;
+    do {
+        buf[--i] = hex[val & 0xF];
+        val >>= 4;
+    } while (val);
+    buf[--i] = 'x';
+    buf[--i] = '0';
+    shell_print(&buf[i]);
+}
+
+static int str_eq(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
     }
-    for (size_t col = 0; col < 80; col++) {
-        buf[24 * 80 + col] = (uint16_t)(' ' | ((uint16_t)VGA_ATTR << 8));
+    return *a == *b;
+}
+
+// The rest of `s` after `prefix`, or NULL if it does not start with it.
+static const char *str_after(const char *s, const char *prefix) {
+    while (*prefix && *s == *prefix) {
+        s++;
+        prefix++;
     }
+    return *prefix ? NULL : s;
 }
 
-static void shell_print(const char *s) {
-    while (*s) {
-        if (*s == '\n') {
-            cursor_col = 0;
-            cursor_row++;
-            if (cursor_row >= 25) {
-                vga_scroll();
-                cursor_row = 24;
-            }
-        } else {
-            vga_put_char(cursor_row, cursor_col, *s);
-            cursor_col++;
-            if (cursor_col >= 80) {
-                cursor_col = 0;
-                cursor_row++;
-                if (cursor_row >= 25) {
-                    vga_scroll();
-                    cursor_row = 24;
-                }
-            }
+// One line per result, "BENCH <name> n=.. min=.. median=.. p99=.. max=..",
+// between BENCH-BEGIN/BENCH-END so logs from different builds can be
+// diffed or parsed.
+// Print an initrd file straight from module memory, a chunk at a time;
+// control bytes other than newline and tab show as '.'.
+static void shell_cat(const char *path) {
+    const struct initrd_file *f = initrd_find(path);
+    if (!f) {
+        shell_print("No such file\n");
+        return;
+    }
+    char buf[129];
+    for (uint64_t off = 0; off < f->size;) {
+        size_t n = 0;
+        while (n < sizeof(buf) - 1 && off < f->size) {
+            char c = (char)f->data[off++];
+            buf[n++] = (c == '\n' || c == '\t' || (c >= 0x20 && c < 0x7F)) ? c : '.';
         }
-        s++;
+        buf[n] = 0;
+        shell_print(buf);
+    }
+    if (f->size && f->data[f->size - 1] != '\n') shell_print("\n");
+}
+
+static void shell_bench(const char *suite) {
+    struct bench_result res[BENCH_MAX_RESULTS];
+    int n = bench_run(suite, res, BENCH_MAX_RESULTS);
+    if (n < 0) {
+        shell_print("bench: unknown suite or out of memory (pmm, vmm, irq, console)\n");
+        return;
+    }
+    struct timer_stats ts;
+    timer_get_stats(&ts);
+    shell_print("BENCH-BEGIN tsc_hz=");
+    shell_print_dec(ts.tsc_hz);
+    shell_print("\n");
+    for (int i = 0; i < n; i++) {
+        shell_print("BENCH ");
+        shell_print(res[i].name);
+        shell_print(" n=");
+        shell_print_dec(res[i].samples);
+        shell_print(" min=");
+        shell_print_dec(res[i].min);
+        shell_print(" median=");
+        shell_print_dec(res[i].median);
+        shell_print(" p99=");
+        shell_print_dec(res[i].p99);
+        shell_print(" max=");
+        shell_print_dec(res[i].max);
+        shell_print("\n");
     }
+    shell_print("BENCH-END\n");
+}
+
+static void shell_print_fault_line(const char *name, uint64_t count, uint64_t cycles) {
+    shell_print(name);
+    shell_print_dec(count);
+    shell_print(" avg=");
+    shell_print_dec(count ? cycles / count : 0);
+    shell_print(" cycles\n");
+}
+
+static void shell_print_fault_stats(const struct vmm_fault_stats *fs) {
+    shell_print_fault_line("Minor faults:     ", fs->minor, fs->minor_cycles);
+    shell_print_fault_line("Zero-fill faults: ", fs->zero_fill, fs->zero_fill_cycles);
+    shell_print_fault_line("COW faults:       ", fs->cow, fs->cow_cycles);
+    shell_print("Max latency: ");
+    shell_print_dec(fs->max_cycles);
+    shell_print(" cycles\n");
+}
+
+// Reference for the fpu command: byte-pair one's complement sum.
+static uint16_t checksum_scalar(const uint8_t *p, uint64_t n) {
+    uint64_t sum = 0;
+    for (; n >= 2; n -= 2, p += 2) sum += (uint64_t)p[0] | ((uint64_t)p[1] << 8);
+    if (n) sum += p[0];
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+static void shell_fpu_bench(void) {
+    const uint64_t size = 65536;
+    const int runs = 16;
+    uint8_t *src = kmalloc(size);
+    uint8_t *dst = kmalloc(size);
+    if (!src || !dst) {
+        shell_print("fpu: out of memory\n");
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+    for (uint64_t i = 0; i < size; i++) src[i] = (uint8_t)(i * 131 + 7);
+
+    uint64_t t0 = rdtsc();
+    for (int r = 0; r < runs; r++) {
+        void *d = dst;
+        const void *s = src;
+        uint64_t n = size;
+        __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+    }
+    uint64_t movsb_cycles = (rdtsc() - t0) / runs;
+    t0 = rdtsc();
+    for (int r = 0; r < runs; r++) simd_memcpy(dst, src, size);
+    uint64_t simd_copy_cycles = (rdtsc() - t0) / runs;
+    int copy_ok = 1;
+    for (uint64_t i = 0; i < size; i++) {
+        if (dst[i] != src[i]) copy_ok = 0;
+    }
+
+    uint16_t ref = 0, vec = 0;
+    t0 = rdtsc();
+    for (int r = 0; r < runs; r++) ref = checksum_scalar(src + 1, size - 1);
+    uint64_t scalar_sum_cycles = (rdtsc() - t0) / runs;
+    t0 = rdtsc();
+    for (int r = 0; r < runs; r++) vec = simd_checksum(src + 1, size - 1);
+    uint64_t simd_sum_cycles = (rdtsc() - t0) / runs;
+
+    shell_print("64 KiB copy: rep movsb ");
+    shell_print_dec(movsb_cycles);
+    shell_print(", simd ");
+    shell_print_dec(simd_copy_cycles);
+    shell_print(copy_ok ? " cycles\n" : " cycles (MISMATCH)\n");
+    shell_print("64 KiB checksum: scalar ");
+    shell_print_dec(scalar_sum_cycles);
+    shell_print(", simd ");
+    shell_print_dec(simd_sum_cycles);
+    shell_print(ref == vec ? " cycles\n" : " cycles (MISMATCH)\n");
+    kfree(src);
+    kfree(dst);
+}
+
+struct trace_print_ctx {
+    uint64_t first_tsc;
+    uint64_t per_us;
+};
+
+static void trace_print_one(uint32_t cpu, const struct trace_rec *r, void *arg) {
+    struct trace_print_ctx *pc = arg;
+    if (!pc->first_tsc) pc->first_tsc = r->tsc;
+    shell_print_dec_w(cpu, 3);
+    shell_print_dec_w((r->tsc - pc->first_tsc) / pc->per_us, 9);
+    shell_print(" ");
+    const char *name = trace_event_name(r->event);
+    shell_print(name);
+    size_t len = 0;
+    while (name[len]) len++;
+    while (len++ < 10) shell_print(" ");
+    shell_print_hex(r->arg0);
+    shell_print(" ");
+    shell_print_hex(r->arg1);
+    shell_print(" ");
+    shell_print_hex(r->arg2);
+    shell_print("\n");
+}
+
+// Background load for the spin command; runs below the shell's priority.
+static void spin_thread(void *arg) {
+    (void)arg;
+    uint64_t end = ktime_ns() + 5000000000ULL;
+    while (ktime_ns() < end) __asm__ __volatile__("pause");
 }
 
 static void shell_print_prompt(void) {
     shell_print("> ");
-    cursor_col = 2;
+    console_flush();
 }
 
 static void shell_execute_command(const char *cmd) {
@@ -76,14 +268,31 @@ static void shell_execute_command(const char *cmd) {
         shell_print("  help    - Show this help\n");
         shell_print("  clear   - Clear screen\n");
         shell_print("  testfb  - Test framebuffer write\n");
+        shell_print("  mem     - Show memory and mapping stats\n");
+        shell_print("  asbench - Address-space switch cost with/without PCID\n");
+        shell_print("  vmstat  - Page-fault counters and latency\n");
+        shell_print("  pfbench - Run demand-zero/COW faults in a scratch space\n");
+        shell_print("  slabinfo - Per-cache kmalloc statistics\n");
+        shell_print("  irqstat - Interrupt counts and handler cycles per vector\n");
+        shell_print("  time    - Clock, timer stats and a 10 ms sleep check\n");
+        shell_print("  sysbench - SYSCALL vs int 0x80 round trip from ring 3\n");
+        shell_print("  fpu     - Vector state info and SIMD copy/checksum bench\n");
+        shell_print("  threads - List threads with switch counts and CPU time\n");
+        shell_print("  csbench - Context-switch latency (yield and wake/block)\n");
+        shell_print("  spin    - Start a CPU-bound background thread for 5 s\n");
+        shell_print("  cpus    - Online CPUs and per-CPU task counters\n");
+        shell_print("  smpbench - Parallel zero/checksum scaling over CPUs\n");
+        shell_print("  events  - Event wake-ups and deferred work latency\n");
+        shell_print("  conbench - Print 200 lines and report console flush cost\n");
+        shell_print("  serial  - UART mode and byte counters\n");
+        shell_print("  trace [on|off|clear|dump] - Tracepoints: last records, or dump to serial\n");
+        shell_print("  wakebench - Timer IRQ to thread latency, MWAIT vs HLT idle\n");
+        shell_print("  bench [pmm|vmm|irq|console] - Hot-path cycles: min/median/p99\n");
+        shell_print("  boottime - Time spent in each boot phase\n");
+        shell_print("  ls      - Files in the initrd\n");
+        shell_print("  cat <file> - Print a file from the initrd\n");
     } else if (cmd[0] == 'c' && cmd[1] == 'l' && cmd[2] == 'e' && cmd[3] == 'a' && cmd[4] == 'r' && cmd[5] == '\0') {
-        // Clear screen
-        volatile uint16_t *buf = vmm_framebuffer ? vmm_framebuffer : vga_buffer;
-        for (size_t i = 0; i < 80 * 25; i++) {
-            buf[i] = (uint16_t)(' ' | ((uint16_t)VGA_ATTR << 8));
-        }
-        cursor_row = 0;
-        cursor_col = 0;
+        console_clear();
         shell_print_prompt();
     } else if (cmd[0] == 't' && cmd[1] == 'e' && cmd[2] == 's' && cmd[3] == 't' && cmd[4] == 'f' && cmd[5] == 'b' && cmd[6] == '\0') {
         shell_print("Testing framebuffer write...\n");
@@ -98,6 +307,470 @@ static void shell_execute_command(const char *cmd) {
             shell_print("Framebuffer not mapped!\n");
         }
         shell_print_prompt();
+    } else if (str_eq(cmd, "mem")) {
+        struct pmm_zero_stats zs;
+        pmm_zero_pool_stats(&zs);
+        shell_print("Total: ");
+        shell_print_dec(pmm_total_bytes() / 1024);
+        shell_print(" KiB, free: ");
+        shell_print_dec(pmm_free_bytes() / 1024);
+        shell_print(" KiB\n");
+        shell_print("Zero pool: ");
+        shell_print_dec(zs.count);
+        shell_print("/");
+        shell_print_dec(zs.capacity);
+        shell_print(" hits=");
+        shell_print_dec(zs.hits);
+        shell_print(" misses=");
+        shell_print_dec(zs.misses);
+        shell_print(" refilled=");
+        shell_print_dec(zs.refilled);
+        shell_print("\n");
+        struct vmm_map_stats ms;
+        vmm_get_map_stats(&ms);
+        shell_print("Leaves mapped: 1G=");
+        shell_print_dec(ms.leaves_1g);
+        shell_print(" 2M=");
+        shell_print_dec(ms.leaves_2m);
+        shell_print(" 4K=");
+        shell_print_dec(ms.leaves_4k);
+        shell_print("\n");
+        struct vmm_tlb_stats ts;
+        vmm_get_tlb_stats(&ts);
+        shell_print("TLB: invlpg=");
+        shell_print_dec(ts.invlpg);
+        shell_print(" full flushes=");
+        shell_print_dec(ts.full_flushes);
+        shell_print(" tables freed=");
+        shell_print_dec(ts.tables_freed);
+        shell_print(" shootdowns=");
+        shell_print_dec(ts.shootdowns);
+        shell_print("\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "asbench")) {
+        struct vmm_pcid_bench r;
+        if (vmm_pcid_bench(&r) < 0) {
+            shell_print("asbench: out of memory\n");
+        } else {
+            shell_print("Pages touched per switch: ");
+            shell_print_dec(r.pages);
+            shell_print(", rounds: ");
+            shell_print_dec(r.rounds);
+            shell_print("\nNo PCID: switch=");
+            shell_print_dec(r.switch_flush);
+            shell_print(" refill=");
+            shell_print_dec(r.refill_flush);
+            shell_print(" cycles\n");
+            if (r.pcid_enabled) {
+                shell_print("PCID:    switch=");
+                shell_print_dec(r.switch_pcid);
+                shell_print(" refill=");
+                shell_print_dec(r.refill_pcid);
+                shell_print(" cycles\n");
+            } else {
+                shell_print("PCID not supported by this CPU\n");
+            }
+        }
+        shell_print_prompt();
+    } else if (str_eq(cmd, "vmstat")) {
+        struct vmm_fault_stats fs;
+        vmm_get_fault_stats(&fs);
+        shell_print_fault_stats(&fs);
+        shell_print_prompt();
+    } else if (str_eq(cmd, "pfbench")) {
+        struct vmm_fault_stats fs;
+        int ok = vmm_fault_bench(256, &fs) == 0;
+        shell_print_fault_stats(&fs);
+        shell_print(ok ? "COW contents OK\n" : "pfbench: FAILED\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "slabinfo")) {
+        shell_print("cache          size obj/slab pg  slabs active  allocs\n");
+        struct kmem_cache_stats cs;
+        for (uint32_t i = 0; kmem_cache_get_stats(i, &cs) == 0; i++) {
+            int len = 0;
+            while (cs.name[len]) len++;
+            shell_print(cs.name);
+            while (len++ < 13) shell_print(" ");
+            shell_print_dec_w(cs.obj_size, 5);
+            shell_print_dec_w(cs.per_slab, 9);
+            shell_print_dec_w(cs.slab_pages, 3);
+            shell_print_dec_w(cs.slabs, 7);
+            shell_print_dec_w(cs.active, 7);
+            shell_print_dec_w(cs.allocs, 8);
+            shell_print("\n");
+        }
+        struct kmalloc_large_stats ls;
+        kmalloc_get_large_stats(&ls);
+        shell_print("large: allocs=");
+        shell_print_dec(ls.allocs);
+        shell_print(" frees=");
+        shell_print_dec(ls.frees);
+        shell_print(" pages held=");
+        shell_print_dec(ls.pages);
+        shell_print("\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "irqstat")) {
+        shell_print("vec      hits  avg cycles\n");
+        uint32_t registered = 0;
+        for (uint32_t vec = 0; vec < 256; vec++) {
+            struct irq_stats st;
+            irq_get_stats((uint8_t)vec, &st);
+            registered += st.registered;
+            if (!st.hits) continue;
+            shell_print_dec_w(vec, 3);
+            shell_print_dec_w(st.hits, 10);
+            shell_print_dec_w(st.cycles / st.hits, 12);
+            shell_print(st.registered ? "\n" : "  (no handler)\n");
+        }
+        struct keyboard_stats ks;
+        keyboard_get_stats(&ks);
+        shell_print("Keyboard: scancodes=");
+        shell_print_dec(ks.scancodes);
+        shell_print(" dropped=");
+        shell_print_dec(ks.dropped);
+        shell_print(" chars=");
+        shell_print_dec(ks.chars);
+        shell_print("\nController: ");
+        shell_print(!apic_enabled() ? "8259 PIC" : apic_x2apic() ? "x2APIC" : "xAPIC");
+        shell_print("\nVectors with handlers: ");
+        shell_print_dec(registered);
+        shell_print("\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "time")) {
+        uint64_t t0 = ktime_ns();
+        ksleep_ns(10000000ULL);
+        uint64_t slept = ktime_ns() - t0;
+        struct timer_stats ts;
+        timer_get_stats(&ts);
+        shell_print("Uptime: ");
+        shell_print_dec(t0 / 1000000ULL);
+        shell_print(" ms\nTSC: ");
+        shell_print_dec(ts.tsc_hz / 1000000ULL);
+        shell_print(ts.invariant_tsc ? " MHz (invariant)\n" : " MHz\n");
+        shell_print("Event source: ");
+        shell_print(ts.event_source);
+        shell_print("\nInterrupts: ");
+        shell_print_dec(ts.interrupts);
+        shell_print(" fired: ");
+        shell_print_dec(ts.fired);
+        shell_print(" reprograms: ");
+        shell_print_dec(ts.reprograms);
+        shell_print("\nLateness: avg ");
+        shell_print_dec(ts.fired ? ts.late_ns_total / ts.fired : 0);
+        shell_print(" ns, max ");
+        shell_print_dec(ts.late_ns_max);
+        shell_print(" ns\nksleep 10 ms took ");
+        shell_print_dec(slept / 1000);
+        shell_print(" us\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "sysbench")) {
+        struct syscall_bench sb;
+        if (syscall_bench(100000, &sb) == 0) {
+            shell_print("Round trips: ");
+            shell_print_dec(sb.iterations);
+            shell_print("\nSYSCALL/SYSRET: ");
+            shell_print_dec(sb.syscall_cycles);
+            shell_print(" cycles\nint 0x80/iretq: ");
+            shell_print_dec(sb.int80_cycles);
+            shell_print(" cycles\nint 0x80 SYS_KTIME: ");
+            shell_print(sb.int80_ok ? "ok\n" : "FAILED (wrong RAX)\n");
+        } else {
+            shell_print("sysbench: out of memory\n");
+        }
+        shell_print_prompt();
+    } else if (str_eq(cmd, "fpu")) {
+        struct fpu_stats fs;
+        fpu_get_stats(&fs);
+        shell_print("Save: ");
+        shell_print(fs.save_insn);
+        shell_print(" area=");
+        shell_print_dec(fs.area_size);
+        shell_print(" bytes XCR0 components:");
+        shell_print(fs.xcr0 ? " x87 sse" : " (none, fxsave)");
+        if (fs.avx) shell_print(" avx");
+        if (fs.avx512) shell_print(" avx512");
+        shell_print(fs.avx2 ? "\nSIMD kernels: AVX2\n" : "\nSIMD kernels: SSE2\n");
+        shell_fpu_bench();
+        fpu_get_stats(&fs);
+        shell_print("Sections: ");
+        shell_print_dec(fs.kernel_sections);
+        shell_print(" nested: ");
+        shell_print_dec(fs.nested_sections);
+        shell_print(" #NM traps: ");
+        shell_print_dec(fs.nm_traps);
+        shell_print("\nSaves: ");
+        shell_print_dec(fs.saves);
+        shell_print(" restores: ");
+        shell_print_dec(fs.restores);
+        shell_print("\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "threads")) {
+        struct thread_info ti;
+        struct timer_stats ts;
+        timer_get_stats(&ts);
+        shell_print("  ID PRI STATE    SWITCHES     CPU ms NAME\n");
+        for (uint32_t i = 0; sched_get_thread_info(i, &ti) == 0; i++) {
+            shell_print_dec_w(ti.id, 4);
+            shell_print_dec_w(ti.prio, 4);
+            shell_print(" ");
+            shell_print(ti.state);
+            size_t len = 0;
+            while (ti.state[len]) len++;
+            while (len++ < 8) shell_print(" ");
+            shell_print_dec_w(ti.switches, 9);
+            shell_print_dec_w(ts.tsc_hz ? ti.run_cycles / (ts.tsc_hz / 1000) : 0, 11);
+            shell_print(" ");
+            shell_print(ti.name);
+            shell_print("\n");
+        }
+        struct sched_stats ss;
+        sched_get_stats(&ss);
+        shell_print("Switches: ");
+        shell_print_dec(ss.switches);
+        shell_print(" preemptions: ");
+        shell_print_dec(ss.preemptions);
+        shell_print(" slices: ");
+        shell_print_dec(ss.slices);
+        shell_print(" yields: ");
+        shell_print_dec(ss.yields);
+        shell_print("\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "csbench")) {
+        struct sched_bench sb;
+        if (sched_bench(100000, &sb) == 0) {
+            shell_print("Switches: ");
+            shell_print_dec(2ULL * sb.iterations);
+            shell_print(" per test\nsched_yield:  ");
+            shell_print_dec(sb.yield_cycles);
+            shell_print(" cycles/switch\nwake + block: ");
+            shell_print_dec(sb.wake_cycles);
+            shell_print(" cycles/switch\n");
+        } else {
+            shell_print("csbench: out of memory\n");
+        }
+        shell_print_prompt();
+    } else if (str_eq(cmd, "spin")) {
+        if (thread_create("spin", spin_thread, NULL, SCHED_PRIO_DEFAULT + 4))
+            shell_print("Started spin thread (5 s)\n");
+        else
+            shell_print("spin: out of memory\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "conbench")) {
+        struct console_stats before, after;
+        console_get_stats(&before);
+        uint64_t t0 = rdtsc();
+        for (int i = 0; i < 200; i++) {
+            shell_print("conbench line ");
+            shell_print_dec_w((uint64_t)i, 3);
+            shell_print(" ................................................\n");
+        }
+        console_flush();
+        uint64_t cycles = rdtsc() - t0;
+        console_get_stats(&after);
+        shell_print("200 lines: ");
+        shell_print_dec(cycles);
+        shell_print(" cycles, ");
+        shell_print_dec(after.flushes - before.flushes);
+        shell_print(" flushes, ");
+        shell_print_dec(after.rows_flushed - before.rows_flushed);
+        shell_print(" rows copied, ");
+        shell_print_dec(after.flush_cycles - before.flush_cycles);
+        shell_print(" cycles flushing\nConsole ");
+        shell_print_dec(console_cols());
+        shell_print("x");
+        shell_print_dec(console_rows());
+        if (fb_active()) {
+            struct fb_info fi;
+            fb_get_info(&fi);
+            shell_print(" on a ");
+            shell_print_dec(fi.width);
+            shell_print("x");
+            shell_print_dec(fi.height);
+            shell_print(fi.write_combining ? " framebuffer (write-combining)\n" : " framebuffer (uncached)\n");
+        } else {
+            shell_print(" VGA text\n");
+        }
+        shell_print("PgUp/PgDn scroll back through the output\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "serial")) {
+        struct serial_stats ss;
+        serial_get_stats(&ss);
+        shell_print("COM1: ");
+        shell_print_dec(ss.baud);
+        shell_print(ss.irq_mode ? " baud, interrupt driven (IRQ 4)\n" : " baud, polled\n");
+        shell_print("TX bytes: ");
+        shell_print_dec(ss.tx_bytes);
+        shell_print(" stalls: ");
+        shell_print_dec(ss.tx_stalls);
+        shell_print("\nRX bytes: ");
+        shell_print_dec(ss.rx_bytes);
+        shell_print(" dropped: ");
+        shell_print_dec(ss.rx_dropped);
+        shell_print("\nInterrupts: ");
+        shell_print_dec(ss.interrupts);
+        shell_print("\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "events")) {
+        struct timer_stats ts;
+        timer_get_stats(&ts);
+        uint64_t per_us = ts.tsc_hz / 1000000 ? ts.tsc_hz / 1000000 : 1;
+        struct event_stats es;
+        shell_print("EVENT         SIGNALS  WAKEUPS  LAT avg/max us\n");
+        for (uint32_t i = 0; event_get_stats(i, &es) == 0; i++) {
+            shell_print(es.name);
+            size_t len = 0;
+            while (es.name[len]) len++;
+            while (len++ < 12) shell_print(" ");
+            shell_print_dec_w(es.signals, 9);
+            shell_print_dec_w(es.wakeups, 9);
+            shell_print_dec_w(es.wakeups ? es.lat_total / es.wakeups / per_us : 0, 8);
+            shell_print_dec_w(es.lat_max / per_us, 8);
+            shell_print("\n");
+        }
+        struct work_stats ws;
+        work_get_stats(&ws);
+        shell_print("Work: posted ");
+        shell_print_dec(ws.posted);
+        shell_print(" run ");
+        shell_print_dec(ws.run);
+        shell_print(" latency avg ");
+        shell_print_dec(ws.run ? ws.lat_total / ws.run : 0);
+        shell_print(" max ");
+        shell_print_dec(ws.lat_max);
+        shell_print(" cycles\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "wakebench")) {
+        for (int mwait = 0; mwait <= 1; mwait++) {
+            struct wake_bench wb;
+            if (mwait && !idle_mwait_supported()) {
+                shell_print("mwait: not supported\n");
+                break;
+            }
+            wake_bench(200, mwait, &wb);
+            shell_print(mwait ? "mwait: " : "hlt:   ");
+            shell_print("irq ");
+            shell_print_dec(wb.irq_ns_avg);
+            shell_print("/");
+            shell_print_dec(wb.irq_ns_max);
+            shell_print(" ns, event ");
+            shell_print_dec(wb.event_cycles_avg);
+            shell_print("/");
+            shell_print_dec(wb.event_cycles_max);
+            shell_print(", work ");
+            shell_print_dec(wb.work_cycles_avg);
+            shell_print("/");
+            shell_print_dec(wb.work_cycles_max);
+            shell_print(" cycles (avg/max)\n");
+        }
+        shell_print_prompt();
+    } else if (str_eq(cmd, "bench")) {
+        shell_bench(NULL);
+        shell_print_prompt();
+    } else if (str_after(cmd, "bench ")) {
+        shell_bench(str_after(cmd, "bench "));
+        shell_print_prompt();
+    } else if (str_eq(cmd, "boottime")) {
+        boot_timeline_write(shell_print);
+        shell_print_prompt();
+    } else if (str_eq(cmd, "ls")) {
+        struct initrd_stats st;
+        initrd_get_stats(&st);
+        uint32_t count;
+        const struct initrd_file *f = initrd_files(&count);
+        for (uint32_t i = 0; i < count; i++) {
+            shell_print_dec_w(f[i].size, 10);
+            shell_print(" ");
+            shell_print(f[i].name);
+            shell_print("\n");
+        }
+        shell_print_dec(st.files);
+        shell_print(" files in ");
+        shell_print_dec(st.modules);
+        shell_print(" modules (");
+        shell_print_dec(st.bytes / 1024);
+        shell_print(" KiB), indexed in ");
+        shell_print_dec(st.index_cycles);
+        shell_print(" cycles\n");
+        if (st.writable) {
+            shell_print_dec(st.writable);
+            shell_print(" modules could not be made read-only\n");
+        }
+        shell_print_prompt();
+    } else if (str_after(cmd, "cat ")) {
+        shell_cat(str_after(cmd, "cat "));
+        shell_print_prompt();
+    } else if (str_eq(cmd, "trace on")) {
+        trace_set_mask(TRACE_ALL);
+        shell_print("Tracing on\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "trace off")) {
+        trace_set_mask(0);
+        shell_print("Tracing off\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "trace clear")) {
+        uint32_t mask = trace_set_mask(0);
+        trace_clear();
+        trace_set_mask(mask);
+        shell_print_prompt();
+    } else if (str_eq(cmd, "trace dump")) {
+        uint32_t mask = trace_set_mask(0);
+        trace_dump();
+        trace_set_mask(mask);
+        shell_print("Trace written to serial (tools/trace_decode.py)\n");
+        shell_print_prompt();
+    } else if (str_eq(cmd, "trace")) {
+        // Stop while reading so the rings hold still; printing would
+        // otherwise trace itself.
+        uint32_t mask = trace_set_mask(0);
+        struct trace_stats st;
+        trace_get_stats(&st);
+        struct timer_stats ts;
+        timer_get_stats(&ts);
+        struct trace_print_ctx pc = { 0, ts.tsc_hz / 1000000 ? ts.tsc_hz / 1000000 : 1 };
+        shell_print(mask ? "Tracing on, " : "Tracing off, ");
+        shell_print_dec(st.recorded);
+        shell_print(" records (");
+        shell_print_dec(st.overwritten);
+        shell_print(" overwritten)\nCPU       us EVENT     ARG0 ARG1 ARG2\n");
+        trace_visit(20, trace_print_one, &pc);
+        trace_set_mask(mask);
+        shell_print_prompt();
+    } else if (str_eq(cmd, "cpus")) {
+        struct task_cpu_stats st;
+        shell_print(idle_mwait_enabled() ? "Idle: mwait\n" : "Idle: hlt\n");
+        shell_print(" CPU APIC    TASKS   STOLEN    IDLES    KICKS\n");
+        for (uint32_t i = 0; task_get_cpu_stats(i, &st) == 0; i++) {
+            shell_print_dec_w(i, 4);
+            shell_print_dec_w(smp_cpu_apic_id(i), 5);
+            shell_print_dec_w(st.executed, 9);
+            shell_print_dec_w(st.stolen, 9);
+            struct idle_cpu_stats is;
+            idle_get_cpu_stats(i, &is);
+            shell_print_dec_w(is.entries, 9);
+            shell_print_dec_w(is.kicks, 9);
+            shell_print("\n");
+        }
+        shell_print_prompt();
+    } else if (str_eq(cmd, "smpbench")) {
+        struct smp_bench rows[8];
+        int n = smp_bench(rows, 8);
+        if (n > 0) {
+            shell_print("Buffer: ");
+            shell_print_dec(rows[0].bytes >> 20);
+            shell_print(" MiB in 256 KiB tasks, cycles (speedup x100)\n");
+            shell_print("CPUS        ZERO        CHECKSUM\n");
+            for (int i = 0; i < n; i++) {
+                shell_print_dec_w(rows[i].cpus, 4);
+                shell_print_dec_w(rows[i].zero_cycles, 12);
+                shell_print_dec_w(rows[i].zero_cycles ? rows[0].zero_cycles * 100 / rows[i].zero_cycles : 0, 5);
+                shell_print_dec_w(rows[i].sum_cycles, 12);
+                shell_print_dec_w(rows[i].sum_cycles ? rows[0].sum_cycles * 100 / rows[i].sum_cycles : 0, 5);
+                shell_print("\n");
+            }
+        } else {
+            shell_print("smpbench: out of memory\n");
+        }
+        shell_print_prompt();
     } else {
         shell_print("Unknown command: ");
         shell_print(cmd);
@@ -112,14 +785,17 @@ void shell_init(void) {
 }
 
 void shell_process_input(char c) {
-    if (c == '\b') {
+    if ((uint8_t)c == KEY_PGUP || (uint8_t)c == KEY_PGDN) {
+        int half = (int)console_rows() / 2;
+        console_scroll_view((uint8_t)c == KEY_PGUP ? half : -half);
+    } else if (c == '\b') {
         // Backspace
         if (input_pos > 0) {
             input_pos--;
             input_buffer[input_pos] = '\0';
-            if (cursor_col > 2) {
-                cursor_col--;
-                vga_put_char(cursor_row, cursor_col, ' ');
+            if (console_col() > 2) {
+                console_backspace();
+                serial_write("\b \b");
             }
         }
     } else if (c == '\n') {
@@ -130,22 +806,19 @@ void shell_process_input(char c) {
     } else if (c >= 32 && c < 127 && input_pos < 255) {
         // Printable character
         input_buffer[input_pos++] = c;
-        vga_put_char(cursor_row, cursor_col, c);
-        cursor_col++;
-        if (cursor_col >= 80) {
-            cursor_col = 0;
-            cursor_row++;
-            if (cursor_row >= 25) {
-                vga_scroll();
-                cursor_row = 24;
-            }
-        }
+        char echo[2] = { c, 0 };
+        shell_print(echo);
     }
 }
 
 void shell_run(void) {
-    char c = keyboard_get_char();
-    if (c) {
-        shell_process_input(c);
+    char buf[32];
+    size_t n;
+    while ((n = keyboard_read(buf, sizeof(buf))) != 0) {
+        for (size_t i = 0; i < n; i++) shell_process_input(buf[i]);
+    }
+    while ((n = serial_read(buf, sizeof(buf))) != 0) {
+        for (size_t i = 0; i < n; i++) shell_process_input(buf[i]);
     }
+    console_flush();
 }
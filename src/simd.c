@@ -0,0 +1,223 @@
+#include "simd.h"
+#include "fpu.h"
+#include <immintrin.h>
+#include <stddef.h>
+
+// The kernel is built with -mgeneral-regs-only; only the target("...")
+// functions below may use vector registers, and only between
+// kernel_fpu_begin() and kernel_fpu_end().
+
+// Below this a kernel_fpu section costs more than it saves.
+#define SIMD_MIN_BYTES 256
+// Copies at least this big bypass the cache with streaming stores.
+#define SIMD_STREAM_BYTES (256 * 1024)
+
+static int avx2_state = -1;
+
+static int have_avx2(void) {
+    if (avx2_state < 0) {
+        struct fpu_stats fs;
+        fpu_get_stats(&fs);
+        avx2_state = fs.avx2;
+    }
+    return avx2_state;
+}
+
+static inline void movsb(void *dst, const void *src, uint64_t n) {
+    __asm__ __volatile__("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+// n >= 64. One unaligned head store aligns the destination, the last 32
+// bytes are an unaligned (possibly overlapping) tail store.
+__attribute__((target("avx2")))
+static void copy_avx2(uint8_t *d, const uint8_t *s, uint64_t n, int stream) {
+    const uint8_t *s_end = s + n;
+    uint8_t *d_end = d + n;
+    _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    uint64_t skip = 32 - ((uintptr_t)d & 31);
+    d += skip;
+    s += skip;
+    n -= skip;
+    if (stream) {
+        for (; n >= 128; n -= 128, d += 128, s += 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)s);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+            _mm256_stream_si256((__m256i *)d, a);
+            _mm256_stream_si256((__m256i *)(d + 32), b);
+            _mm256_stream_si256((__m256i *)(d + 64), c);
+            _mm256_stream_si256((__m256i *)(d + 96), e);
+        }
+        _mm_sfence();
+    } else {
+        for (; n >= 128; n -= 128, d += 128, s += 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)s);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+            _mm256_store_si256((__m256i *)d, a);
+            _mm256_store_si256((__m256i *)(d + 32), b);
+            _mm256_store_si256((__m256i *)(d + 64), c);
+            _mm256_store_si256((__m256i *)(d + 96), e);
+        }
+    }
+    for (; n >= 32; n -= 32, d += 32, s += 32)
+        _mm256_store_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    if (n)
+        _mm256_storeu_si256((__m256i *)(d_end - 32), _mm256_loadu_si256((const __m256i *)(s_end - 32)));
+}
+
+// Same shape as copy_avx2 with 16-byte vectors; n >= 64.
+__attribute__((target("sse2")))
+static void copy_sse2(uint8_t *d, const uint8_t *s, uint64_t n, int stream) {
+    const uint8_t *s_end = s + n;
+    uint8_t *d_end = d + n;
+    _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    uint64_t skip = 16 - ((uintptr_t)d & 15);
+    d += skip;
+    s += skip;
+    n -= skip;
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        if (stream) {
+            _mm_stream_si128((__m128i *)d, a);
+            _mm_stream_si128((__m128i *)(d + 16), b);
+            _mm_stream_si128((__m128i *)(d + 32), c);
+            _mm_stream_si128((__m128i *)(d + 48), e);
+        } else {
+            _mm_store_si128((__m128i *)d, a);
+            _mm_store_si128((__m128i *)(d + 16), b);
+            _mm_store_si128((__m128i *)(d + 32), c);
+            _mm_store_si128((__m128i *)(d + 48), e);
+        }
+    }
+    if (stream) _mm_sfence();
+    for (; n >= 16; n -= 16, d += 16, s += 16)
+        _mm_store_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    if (n)
+        _mm_storeu_si128((__m128i *)(d_end - 16), _mm_loadu_si128((const __m128i *)(s_end - 16)));
+}
+
+static void copy_vec(void *dst, const void *src, uint64_t n, int stream) {
+    if (n < 64) movsb(dst, src, n);
+    else if (have_avx2()) copy_avx2(dst, src, n, stream);
+    else copy_sse2(dst, src, n, stream);
+}
+
+void simd_memcpy(void *dst, const void *src, uint64_t n) {
+    if (n < SIMD_MIN_BYTES) {
+        movsb(dst, src, n);
+        return;
+    }
+    kernel_fpu_begin();
+    copy_vec(dst, src, n, n >= SIMD_STREAM_BYTES);
+    kernel_fpu_end();
+}
+
+// One's complement accumulation: add with end-around carry.
+static inline uint64_t csum_add(uint64_t sum, uint64_t v) {
+    sum += v;
+    return sum + (sum < v);
+}
+
+static uint16_t csum_fold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFFULL) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFFULL) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+// Summing 32-bit words zero-extended into 64-bit lanes gives the same
+// folded result as summing 16-bit words (2^16 == 1 mod 0xFFFF).
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *p, uint64_t n) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = zero, hi = zero;
+    for (; n >= 32; n -= 32, p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        lo = _mm256_add_epi64(lo, _mm256_unpacklo_epi32(v, zero));
+        hi = _mm256_add_epi64(hi, _mm256_unpackhi_epi32(v, zero));
+    }
+    uint64_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, lo);
+    _mm256_storeu_si256((__m256i *)(lanes + 4), hi);
+    uint64_t sum = 0;
+    for (int i = 0; i < 8; i++) sum = csum_add(sum, lanes[i]);
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *p, uint64_t n) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero, hi = zero;
+    for (; n >= 16; n -= 16, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        lo = _mm_add_epi64(lo, _mm_unpacklo_epi32(v, zero));
+        hi = _mm_add_epi64(hi, _mm_unpackhi_epi32(v, zero));
+    }
+    uint64_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, lo);
+    _mm_storeu_si128((__m128i *)(lanes + 2), hi);
+    uint64_t sum = 0;
+    for (int i = 0; i < 4; i++) sum = csum_add(sum, lanes[i]);
+    return sum;
+}
+
+uint16_t simd_checksum(const void *buf, uint64_t n) {
+    const uint8_t *p = buf;
+    uint64_t sum = 0;
+    if (n >= SIMD_MIN_BYTES) {
+        uint64_t bulk = n & ~31ULL;
+        kernel_fpu_begin();
+        sum = have_avx2() ? sum_avx2(p, bulk) : sum_sse2(p, bulk);
+        kernel_fpu_end();
+        p += bulk;
+        n -= bulk;
+    }
+    for (; n >= 2; n -= 2, p += 2) sum = csum_add(sum, (uint64_t)p[0] | ((uint64_t)p[1] << 8));
+    if (n) sum = csum_add(sum, p[0]);
+    return csum_fold(sum);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint32_t *d, uint32_t value, uint64_t count) {
+    __m256i v = _mm256_set1_epi32((int)value);
+    for (; count >= 8; count -= 8, d += 8) _mm256_storeu_si256((__m256i *)d, v);
+    while (count--) *d++ = value;
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint32_t *d, uint32_t value, uint64_t count) {
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; count >= 4; count -= 4, d += 4) _mm_storeu_si128((__m128i *)d, v);
+    while (count--) *d++ = value;
+}
+
+void simd_fill32(uint32_t *dst, uint32_t value, uint64_t count) {
+    if (count * 4 < SIMD_MIN_BYTES) {
+        __asm__ __volatile__("rep stosl" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+        return;
+    }
+    kernel_fpu_begin();
+    if (have_avx2()) fill_avx2(dst, value, count);
+    else fill_sse2(dst, value, count);
+    kernel_fpu_end();
+}
+
+void simd_blit(void *dst, uint64_t dst_pitch, const void *src, uint64_t src_pitch,
+               uint64_t row_bytes, uint64_t rows) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    if (row_bytes < 64 || row_bytes * rows < SIMD_MIN_BYTES) {
+        for (; rows; rows--, d += dst_pitch, s += src_pitch) movsb(d, s, row_bytes);
+        return;
+    }
+    kernel_fpu_begin();
+    for (; rows; rows--, d += dst_pitch, s += src_pitch) copy_vec(d, s, row_bytes, 0);
+    kernel_fpu_end();
+}
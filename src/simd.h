@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+
+// Vectorised memory kernels. Each call opens its own kernel_fpu section
+// and picks AVX2 or SSE2 at run time; requests too small to pay for the
+// section fall back to general-purpose code. Requires fpu_init().
+
+void simd_memcpy(void *dst, const void *src, uint64_t n);
+
+// 16-bit one's complement sum (RFC 1071) of `n` bytes, folded but not
+// inverted, in the byte order of the data.
+uint16_t simd_checksum(const void *buf, uint64_t n);
+
+// Fill `count` 32-bit pixels with `value`.
+void simd_fill32(uint32_t *dst, uint32_t value, uint64_t count);
+
+// Copy a `row_bytes` x `rows` rectangle between surfaces with the given
+// pitches (bytes per line).
+void simd_blit(void *dst, uint64_t dst_pitch, const void *src, uint64_t src_pitch,
+               uint64_t row_bytes, uint64_t rows);
@@ -0,0 +1,279 @@
+#include "smp.h"
+#include "acpi.h"
+#include "apic.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "simd.h"
+#include "spinlock.h"
+#include "irq.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "percpu.h"
+#include "syscall.h"
+#include "task.h"
+#include "timer.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define AP_STACK_SIZE 16384
+
+// percpu.online: 0 while an AP starts, 1 once it is up, AP_ABANDONED once
+// the boot CPU has given up waiting. Whichever side moves it off 0 first
+// decides.
+#define AP_ABANDONED 2
+
+#define BENCH_BLOCK_ORDER 10  // 4 MiB
+#define BENCH_BLOCK_BYTES (4096ULL << BENCH_BLOCK_ORDER)
+#define BENCH_BLOCKS      16
+#define BENCH_CHUNK       (256 * 1024)
+#define BENCH_RUNS        3
+
+// trampoline.asm, copied to SMP_TRAMPOLINE_PHYS for each start-up.
+struct ap_params {
+    uint64_t cr3;
+    uint64_t stack;
+    uint64_t percpu;
+    uint64_t entry;
+};
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern struct ap_params ap_trampoline_params;
+
+static struct percpu bsp_cpu;
+static struct percpu *cpus[ACPI_MAX_CPUS];
+static volatile uint32_t cpu_count = 1;
+
+static void wake_handler(struct isr_context *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    apic_eoi();
+}
+
+// TLB shootdown. Only the boot CPU changes kernel mappings, so one request
+// is in flight at a time; the lock only keeps that true.
+static struct spinlock tlb_lock = SPINLOCK_INIT;
+static volatile uint32_t tlb_pending;
+
+// Nothing is mapped global and APs only run the kernel space, so a CR3
+// reload drops every stale kernel translation.
+static void tlb_handler(struct isr_context *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    write_cr3(read_cr3());
+    __atomic_fetch_sub(&tlb_pending, 1, __ATOMIC_RELEASE);
+    apic_eoi();
+}
+
+static void tlb_shootdown(void) {
+    uint32_t n = smp_cpu_count();
+    if (n < 2) return;
+    spin_lock(&tlb_lock);
+    uint32_t self = this_cpu()->id;
+    __atomic_store_n(&tlb_pending, n - 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < n; i++) {
+        if (i != self) apic_send_ipi(cpus[i]->apic_id, APIC_IPI_FIXED | SMP_TLB_VECTOR);
+    }
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE)) __asm__ __volatile__("pause");
+    spin_unlock(&tlb_lock);
+}
+
+void smp_init_bsp(void) {
+    bsp_cpu.id = 0;
+    bsp_cpu.online = 1;
+    percpu_install(&bsp_cpu);
+    cpus[0] = &bsp_cpu;
+}
+
+// First C code on an AP, on its own stack, with interrupts off.
+static void __attribute__((noreturn)) smp_ap_main(struct percpu *cpu) {
+    gdt_init_ap(cpu->id);
+    percpu_install(cpu);
+    idt_init_ap();
+    fpu_init_ap();
+    vmm_init_ap();
+    apic_init_ap();
+    syscall_init_ap();
+    uint32_t starting = 0;
+    if (!__atomic_compare_exchange_n(&cpu->online, &starting, 1, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        // Too late: the boot CPU has moved on without us.
+        for (;;) __asm__ __volatile__("cli; hlt");
+    }
+    __asm__ __volatile__("sti");
+    task_worker();
+}
+
+static void busy_wait_ns(uint64_t ns) {
+    uint64_t end = ktime_ns() + ns;
+    while (ktime_ns() < end) __asm__ __volatile__("pause");
+}
+
+static int start_ap(struct percpu *cpu) {
+    uint8_t *stack = kmalloc(AP_STACK_SIZE);
+    uint8_t *entry = kmalloc(SYSCALL_ENTRY_STACK_SIZE);
+    if (!stack || !entry) {
+        kfree(stack);
+        kfree(entry);
+        return -1;
+    }
+    cpu->stack_top = ((uint64_t)(uintptr_t)stack + AP_STACK_SIZE) & ~15ULL;
+    cpu->entry_rsp = ((uint64_t)(uintptr_t)entry + SYSCALL_ENTRY_STACK_SIZE) & ~15ULL;
+
+    // Code and parameters go below 1 MiB where the SIPI can point.
+    uint8_t *dst = (uint8_t *)(uintptr_t)SMP_TRAMPOLINE_PHYS;
+    const uint8_t *src = ap_trampoline_start;
+    uint64_t len = (uint64_t)(ap_trampoline_end - ap_trampoline_start);
+    __asm__ __volatile__("rep movsb" : "+D"(dst), "+S"(src), "+c"(len) : : "memory");
+    struct ap_params *p = (struct ap_params *)(uintptr_t)(SMP_TRAMPOLINE_PHYS +
+        ((uint8_t *)&ap_trampoline_params - ap_trampoline_start));
+    p->cr3 = vmm_kernel_space()->pml4_phys;
+    p->stack = cpu->stack_top;
+    p->percpu = (uint64_t)(uintptr_t)cpu;
+    p->entry = (uint64_t)(uintptr_t)smp_ap_main;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // The MP spec sequence: INIT, 10 ms, SIPI, 200 us, second SIPI only
+    // if the first one was missed.
+    uint32_t sipi = APIC_IPI_SIPI | (SMP_TRAMPOLINE_PHYS >> 12);
+    apic_send_ipi(cpu->apic_id, APIC_IPI_INIT);
+    busy_wait_ns(10000000);
+    apic_send_ipi(cpu->apic_id, sipi);
+    busy_wait_ns(200000);
+    if (!cpu->online) apic_send_ipi(cpu->apic_id, sipi);
+
+    uint64_t deadline = ktime_ns() + 100000000;
+    while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) && ktime_ns() < deadline)
+        __asm__ __volatile__("pause");
+    uint32_t starting = 0;
+    if (__atomic_compare_exchange_n(&cpu->online, &starting, AP_ABANDONED, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        // Still in the trampoline: INIT puts it back into wait-for-SIPI.
+        // Further along it halts on seeing AP_ABANDONED. Either way it may
+        // have run on the stacks and percpu already: leak them.
+        apic_send_ipi(cpu->apic_id, APIC_IPI_INIT);
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t smp_init(void) {
+    const struct acpi_madt_info *madt = acpi_madt();
+    if (!madt || !apic_enabled()) return cpu_count;
+    // The trampoline loads CR3 in 32-bit mode.
+    if (vmm_kernel_space()->pml4_phys >> 32) return cpu_count;
+
+    bsp_cpu.apic_id = apic_id();
+    irq_register(SMP_WAKE_VECTOR, wake_handler, NULL);
+    irq_register(SMP_TLB_VECTOR, tlb_handler, NULL);
+    vmm_set_remote_flush(tlb_shootdown);
+
+    for (uint32_t i = 0; i < madt->cpu_count && cpu_count < ACPI_MAX_CPUS; i++) {
+        if (madt->cpu_apic_ids[i] == bsp_cpu.apic_id) continue;
+        struct percpu *cpu = kzalloc(sizeof(*cpu));
+        if (!cpu) break;
+        cpu->id = cpu_count;
+        cpu->apic_id = madt->cpu_apic_ids[i];
+        // A CPU that did not come up may still hold the trampoline page,
+        // its id and that id's TSS slot: stop rather than hand them to the
+        // next one. `cpu` is leaked with it.
+        if (start_ap(cpu) != 0) break;
+        cpus[cpu->id] = cpu;
+        __atomic_store_n(&cpu_count, cpu->id + 1, __ATOMIC_RELEASE);
+    }
+    return cpu_count;
+}
+
+uint32_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpu_count, __ATOMIC_ACQUIRE);
+}
+
+struct percpu *smp_cpu(uint32_t id) {
+    return id < smp_cpu_count() ? cpus[id] : NULL;
+}
+
+uint32_t smp_cpu_apic_id(uint32_t id) {
+    struct percpu *cpu = smp_cpu(id);
+    return cpu ? cpu->apic_id : 0;
+}
+
+void smp_wake(struct percpu *cpu) {
+    apic_send_ipi(cpu->apic_id, APIC_IPI_FIXED | SMP_WAKE_VECTOR);
+}
+
+struct bench_chunk {
+    uint8_t *buf;
+    uint16_t sum;
+};
+
+static void bench_zero(void *arg) {
+    struct bench_chunk *c = arg;
+    simd_fill32((uint32_t *)c->buf, 0, BENCH_CHUNK / 4);
+}
+
+static void bench_sum(void *arg) {
+    struct bench_chunk *c = arg;
+    c->sum = simd_checksum(c->buf, BENCH_CHUNK);
+}
+
+static uint64_t bench_phase(struct task *tasks, struct bench_chunk *chunks,
+                            uint32_t n, task_fn fn) {
+    uint64_t best = ~0ULL;
+    for (int r = 0; r < BENCH_RUNS; r++) {
+        struct task_group g = TASK_GROUP_INIT;
+        uint64_t t0 = rdtsc();
+        for (uint32_t i = 0; i < n; i++) {
+            tasks[i].fn = fn;
+            tasks[i].arg = &chunks[i];
+            tasks[i].group = &g;
+            task_spawn(&tasks[i]);
+        }
+        task_wait(&g);
+        uint64_t dt = rdtsc() - t0;
+        if (dt < best) best = dt;
+    }
+    return best;
+}
+
+int smp_bench(struct smp_bench *out, int max) {
+    void *blocks[BENCH_BLOCKS];
+    uint32_t nblocks = 0;
+    while (nblocks < BENCH_BLOCKS) {
+        void *phys = pmm_alloc_pages(BENCH_BLOCK_ORDER);
+        if (!phys) break;
+        blocks[nblocks++] = phys;
+    }
+    uint32_t per_block = BENCH_BLOCK_BYTES / BENCH_CHUNK;
+    uint32_t n = nblocks * per_block;
+    struct bench_chunk *chunks = kmalloc(BENCH_BLOCKS * per_block * sizeof(*chunks));
+    struct task *tasks = kmalloc(BENCH_BLOCKS * per_block * sizeof(*tasks));
+    int rows = -1;
+    if (!nblocks || !chunks || !tasks) goto out;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *base = vmm_phys_to_virt((uint64_t)(uintptr_t)blocks[i / per_block]);
+        chunks[i].buf = base + (uint64_t)(i % per_block) * BENCH_CHUNK;
+    }
+
+    rows = 0;
+    uint32_t total = smp_cpu_count();
+    uint32_t old_limit = task_set_cpu_limit(0);
+    for (uint32_t cpus = 1; rows < max; cpus *= 2) {
+        if (cpus > total) cpus = total;
+        task_set_cpu_limit(cpus);
+        out[rows].cpus = cpus;
+        out[rows].bytes = (uint64_t)n * BENCH_CHUNK;
+        out[rows].zero_cycles = bench_phase(tasks, chunks, n, bench_zero);
+        out[rows].sum_cycles = bench_phase(tasks, chunks, n, bench_sum);
+        rows++;
+        if (cpus == total) break;
+    }
+    task_set_cpu_limit(old_limit);
+
+out:
+    kfree(chunks);
+    kfree(tasks);
+    for (uint32_t i = 0; i < nblocks; i++) pmm_free_pages(blocks[i], BENCH_BLOCK_ORDER);
+    return rows;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+
+// Application processor bring-up. Every CPU gets a struct percpu behind
+// its GS base; the boot CPU keeps running threads (sched.c) while the
+// others run kernel tasks (task.c).
+
+// Real-mode start page for the APs; below 1 MiB, reserved by the PMM and
+// identity mapped by the VMM.
+#define SMP_TRAMPOLINE_PHYS 0x8000
+#define SMP_WAKE_VECTOR     0xF1
+#define SMP_TLB_VECTOR      0xF3
+
+struct percpu;
+
+// Per-CPU data for the boot CPU. Call right after gdt_init(), which
+// clears the GS base.
+void smp_init_bsp(void);
+
+// Start every other CPU in the MADT with INIT-SIPI-SIPI, one at a time,
+// stopping at the first one that does not come up within 100 ms.
+// Needs kmalloc, the local APIC and timer_init(). Returns the number of
+// CPUs online, the boot CPU included.
+uint32_t smp_init(void);
+
+uint32_t smp_cpu_count(void);
+// CPU `id` (0 is the boot CPU), or NULL.
+struct percpu *smp_cpu(uint32_t id);
+uint32_t smp_cpu_apic_id(uint32_t id);
+// Bring `cpu` out of HLT.
+void smp_wake(struct percpu *cpu);
+
+// Zero and then checksum a large buffer in 256 KiB tasks, with 1, 2, 4, ...
+// and finally all CPUs taking part. One row per CPU count.
+struct smp_bench {
+    uint32_t cpus;
+    uint64_t bytes;
+    uint64_t zero_cycles;  // best of a few runs
+    uint64_t sum_cycles;
+};
+// Returns the number of rows filled (at most `max`), or -1 on OOM.
+int smp_bench(struct smp_bench *out, int max);
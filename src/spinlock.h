@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+#include "cpu.h"
+
+// Ticket spinlock: FIFO under contention, one cache line of state. The
+// _irqsave variants also keep interrupt handlers (and with them the
+// scheduler) off this CPU while the lock is held.
+
+struct spinlock {
+    volatile uint32_t next;
+    volatile uint32_t owner;
+};
+#define SPINLOCK_INIT { 0, 0 }
+
+static inline void spin_lock(struct spinlock *l) {
+    uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket)
+        __asm__ __volatile__("pause" ::: "memory");
+}
+
+static inline void spin_unlock(struct spinlock *l) {
+    __atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(struct spinlock *l) {
+    uint64_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock *l, uint64_t flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+}
@@ -0,0 +1,38 @@
+; switch.asm - kernel thread context switch
+;
+; - context_switch: saves the callee-saved registers on the current stack,
+;   stores RSP through the first argument and resumes the thread whose
+;   saved RSP is the second
+; - thread_trampoline: first "return address" of a new thread; calls
+;   sched_thread_start(fn = r12, arg = r13)
+
+BITS 64
+
+global context_switch, thread_trampoline
+extern sched_thread_start
+
+section .text
+
+; void context_switch(uint64_t *prev_rsp, uint64_t next_rsp)
+context_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+thread_trampoline:
+    mov rdi, r12
+    mov rsi, r13
+    call sched_thread_start
+    ud2
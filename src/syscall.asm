@@ -0,0 +1,190 @@
+; syscall.asm - SYSCALL entry, ring-3 entry/exit and the user benchmark
+;
+; - syscall_entry: LSTAR target. Swaps in the per-CPU GS, switches to
+;   this CPU's entry stack, calls syscall_table[rax] with the Linux
+;   register convention (rdi, rsi, rdx, r10, r8, r9) and returns with SYSRET
+; - user_enter / user_return: run user code and come back to the caller
+;   once a syscall handler calls user_return
+; - user_bench_start..user_bench_end: position-independent ring-3 code
+;   copied into a user page by syscall_bench
+
+BITS 64
+
+%define SYS_NOP   0
+%define SYS_EXIT  1
+%define SYS_KTIME 2
+%define SYSCALL_COUNT 3
+
+; struct percpu fields (percpu.h checks the offsets).
+%define PERCPU_ENTRY_RSP       32
+%define PERCPU_USER_RSP        40
+%define PERCPU_USER_RETURN_RSP 48
+
+%define USER_CS   (0x20 | 3)
+%define USER_SS   (0x18 | 3)
+%define USER_TOP  0x0000800000000000
+
+global syscall_entry, user_enter, user_return
+global user_bench_start, user_bench_end
+extern syscall_table
+
+section .text
+
+syscall_entry:
+    ; SFMASK cleared IF, so nothing can run on this stack behind our back
+    ; or see the user GS base.
+    swapgs
+    mov [gs:PERCPU_USER_RSP], rsp
+    mov rsp, [gs:PERCPU_ENTRY_RSP]
+    push qword [gs:PERCPU_USER_RSP]
+    push rcx                  ; user RIP
+    push r11                  ; user RFLAGS
+    push rdi
+    push rsi
+    push rdx
+    push r10
+    push r8
+    push r9
+    sub rsp, 8                ; 16-byte alignment for the call
+
+    cmp rax, SYSCALL_COUNT
+    jae .bad
+    mov rcx, r10              ; 4th argument per the C ABI
+    lea r11, [rel syscall_table]
+    call [r11 + rax * 8]
+    jmp .done
+.bad:
+    mov rax, -1
+.done:
+    add rsp, 8
+    pop r9
+    pop r8
+    pop r10
+    pop rdx
+    pop rsi
+    pop rdi
+    pop r11
+    pop rcx
+    ; SYSRET with a non-canonical RIP faults in ring 0; user RIPs are
+    ; below USER_TOP, anything else is refused.
+    mov r10, USER_TOP
+    cmp rcx, r10
+    jae .kill
+    pop rsp
+    swapgs
+    o64 sysret
+.kill:
+    mov rsp, [gs:PERCPU_ENTRY_RSP]
+    mov rdi, -1
+    jmp user_return
+
+; uint64_t user_enter(uint64_t rip, uint64_t rsp, uint64_t arg)
+; Enters ring 3 at `rip` with RDI = arg. Returns the value later passed to
+; user_return.
+user_enter:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    pushfq
+    mov [gs:PERCPU_USER_RETURN_RSP], rsp
+
+    push qword USER_SS
+    push rsi
+    push qword 0x202          ; IF set
+    push qword USER_CS
+    push rdi
+    mov rdi, rdx
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor ebp, ebp
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    xor r11d, r11d
+    xor r12d, r12d
+    xor r13d, r13d
+    xor r14d, r14d
+    xor r15d, r15d
+    ; No interrupt may arrive between SWAPGS and IRETQ: it would see ring-0
+    ; CS and keep the user GS base. IRETQ sets IF again.
+    cli
+    swapgs
+    iretq
+
+; void user_return(uint64_t value) - unwinds to the user_enter caller.
+user_return:
+    mov rax, rdi
+    mov rsp, [gs:PERCPU_USER_RETURN_RSP]
+    popfq
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; Ring-3 benchmark, entered with RDI = iterations. Times RDI SYSCALL round
+; trips, then RDI `int 0x80` round trips, then makes one `int 0x80`
+; SYS_KTIME call and exits with the two cycle totals and the time in
+; RDI/RSI/RDX.
+user_bench_start:
+    mov r12, rdi
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r13, rax
+    mov rbx, r12
+.syscall_loop:
+    mov eax, SYS_NOP
+    syscall
+    dec rbx
+    jnz .syscall_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r13
+    mov r14, rax
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r13, rax
+    mov rbx, r12
+.int_loop:
+    mov eax, SYS_NOP
+    int 0x80
+    dec rbx
+    jnz .int_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r13
+    mov r13, rax
+
+    ; Every argument register and R15 non-zero, so the handler only gets
+    ; ktime_ns() into RAX if it reads the number from the right slot.
+    mov edi, 1
+    mov esi, 2
+    mov edx, 3
+    mov r10d, 4
+    mov r8d, 5
+    mov r9d, 6
+    mov r15, -1
+    mov eax, SYS_KTIME
+    int 0x80
+
+    mov rdx, rax
+    mov rdi, r14
+    mov rsi, r13
+    mov eax, SYS_EXIT
+    syscall
+    ud2
+user_bench_end:
@@ -0,0 +1,144 @@
+#include "syscall.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "irq.h"
+#include "percpu.h"
+#include "pmm.h"
+#include "timer.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define MSR_EFER   0xC0000080
+#define MSR_STAR   0xC0000081
+#define MSR_LSTAR  0xC0000082
+#define MSR_SFMASK 0xC0000084
+#define EFER_SCE   (1ULL << 0)
+
+// RFLAGS bits cleared on SYSCALL entry: TF, IF, DF, AC.
+#define SFMASK_BITS ((1ULL << 8) | (1ULL << 9) | (1ULL << 10) | (1ULL << 18))
+
+// Where the benchmark lives in its scratch address space.
+#define USER_CODE_VIRT  VMM_USER_BASE
+#define USER_STACK_VIRT (VMM_USER_BASE + 0x100000)
+
+typedef uint64_t (*syscall_fn)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+// Defined in syscall.asm.
+extern void syscall_entry(void);
+extern uint64_t user_enter(uint64_t rip, uint64_t rsp, uint64_t arg);
+extern void user_return(uint64_t value) __attribute__((noreturn));
+extern const uint8_t user_bench_start[], user_bench_end[];
+
+// Ring 3 -> ring 0 stack for SYSCALL, int 0x80 and IRQs taken in user mode
+// on the boot CPU; smp.c allocates the APs' ones.
+static uint8_t kernel_entry_stack[SYSCALL_ENTRY_STACK_SIZE] __attribute__((aligned(16)));
+
+static uint64_t exit_values[3];
+
+static uint64_t sys_nop(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f) {
+    (void)a; (void)b; (void)c; (void)d; (void)e; (void)f;
+    return 0;
+}
+
+static uint64_t sys_exit(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f) {
+    (void)d; (void)e; (void)f;
+    exit_values[0] = a;
+    exit_values[1] = b;
+    exit_values[2] = c;
+    user_return(a);
+}
+
+static uint64_t sys_ktime(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f) {
+    (void)a; (void)b; (void)c; (void)d; (void)e; (void)f;
+    return ktime_ns();
+}
+
+// Indexed by syscall_entry in syscall.asm and by the int 0x80 handler.
+const syscall_fn syscall_table[SYSCALL_COUNT] = {
+    [SYS_NOP]   = sys_nop,
+    [SYS_EXIT]  = sys_exit,
+    [SYS_KTIME] = sys_ktime,
+};
+
+static void int80_handler(struct isr_context *frame, void *ctx) {
+    (void)ctx;
+    if (frame->rax >= SYSCALL_COUNT) {
+        frame->rax = (uint64_t)-1;
+        return;
+    }
+    frame->rax = syscall_table[frame->rax](frame->rdi, frame->rsi, frame->rdx,
+                                           frame->r10, frame->r8, frame->r9);
+}
+
+// SYSCALL MSRs and the TSS stack of the calling CPU.
+static void syscall_init_cpu(void) {
+    struct percpu *cpu = this_cpu();
+    gdt_set_kernel_stack(cpu->id, cpu->entry_rsp);
+
+    // SYSCALL loads CS = STAR[47:32], SS = +8; SYSRET loads
+    // CS = STAR[63:48] + 16, SS = STAR[63:48] + 8 (see gdt_init).
+    wrmsr(MSR_STAR, ((uint64_t)GDT_KERNEL_DATA_SEL << 48) | ((uint64_t)GDT_KERNEL_CODE_SEL << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)(uintptr_t)syscall_entry);
+    wrmsr(MSR_SFMASK, SFMASK_BITS);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
+
+void syscall_init(void) {
+    this_cpu()->entry_rsp = (uint64_t)(uintptr_t)(kernel_entry_stack + sizeof(kernel_entry_stack));
+    syscall_init_cpu();
+    irq_register(SYSCALL_INT_VECTOR, int80_handler, NULL);
+    idt_allow_user(SYSCALL_INT_VECTOR);
+}
+
+void syscall_init_ap(void) {
+    syscall_init_cpu();
+}
+
+static int map_user_page(struct vmm_space *as, uint64_t virt, uint64_t flags, void **out) {
+    void *page = pmm_alloc_zeroed();
+    if (!page) return -1;
+    uint64_t phys = (uint64_t)(uintptr_t)page;
+    // Managed, so vmm_space_destroy frees it.
+    pmm_page_ref(phys);
+    if (vmm_map_range(as->pml4, virt, phys, 0x1000, VMM_PRESENT | VMM_USER | flags) < 0) {
+        pmm_page_unref(phys);
+        return -1;
+    }
+    *out = vmm_phys_to_virt(phys);
+    return 0;
+}
+
+int syscall_bench(uint32_t iterations, struct syscall_bench *out) {
+    out->iterations = iterations;
+    out->syscall_cycles = out->int80_cycles = 0;
+    out->int80_ok = 0;
+    if (!iterations) return -1;
+
+    struct vmm_space as;
+    if (vmm_space_create(&as) < 0) return -1;
+
+    void *code, *stack;
+    int ret = -1;
+    uint64_t len = (uint64_t)(user_bench_end - user_bench_start);
+    if (map_user_page(&as, USER_CODE_VIRT, 0, &code) < 0) goto out;
+    if (map_user_page(&as, USER_STACK_VIRT, VMM_WRITABLE, &stack) < 0) goto out;
+    const void *src = user_bench_start;
+    __asm__ __volatile__("rep movsb" : "+D"(code), "+S"(src), "+c"(len) : : "memory");
+
+    struct vmm_space *prev = vmm_current_space();
+    exit_values[2] = 0;
+    uint64_t t0 = ktime_ns();
+    vmm_space_switch(&as);
+    user_enter(USER_CODE_VIRT, USER_STACK_VIRT + 0x1000, iterations);
+    vmm_space_switch(prev);
+    uint64_t t1 = ktime_ns();
+
+    out->syscall_cycles = exit_values[0] / iterations;
+    out->int80_cycles = exit_values[1] / iterations;
+    out->int80_ok = exit_values[2] >= t0 && exit_values[2] <= t1;
+    ret = 0;
+out:
+    vmm_space_destroy(&as);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+
+// System call numbers; arguments and result use the Linux x86_64
+// convention (RAX = number/result, RDI, RSI, RDX, R10, R8, R9).
+#define SYS_NOP    0
+#define SYS_EXIT   1  // (a, b, c): leave user mode, user_enter returns a
+#define SYS_KTIME  2  // -> ktime_ns()
+#define SYSCALL_COUNT 3
+
+#define SYSCALL_INT_VECTOR 0x80
+#define SYSCALL_ENTRY_STACK_SIZE 16384
+
+// Enable SYSCALL/SYSRET, set up the ring-0 entry stack and the int 0x80 gate.
+// Needs smp_init_bsp() for the per-CPU data.
+void syscall_init(void);
+// The same on an AP, whose percpu entry_rsp the starting CPU has set.
+void syscall_init_ap(void);
+
+struct syscall_bench {
+    uint32_t iterations;
+    uint64_t syscall_cycles;  // avg per SYSCALL/SYSRET round trip
+    uint64_t int80_cycles;    // avg per int 0x80/iretq round trip
+    int int80_ok;             // int 0x80 SYS_KTIME returned ktime_ns() in RAX
+};
+// Run a ring-3 loop timing both entry paths in a scratch address space,
+// then check one int 0x80 SYS_KTIME call with all argument registers set.
+int syscall_bench(uint32_t iterations, struct syscall_bench *out);
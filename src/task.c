@@ -0,0 +1,157 @@
+#include "task.h"
+#include "cpu.h"
+#include "idle.h"
+#include "percpu.h"
+#include "smp.h"
+#include <stddef.h>
+
+#define DEQUE_MASK (TASK_DEQUE_SIZE - 1)
+
+// Tasks pushed and not yet taken, over all deques. A worker announces that
+// it is about to sleep (idle_prepare), then re-checks this count; a
+// spawner bumps the count, then kicks whoever is idle. With a full fence
+// on both sides one of them always sees the other.
+static volatile int64_t queued;
+static volatile uint32_t cpu_limit;
+
+// Owner side. Interrupts stay off so another thread on this CPU cannot
+// interleave its own push or pop.
+static int deque_push(struct task_deque *q, struct task *t) {
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    if (b - top >= TASK_DEQUE_SIZE) return -1;
+    __atomic_store_n(&q->slots[b & DEQUE_MASK], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static struct task *deque_pop(struct task_deque *q) {
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+    if (top > b) {
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct task *t = __atomic_load_n(&q->slots[b & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (top == b) {
+        // Last one: race the thieves for it.
+        if (!__atomic_compare_exchange_n(&q->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            t = NULL;
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+// Any CPU. Returns NULL if the deque looked empty or we lost a race.
+static struct task *deque_steal(struct task_deque *q, int *lost) {
+    int64_t top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b) return NULL;
+    struct task *t = __atomic_load_n(&q->slots[top & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&q->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *lost = 1;
+        return NULL;
+    }
+    return t;
+}
+
+static int may_run_tasks(struct percpu *cpu) {
+    uint32_t limit = __atomic_load_n(&cpu_limit, __ATOMIC_RELAXED);
+    return !limit || cpu->id < limit;
+}
+
+// Own deque first (most recently spawned, likely still in cache), then the
+// other CPUs starting after ourselves so thieves spread out.
+static struct task *take_task(struct percpu *cpu) {
+    uint64_t flags = irq_save();
+    struct task *t = deque_pop(&cpu->tasks);
+    irq_restore(flags);
+    if (!t) {
+        uint32_t n = smp_cpu_count();
+        for (uint32_t i = 1; i < n && !t; i++) {
+            struct percpu *victim = smp_cpu((cpu->id + i) % n);
+            if (!victim) continue;
+            int lost = 0;
+            t = deque_steal(&victim->tasks, &lost);
+            if (lost) cpu->task_stats.steal_fails++;
+        }
+        if (t) cpu->task_stats.stolen++;
+    }
+    if (t) __atomic_fetch_sub(&queued, 1, __ATOMIC_SEQ_CST);
+    return t;
+}
+
+static void run_task(struct percpu *cpu, struct task *t) {
+    struct task_group *g = t->group;
+    t->fn(t->arg);
+    cpu->task_stats.executed++;
+    if (g) __atomic_fetch_sub(&g->pending, 1, __ATOMIC_RELEASE);
+}
+
+void task_spawn(struct task *t) {
+    struct percpu *cpu = this_cpu();
+    if (t->group) __atomic_fetch_add(&t->group->pending, 1, __ATOMIC_RELAXED);
+
+    uint64_t flags = irq_save();
+    int full = deque_push(&cpu->tasks, t);
+    irq_restore(flags);
+    if (full) {
+        run_task(cpu, t);
+        return;
+    }
+
+    __atomic_fetch_add(&queued, 1, __ATOMIC_SEQ_CST);
+    uint32_t n = smp_cpu_count();
+    for (uint32_t i = 0; i < n; i++) {
+        struct percpu *c = smp_cpu(i);
+        if (!c || c == cpu || !may_run_tasks(c)) continue;
+        idle_kick(c);
+    }
+}
+
+void task_wait(struct task_group *g) {
+    struct percpu *cpu = this_cpu();
+    while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE)) {
+        struct task *t = take_task(cpu);
+        if (t) run_task(cpu, t);
+        else __asm__ __volatile__("pause");
+    }
+}
+
+void task_worker(void) {
+    struct percpu *cpu = this_cpu();
+    for (;;) {
+        if (may_run_tasks(cpu)) {
+            struct task *t = take_task(cpu);
+            if (t) {
+                run_task(cpu, t);
+                continue;
+            }
+        }
+        __asm__ __volatile__("cli");
+        idle_prepare(cpu);
+        if (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) > 0 && may_run_tasks(cpu)) {
+            idle_cancel(cpu);
+            __asm__ __volatile__("sti");
+            continue;
+        }
+        idle_wait(cpu);
+    }
+}
+
+uint32_t task_set_cpu_limit(uint32_t n) {
+    return __atomic_exchange_n(&cpu_limit, n, __ATOMIC_SEQ_CST);
+}
+
+int task_get_cpu_stats(uint32_t id, struct task_cpu_stats *out) {
+    struct percpu *cpu = smp_cpu(id);
+    if (!cpu) return -1;
+    *out = cpu->task_stats;
+    return 0;
+}
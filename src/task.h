@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+
+// Kernel tasks: short run-to-completion calls spread over every CPU. Each
+// CPU owns a Chase-Lev deque; the owner pushes and pops at the bottom
+// without locking, other CPUs steal from the top with a single CAS.
+//
+// Tasks run with interrupts enabled and must not block: on application
+// processors there is no thread to switch to. Spawning and waiting are for
+// thread context, not interrupt handlers.
+
+#define TASK_DEQUE_SIZE 1024  // power of two
+
+struct task_group;
+typedef void (*task_fn)(void *arg);
+
+// Caller-owned; must stay valid until its group has drained.
+struct task {
+    task_fn fn;
+    void *arg;
+    struct task_group *group;
+};
+
+// Completion counter for a batch of tasks.
+struct task_group {
+    volatile uint32_t pending;
+};
+#define TASK_GROUP_INIT { 0 }
+
+struct task_deque {
+    volatile int64_t top;          // thieves
+    uint8_t pad[56];
+    volatile int64_t bottom;       // owner
+    struct task *slots[TASK_DEQUE_SIZE];
+};
+
+struct task_cpu_stats {
+    uint64_t executed;
+    uint64_t stolen;       // of those, taken from another CPU
+    uint64_t steal_fails;  // lost a race for the last task
+};
+
+// Queue `t` on this CPU. Runs it inline if the deque is full.
+void task_spawn(struct task *t);
+// Run queued tasks (own first, then stolen) until `g` has drained.
+void task_wait(struct task_group *g);
+
+// Application processor main loop: run tasks, halt when there are none.
+void task_worker(void) __attribute__((noreturn));
+
+// Only CPUs with id < `n` take tasks (0: all). Returns the previous limit.
+uint32_t task_set_cpu_limit(uint32_t n);
+
+// Fill `out` for CPU `id`; returns -1 if there is no such CPU.
+int task_get_cpu_stats(uint32_t id, struct task_cpu_stats *out);
@@ -0,0 +1,385 @@
+#include "timer.h"
+#include "apic.h"
+#include "cpu.h"
+#include "irq.h"
+#include <stddef.h>
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+uint64_t ktime_tsc_base;
+uint64_t ktime_ns_mult;
+
+#define NS_PER_SEC 1000000000ULL
+
+#define PIT_HZ       1193182ULL
+#define PIT_CH0      0x40
+#define PIT_CH2      0x42
+#define PIT_CMD      0x43
+#define PIT_GATE     0x61   // bit 0: ch2 gate, bit 1: speaker, bit 5: ch2 out
+#define PIT_CAL_TICKS 11932 // ~10 ms
+#define PIT_MAX_TICKS 0xFFFF
+
+#define IA32_TSC_DEADLINE   0x6E0
+#define LVT_TSC_DEADLINE    (2u << 17)
+#define TIMER_VECTOR        0xF0
+
+enum event_source { EVENT_NONE, EVENT_TSC_DEADLINE, EVENT_LAPIC, EVENT_PIT };
+static const char *const source_names[] = { "none", "TSC-deadline", "LAPIC one-shot", "PIT one-shot" };
+
+static enum event_source source;
+static uint64_t tsc_hz;
+static uint64_t tsc_per_ns_mult;  // TSC cycles per ns, 32.32 fixed point
+static uint64_t lapic_per_ns_mult; // LAPIC timer ticks (divide-by-16) per ns, 32.32
+static int invariant_tsc;
+static uint64_t armed = UINT64_MAX;  // expiry the hardware is set for
+
+static struct timer_stats stats;
+
+// Timer wheel: WHEEL_LEVELS levels of 64 slots. A level-0 slot spans
+// 2^WHEEL_SHIFT ns; each level up is 64 times coarser. Timers are
+// re-filed one level down when the wheel clock crosses their slot, and
+// keep their exact expiry, so the hardware is armed for the precise time.
+#define WHEEL_LEVELS 5
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1u << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_SHIFT  17  // ~131 us
+
+static struct timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t occupied[WHEEL_LEVELS];
+static uint64_t wheel_clk;  // level-0 tick; earlier ticks are done
+
+static inline uint64_t ns_to_tsc(uint64_t ns) {
+    return ktime_tsc_base + (uint64_t)(((unsigned __int128)ns * tsc_per_ns_mult) >> 32);
+}
+
+static void wheel_insert(struct timer *t) {
+    uint64_t tick = t->expires >> WHEEL_SHIFT;
+    if (tick < wheel_clk) tick = wheel_clk;
+
+    unsigned level = 0;
+    uint64_t slot_tick = tick;
+    while (level < WHEEL_LEVELS - 1 &&
+           (tick >> (level * WHEEL_BITS)) - (wheel_clk >> (level * WHEEL_BITS)) >= WHEEL_SIZE)
+        level++;
+    slot_tick = tick >> (level * WHEEL_BITS);
+    // Beyond the top level's reach: park in its last slot and re-file later.
+    uint64_t top = (wheel_clk >> (level * WHEEL_BITS)) + WHEEL_MASK;
+    if (slot_tick > top) slot_tick = top;
+
+    unsigned slot = slot_tick & WHEEL_MASK;
+    struct timer **head = &wheel[level][slot];
+    t->next = *head;
+    if (*head) (*head)->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    occupied[level] |= 1ULL << slot;
+}
+
+static void wheel_remove(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    // Removing the last timer of a slot: pprev is the slot head itself.
+    struct timer **first = &wheel[0][0];
+    if (!t->next && t->pprev >= first && t->pprev < first + WHEEL_LEVELS * WHEEL_SIZE &&
+        !*t->pprev) {
+        uint64_t idx = (uint64_t)(t->pprev - first);
+        occupied[idx / WHEEL_SIZE] &= ~(1ULL << (idx % WHEEL_SIZE));
+    }
+    t->pprev = NULL;
+}
+
+static struct timer *slot_take(unsigned level, unsigned slot) {
+    struct timer *list = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+    for (struct timer *t = list; t; t = t->next) t->pprev = NULL;
+    return list;
+}
+
+// Called when wheel_clk enters a new 64-tick window: bring down the slots
+// of every level whose window starts here.
+static void wheel_cascade(void) {
+    for (unsigned level = 1; level < WHEEL_LEVELS; level++) {
+        if (wheel_clk & ((1ULL << (level * WHEEL_BITS)) - 1)) break;
+        unsigned slot = (wheel_clk >> (level * WHEEL_BITS)) & WHEEL_MASK;
+        struct timer *t = slot_take(level, slot);
+        while (t) {
+            struct timer *next = t->next;
+            wheel_insert(t);
+            t = next;
+        }
+    }
+}
+
+// Run expired timers in the current level-0 slot; later ones stay put.
+static void wheel_run_slot(uint64_t now) {
+    struct timer *t = slot_take(0, wheel_clk & WHEEL_MASK);
+    while (t) {
+        struct timer *next = t->next;
+        if (t->expires <= now) {
+            uint64_t late = now - t->expires;
+            stats.fired++;
+            stats.late_ns_total += late;
+            if (late > stats.late_ns_max) stats.late_ns_max = late;
+            t->fn(t, t->ctx);
+        } else {
+            wheel_insert(t);
+        }
+        t = next;
+    }
+}
+
+// First level-0 tick at which a higher-level slot has to be cascaded.
+static uint64_t wheel_next_cascade(void) {
+    uint64_t best = UINT64_MAX;
+    for (unsigned level = 1; level < WHEEL_LEVELS; level++) {
+        if (!occupied[level]) continue;
+        unsigned shift = level * WHEEL_BITS;
+        unsigned cur = (wheel_clk >> shift) & WHEEL_MASK;
+        uint64_t rot = (occupied[level] >> cur) | (cur ? occupied[level] << (WHEEL_SIZE - cur) : 0);
+        uint64_t blocks = (uint64_t)__builtin_ctzll(rot);
+        if (blocks == 0) blocks = WHEEL_SIZE;  // current slot: a full lap away
+        uint64_t tick = ((wheel_clk >> shift) + blocks) << shift;
+        if (tick < best) best = tick;
+    }
+    return best;
+}
+
+// Earliest moment the wheel needs attention: the exact expiry of the
+// nearest level-0 timer, or the start of the tick at which a higher slot
+// cascades.
+static uint64_t wheel_next_event(void) {
+    uint64_t best = UINT64_MAX;
+    if (occupied[0]) {
+        unsigned cur = wheel_clk & WHEEL_MASK;
+        uint64_t rot = (occupied[0] >> cur) | (cur ? occupied[0] << (WHEEL_SIZE - cur) : 0);
+        unsigned slot = (cur + (unsigned)__builtin_ctzll(rot)) & WHEEL_MASK;
+        for (struct timer *t = wheel[0][slot]; t; t = t->next) {
+            if (t->expires < best) best = t->expires;
+        }
+    }
+    uint64_t cascade = wheel_next_cascade();
+    if (cascade != UINT64_MAX && (cascade << WHEEL_SHIFT) < best) best = cascade << WHEEL_SHIFT;
+    return best;
+}
+
+static void wheel_advance(uint64_t now) {
+    uint64_t target = now >> WHEEL_SHIFT;
+    for (;;) {
+        if (occupied[0] & (1ULL << (wheel_clk & WHEEL_MASK))) wheel_run_slot(now);
+        if (wheel_clk >= target) break;
+
+        // Skip empty level-0 slots, stopping at the end of the window.
+        // With level 0 empty, jump straight to the next cascade.
+        uint64_t next;
+        if (occupied[0]) {
+            next = (wheel_clk | WHEEL_MASK) + 1;
+            unsigned from = (unsigned)((wheel_clk + 1) & WHEEL_MASK);
+            uint64_t ahead = from ? occupied[0] >> from : 0;
+            if (ahead) next = wheel_clk + 1 + (uint64_t)__builtin_ctzll(ahead);
+        } else {
+            next = wheel_next_cascade();
+        }
+        if (next > target) next = target;
+        wheel_clk = next;
+        if ((wheel_clk & WHEEL_MASK) == 0) wheel_cascade();
+    }
+}
+
+static void hw_arm(uint64_t expires) {
+    armed = expires;
+    stats.reprograms++;
+    if (expires == UINT64_MAX) {
+        if (source == EVENT_TSC_DEADLINE) wrmsr(IA32_TSC_DEADLINE, 0);
+        else if (source == EVENT_LAPIC) apic_write(APIC_TIMER_INIT, 0);
+        return;
+    }
+
+    uint64_t now = ktime_ns();
+    uint64_t delta = expires > now ? expires - now : 0;
+    switch (source) {
+    case EVENT_TSC_DEADLINE:
+        wrmsr(IA32_TSC_DEADLINE, ns_to_tsc(expires));
+        break;
+    case EVENT_LAPIC: {
+        // Long waits are cut short; the handler simply re-arms.
+        uint64_t count = (uint64_t)(((unsigned __int128)delta * lapic_per_ns_mult) >> 32);
+        if (count == 0) count = 1;
+        if (count > 0xFFFFFFFFULL) count = 0xFFFFFFFFULL;
+        apic_write(APIC_TIMER_INIT, (uint32_t)count);
+        break;
+    }
+    case EVENT_PIT: {
+        if (delta > NS_PER_SEC) delta = NS_PER_SEC;
+        uint64_t count = delta * PIT_HZ / NS_PER_SEC;
+        if (count == 0) count = 1;
+        if (count > PIT_MAX_TICKS) count = PIT_MAX_TICKS;
+        outb(PIT_CMD, 0x30);  // ch0, lobyte/hibyte, mode 0 (one-shot)
+        outb(PIT_CH0, count & 0xFF);
+        outb(PIT_CH0, (uint8_t)(count >> 8));
+        break;
+    }
+    case EVENT_NONE:
+        break;
+    }
+}
+
+static void reprogram(void) {
+    uint64_t next = wheel_next_event();
+    if (next != armed) hw_arm(next);
+}
+
+static void timer_irq(struct isr_context *frame, void *ctx) {
+    (void)ctx;
+    irq_eoi(frame->vector);
+    stats.interrupts++;
+    armed = UINT64_MAX;
+    wheel_advance(ktime_ns());
+    reprogram();
+}
+
+void timer_setup(struct timer *t, timer_fn_t fn, void *ctx) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->ctx = ctx;
+}
+
+void timer_arm(struct timer *t, uint64_t expires) {
+    uint64_t flags = irq_save();
+    if (t->pprev) wheel_remove(t);
+    // An empty wheel may have been idle for ages: restart its clock at now.
+    int empty = 1;
+    for (unsigned level = 0; level < WHEEL_LEVELS; level++) {
+        if (occupied[level]) empty = 0;
+    }
+    if (empty) wheel_clk = ktime_ns() >> WHEEL_SHIFT;
+    t->expires = expires;
+    wheel_insert(t);
+    if (expires < armed) hw_arm(expires);
+    irq_restore(flags);
+}
+
+int timer_cancel(struct timer *t) {
+    uint64_t flags = irq_save();
+    int pending = t->pprev != NULL;
+    // The hardware may still fire for it; the handler then finds nothing.
+    if (pending) wheel_remove(t);
+    irq_restore(flags);
+    return pending;
+}
+
+static void sleep_done(struct timer *t, void *ctx) {
+    (void)t;
+    *(volatile int *)ctx = 1;
+}
+
+void ksleep_ns(uint64_t ns) {
+    volatile int done = 0;
+    struct timer t;
+    timer_setup(&t, sleep_done, (void *)&done);
+    timer_arm(&t, ktime_ns() + ns);
+    // sti;hlt is atomic: the wakeup cannot slip in between check and halt.
+    while (!done) {
+        __asm__ __volatile__("cli" ::: "memory");
+        if (!done) __asm__ __volatile__("sti; hlt" ::: "memory");
+        else __asm__ __volatile__("sti" ::: "memory");
+    }
+}
+
+// TSC cycles for `ticks` PIT periods, timed on channel 2 (gate-driven, no IRQ).
+static uint64_t pit_measure(uint16_t ticks) {
+    uint8_t gate = inb(PIT_GATE) & ~0x03;
+    outb(PIT_GATE, gate);               // gate low, speaker off
+    outb(PIT_CMD, 0xB0);                // ch2, lobyte/hibyte, mode 0
+    outb(PIT_CH2, ticks & 0xFF);
+    outb(PIT_CH2, (uint8_t)(ticks >> 8));
+    outb(PIT_GATE, gate | 0x01);        // start counting
+    uint64_t t0 = rdtsc();
+    while (!(inb(PIT_GATE) & 0x20)) {}
+    uint64_t t1 = rdtsc();
+    outb(PIT_GATE, gate);
+    return t1 - t0;
+}
+
+// Rate in Hz to units per ns in 32.32 fixed point, without a 128-bit divide.
+static uint64_t per_ns_mult(uint64_t hz) {
+    return ((hz / NS_PER_SEC) << 32) + ((hz % NS_PER_SEC) << 32) / NS_PER_SEC;
+}
+
+static void calibrate_tsc(void) {
+    // Extra delay only ever lengthens a run, so keep the shortest.
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 5; i++) {
+        uint64_t c = pit_measure(PIT_CAL_TICKS);
+        if (c < best) best = c;
+    }
+    tsc_hz = best * PIT_HZ / PIT_CAL_TICKS;
+    tsc_per_ns_mult = per_ns_mult(tsc_hz);
+    ktime_tsc_base = rdtsc();
+    ktime_ns_mult = (uint64_t)((NS_PER_SEC << 32) / tsc_hz);
+}
+
+static void calibrate_lapic(void) {
+    apic_write(APIC_TIMER_DIV, 0x3);  // divide by 16
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | TIMER_VECTOR);
+    apic_write(APIC_TIMER_INIT, 0xFFFFFFFF);
+    uint64_t start = ktime_ns();
+    while (ktime_ns() - start < 10000000ULL) {}
+    uint32_t elapsed = 0xFFFFFFFF - apic_read(APIC_TIMER_COUNT);
+    uint64_t ns = ktime_ns() - start;
+    apic_write(APIC_TIMER_INIT, 0);
+    lapic_per_ns_mult = per_ns_mult((uint64_t)elapsed * NS_PER_SEC / ns);
+}
+
+void timer_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a >= 0x80000007) {
+        cpuid(0x80000007, 0, &a, &b, &c, &d);
+        invariant_tsc = (d >> 8) & 1;
+    }
+
+    calibrate_tsc();
+    wheel_clk = ktime_ns() >> WHEEL_SHIFT;
+
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (apic_enabled()) {
+        irq_register(TIMER_VECTOR, timer_irq, NULL);
+        if ((c >> 24) & 1) {
+            source = EVENT_TSC_DEADLINE;
+            apic_write(APIC_LVT_TIMER, LVT_TSC_DEADLINE | TIMER_VECTOR);
+            // Order the LVT write before the first IA32_TSC_DEADLINE write.
+            __asm__ __volatile__("mfence" ::: "memory");
+        } else {
+            calibrate_lapic();
+            source = EVENT_LAPIC;
+            apic_write(APIC_LVT_TIMER, TIMER_VECTOR);  // one-shot
+        }
+    } else {
+        irq_register(IRQ_BASE_VECTOR + 0, timer_irq, NULL);
+        source = EVENT_PIT;
+        // Replace the BIOS's periodic mode with a single, far-off shot.
+        outb(PIT_CMD, 0x30);
+        outb(PIT_CH0, 0xFF);
+        outb(PIT_CH0, 0xFF);
+        irq_enable_legacy(0);
+    }
+}
+
+void timer_get_stats(struct timer_stats *out) {
+    *out = stats;
+    out->tsc_hz = tsc_hz;
+    out->invariant_tsc = invariant_tsc;
+    out->event_source = source_names[source];
+}
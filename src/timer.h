@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+
+// Timekeeping and one-shot timers. The TSC is the clock source; timers sit
+// in a hierarchical wheel and the hardware is programmed for the nearest
+// expiry only (TSC-deadline, else LAPIC one-shot, else PIT one-shot), so
+// there is no periodic tick.
+
+extern uint64_t ktime_tsc_base;
+extern uint64_t ktime_ns_mult;  // ns per TSC cycle, 32.32 fixed point
+
+// Monotonic nanoseconds since timer_init(); 0 before it.
+static inline uint64_t ktime_ns(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    uint64_t delta = (((uint64_t)hi << 32) | lo) - ktime_tsc_base;
+    return (uint64_t)(((unsigned __int128)delta * ktime_ns_mult) >> 32);
+}
+
+struct timer;
+// Runs in interrupt context. May re-arm its own timer.
+typedef void (*timer_fn_t)(struct timer *t, void *ctx);
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;  // NULL while not pending
+    uint64_t expires;      // ktime_ns()
+    timer_fn_t fn;
+    void *ctx;
+};
+
+// Calibrate the TSC and pick the event source. Run after apic_init().
+void timer_init(void);
+
+void timer_setup(struct timer *t, timer_fn_t fn, void *ctx);
+// (Re)arm `t` to fire at `expires` (absolute ktime_ns).
+void timer_arm(struct timer *t, uint64_t expires);
+// Returns 1 if the timer was pending.
+int timer_cancel(struct timer *t);
+
+// Sleep with interrupts enabled until `ns` have passed.
+void ksleep_ns(uint64_t ns);
+
+struct timer_stats {
+    uint64_t tsc_hz;
+    int invariant_tsc;
+    const char *event_source;
+    uint64_t interrupts;
+    uint64_t fired;
+    uint64_t reprograms;
+    uint64_t late_ns_total;  // callback time minus expiry, summed
+    uint64_t late_ns_max;
+};
+void timer_get_stats(struct timer_stats *out);
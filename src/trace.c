@@ -0,0 +1,155 @@
+#include "trace.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "percpu.h"
+#include "serial.h"
+#include "smp.h"
+#include "timer.h"
+#include <stddef.h>
+
+#define RING_MASK (TRACE_RING_RECORDS - 1)
+
+volatile uint32_t trace_mask;
+
+static const char *const event_names[TRACE_EVENT_COUNT] = {
+    "pmm_alloc", "pmm_free", "vmm_map", "irq", "kbd_irq",
+};
+
+// Only the owning CPU writes its ring, so the one thing to guard against
+// is an interrupt recording in the middle of a record. A non-locked XADD
+// claims the slot in one instruction, which is atomic with respect to
+// interrupts on this CPU and needs no bus lock.
+void trace_record(uint32_t event, uint32_t arg0, uint64_t arg1, uint64_t arg2) {
+    struct percpu *cpu = this_cpu();
+    struct trace_rec *ring = cpu->trace_ring;
+    if (!ring) return;
+    uint64_t idx = 1;
+    __asm__ __volatile__("xaddq %0, %1" : "+r"(idx), "+m"(cpu->trace_head));
+    struct trace_rec *r = &ring[idx & RING_MASK];
+    r->tsc = rdtsc();
+    r->event = event;
+    r->arg0 = arg0;
+    r->arg1 = arg1;
+    r->arg2 = arg2;
+}
+
+void trace_init(void) {
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        struct percpu *cpu = smp_cpu(i);
+        if (!cpu || cpu->trace_ring) continue;
+        cpu->trace_ring = kzalloc(TRACE_RING_RECORDS * sizeof(struct trace_rec));
+    }
+}
+
+uint32_t trace_set_mask(uint32_t mask) {
+    return __atomic_exchange_n(&trace_mask, mask & TRACE_ALL, __ATOMIC_SEQ_CST);
+}
+
+void trace_clear(void) {
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        struct percpu *cpu = smp_cpu(i);
+        if (cpu) cpu->trace_head = 0;
+    }
+}
+
+const char *trace_event_name(uint32_t event) {
+    return event < TRACE_EVENT_COUNT ? event_names[event] : "?";
+}
+
+static uint64_t retained(struct percpu *cpu) {
+    return cpu->trace_head < TRACE_RING_RECORDS ? cpu->trace_head : TRACE_RING_RECORDS;
+}
+
+// Merge the per-CPU rings by timestamp. Each ring is already in order, so
+// this repeatedly takes the oldest head among the CPUs.
+void trace_visit(uint32_t max, trace_visit_fn fn, void *ctx) {
+    uint64_t pos[ACPI_MAX_CPUS];
+    uint32_t n = smp_cpu_count();
+    if (n > ACPI_MAX_CPUS) n = ACPI_MAX_CPUS;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        struct percpu *cpu = smp_cpu(i);
+        pos[i] = cpu && cpu->trace_ring ? cpu->trace_head - retained(cpu) : 0;
+        if (cpu && cpu->trace_ring) total += retained(cpu);
+    }
+    // Skip the oldest records beyond `max`.
+    uint64_t skip = total > max ? total - max : 0;
+    for (uint64_t emitted = 0;; emitted++) {
+        uint32_t best = n;
+        uint64_t best_tsc = ~0ULL;
+        for (uint32_t i = 0; i < n; i++) {
+            struct percpu *cpu = smp_cpu(i);
+            if (!cpu || !cpu->trace_ring || pos[i] == cpu->trace_head) continue;
+            uint64_t tsc = cpu->trace_ring[pos[i] & RING_MASK].tsc;
+            if (tsc < best_tsc) {
+                best_tsc = tsc;
+                best = i;
+            }
+        }
+        if (best == n) break;
+        struct percpu *cpu = smp_cpu(best);
+        const struct trace_rec *r = &cpu->trace_ring[pos[best] & RING_MASK];
+        pos[best]++;
+        if (emitted >= skip) fn(best, r, ctx);
+    }
+}
+
+static void put_hex(uint64_t v) {
+    char buf[17];
+    const char *hex = "0123456789abcdef";
+    int i = 16;
+    buf[i] = 0;
+    do {
+        buf[--i] = hex[v & 0xF];
+        v >>= 4;
+    } while (v);
+    serial_write(&buf[i]);
+}
+
+static void dump_one(uint32_t cpu, const struct trace_rec *r, void *ctx) {
+    (void)ctx;
+    serial_write("R ");
+    put_hex(cpu);
+    serial_write(" ");
+    put_hex(r->tsc);
+    serial_write(" ");
+    put_hex(r->event);
+    serial_write(" ");
+    put_hex(r->arg0);
+    serial_write(" ");
+    put_hex(r->arg1);
+    serial_write(" ");
+    put_hex(r->arg2);
+    serial_write("\r\n");
+}
+
+// Line format (all numbers hex):
+//   TRACE-BEGIN <version> <tsc_hz> <cpus> <event names...>
+//   R <cpu> <tsc> <event> <arg0> <arg1> <arg2>
+//   TRACE-END
+void trace_dump(void) {
+    struct timer_stats ts;
+    timer_get_stats(&ts);
+    serial_write("TRACE-BEGIN 1 ");
+    put_hex(ts.tsc_hz);
+    serial_write(" ");
+    put_hex(smp_cpu_count());
+    for (uint32_t e = 0; e < TRACE_EVENT_COUNT; e++) {
+        serial_write(" ");
+        serial_write(event_names[e]);
+    }
+    serial_write("\r\n");
+    trace_visit(~0u, dump_one, NULL);
+    serial_write("TRACE-END\r\n");
+}
+
+void trace_get_stats(struct trace_stats *out) {
+    out->recorded = out->overwritten = 0;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        struct percpu *cpu = smp_cpu(i);
+        if (!cpu || !cpu->trace_ring) continue;
+        out->recorded += cpu->trace_head;
+        out->overwritten += cpu->trace_head - retained(cpu);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+
+// Tracepoints: fixed-size binary records (TSC, event id, three raw
+// arguments) appended to a per-CPU ring. Nothing is formatted at record
+// time; the shell's `trace` command and trace_dump() (serial, for
+// tools/trace_decode.py) do that later. A disabled tracepoint costs one
+// load and a branch.
+
+enum trace_event {
+    TRACE_PMM_ALLOC = 0,  // order, phys, caller
+    TRACE_PMM_FREE,       // order, phys, caller
+    TRACE_VMM_MAP,        // flags, virt, phys
+    TRACE_IRQ,            // vector, handler cycles, interrupted RIP
+    TRACE_KBD_IRQ,        // scancodes taken, ring fill, 0
+    TRACE_EVENT_COUNT
+};
+
+#define TRACE_ALL ((1u << TRACE_EVENT_COUNT) - 1)
+#define TRACE_RING_RECORDS 4096  // per CPU; power of two
+
+struct trace_rec {
+    uint64_t tsc;
+    uint32_t event;
+    uint32_t arg0;
+    uint64_t arg1;
+    uint64_t arg2;
+};
+
+// Bit n enables event n.
+extern volatile uint32_t trace_mask;
+
+void trace_record(uint32_t event, uint32_t arg0, uint64_t arg1, uint64_t arg2);
+
+static inline void trace(uint32_t event, uint32_t arg0, uint64_t arg1, uint64_t arg2) {
+    if (__builtin_expect(trace_mask & (1u << event), 0)) trace_record(event, arg0, arg1, arg2);
+}
+
+// Allocate rings for every online CPU. Needs kmalloc and smp_init().
+void trace_init(void);
+// Returns the previous mask. Stopping leaves the rings intact to read.
+uint32_t trace_set_mask(uint32_t mask);
+void trace_clear(void);
+
+const char *trace_event_name(uint32_t event);
+
+// Visit up to the `max` most recent records, across CPUs in TSC order
+// (oldest first). Call with tracing stopped.
+typedef void (*trace_visit_fn)(uint32_t cpu, const struct trace_rec *r, void *ctx);
+void trace_visit(uint32_t max, trace_visit_fn fn, void *ctx);
+
+// Every retained record to serial as text lines for the host decoder.
+void trace_dump(void);
+
+struct trace_stats {
+    uint64_t recorded;     // over all CPUs since the last clear
+    uint64_t overwritten;  // older records lost to ring wrap
+};
+void trace_get_stats(struct trace_stats *out);
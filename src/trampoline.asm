@@ -0,0 +1,96 @@
+; trampoline.asm - application processor start-up code
+;
+; smp.c copies ap_trampoline_start..ap_trampoline_end to SMP_TRAMPOLINE_PHYS
+; (0x8000) and fills in ap_trampoline_params; the SIPI starts the AP there
+; in real mode with CS = 0x0800, IP = 0. We switch to protected mode, enable
+; PAE paging on the kernel page tables, enter long mode and call
+; entry(percpu) on the AP's own stack.
+;
+; The code runs at a different address than it is linked at, so every
+; absolute reference goes through REL().
+
+%define TRAMPOLINE_PHYS 0x8000
+%define REL(x) (TRAMPOLINE_PHYS + (x) - ap_trampoline_start)
+
+global ap_trampoline_start, ap_trampoline_end, ap_trampoline_params
+
+section .text
+
+BITS 16
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [REL(tramp_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1                   ; PE
+    mov cr0, eax
+    jmp dword 0x18:REL(.pm32)
+
+BITS 32
+.pm32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    ; PAE plus the SSE bits entry.asm sets on the boot CPU.
+    mov eax, cr4
+    or eax, (1 << 5) | (1 << 9) | (1 << 10)
+    mov cr4, eax
+
+    mov eax, [REL(ap_trampoline_params.cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080         ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8              ; LME
+    wrmsr
+
+    ; Paging on, WP as on the BSP (copy-on-write); MP set and EM clear
+    ; for SSE.
+    mov eax, cr0
+    and eax, ~(1 << 2)
+    or eax, (1 << 31) | (1 << 16) | (1 << 1)
+    mov cr0, eax
+
+    jmp 0x08:REL(.lm64)
+
+BITS 64
+.lm64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor eax, eax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [REL(ap_trampoline_params.stack)]
+    mov rdi, [REL(ap_trampoline_params.percpu)]
+    call [REL(ap_trampoline_params.entry)]
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0x0000000000000000       ; null
+    dq 0x00AF9A000000FFFF       ; 0x08: 64-bit code
+    dq 0x00CF92000000FFFF       ; 0x10: data
+    dq 0x00CF9A000000FFFF       ; 0x18: 32-bit code
+tramp_gdt_end:
+
+tramp_gdt_ptr:
+    dw tramp_gdt_end - tramp_gdt - 1
+    dd REL(tramp_gdt)
+
+align 8
+ap_trampoline_params:
+.cr3:    dq 0
+.stack:  dq 0
+.percpu: dq 0
+.entry:  dq 0
+ap_trampoline_end:
@@ -1,22 +1,95 @@
 #include "vmm.h"
 #include "pmm.h"
+#include "cpu.h"
+#include "multiboot2.h"
+#include "trace.h"
 #include <stddef.h>
 
 volatile uint16_t *vmm_framebuffer = NULL;
+uint64_t vmm_direct_map_offset = 0;
 
 static uint64_t *kernel_pml4 = NULL;
+static int gb_pages_supported;
+static int pat_supported;
+static struct vmm_map_stats map_stats;
+
+// Address spaces. PCID 0 belongs to the kernel space; others are handed
+// out from a bitmap. A freed PCID may still tag TLB entries, so unless
+// INVPCID can drop them right away it is marked stale and the first switch
+// after reuse does a flushing CR3 load.
+#define CR4_PCIDE   (1ULL << 17)
+#define CR0_WP      (1ULL << 16)
+#define CR3_NOFLUSH (1ULL << 63)
+#define PCID_COUNT  4096
+
+static struct vmm_space kernel_space;
+static struct vmm_space *current_space = &kernel_space;
+static struct vmm_space *pcid0_owner = &kernel_space;
+static int pcid_enabled;
+static int invpcid_supported;
+static uint64_t pcid_used[PCID_COUNT / 64];
+static uint64_t pcid_stale[PCID_COUNT / 64];
+
+// Page-fault handling. Reads of reserved-but-unbacked pages map one shared
+// zero page copy-on-write; writes get a private zeroed frame.
+#define PF_PRESENT (1ULL << 0)
+#define PF_WRITE   (1ULL << 1)
+#define PF_USER    (1ULL << 2)
+
+static uint64_t zero_page_phys;
+static struct vmm_fault_stats fault_stats;
+
+// TLB gather for unmap/protect. Invalidations are queued and issued once
+// per call: individual invlpg up to GATHER_PAGES addresses, a full CR3
+// reload beyond that. Frames and page tables released along the way are
+// only handed back after the flush, so nothing is reused while a stale
+// translation may still point at it.
+#define GATHER_PAGES 32
+
+struct tlb_gather {
+    struct vmm_space *as;
+    uint32_t count;
+    uint32_t nfree;
+    int full;
+    int kernel_half;
+    uint64_t addrs[GATHER_PAGES];
+    uint64_t frees[GATHER_PAGES]; // phys | 1 for page tables
+};
+
+static struct vmm_tlb_stats tlb_stats;
+static void (*remote_flush)(void);
+
+#define PAGE_SIZE_4K 0x1000ULL
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
+// PS marks a 2 MiB/1 GiB leaf. It occupies the bit that selects PAT in a
+// 4 KiB PTE, so in large leaves PAT moves up to bit 12.
+#define PTE_PS        (1ULL << 7)
+#define PTE_PAT_4K    (1ULL << 7)
+#define PTE_PAT_LARGE (1ULL << 12)
+
+// IA32_PAT: entries 0-3 keep their reset types (WB, WT, UC-, UC) so that
+// PWT/PCD alone mean what they always did; entry 4, selected by the PAT
+// bit alone, becomes write-combining.
+#define MSR_IA32_PAT 0x277
+#define PAT_VALUE    0x0007040100070406ULL
 
 // Page table entry helpers
 static inline int pte_present(uint64_t pte) {
     return (pte & VMM_PRESENT) != 0;
 }
 
+static inline int pte_large(uint64_t pte) {
+    return (pte & PTE_PS) != 0;
+}
+
 static inline uint64_t pte_addr(uint64_t pte) {
     return pte & 0x000FFFFFFFFFF000ULL;
 }
 
 static inline uint64_t *pte_to_ptr(uint64_t pte) {
-    return (uint64_t *)(uintptr_t)pte_addr(pte);
+    return (uint64_t *)vmm_phys_to_virt(pte_addr(pte));
 }
 
 // Get page table indices from virtual address
@@ -40,85 +113,775 @@ static inline uint64_t page_offset(uint64_t virt) {
     return virt & 0xFFF;
 }
 
+// Translate 4 KiB-format leaf flags into a 2 MiB/1 GiB leaf and back.
+static inline uint64_t large_leaf_flags(uint64_t flags) {
+    uint64_t pat = (flags & PTE_PAT_4K) ? PTE_PAT_LARGE : 0;
+    return (flags & ~PTE_PAT_4K) | PTE_PS | pat;
+}
+
+static inline uint64_t small_leaf_flags(uint64_t large) {
+    uint64_t pat = (large & PTE_PAT_LARGE) ? PTE_PAT_4K : 0;
+    return (large & (0xFFFULL & ~PTE_PS)) | (large & (1ULL << 63)) | pat;
+}
+
+// Return the table referenced by `*entry`, creating it if needed. If the
+// entry is a large leaf covering `leaf_size` bytes it is split into a table
+// of equivalent smaller leaves first.
+static uint64_t *get_table(uint64_t *entry, uint64_t leaf_size, uint64_t flags) {
+    uint64_t user = flags & VMM_USER;
+    if (pte_present(*entry) && !pte_large(*entry)) {
+        *entry |= user;
+        return pte_to_ptr(*entry);
+    }
+
+    void *page = pmm_alloc_zeroed();
+    if (!page) return NULL;
+    uint64_t *table = (uint64_t *)vmm_phys_to_virt((uint64_t)(uintptr_t)page);
+
+    if (pte_present(*entry)) {
+        uint64_t child = leaf_size / 512;
+        uint64_t base  = *entry & 0x000FFFFFFFFFE000ULL & ~(leaf_size - 1);
+        uint64_t attrs = small_leaf_flags(*entry);
+        if (child != PAGE_SIZE_4K) attrs = large_leaf_flags(attrs);
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + (uint64_t)i * child) | attrs;
+        }
+        user |= *entry & VMM_USER;
+    }
+    *entry = (uint64_t)(uintptr_t)page | VMM_PRESENT | VMM_WRITABLE | user;
+    return table;
+}
+
+static inline void set_leaf(uint64_t *entry, uint64_t value, uint64_t virt) {
+    uint64_t old = *entry;
+    *entry = value;
+    // Not-present entries are never cached, so only replacements need a flush.
+    if (pte_present(old)) invlpg(virt);
+}
+
+int vmm_map_range(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags) {
+    uint64_t end = (virt + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    virt &= ~(PAGE_SIZE_4K - 1);
+    phys &= ~(PAGE_SIZE_4K - 1);
+
+    while (virt < end) {
+        uint64_t *pdpt = get_table(&pml4[pml4_index(virt)], 0, flags);
+        if (!pdpt) return -1;
+
+        // 1 GiB leaves while alignment and length allow.
+        uint64_t *pdpte = &pdpt[pdpt_index(virt)];
+        if (gb_pages_supported && ((virt | phys) & (PAGE_SIZE_1G - 1)) == 0 &&
+            end - virt >= PAGE_SIZE_1G &&
+            (!pte_present(*pdpte) || pte_large(*pdpte))) {
+            set_leaf(pdpte, phys | large_leaf_flags(flags), virt);
+            map_stats.leaves_1g++;
+            virt += PAGE_SIZE_1G;
+            phys += PAGE_SIZE_1G;
+            continue;
+        }
+
+        uint64_t *pd = get_table(pdpte, PAGE_SIZE_1G, flags);
+        if (!pd) return -1;
+
+        // 2 MiB leaves up to the next 1 GiB boundary, unless a page table
+        // already hangs off the slot.
+        uint64_t *pde = &pd[pd_index(virt)];
+        if (((virt | phys) & (PAGE_SIZE_2M - 1)) == 0 && end - virt >= PAGE_SIZE_2M &&
+            (!pte_present(*pde) || pte_large(*pde))) {
+            do {
+                set_leaf(pde, phys | large_leaf_flags(flags), virt);
+                map_stats.leaves_2m++;
+                virt += PAGE_SIZE_2M;
+                phys += PAGE_SIZE_2M;
+                pde++;
+            } while (end - virt >= PAGE_SIZE_2M && (virt & (PAGE_SIZE_1G - 1)) != 0 &&
+                     (!pte_present(*pde) || pte_large(*pde)));
+            continue;
+        }
+
+        uint64_t *pt = get_table(pde, PAGE_SIZE_2M, flags);
+        if (!pt) return -1;
+
+        // 4 KiB leaves up to the next 2 MiB boundary, without re-walking.
+        do {
+            set_leaf(&pt[pt_index(virt)], phys | flags, virt);
+            map_stats.leaves_4k++;
+            virt += PAGE_SIZE_4K;
+            phys += PAGE_SIZE_4K;
+        } while (virt < end && (virt & (PAGE_SIZE_2M - 1)) != 0);
+    }
+    return 0;
+}
+
 void vmm_map_page(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
-    uint64_t pml4_idx = pml4_index(virt);
-    uint64_t pdpt_idx = pdpt_index(virt);
-    uint64_t pd_idx = pd_index(virt);
-    uint64_t pt_idx = pt_index(virt);
-    
-    // Get or create PML4 entry
-    if (!pte_present(pml4[pml4_idx])) {
-        void *pdpt_page = pmm_alloc();
-        if (!pdpt_page) return; // Out of memory
-        pml4[pml4_idx] = (uint64_t)(uintptr_t)pdpt_page | VMM_PRESENT | VMM_WRITABLE;
-        // Zero the new page
-        uint64_t *pdpt = (uint64_t *)pdpt_page;
-        for (int i = 0; i < 512; i++) pdpt[i] = 0;
-    }
-    uint64_t *pdpt = pte_to_ptr(pml4[pml4_idx]);
-    
-    // Get or create PDPT entry
-    if (!pte_present(pdpt[pdpt_idx])) {
-        void *pd_page = pmm_alloc();
-        if (!pd_page) return;
-        pdpt[pdpt_idx] = (uint64_t)(uintptr_t)pd_page | VMM_PRESENT | VMM_WRITABLE;
-        uint64_t *pd = (uint64_t *)pd_page;
-        for (int i = 0; i < 512; i++) pd[i] = 0;
-    }
-    uint64_t *pd = pte_to_ptr(pdpt[pdpt_idx]);
-    
-    // Get or create PD entry
-    if (!pte_present(pd[pd_idx])) {
-        void *pt_page = pmm_alloc();
-        if (!pt_page) return;
-        pd[pd_idx] = (uint64_t)(uintptr_t)pt_page | VMM_PRESENT | VMM_WRITABLE;
-        uint64_t *pt = (uint64_t *)pt_page;
-        for (int i = 0; i < 512; i++) pt[i] = 0;
-    }
-    uint64_t *pt = pte_to_ptr(pd[pd_idx]);
-    
-    // Set page table entry
-    pt[pt_idx] = phys | flags;
-    
-    // Invalidate TLB for this page
-    __asm__ __volatile__("invlpg (%0)" : : "r"(virt) : "memory");
+    trace(TRACE_VMM_MAP, (uint32_t)flags, virt, phys);
+    vmm_map_range(pml4, virt, phys, PAGE_SIZE_4K, flags);
 }
 
 void vmm_identity_map(uint64_t *pml4, uint64_t start, uint64_t len, uint64_t flags) {
-    uint64_t end = start + len;
-    for (uint64_t addr = start; addr < end; addr += 4096) {
-        vmm_map_page(pml4, addr, addr, flags);
-    }
+    vmm_map_range(pml4, start, start, len, flags);
 }
 
 void vmm_load_pml4(uint64_t *pml4) {
-    uint64_t cr3 = (uint64_t)(uintptr_t)pml4;
-    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    // Untagged load: flushes whatever PCID 0 holds.
+    pcid0_owner = NULL;
+    write_cr3(vmm_virt_to_phys(pml4));
 }
 
 uint64_t *vmm_get_pml4(void) {
     return kernel_pml4;
 }
 
+static uint16_t pcid_alloc(void) {
+    for (uint32_t w = 0; w < PCID_COUNT / 64; ++w) {
+        uint64_t avail = ~pcid_used[w];
+        if (w == 0) avail &= ~1ULL;
+        if (avail) {
+            uint32_t bit = (uint32_t)__builtin_ctzll(avail);
+            pcid_used[w] |= 1ULL << bit;
+            return (uint16_t)(w * 64 + bit);
+        }
+    }
+    return 0; // exhausted: run untagged, flushing on every switch
+}
+
+static void pcid_free(uint16_t pcid) {
+    if (pcid == 0) return;
+    pcid_used[pcid / 64] &= ~(1ULL << (pcid % 64));
+    if (invpcid_supported) invpcid_single(pcid);
+    else pcid_stale[pcid / 64] |= 1ULL << (pcid % 64);
+}
+
+int vmm_space_create(struct vmm_space *as) {
+    void *page = pmm_alloc_zeroed();
+    if (!page) return -1;
+    as->pml4_phys = (uint64_t)(uintptr_t)page;
+    as->pml4 = (uint64_t *)vmm_phys_to_virt(as->pml4_phys);
+
+    // Share the kernel half: slot 0 holds the kernel identity map, slots
+    // 256+ the direct map. Their lower-level tables are shared, so later
+    // kernel mappings inside these slots are visible everywhere.
+    as->pml4[0] = kernel_pml4[0];
+    for (int i = 256; i < 512; i++) as->pml4[i] = kernel_pml4[i];
+
+    as->pcid = pcid_enabled ? pcid_alloc() : 0;
+    as->area_count = 0;
+    return 0;
+}
+
+// Drop the reference a 4 KiB leaf holds on a VM-managed frame.
+static void release_leaf(uint64_t pte) {
+    uint64_t frame = pte_addr(pte);
+    if (pte_present(pte) && frame != zero_page_phys && pmm_page_refcount(frame) > 0)
+        pmm_page_unref(frame);
+}
+
+// Free a page table and everything below it. Frames mapped by 4 KiB leaves
+// lose a reference; unmanaged frames are left alone.
+static void free_table(uint64_t *table, int level) {
+    for (int i = 0; i < 512; i++) {
+        if (!pte_present(table[i])) continue;
+        if (level == 1) release_leaf(table[i]);
+        else if (!pte_large(table[i])) free_table(pte_to_ptr(table[i]), level - 1);
+    }
+    pmm_free((void *)(uintptr_t)vmm_virt_to_phys(table));
+}
+
+// Drop all non-global TLB entries of `as`: right away if it is loaded,
+// otherwise on its next switch.
+static void space_flush_tlb(struct vmm_space *as) {
+    if (current_space == as) {
+        write_cr3(as->pml4_phys | (pcid_enabled ? as->pcid : 0));
+        if (as->pcid == 0) pcid0_owner = as;
+    } else if (as->pcid != 0) {
+        pcid_stale[as->pcid / 64] |= 1ULL << (as->pcid % 64);
+    } else if (pcid0_owner == as) {
+        pcid0_owner = NULL;
+    }
+}
+
+static void gather_flush(struct tlb_gather *g);
+
+static void gather_init(struct tlb_gather *g, struct vmm_space *as) {
+    g->as = as;
+    g->count = 0;
+    g->nfree = 0;
+    g->full = 0;
+    g->kernel_half = 0;
+}
+
+static void gather_add(struct tlb_gather *g, uint64_t virt) {
+    uint64_t slot = pml4_index(virt);
+    if (slot == 0 || slot >= 256) g->kernel_half = 1;
+    if (g->count < GATHER_PAGES) g->addrs[g->count++] = virt;
+    else g->full = 1;
+}
+
+static void gather_release(struct tlb_gather *g, uint64_t phys, int table) {
+    if (g->nfree == GATHER_PAGES) gather_flush(g);
+    g->frees[g->nfree++] = phys | (table ? 1 : 0);
+}
+
+static void gather_flush(struct tlb_gather *g) {
+    struct vmm_space *as = g->as;
+
+    if (g->count || g->full) {
+        if (current_space != as) {
+            space_flush_tlb(as);
+        } else if (g->full) {
+            space_flush_tlb(as);
+            tlb_stats.full_flushes++;
+        } else {
+            for (uint32_t i = 0; i < g->count; i++) invlpg(g->addrs[i]);
+            tlb_stats.invlpg += g->count;
+        }
+        // Shared kernel tables may be cached under every PCID.
+        if (g->kernel_half && pcid_enabled) {
+            for (uint32_t w = 0; w < PCID_COUNT / 64; w++) pcid_stale[w] |= pcid_used[w];
+            if (current_space->pcid != 0) pcid_stale[current_space->pcid / 64] &= ~(1ULL << (current_space->pcid % 64));
+            if (pcid0_owner != current_space) pcid0_owner = NULL;
+        }
+        if (g->kernel_half && remote_flush) {
+            remote_flush();
+            tlb_stats.shootdowns++;
+        }
+    }
+
+    for (uint32_t i = 0; i < g->nfree; i++) {
+        uint64_t phys = g->frees[i] & ~1ULL;
+        if (g->frees[i] & 1) {
+            pmm_free((void *)(uintptr_t)phys);
+            tlb_stats.tables_freed++;
+        } else {
+            pmm_page_unref(phys);
+        }
+    }
+    g->count = 0;
+    g->nfree = 0;
+    g->full = 0;
+    g->kernel_half = 0;
+}
+
+static int table_empty(const uint64_t *table) {
+    for (int i = 0; i < 512; i++) {
+        if (pte_present(table[i])) return 0;
+    }
+    return 1;
+}
+
+// Apply an unmap (prot == 0) or a protection change to [start, end) below
+// `table`, where `level` is 4 for a PML4 down to 1 for a PT. Large leaves
+// only partly inside the range are split first. Returns -1 if a split ran
+// out of memory.
+static int change_level(uint64_t *table, int level, uint64_t start, uint64_t end,
+                        uint64_t prot, struct tlb_gather *g) {
+    uint64_t size = 1ULL << (12 + 9 * (level - 1));
+    uint64_t addr = start;
+
+    while (addr < end) {
+        uint64_t entry_start = addr & ~(size - 1);
+        uint64_t entry_end   = entry_start + size;
+        if (entry_end < entry_start) entry_end = end; // top slot wraps
+        uint64_t hi = end < entry_end ? end : entry_end;
+        uint64_t *e = &table[(addr >> (12 + 9 * (level - 1))) & 0x1FF];
+        addr = entry_end;
+        if (!pte_present(*e)) continue;
+
+        int leaf = (level == 1 || pte_large(*e));
+        if (leaf && (entry_start < start || hi < entry_end)) {
+            if (!get_table(e, size, *e & VMM_USER)) return -1;
+            leaf = 0;
+        }
+
+        if (leaf) {
+            if (prot == 0) {
+                if (level == 1 && pte_addr(*e) != zero_page_phys && pmm_page_refcount(pte_addr(*e)) > 0)
+                    gather_release(g, pte_addr(*e), 0);
+                *e = 0;
+            } else {
+                uint64_t want = prot & (VMM_WRITABLE | VMM_USER);
+                if (*e & VMM_COW) want &= ~VMM_WRITABLE; // stays read-only until broken
+                *e = (*e & ~(VMM_WRITABLE | VMM_USER)) | want;
+            }
+            gather_add(g, entry_start);
+            continue;
+        }
+
+        uint64_t *child = pte_to_ptr(*e);
+        uint64_t lo = start > entry_start ? start : entry_start;
+        if (change_level(child, level - 1, lo, hi, prot, g) < 0) return -1;
+
+        // Reclaim intermediate tables that became empty, except the shared
+        // kernel-half ones other spaces still point at.
+        uint64_t slot = pml4_index(entry_start);
+        if (prot == 0 && table_empty(child) && !(level == 4 && (slot == 0 || slot >= 256))) {
+            *e = 0;
+            gather_release(g, vmm_virt_to_phys(child), 1);
+            gather_add(g, entry_start);
+        }
+    }
+    return 0;
+}
+
+int vmm_unmap_range(struct vmm_space *as, uint64_t virt, uint64_t len) {
+    struct tlb_gather g;
+    uint64_t end = (virt + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    gather_init(&g, as);
+    int ret = change_level(as->pml4, 4, virt & ~(PAGE_SIZE_4K - 1), end, 0, &g);
+    gather_flush(&g);
+    return ret;
+}
+
+int vmm_protect_range(struct vmm_space *as, uint64_t virt, uint64_t len, uint64_t flags) {
+    struct tlb_gather g;
+    uint64_t end = (virt + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    gather_init(&g, as);
+    int ret = change_level(as->pml4, 4, virt & ~(PAGE_SIZE_4K - 1), end, flags | VMM_PRESENT, &g);
+    gather_flush(&g);
+    return ret;
+}
+
+void vmm_set_remote_flush(void (*fn)(void)) {
+    remote_flush = fn;
+}
+
+void vmm_get_tlb_stats(struct vmm_tlb_stats *out) {
+    *out = tlb_stats;
+}
+
+// Copy a page table for vmm_space_clone. Writable managed leaves become
+// read-only + VMM_COW in both copies and gain a reference; everything else
+// is shared as is. Returns the new table's physical address or 0.
+static uint64_t clone_table(uint64_t *src, int level) {
+    void *page = pmm_alloc_zeroed();
+    if (!page) return 0;
+    uint64_t *dst = (uint64_t *)vmm_phys_to_virt((uint64_t)(uintptr_t)page);
+
+    for (int i = 0; i < 512; i++) {
+        uint64_t e = src[i];
+        if (!pte_present(e)) {
+            dst[i] = e;
+            continue;
+        }
+        if (level > 1 && !pte_large(e)) {
+            uint64_t child = clone_table(pte_to_ptr(e), level - 1);
+            if (!child) {
+                free_table(dst, level);
+                return 0;
+            }
+            dst[i] = child | (e & 0xFFF);
+            continue;
+        }
+        if (level == 1 && pte_addr(e) != zero_page_phys && pmm_page_refcount(pte_addr(e)) > 0) {
+            if (e & VMM_WRITABLE) {
+                e = (e & ~VMM_WRITABLE) | VMM_COW;
+                src[i] = e;
+            }
+            pmm_page_ref(pte_addr(e));
+        }
+        dst[i] = e;
+    }
+    return (uint64_t)(uintptr_t)page;
+}
+
+int vmm_space_clone(struct vmm_space *dst, struct vmm_space *src) {
+    if (vmm_space_create(dst) < 0) return -1;
+    for (uint32_t i = 0; i < src->area_count; i++) dst->areas[i] = src->areas[i];
+    dst->area_count = src->area_count;
+
+    int ret = 0;
+    for (uint64_t i = pml4_index(VMM_USER_BASE); i < pml4_index(VMM_USER_END - 1) + 1; i++) {
+        if (!pte_present(src->pml4[i])) continue;
+        uint64_t child = clone_table(pte_to_ptr(src->pml4[i]), 3);
+        if (!child) {
+            ret = -1;
+            break;
+        }
+        dst->pml4[i] = child | (src->pml4[i] & 0xFFF);
+    }
+
+    // Source leaves may have lost their write permission.
+    space_flush_tlb(src);
+    if (ret < 0) vmm_space_destroy(dst);
+    return ret;
+}
+
+int vmm_reserve(struct vmm_space *as, uint64_t start, uint64_t len, uint64_t flags) {
+    if (as->area_count == VMM_MAX_AREAS) return -1;
+    struct vmm_area *a = &as->areas[as->area_count++];
+    a->start = start & ~(PAGE_SIZE_4K - 1);
+    a->end   = (start + len + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    a->flags = flags & (VMM_WRITABLE | VMM_USER);
+    return 0;
+}
+
+static const struct vmm_area *find_area(const struct vmm_space *as, uint64_t virt) {
+    for (uint32_t i = 0; i < as->area_count; i++) {
+        if (virt >= as->areas[i].start && virt < as->areas[i].end) return &as->areas[i];
+    }
+    return NULL;
+}
+
+// The 4 KiB PTE for `virt`, or NULL if no page table covers it.
+static uint64_t *lookup_pte(uint64_t *pml4, uint64_t virt) {
+    uint64_t e = pml4[pml4_index(virt)];
+    if (!pte_present(e)) return NULL;
+    e = pte_to_ptr(e)[pdpt_index(virt)];
+    if (!pte_present(e) || pte_large(e)) return NULL;
+    e = pte_to_ptr(e)[pd_index(virt)];
+    if (!pte_present(e) || pte_large(e)) return NULL;
+    return &pte_to_ptr(e)[pt_index(virt)];
+}
+
+static inline void copy_page(void *dst, const void *src) {
+    uint64_t count = PAGE_SIZE_4K / 8;
+    __asm__ __volatile__("rep movsq"
+                         : "+D"(dst), "+S"(src), "+c"(count)
+                         :
+                         : "memory");
+}
+
+enum { FAULT_MINOR, FAULT_ZERO_FILL, FAULT_COW };
+
+// Resolve a write to a present VMM_COW page. Returns the fault kind or -1.
+static int break_cow(uint64_t *pte, uint64_t page) {
+    uint64_t frame = pte_addr(*pte);
+    uint64_t flags = (*pte & 0xFFF & ~VMM_COW) | VMM_WRITABLE;
+
+    if (frame != zero_page_phys && pmm_page_refcount(frame) == 1) {
+        *pte = frame | flags;
+        invlpg(page);
+        return FAULT_MINOR;
+    }
+
+    void *copy = frame == zero_page_phys ? pmm_alloc_zeroed() : pmm_alloc();
+    if (!copy) return -1;
+    uint64_t copy_phys = (uint64_t)(uintptr_t)copy;
+    if (frame != zero_page_phys) {
+        copy_page(vmm_phys_to_virt(copy_phys), vmm_phys_to_virt(frame));
+        pmm_page_unref(frame);
+    }
+    pmm_page_ref(copy_phys);
+    *pte = copy_phys | flags;
+    invlpg(page);
+    return frame == zero_page_phys ? FAULT_ZERO_FILL : FAULT_COW;
+}
+
+int vmm_handle_fault(uint64_t addr, uint64_t error) {
+    uint64_t t0 = rdtsc();
+    struct vmm_space *as = current_space;
+    uint64_t page = addr & ~(PAGE_SIZE_4K - 1);
+    uint64_t *pte = lookup_pte(as->pml4, page);
+    int kind;
+
+    if (pte && pte_present(*pte)) {
+        // Only retry accesses the PTE grants: a ring-3 access to a
+        // supervisor page would otherwise fault again forever.
+        if ((error & PF_USER) && !(*pte & VMM_USER)) return 0;
+        if (!(error & PF_WRITE)) return 0;
+        if (*pte & VMM_WRITABLE) {
+            invlpg(page); // stale TLB entry from before a COW break
+            kind = FAULT_MINOR;
+        } else if (*pte & VMM_COW) {
+            kind = break_cow(pte, page);
+            if (kind < 0) return 0;
+        } else {
+            return 0;
+        }
+    } else {
+        const struct vmm_area *area = find_area(as, page);
+        if (!area) return 0;
+        if ((error & PF_USER) && !(area->flags & VMM_USER)) return 0;
+        uint64_t flags = VMM_PRESENT | area->flags;
+
+        if (error & PF_WRITE) {
+            if (!(area->flags & VMM_WRITABLE)) return 0;
+            void *frame = pmm_alloc_zeroed();
+            if (!frame) return 0;
+            if (vmm_map_range(as->pml4, page, (uint64_t)(uintptr_t)frame, PAGE_SIZE_4K, flags) < 0) {
+                pmm_free(frame);
+                return 0;
+            }
+            pmm_page_ref((uint64_t)(uintptr_t)frame);
+            kind = FAULT_ZERO_FILL;
+        } else {
+            if (area->flags & VMM_WRITABLE) flags = (flags & ~VMM_WRITABLE) | VMM_COW;
+            if (vmm_map_range(as->pml4, page, zero_page_phys, PAGE_SIZE_4K, flags) < 0) return 0;
+            kind = FAULT_MINOR;
+        }
+    }
+
+    uint64_t cycles = rdtsc() - t0;
+    switch (kind) {
+    case FAULT_MINOR:
+        fault_stats.minor++;
+        fault_stats.minor_cycles += cycles;
+        break;
+    case FAULT_ZERO_FILL:
+        fault_stats.zero_fill++;
+        fault_stats.zero_fill_cycles += cycles;
+        break;
+    default:
+        fault_stats.cow++;
+        fault_stats.cow_cycles += cycles;
+        break;
+    }
+    if (cycles > fault_stats.max_cycles) fault_stats.max_cycles = cycles;
+    return 1;
+}
+
+void vmm_get_fault_stats(struct vmm_fault_stats *out) {
+    *out = fault_stats;
+}
+
+// Exercise every fault path in a scratch space: read `pages` reserved pages
+// (zero page), write them (zero-fill), clone the space and write again from
+// the clone (COW). Returns the counter delta of the run.
+int vmm_fault_bench(uint32_t pages, struct vmm_fault_stats *out) {
+    struct vmm_space a, b;
+    struct vmm_space *prev = current_space;
+    struct vmm_fault_stats before = fault_stats;
+    volatile uint8_t *base = (volatile uint8_t *)(uintptr_t)VMM_USER_BASE;
+
+    if (vmm_space_create(&a) < 0) return -1;
+    vmm_reserve(&a, VMM_USER_BASE, (uint64_t)pages * PAGE_SIZE_4K, VMM_WRITABLE);
+    vmm_space_switch(&a);
+
+    for (uint32_t i = 0; i < pages; i++) (void)base[(uint64_t)i * PAGE_SIZE_4K];
+    for (uint32_t i = 0; i < pages; i++) base[(uint64_t)i * PAGE_SIZE_4K] = (uint8_t)i;
+
+    int ret = -1;
+    if (vmm_space_clone(&b, &a) == 0) {
+        vmm_space_switch(&b);
+        for (uint32_t i = 0; i < pages; i++) base[(uint64_t)i * PAGE_SIZE_4K] += 1;
+        vmm_space_switch(&a);
+        ret = 0;
+        for (uint32_t i = 0; i < pages; i++) {
+            if (base[(uint64_t)i * PAGE_SIZE_4K] != (uint8_t)i) ret = -1;
+        }
+        vmm_space_destroy(&b);
+    }
+
+    vmm_space_switch(prev);
+    vmm_space_destroy(&a);
+
+    out->minor            = fault_stats.minor - before.minor;
+    out->zero_fill        = fault_stats.zero_fill - before.zero_fill;
+    out->cow              = fault_stats.cow - before.cow;
+    out->minor_cycles     = fault_stats.minor_cycles - before.minor_cycles;
+    out->zero_fill_cycles = fault_stats.zero_fill_cycles - before.zero_fill_cycles;
+    out->cow_cycles       = fault_stats.cow_cycles - before.cow_cycles;
+    out->max_cycles       = fault_stats.max_cycles;
+    return ret;
+}
+
+void vmm_space_destroy(struct vmm_space *as) {
+    if (as == &kernel_space || !as->pml4) return;
+    if (current_space == as) vmm_space_switch(&kernel_space);
+    if (pcid0_owner == as) pcid0_owner = NULL;
+
+    for (uint64_t i = pml4_index(VMM_USER_BASE); i < pml4_index(VMM_USER_END - 1) + 1; i++) {
+        if (pte_present(as->pml4[i]))
+            free_table(pte_to_ptr(as->pml4[i]), 3);
+    }
+    pmm_free((void *)(uintptr_t)as->pml4_phys);
+    pcid_free(as->pcid);
+    as->pml4 = NULL;
+}
+
+void vmm_space_switch(struct vmm_space *as) {
+    uint64_t cr3 = as->pml4_phys;
+    if (pcid_enabled) {
+        int flush;
+        if (as->pcid == 0) {
+            flush = (pcid0_owner != as);
+            pcid0_owner = as;
+        } else {
+            uint64_t bit = 1ULL << (as->pcid % 64);
+            flush = (pcid_stale[as->pcid / 64] & bit) != 0;
+            pcid_stale[as->pcid / 64] &= ~bit;
+        }
+        cr3 |= as->pcid;
+        if (!flush) cr3 |= CR3_NOFLUSH;
+    }
+    current_space = as;
+    write_cr3(cr3);
+}
+
+struct vmm_space *vmm_kernel_space(void) {
+    return &kernel_space;
+}
+
+struct vmm_space *vmm_current_space(void) {
+    return current_space;
+}
+
+int vmm_pcid_enabled(void) {
+    return pcid_enabled;
+}
+
+int vmm_pat_enabled(void) {
+    return pat_supported;
+}
+
+// Switch/refill benchmark: two spaces map the same frames at VMM_USER_BASE.
+// Each round switches to one space and touches every page, once with
+// untagged (flushing) switches and once with PCID-tagged ones.
+#define BENCH_PAGES  64
+#define BENCH_ROUNDS 1000
+
+static void bench_rounds(struct vmm_space *a, struct vmm_space *b,
+                         uint64_t *switch_cycles, uint64_t *refill_cycles) {
+    uint64_t sw = 0, refill = 0;
+    for (uint32_t r = 0; r < BENCH_ROUNDS; r++) {
+        struct vmm_space *as = (r & 1) ? b : a;
+        uint64_t t0 = rdtsc();
+        vmm_space_switch(as);
+        uint64_t t1 = rdtsc();
+        for (uint32_t i = 0; i < BENCH_PAGES; i++) {
+            (void)*(volatile uint64_t *)(uintptr_t)(VMM_USER_BASE + (uint64_t)i * PAGE_SIZE_4K);
+        }
+        uint64_t t2 = rdtsc();
+        sw += t1 - t0;
+        refill += t2 - t1;
+    }
+    *switch_cycles = sw / BENCH_ROUNDS;
+    *refill_cycles = refill / BENCH_ROUNDS;
+}
+
+int vmm_pcid_bench(struct vmm_pcid_bench *out) {
+    struct vmm_space a, b;
+    uint64_t frames[BENCH_PAGES];
+    struct vmm_space *prev = current_space;
+    int ret = -1;
+
+    out->pcid_enabled = pcid_enabled;
+    out->pages = BENCH_PAGES;
+    out->rounds = BENCH_ROUNDS;
+    if (vmm_space_create(&a) < 0) return -1;
+    if (vmm_space_create(&b) < 0) goto out_a;
+
+    uint32_t n;
+    for (n = 0; n < BENCH_PAGES; n++) {
+        void *f = pmm_alloc();
+        if (!f) goto out_frames;
+        frames[n] = (uint64_t)(uintptr_t)f;
+        uint64_t va = VMM_USER_BASE + (uint64_t)n * PAGE_SIZE_4K;
+        if (vmm_map_range(a.pml4, va, frames[n], PAGE_SIZE_4K, VMM_PRESENT | VMM_WRITABLE) < 0 ||
+            vmm_map_range(b.pml4, va, frames[n], PAGE_SIZE_4K, VMM_PRESENT | VMM_WRITABLE) < 0) {
+            n++;
+            goto out_frames;
+        }
+    }
+
+    uint64_t flags = irq_save();
+
+    // Untagged: both spaces on PCID 0, so every switch flushes.
+    uint16_t pcid_a = a.pcid, pcid_b = b.pcid;
+    a.pcid = b.pcid = 0;
+    bench_rounds(&a, &b, &out->switch_flush, &out->refill_flush);
+    a.pcid = pcid_a;
+    b.pcid = pcid_b;
+
+    out->switch_pcid = out->refill_pcid = 0;
+    if (pcid_enabled) {
+        bench_rounds(&a, &b, &out->switch_pcid, &out->refill_pcid); // warm up
+        bench_rounds(&a, &b, &out->switch_pcid, &out->refill_pcid);
+    }
+
+    vmm_space_switch(prev);
+    irq_restore(flags);
+    ret = 0;
+
+out_frames:
+    for (uint32_t i = 0; i < n; i++) pmm_free((void *)(uintptr_t)frames[i]);
+    vmm_space_destroy(&b);
+out_a:
+    vmm_space_destroy(&a);
+    return ret;
+}
+
+void *vmm_map_mmio(uint64_t phys, uint64_t len, uint64_t flags) {
+    if ((flags & VMM_WRITE_COMBINING) && !pat_supported)
+        flags = (flags & ~VMM_WRITE_COMBINING) | VMM_NO_CACHE | VMM_WRITE_THROUGH;
+    uint64_t start = phys & ~(PAGE_SIZE_4K - 1);
+    if (vmm_map_range(kernel_pml4, VMM_DIRECT_MAP_BASE + start, start, phys + len - start,
+                      VMM_PRESENT | VMM_WRITABLE | flags) < 0)
+        return NULL;
+    return (void *)(uintptr_t)(VMM_DIRECT_MAP_BASE + phys);
+}
+
+void vmm_get_map_stats(struct vmm_map_stats *out) {
+    *out = map_stats;
+}
+
 void vmm_init(void) {
-    // Allocate PML4
-    kernel_pml4 = (uint64_t *)pmm_alloc();
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a >= 0x80000001) {
+        cpuid(0x80000001, 0, &a, &b, &c, &d);
+        gb_pages_supported = (d >> 26) & 1;
+    }
+    cpuid(1, 0, &a, &b, &c, &d);
+    pat_supported = (d >> 16) & 1;
+    // Nothing maps with the PAT bit yet, so no cache flush is needed.
+    if (pat_supported) wrmsr(MSR_IA32_PAT, PAT_VALUE);
+    // Copy-on-write relies on read-only mappings binding ring 0 too.
+    write_cr0(read_cr0() | CR0_WP);
+
+    // Allocate PML4. Until the new tables are live, physical addresses are
+    // reached through the boot identity map.
+    kernel_pml4 = (uint64_t *)pmm_alloc_zeroed();
     if (!kernel_pml4) return;
-    
-    // Zero PML4
-    for (int i = 0; i < 512; i++) {
-        kernel_pml4[i] = 0;
+    uint64_t pml4_phys = (uint64_t)(uintptr_t)kernel_pml4;
+
+    // Kernel image and PMM metadata stay identity mapped: we link at 1 MiB.
+    uint64_t ident_end = (pmm_metadata_end() + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    vmm_identity_map(kernel_pml4, 0x00000000, ident_end, VMM_PRESENT | VMM_WRITABLE);
+
+    // Direct map of all usable RAM at VMM_DIRECT_MAP_BASE.
+    uint32_t count;
+    const struct pmm_region *regions = pmm_regions(&count);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (regions[i].type != MULTIBOOT2_MEMORY_AVAILABLE) continue;
+        uint64_t start = (regions[i].base + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+        uint64_t end   = (regions[i].base + regions[i].len) & ~(PAGE_SIZE_4K - 1);
+        if (start >= end) continue;
+        vmm_map_range(kernel_pml4, VMM_DIRECT_MAP_BASE + start, start, end - start,
+                      VMM_PRESENT | VMM_WRITABLE);
     }
-    
-    // Identity map first 4MB (kernel code, data, stack, etc.)
-    vmm_identity_map(kernel_pml4, 0x00000000, 0x00400000, VMM_PRESENT | VMM_WRITABLE);
-    
+
+    // Shared source for demand-zero reads; never freed.
+    zero_page_phys = (uint64_t)(uintptr_t)pmm_alloc_zeroed();
+
     // Map framebuffer (physical 0xB8000) to high virtual address
     vmm_map_page(kernel_pml4, VMM_FRAMEBUFFER_VIRT, 0xB8000, VMM_PRESENT | VMM_WRITABLE);
-    
-    // Load the new PML4
-    vmm_load_pml4(kernel_pml4);
-    
+
+    // Load the new PML4 and switch page-table access to the direct map.
+    write_cr3(pml4_phys);
+    vmm_direct_map_offset = VMM_DIRECT_MAP_BASE;
+    kernel_pml4 = (uint64_t *)vmm_phys_to_virt(pml4_phys);
+    kernel_space.pml4 = kernel_pml4;
+    kernel_space.pml4_phys = pml4_phys;
+    kernel_space.pcid = 0;
+
+    // CR4.PCIDE may only be set while CR3 carries PCID 0, as it does now.
+    cpuid(1, 0, &a, &b, &c, &d);
+    if ((c >> 17) & 1) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = 1;
+        cpuid(0, 0, &a, &b, &c, &d);
+        if (a >= 7) {
+            cpuid(7, 0, &a, &b, &c, &d);
+            invpcid_supported = (b >> 10) & 1;
+        }
+    }
+
     // Update framebuffer pointer to use virtual address
     vmm_framebuffer = (volatile uint16_t *)VMM_FRAMEBUFFER_VIRT;
 }
+
+// The PAT is per CPU and has to agree everywhere a mapping may be used.
+void vmm_init_ap(void) {
+    if (pat_supported) wrmsr(MSR_IA32_PAT, PAT_VALUE);
+}
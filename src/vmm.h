@@ -4,14 +4,148 @@
 #define VMM_PRESENT  (1ULL << 0)
 #define VMM_WRITABLE (1ULL << 1)
 #define VMM_USER     (1ULL << 2)
+#define VMM_WRITE_THROUGH (1ULL << 3)
+#define VMM_NO_CACHE      (1ULL << 4)
+// PAT bit of a 4 KiB leaf. vmm_init() programs the PAT entry it selects as
+// write-combining; PWT/PCD keep their power-on meaning.
+#define VMM_WRITE_COMBINING (1ULL << 7)
+
+// Software-defined PTE bit (ignored by the MMU): the page is mapped
+// read-only and must be copied before the first write.
+#define VMM_COW      (1ULL << 9)
+
+// All usable RAM is mapped at VMM_DIRECT_MAP_BASE + phys once vmm_init()
+// has run; before that physical memory is reached through the boot
+// identity map. The host test build overrides it to keep using the
+// identity map.
+#ifndef VMM_DIRECT_MAP_BASE
+#define VMM_DIRECT_MAP_BASE 0xFFFF800000000000ULL
+#endif
+
+// Lower-half range private to each address space. PML4 slot 0 holds the
+// kernel identity map and is shared, like every slot from 256 up.
+#define VMM_USER_BASE 0x0000008000000000ULL
+#define VMM_USER_END  0x0000800000000000ULL
 
 // Virtual framebuffer address (high virtual address)
 #define VMM_FRAMEBUFFER_VIRT 0xFFFF8000000B8000ULL
 
 extern volatile uint16_t *vmm_framebuffer;
+extern uint64_t vmm_direct_map_offset;
+
+static inline void *vmm_phys_to_virt(uint64_t phys) {
+    return (void *)(uintptr_t)(phys + vmm_direct_map_offset);
+}
+
+static inline uint64_t vmm_virt_to_phys(const void *virt) {
+    uint64_t v = (uint64_t)(uintptr_t)virt;
+    return v >= VMM_DIRECT_MAP_BASE ? v - VMM_DIRECT_MAP_BASE : v;
+}
+
+// Reserved range backed on first touch. `flags` is VMM_WRITABLE/VMM_USER.
+struct vmm_area {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;
+};
+
+#define VMM_MAX_AREAS 16
+
+// An address space: its own lower half plus the shared kernel half.
+// `pcid` tags its TLB entries when the CPU supports PCIDs (0 otherwise).
+struct vmm_space {
+    uint64_t *pml4;
+    uint64_t pml4_phys;
+    uint16_t pcid;
+    uint32_t area_count;
+    struct vmm_area areas[VMM_MAX_AREAS];
+};
+
+// Page faults resolved by vmm_handle_fault, with handler latency in cycles.
+// minor: no allocation or copy; zero_fill: fresh zeroed frame; cow: copy.
+struct vmm_fault_stats {
+    uint64_t minor;
+    uint64_t zero_fill;
+    uint64_t cow;
+    uint64_t minor_cycles;
+    uint64_t zero_fill_cycles;
+    uint64_t cow_cycles;
+    uint64_t max_cycles;
+};
+
+struct vmm_pcid_bench {
+    int pcid_enabled;
+    uint32_t pages;
+    uint32_t rounds;
+    uint64_t switch_flush;  // avg cycles per untagged CR3 switch
+    uint64_t refill_flush;  // avg cycles to touch all pages afterwards
+    uint64_t switch_pcid;   // same with PCID-tagged, non-flushing switches
+    uint64_t refill_pcid;
+};
+
+// Invalidations issued by vmm_unmap_range/vmm_protect_range.
+struct vmm_tlb_stats {
+    uint64_t invlpg;        // single-page invalidations
+    uint64_t full_flushes;  // CR3 reloads once a batch exceeded the threshold
+    uint64_t tables_freed;  // empty PT/PD/PDPT pages returned to the PMM
+    uint64_t shootdowns;    // kernel-half changes flushed on the other CPUs
+};
+
+// Leaves created by vmm_map_range, by size.
+struct vmm_map_stats {
+    uint64_t leaves_4k;
+    uint64_t leaves_2m;
+    uint64_t leaves_1g;
+};
+
+// SMP: address spaces, PCIDs, page faults and the statistics belong to the
+// boot CPU, the only one that runs threads. APs stay on the kernel space
+// and only call vmm_init_ap(); they see kernel-half unmap/protect through
+// the remote flush below.
 
 void vmm_init(void);
+// Per-CPU MMU setup (the PAT) on an application processor.
+void vmm_init_ap(void);
+// `fn` flushes the TLBs of every other online CPU and returns once they
+// have; vmm_unmap_range/vmm_protect_range call it for kernel-half changes
+// before freeing anything. Set by smp_init().
+void vmm_set_remote_flush(void (*fn)(void));
 void vmm_map_page(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 void vmm_identity_map(uint64_t *pml4, uint64_t start, uint64_t len, uint64_t flags);
+// Map [virt, virt+len) to phys using 1 GiB and 2 MiB leaves wherever
+// alignment allows. Returns -1 if a page table could not be allocated.
+int vmm_map_range(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags);
 void vmm_load_pml4(uint64_t *pml4);
 uint64_t *vmm_get_pml4(void);
+void vmm_get_map_stats(struct vmm_map_stats *out);
+// Map physical [phys, phys+len) at its direct-map address (for firmware
+// tables and device registers outside usable RAM) and return a pointer
+// to `phys`. `flags` adds caching bits such as VMM_NO_CACHE or
+// VMM_WRITE_COMBINING (uncached on CPUs without a PAT).
+void *vmm_map_mmio(uint64_t phys, uint64_t len, uint64_t flags);
+
+int vmm_space_create(struct vmm_space *as);
+void vmm_space_destroy(struct vmm_space *as);
+void vmm_space_switch(struct vmm_space *as);
+struct vmm_space *vmm_kernel_space(void);
+struct vmm_space *vmm_current_space(void);
+int vmm_pcid_enabled(void);
+int vmm_pat_enabled(void);
+int vmm_pcid_bench(struct vmm_pcid_bench *out);
+
+// Remove mappings in [virt, virt+len), dropping references on managed
+// frames and freeing page tables that become empty.
+int vmm_unmap_range(struct vmm_space *as, uint64_t virt, uint64_t len);
+// Set VMM_WRITABLE/VMM_USER on present mappings in [virt, virt+len).
+// Copy-on-write pages stay read-only until their first write.
+int vmm_protect_range(struct vmm_space *as, uint64_t virt, uint64_t len, uint64_t flags);
+void vmm_get_tlb_stats(struct vmm_tlb_stats *out);
+
+// Copy `src` into a new space; private writable pages become copy-on-write.
+int vmm_space_clone(struct vmm_space *dst, struct vmm_space *src);
+// Reserve [start, start+len) in `as` without committing memory.
+int vmm_reserve(struct vmm_space *as, uint64_t start, uint64_t len, uint64_t flags);
+// Returns 1 if the fault at `addr` was resolved, 0 if it is a real error.
+int vmm_handle_fault(uint64_t addr, uint64_t error);
+void vmm_get_fault_stats(struct vmm_fault_stats *out);
+int vmm_fault_bench(uint32_t pages, struct vmm_fault_stats *out);
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include "harness.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "trace.h"
+#include "vmm.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/personality.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct host_cpu host_cpu;
+
+// The tracepoints compile in; tracing stays off.
+volatile uint32_t trace_mask;
+
+void trace_record(uint32_t event, uint32_t arg0, uint64_t arg1, uint64_t arg2) {
+    (void)event;
+    (void)arg0;
+    (void)arg1;
+    (void)arg2;
+}
+
+// initrd.c builds its index with kmalloc.
+void *kmalloc(uint64_t size) {
+    return malloc(size);
+}
+
+void kfree(void *ptr) {
+    free(ptr);
+}
+
+struct host_module host_modules[HOST_MAX_MODULES];
+uint32_t host_module_count;
+
+#define KiB 1024ULL
+#define MiB (1024 * KiB)
+#define GiB (1024 * MiB)
+
+#define AVAIL    MULTIBOOT2_MEMORY_AVAILABLE
+#define RESERVED 2
+#define ACPI     3
+
+const struct host_layout host_layouts[] = {
+    // What QEMU's SeaBIOS reports for -m 128M.
+    { "qemu-128m", 5, {
+        { 0, 0x9FC00, AVAIL, 0 },
+        { 0x9FC00, 0x400, RESERVED, 0 },
+        { 0xF0000, 0x10000, RESERVED, 0 },
+        { 1 * MiB, 128 * MiB - 1 * MiB - 128 * KiB, AVAIL, 0 },
+        { 128 * MiB - 128 * KiB, 128 * KiB, ACPI, 0 },
+    } },
+    // Unsorted, overlapping and unaligned entries around a PCI hole.
+    { "holes-6g", 8, {
+        { 4 * GiB, 2 * GiB, AVAIL, 0 },
+        { 1 * MiB, 2 * GiB - 1 * MiB, AVAIL, 0 },
+        { 0, 0x9F000, AVAIL, 0 },
+        { 2 * GiB, 256 * MiB, RESERVED, 0 },
+        { 2 * GiB + 256 * MiB + 0x800, 1 * GiB - 0x1800, AVAIL, 0 },
+        { 3 * GiB + 128 * MiB, 64 * MiB, AVAIL, 0 },  // overlaps the previous one
+        { 3 * GiB + 256 * MiB, 768 * MiB, RESERVED, 0 },
+        { 0xFEC00000, 0x1000, RESERVED, 0 },
+    } },
+    // 64 GiB above the 4 GiB line, like a large server.
+    { "big-66g", 4, {
+        { 0, 0x9F000, AVAIL, 0 },
+        { 1 * MiB, 3 * GiB - 1 * MiB, AVAIL, 0 },
+        { 3 * GiB, 1 * GiB, RESERVED, 0 },
+        { 4 * GiB, 64 * GiB, AVAIL, 0 },
+    } },
+    // Two islands far apart: metadata covers the hole too.
+    { "sparse-64g", 3, {
+        { 0, 0x9F000, AVAIL, 0 },
+        { 1 * MiB, 511 * MiB, AVAIL, 0 },
+        { 63 * GiB, 1 * GiB, AVAIL, 0 },
+    } },
+};
+const uint32_t host_layout_count = sizeof(host_layouts) / sizeof(host_layouts[0]);
+
+const struct host_layout *host_layout(const char *name) {
+    for (uint32_t i = 0; i < host_layout_count; i++) {
+        if (strcmp(host_layouts[i].name, name) == 0) return &host_layouts[i];
+    }
+    fprintf(stderr, "unknown layout %s\n", name);
+    exit(2);
+}
+
+uint64_t host_layout_top(const struct host_layout *l) {
+    uint64_t top = 0;
+    for (uint32_t i = 0; i < l->count; i++) {
+        const struct multiboot2_mmap_entry *e = &l->entries[i];
+        if (e->type == AVAIL && e->addr + e->len > top) top = e->addr + e->len;
+    }
+    return top;
+}
+
+int host_page_available(const struct host_layout *l, uint64_t phys) {
+    for (uint32_t i = 0; i < l->count; i++) {
+        const struct multiboot2_mmap_entry *e = &l->entries[i];
+        if (e->type == AVAIL && phys >= e->addr && phys + HOST_PAGE_SIZE <= e->addr + e->len)
+            return 1;
+    }
+    return 0;
+}
+
+// The brk heap is placed at a random offset past the binary, anywhere in
+// the first gigabyte: run without address randomisation so it stays below
+// 1 MiB (glibc falls back to mmap once it runs into the arena).
+__attribute__((constructor)) static void host_no_aslr(int argc, char **argv, char **envp) {
+    (void)argc;
+    int pers = personality(0xFFFFFFFF);
+    if (pers == -1 || (pers & ADDR_NO_RANDOMIZE)) return;
+    if (personality((unsigned long)pers | ADDR_NO_RANDOMIZE) == -1) return;
+    execve("/proc/self/exe", argv, envp);
+}
+
+// Everything from the kernel image up is backed; nothing is allowed below
+// it, which catches stray accesses to the reserved low megabyte.
+static void map_arena(uint64_t top) {
+    void *p = mmap((void *)HOST_KERNEL_START, top - HOST_KERNEL_START, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (p != (void *)HOST_KERNEL_START) {
+        perror("mmap arena");
+        exit(2);
+    }
+}
+
+uint64_t host_boot(const struct host_layout *l, uint64_t mb_addr) {
+    if (!mb_addr) mb_addr = HOST_KERNEL_END;
+    uint64_t top = host_layout_top(l);
+    if (top < mb_addr + 64 * KiB) top = mb_addr + 64 * KiB;
+    map_arena(top);
+
+    uint8_t *p = (uint8_t *)(uintptr_t)mb_addr;
+    struct multiboot2_tag_mmap *mmap_tag = (struct multiboot2_tag_mmap *)(p + 8);
+    mmap_tag->type = MULTIBOOT2_TAG_TYPE_MMAP;
+    mmap_tag->size = sizeof(*mmap_tag) + l->count * sizeof(struct multiboot2_mmap_entry);
+    mmap_tag->entry_size = sizeof(struct multiboot2_mmap_entry);
+    mmap_tag->entry_version = 0;
+    memcpy(mmap_tag + 1, l->entries, l->count * sizeof(struct multiboot2_mmap_entry));
+    uint32_t off = 8 + ((mmap_tag->size + 7) & ~7u);
+    for (uint32_t i = 0; i < host_module_count; i++) {
+        const struct host_module *m = &host_modules[i];
+        struct multiboot2_tag_module *mod = (struct multiboot2_tag_module *)(p + off);
+        mod->type = MULTIBOOT2_TAG_TYPE_MODULE;
+        mod->size = (uint32_t)(sizeof(*mod) + strlen(m->cmdline) + 1);
+        mod->mod_start = (uint32_t)m->start;
+        mod->mod_end = (uint32_t)(m->start + m->size);
+        strcpy(mod->cmdline, m->cmdline);
+        memcpy((void *)(uintptr_t)m->start, m->data, m->size);
+        off += (mod->size + 7) & ~7u;
+    }
+    struct multiboot2_tag *end = (struct multiboot2_tag *)(p + off);
+    end->type = MULTIBOOT2_TAG_TYPE_END;
+    end->size = 8;
+    struct multiboot2_info_header *hdr = (struct multiboot2_info_header *)p;
+    hdr->total_size = off + 8;
+    hdr->reserved = 0;
+
+    pmm_init(mb_addr);
+    return mb_addr;
+}
+
+uint64_t host_boot_vm(const struct host_layout *l) {
+    uint64_t mb = host_boot(l, 0);
+    vmm_init();
+    CHECK(vmm_get_pml4() != NULL);
+    CHECK(host_cpu.cr3 == vmm_virt_to_phys(vmm_get_pml4()));
+    return mb;
+}
+
+void host_fail(const char *file, int line, const char *expr) {
+    fprintf(stderr, "    %s:%d: CHECK(%s) failed\n", file, line, expr);
+    fflush(stderr);
+    _exit(1);
+}
+
+int host_fork(void (*fn)(void)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(2);
+    }
+    if (pid == 0) {
+        fn();
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) printf("    killed by signal %d\n", WTERMSIG(status));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+int host_run(const char *name, void (*fn)(void)) {
+    uint64_t t0 = host_now_ns();
+    int failed = host_fork(fn);
+    printf("%-4s %-40s %8.1f ms\n", failed ? "FAIL" : "ok", name, (host_now_ns() - t0) / 1e6);
+    return failed;
+}
+
+uint64_t host_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+uint64_t host_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+double host_tsc_per_ns(void) {
+    static double rate;
+    if (rate == 0) {
+        uint64_t n0 = host_now_ns(), t0 = rdtsc();
+        while (host_now_ns() - n0 < 50000000ULL) {}
+        rate = (double)(rdtsc() - t0) / (double)(host_now_ns() - n0);
+    }
+    return rate;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include "multiboot2.h"
+
+// Host-side harness for the PMM and VMM. "Physical" memory is a sparse
+// anonymous mapping at its own addresses (the binary is linked below
+// 1 MiB, see the Makefile), so pmm.c and vmm.c run unmodified against a
+// synthetic Multiboot2 memory map. Every test case runs in a fresh
+// process: the allocators keep their state in statics.
+
+#ifndef HOST_KERNEL_END
+#error "HOST_KERNEL_END must match the --defsym of _kernel_end"
+#endif
+#define HOST_KERNEL_START 0x100000ULL
+#define HOST_PAGE_SIZE    4096ULL
+
+#define HOST_MAX_ENTRIES 16
+
+struct host_layout {
+    const char *name;
+    uint32_t count;
+    struct multiboot2_mmap_entry entries[HOST_MAX_ENTRIES];  // in map order
+};
+
+extern const struct host_layout host_layouts[];
+extern const uint32_t host_layout_count;
+const struct host_layout *host_layout(const char *name);
+
+// Highest byte of available memory in `l`.
+uint64_t host_layout_top(const struct host_layout *l);
+
+// Multiboot2 modules for the next host_boot(): copied to `start` in the
+// arena and described by module tags.
+#define HOST_MAX_MODULES 32
+struct host_module {
+    uint64_t start;
+    const void *data;
+    uint64_t size;
+    const char *cmdline;
+};
+extern struct host_module host_modules[HOST_MAX_MODULES];
+extern uint32_t host_module_count;
+
+// Map the arena for `l`, write the boot information at `mb_addr` (0: just
+// past the kernel image, where GRUB puts it) and run pmm_init(). Returns
+// the address of the boot information.
+uint64_t host_boot(const struct host_layout *l, uint64_t mb_addr);
+// host_boot() followed by vmm_init() and a few sanity checks.
+uint64_t host_boot_vm(const struct host_layout *l);
+
+// Non-zero if the page at `phys` lies wholly in an available entry of `l`.
+int host_page_available(const struct host_layout *l, uint64_t phys);
+
+// Run `fn` in a child process; returns 0 if it exited cleanly.
+int host_fork(void (*fn)(void));
+// host_fork() with an ok/FAIL line and the run time.
+int host_run(const char *name, void (*fn)(void));
+
+void host_fail(const char *file, int line, const char *expr);
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) host_fail(__FILE__, __LINE__, #cond); \
+    } while (0)
+
+// Small deterministic PRNG (xorshift64*).
+uint64_t host_rand(uint64_t *state);
+
+// TSC ticks per nanosecond, measured once against CLOCK_MONOTONIC.
+double host_tsc_per_ns(void);
+uint64_t host_now_ns(void);
@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+
+// cpu.h for the host test build. rdtsc and cpuid run as they are; the
+// privileged instructions only update host_cpu so tests can check what the
+// kernel code asked for.
+
+struct host_cpu {
+    uint64_t cr0, cr3, cr4;
+    uint64_t invlpg;        // single-page invalidations issued
+    uint64_t cr3_writes;
+    uint64_t invpcid;
+    uint64_t msr_pat;
+};
+extern struct host_cpu host_cpu;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+static inline void invlpg(uint64_t virt) {
+    (void)virt;
+    host_cpu.invlpg++;
+}
+
+static inline uint64_t read_cr3(void) {
+    return host_cpu.cr3;
+}
+
+static inline void write_cr3(uint64_t v) {
+    host_cpu.cr3 = v;
+    host_cpu.cr3_writes++;
+}
+
+static inline uint64_t read_cr4(void) {
+    return host_cpu.cr4;
+}
+
+static inline void write_cr4(uint64_t v) {
+    host_cpu.cr4 = v;
+}
+
+static inline void invpcid_single(uint16_t pcid) {
+    (void)pcid;
+    host_cpu.invpcid++;
+}
+
+static inline uint64_t irq_save(void) {
+    return 0;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    (void)flags;
+}
+
+static inline uint64_t read_cr2(void) {
+    return 0;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    return msr == 0x277 ? host_cpu.msr_pat : 0;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+    if (msr == 0x277) host_cpu.msr_pat = v;
+}
+
+static inline uint64_t read_cr0(void) {
+    return host_cpu.cr0;
+}
+
+static inline void write_cr0(uint64_t v) {
+    host_cpu.cr0 = v;
+}
@@ -0,0 +1,226 @@
+#include "harness.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE HOST_PAGE_SIZE
+#define MiB (1024ULL * 1024)
+#define GiB (1024 * MiB)
+
+// Minimal take on Google Benchmark's state loop:
+//
+//     while (bench_next(b)) { ...one operation... }
+//
+// runs the body until MIN_TIME_NS has passed (or b->max_iters), timing
+// every iteration with the TSC for the latency percentiles. Each benchmark
+// runs in its own process on a freshly booted allocator.
+
+#define MIN_TIME_NS 200000000ULL
+#define MAX_SAMPLES (1u << 20)
+
+struct bench {
+    uint64_t iters;
+    uint64_t max_iters;
+    uint64_t start_ns;
+    uint64_t last_tsc;
+    uint64_t budget_tsc;
+    uint64_t *samples;
+};
+
+static int bench_next(struct bench *b) {
+    uint64_t now = rdtsc();
+    if (b->iters == 0) {
+        b->samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        if (!b->samples) abort();
+        b->budget_tsc = (uint64_t)(MIN_TIME_NS * host_tsc_per_ns());
+        b->start_ns = host_now_ns();
+        b->last_tsc = rdtsc();
+        b->budget_tsc += b->last_tsc;  // now the deadline
+        b->iters = 1;
+        return 1;
+    }
+    b->samples[(b->iters - 1) % MAX_SAMPLES] = now - b->last_tsc;
+    if (now >= b->budget_tsc || (b->max_iters && b->iters >= b->max_iters)) return 0;
+    b->iters++;
+    b->last_tsc = rdtsc();
+    return 1;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_report(struct bench *b, const char *name) {
+    uint64_t ns = host_now_ns() - b->start_ns;
+    uint64_t n = b->iters < MAX_SAMPLES ? b->iters : MAX_SAMPLES;
+    qsort(b->samples, n, sizeof(uint64_t), u64_cmp);
+    printf("%-36s %12.1f %12llu %10llu %10llu\n", name, (double)ns / (double)b->iters,
+           (unsigned long long)b->iters, (unsigned long long)b->samples[n / 2],
+           (unsigned long long)b->samples[n * 99 / 100]);
+    free(b->samples);
+}
+
+// --- benchmarks ----------------------------------------------------------
+
+static const struct host_layout *layout;
+static unsigned arg;  // order or page count, depending on the benchmark
+
+static void bm_pmm_init(struct bench *b) {
+    uint64_t mb = host_boot(layout, 0);
+    uint64_t free0 = pmm_free_bytes();
+    while (bench_next(b)) pmm_init(mb);
+    CHECK(pmm_free_bytes() == free0);
+}
+
+static void bm_pmm_alloc_free(struct bench *b) {
+    host_boot(layout, 0);
+    while (bench_next(b)) {
+        void *p = pmm_alloc_pages(arg);
+        pmm_free_pages(p, arg);
+    }
+}
+
+// Every other page of the lower half taken: order-0 requests find single
+// free pages, larger ones have to split blocks from the untouched rest.
+static void bm_pmm_alloc_fragmented(struct bench *b) {
+    host_boot(layout, 0);
+    uint64_t pages = pmm_free_bytes() / PAGE / 2;
+    uint64_t *held = malloc(pages * sizeof(uint64_t));
+    for (uint64_t i = 0; i < pages; i++) held[i] = (uint64_t)(uintptr_t)pmm_alloc();
+    for (uint64_t i = 0; i < pages; i += 2) pmm_free((void *)(uintptr_t)held[i]);
+    while (bench_next(b)) {
+        void *p = pmm_alloc_pages(arg);
+        pmm_free_pages(p, arg);
+    }
+}
+
+static void bm_pmm_alloc_zeroed(struct bench *b) {
+    host_boot(layout, 0);
+    while (bench_next(b)) pmm_free(pmm_alloc_zeroed());
+}
+
+static void bm_vmm_map_page(struct bench *b) {
+    host_boot_vm(layout);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    uint64_t virt = VMM_USER_BASE;
+    while (bench_next(b)) {
+        vmm_map_page(as.pml4, virt, 0x200000, VMM_PRESENT | VMM_WRITABLE | VMM_USER);
+        virt += PAGE;
+    }
+}
+
+// `arg` MiB per call, 2 MiB aligned.
+static void bm_vmm_map_range(struct bench *b) {
+    host_boot_vm(layout);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    uint64_t len = (uint64_t)arg * MiB;
+    uint64_t virt = VMM_USER_BASE;
+    b->max_iters = (64ULL << 30) / len;  // stay in the user half
+    while (bench_next(b)) {
+        vmm_map_range(as.pml4, virt, 0, len, VMM_PRESENT | VMM_WRITABLE | VMM_USER);
+        virt += len;
+    }
+}
+
+// Map and unmap `arg` pages; the last unmap frees the page table again.
+static void bm_vmm_map_unmap(struct bench *b) {
+    host_boot_vm(layout);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    vmm_space_switch(&as);
+    uint64_t virt = VMM_USER_BASE + 2 * MiB;
+    while (bench_next(b)) {
+        for (unsigned i = 0; i < arg; i++)
+            vmm_map_page(as.pml4, virt + i * PAGE, 0x200000, VMM_PRESENT | VMM_USER);
+        vmm_unmap_range(&as, virt, arg * PAGE);
+    }
+}
+
+static void bm_vmm_fault_zero_fill(struct bench *b) {
+    host_boot_vm(layout);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    uint64_t len = 1 * GiB;
+    CHECK(vmm_reserve(&as, VMM_USER_BASE, len, VMM_WRITABLE | VMM_USER) == 0);
+    vmm_space_switch(&as);
+    b->max_iters = len / PAGE;
+    uint64_t virt = VMM_USER_BASE;
+    while (bench_next(b)) {
+        vmm_handle_fault(virt, 6);  // user write
+        virt += PAGE;
+    }
+}
+
+// Clone and destroy a space with `arg` private pages.
+static void bm_vmm_clone(struct bench *b) {
+    host_boot_vm(layout);
+    struct vmm_space as, copy;
+    CHECK(vmm_space_create(&as) == 0);
+    CHECK(vmm_reserve(&as, VMM_USER_BASE, arg * PAGE, VMM_WRITABLE | VMM_USER) == 0);
+    vmm_space_switch(&as);
+    for (unsigned i = 0; i < arg; i++) vmm_handle_fault(VMM_USER_BASE + i * PAGE, 6);
+    while (bench_next(b)) {
+        vmm_space_clone(&copy, &as);
+        vmm_space_destroy(&copy);
+    }
+}
+
+// --- driver --------------------------------------------------------------
+
+static const struct {
+    const char *name;
+    void (*fn)(struct bench *);
+    const char *layout;  // NULL: every layout
+    unsigned arg;
+} benches[] = {
+    { "pmm_init", bm_pmm_init, NULL, 0 },
+    { "pmm_alloc_free/order:0", bm_pmm_alloc_free, "holes-6g", 0 },
+    { "pmm_alloc_free/order:4", bm_pmm_alloc_free, "holes-6g", 4 },
+    { "pmm_alloc_free/order:9", bm_pmm_alloc_free, "holes-6g", 9 },
+    { "pmm_alloc_fragmented/order:0", bm_pmm_alloc_fragmented, "holes-6g", 0 },
+    { "pmm_alloc_fragmented/order:1", bm_pmm_alloc_fragmented, "holes-6g", 1 },
+    { "pmm_alloc_zeroed", bm_pmm_alloc_zeroed, "holes-6g", 0 },
+    { "vmm_map_page", bm_vmm_map_page, "holes-6g", 0 },
+    { "vmm_map_range/MiB:2", bm_vmm_map_range, "holes-6g", 2 },
+    { "vmm_map_range/MiB:1024", bm_vmm_map_range, "holes-6g", 1024 },
+    { "vmm_map_unmap/pages:1", bm_vmm_map_unmap, "holes-6g", 1 },
+    { "vmm_map_unmap/pages:64", bm_vmm_map_unmap, "holes-6g", 64 },
+    { "vmm_fault_zero_fill", bm_vmm_fault_zero_fill, "holes-6g", 0 },
+    { "vmm_clone/pages:256", bm_vmm_clone, "holes-6g", 256 },
+};
+
+static uint32_t current;
+
+static void run_current(void) {
+    struct bench b = { 0 };
+    char name[96];
+    arg = benches[current].arg;
+    benches[current].fn(&b);
+    snprintf(name, sizeof(name), "%s/%s", benches[current].name, layout->name);
+    bench_report(&b, name);
+}
+
+int main(int argc, char **argv) {
+    const char *only = argc > 1 ? argv[1] : NULL;
+    int failed = 0;
+    printf("TSC: %.3f GHz\n", host_tsc_per_ns());
+    printf("%-36s %12s %12s %10s %10s\n", "Benchmark", "Time (ns)", "Iterations", "p50 (cyc)",
+           "p99 (cyc)");
+    printf("----------------------------------------------------------------------------------\n");
+    for (current = 0; current < sizeof(benches) / sizeof(benches[0]); current++) {
+        if (only && !strstr(benches[current].name, only)) continue;
+        for (uint32_t l = 0; l < host_layout_count; l++) {
+            if (benches[current].layout && strcmp(host_layouts[l].name, benches[current].layout) != 0)
+                continue;
+            layout = &host_layouts[l];
+            failed += host_fork(run_current);
+        }
+    }
+    return failed ? 1 : 0;
+}
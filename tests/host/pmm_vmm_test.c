@@ -0,0 +1,749 @@
+#define _GNU_SOURCE
+#include "harness.h"
+#include "initrd.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE HOST_PAGE_SIZE
+#define MiB (1024ULL * 1024)
+#define GiB (1024 * MiB)
+
+// Layout for the current test case (set before each fork).
+static const struct host_layout *layout;
+
+// --- helpers -------------------------------------------------------------
+
+struct range {
+    uint64_t start, end;  // pages
+};
+
+static int range_cmp(const void *a, const void *b) {
+    const struct range *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Pages the PMM should hand out: whole pages of available entries, merged,
+// from `first_page` up. Everything below that is low memory, kernel,
+// boot information and metadata.
+static uint64_t expected_free_pages(const struct host_layout *l, uint64_t first_page) {
+    struct range r[HOST_MAX_ENTRIES];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < l->count; i++) {
+        const struct multiboot2_mmap_entry *e = &l->entries[i];
+        if (e->type != MULTIBOOT2_MEMORY_AVAILABLE) continue;
+        r[n].start = (e->addr + PAGE - 1) / PAGE;
+        r[n].end = (e->addr + e->len) / PAGE;
+        if (r[n].start < r[n].end) n++;
+    }
+    qsort(r, n, sizeof(r[0]), range_cmp);
+    uint64_t pages = 0, covered = first_page;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t s = r[i].start > covered ? r[i].start : covered;
+        if (s < r[i].end) {
+            pages += r[i].end - s;
+            covered = r[i].end;
+        }
+    }
+    return pages;
+}
+
+// One bit per page of the layout, for catching double allocations.
+static uint64_t *page_bits;
+
+static void bits_alloc(void) {
+    uint64_t pages = host_layout_top(layout) / PAGE;
+    page_bits = calloc((pages + 63) / 64, sizeof(uint64_t));
+    CHECK(page_bits != NULL);
+}
+
+static int bit_test(uint64_t p) {
+    return (page_bits[p / 64] >> (p % 64)) & 1;
+}
+
+static void bit_set(uint64_t p, int v) {
+    if (v) page_bits[p / 64] |= 1ULL << (p % 64);
+    else page_bits[p / 64] &= ~(1ULL << (p % 64));
+}
+
+// Claim the pages of a block in the shadow map, checking it is new, free
+// memory above the metadata.
+static void claim(uint64_t phys, unsigned order) {
+    CHECK((phys & ((PAGE << order) - 1)) == 0);
+    CHECK(phys >= pmm_metadata_end());
+    for (uint64_t i = 0; i < (1ULL << order); i++) {
+        uint64_t p = phys / PAGE + i;
+        CHECK(host_page_available(layout, p * PAGE));
+        CHECK(!bit_test(p));
+        bit_set(p, 1);
+    }
+}
+
+static void release(uint64_t phys, unsigned order) {
+    for (uint64_t i = 0; i < (1ULL << order); i++) bit_set(phys / PAGE + i, 0);
+}
+
+// Allocate and free back every max-order block: a measure of how well
+// free memory is coalesced.
+static uint64_t count_max_blocks(void) {
+    uint64_t n = 0;
+    void *head = NULL;
+    void *p;
+    while ((p = pmm_alloc_pages(PMM_MAX_ORDER)) != NULL) {
+        *(void **)p = head;
+        head = p;
+        n++;
+    }
+    while (head) {
+        void *next = *(void **)head;
+        pmm_free_pages(head, PMM_MAX_ORDER);
+        head = next;
+    }
+    return n;
+}
+
+// Page-table walk: physical address behind `virt` and its leaf entry, or
+// 0 if unmapped.
+static uint64_t translate(uint64_t *pml4, uint64_t virt, uint64_t *leaf, uint64_t *size) {
+    uint64_t *table = pml4;
+    for (int level = 4; level >= 1; level--) {
+        uint64_t sz = 1ULL << (12 + 9 * (level - 1));
+        uint64_t e = table[(virt >> (12 + 9 * (level - 1))) & 0x1FF];
+        if (!(e & VMM_PRESENT)) return 0;
+        if (level == 1 || (level <= 3 && (e & (1ULL << 7)))) {
+            if (leaf) *leaf = e;
+            if (size) *size = sz;
+            uint64_t mask = level == 1 ? 0x000FFFFFFFFFF000ULL : 0x000FFFFFFFFFE000ULL & ~(sz - 1);
+            return (e & mask) + (virt & (sz - 1));
+        }
+        table = vmm_phys_to_virt(e & 0x000FFFFFFFFFF000ULL);
+    }
+    return 0;
+}
+
+// --- PMM -----------------------------------------------------------------
+
+static void test_pmm_init(void) {
+    host_boot(layout, 0);
+    uint32_t count;
+    const struct pmm_region *r = pmm_regions(&count);
+    CHECK(count == layout->count);
+    for (uint32_t i = 1; i < count; i++) CHECK(r[i - 1].base <= r[i].base);
+    CHECK(pmm_total_bytes() == host_layout_top(layout) / PAGE * PAGE);
+    CHECK(pmm_metadata_end() > HOST_KERNEL_END);
+    uint64_t first = (pmm_metadata_end() + PAGE - 1) / PAGE;
+    CHECK(pmm_free_bytes() == expected_free_pages(layout, first) * PAGE);
+}
+
+static void test_pmm_drain(void) {
+    host_boot(layout, 0);
+    bits_alloc();
+    uint64_t free0 = pmm_free_bytes();
+    uint64_t blocks0 = count_max_blocks();
+    CHECK(pmm_free_bytes() == free0);
+
+    uint64_t n = 0;
+    void *p;
+    while ((p = pmm_alloc()) != NULL) {
+        claim((uint64_t)(uintptr_t)p, 0);
+        n++;
+    }
+    CHECK(n * PAGE == free0);
+    CHECK(pmm_free_bytes() == 0);
+    CHECK(pmm_alloc_pages(3) == NULL);
+
+    // Free in an order that forces every merge to wait for its buddy.
+    uint64_t pages = host_layout_top(layout) / PAGE;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint64_t i = (uint64_t)pass; i < pages; i += 2) {
+            if (bit_test(i)) {
+                pmm_free((void *)(uintptr_t)(i * PAGE));
+                bit_set(i, 0);
+            }
+        }
+    }
+    CHECK(pmm_free_bytes() == free0);
+    CHECK(count_max_blocks() == blocks0);
+}
+
+static void test_pmm_orders(void) {
+    host_boot(layout, 0);
+    uint64_t free0 = pmm_free_bytes();
+    for (unsigned k = 0; k <= PMM_MAX_ORDER; k++) {
+        void *p = pmm_alloc_pages(k);
+        CHECK(p != NULL);
+        CHECK(((uint64_t)(uintptr_t)p & ((PAGE << k) - 1)) == 0);
+        CHECK(pmm_free_bytes() == free0 - (PAGE << k));
+        pmm_free_pages(p, k);
+        CHECK(pmm_free_bytes() == free0);
+    }
+    CHECK(pmm_alloc_pages(PMM_MAX_ORDER + 1) == NULL);
+}
+
+static void test_pmm_bad_frees(void) {
+    host_boot(layout, 0);
+    uint64_t free0 = pmm_free_bytes();
+    void *p = pmm_alloc_pages(3);
+    CHECK(p != NULL);
+    uint8_t *b = p;
+
+    pmm_free_pages(b + PAGE, 3);  // misaligned for its order
+    CHECK(pmm_free_bytes() == free0 - 8 * PAGE);
+    pmm_free_pages(b, 4);         // larger than what was allocated
+    CHECK(pmm_free_bytes() == free0 - 8 * PAGE);
+    pmm_free((void *)(uintptr_t)pmm_total_bytes());  // past the end
+    CHECK(pmm_free_bytes() == free0 - 8 * PAGE);
+
+    pmm_free_pages(p, 3);
+    CHECK(pmm_free_bytes() == free0);
+    pmm_free_pages(p, 3);         // double free
+    CHECK(pmm_free_bytes() == free0);
+}
+
+static void test_pmm_refcount(void) {
+    host_boot(layout, 0);
+    uint64_t free0 = pmm_free_bytes();
+    uint64_t p = (uint64_t)(uintptr_t)pmm_alloc();
+    CHECK(pmm_page_refcount(p) == 0);
+    pmm_page_ref(p);
+    pmm_page_ref(p);
+    CHECK(pmm_page_refcount(p) == 2);
+    CHECK(pmm_page_unref(p) == 1);
+    CHECK(pmm_free_bytes() == free0 - PAGE);
+    CHECK(pmm_page_unref(p) == 0);
+    CHECK(pmm_free_bytes() == free0);
+    CHECK(pmm_page_unref(p) == 0);  // unmanaged now: no effect
+    CHECK(pmm_free_bytes() == free0);
+}
+
+// Boot information two pages past the kernel: the metadata does not fit
+// in the gap and must go after it, and the gap stays allocatable.
+static void test_pmm_mb_gap(void) {
+    uint64_t mb = host_boot(layout, HOST_KERNEL_END + 2 * PAGE);
+    CHECK(pmm_metadata_end() > mb + PAGE);
+    bits_alloc();
+    void *p;
+    while ((p = pmm_alloc()) != NULL) {
+        uint64_t a = (uint64_t)(uintptr_t)p;
+        CHECK(a >= HOST_KERNEL_END);
+        CHECK(a != mb);
+        if (a >= pmm_metadata_end()) claim(a, 0);
+        else CHECK(a < mb);
+    }
+    CHECK(*(uint32_t *)(uintptr_t)(mb + 8) == MULTIBOOT2_TAG_TYPE_MMAP);  // not overwritten
+}
+
+// Only a quarter megabyte of RAM past the kernel, the rest above 16 MiB:
+// the metadata goes to the first available region it fits in.
+static const struct host_layout tight_low = { "tight-low", 3, {
+    { 0, 0x9F000, MULTIBOOT2_MEMORY_AVAILABLE, 0 },
+    { 1 * MiB, 1 * MiB + 256 * 1024, MULTIBOOT2_MEMORY_AVAILABLE, 0 },
+    { 16 * MiB, 8 * GiB - 16 * MiB, MULTIBOOT2_MEMORY_AVAILABLE, 0 },
+} };
+
+// Same, but the big region starts above the boot identity map: nothing
+// below 1 GiB can hold metadata for 64 GiB, so the PMM manages less.
+static const struct host_layout tight_capped = { "tight-capped", 3, {
+    { 0, 0x9F000, MULTIBOOT2_MEMORY_AVAILABLE, 0 },
+    { 1 * MiB, 1 * MiB + 256 * 1024, MULTIBOOT2_MEMORY_AVAILABLE, 0 },
+    { 4 * GiB, 60 * GiB, MULTIBOOT2_MEMORY_AVAILABLE, 0 },
+} };
+
+static void test_pmm_metadata_placement(void) {
+    layout = &tight_low;
+    host_boot(layout, 0);
+    uint64_t end = pmm_metadata_end();
+    CHECK(end > 16 * MiB && end <= 1 * GiB);
+    CHECK(pmm_total_bytes() == 8 * GiB);
+    CHECK(pmm_unmanaged_bytes() == 0);
+    uint64_t free0 = pmm_free_bytes(), n = 0;
+    void *p;
+    while ((p = pmm_alloc()) != NULL) {
+        uint64_t a = (uint64_t)(uintptr_t)p;
+        CHECK(host_page_available(layout, a));
+        CHECK(a > HOST_KERNEL_END);  // not the boot information either
+        CHECK(a < 16 * MiB || a >= end);
+        n++;
+    }
+    CHECK(n * PAGE == free0);
+}
+
+static void test_pmm_metadata_capped(void) {
+    layout = &tight_capped;
+    host_boot(layout, 0);
+    CHECK(pmm_metadata_end() <= 2 * MiB + 256 * 1024);
+    CHECK(pmm_total_bytes() > 0 && pmm_total_bytes() < 4 * GiB);
+    CHECK(pmm_unmanaged_bytes() == 60 * GiB);
+    void *p;
+    while ((p = pmm_alloc()) != NULL) {
+        uint64_t a = (uint64_t)(uintptr_t)p;
+        CHECK(host_page_available(layout, a));
+        CHECK(a >= pmm_metadata_end() && a < 4 * GiB);
+    }
+}
+
+#define STRESS_OPS  200000
+#define STRESS_LIVE 4096
+
+static void test_pmm_stress(void) {
+    host_boot(layout, 0);
+    bits_alloc();
+    uint64_t free0 = pmm_free_bytes();
+    uint64_t blocks0 = count_max_blocks();
+    static uint64_t addr[STRESS_LIVE];
+    static uint8_t order[STRESS_LIVE];
+    uint32_t live = 0;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+    for (uint32_t op = 0; op < STRESS_OPS; op++) {
+        uint64_t r = host_rand(&seed);
+        if (live < STRESS_LIVE && (live == 0 || (r & 1))) {
+            // Mostly small blocks, now and then a big one.
+            unsigned k = (r >> 8) % 16 == 0 ? (unsigned)((r >> 16) % (PMM_MAX_ORDER + 1))
+                                            : (unsigned)((r >> 16) % 3);
+            void *p = pmm_alloc_pages(k);
+            if (!p) continue;
+            claim((uint64_t)(uintptr_t)p, k);
+            addr[live] = (uint64_t)(uintptr_t)p;
+            order[live++] = (uint8_t)k;
+        } else {
+            uint32_t i = (uint32_t)((r >> 8) % live);
+            pmm_free_pages((void *)(uintptr_t)addr[i], order[i]);
+            release(addr[i], order[i]);
+            addr[i] = addr[--live];
+            order[i] = order[live];
+        }
+    }
+    while (live) {
+        live--;
+        pmm_free_pages((void *)(uintptr_t)addr[live], order[live]);
+    }
+    CHECK(pmm_free_bytes() == free0);
+    CHECK(count_max_blocks() == blocks0);
+}
+
+static void test_pmm_zero_pool(void) {
+    host_boot(layout, 0);
+    // Dirty some pages so a missing clear would show.
+    for (int i = 0; i < 128; i++) {
+        uint8_t *p = pmm_alloc();
+        memset(p, 0xA5, PAGE);
+        pmm_free(p);
+    }
+    uint64_t free0 = pmm_free_bytes();
+    uint32_t added = pmm_zero_pool_refill(1000);
+    struct pmm_zero_stats zs;
+    pmm_zero_pool_stats(&zs);
+    CHECK(added == zs.capacity && zs.count == zs.capacity);
+    CHECK(pmm_free_bytes() == free0 - added * PAGE);
+    for (uint32_t i = 0; i < zs.capacity + 4; i++) {
+        uint64_t *p = pmm_alloc_zeroed();
+        for (uint32_t w = 0; w < PAGE / 8; w++) CHECK(p[w] == 0);
+    }
+    pmm_zero_pool_stats(&zs);
+    CHECK(zs.hits == zs.capacity && zs.misses == 4);
+}
+
+// --- initrd --------------------------------------------------------------
+
+#define TAR_BYTES (300 * 1024)
+#define MODULE_AT (HOST_KERNEL_END + 4 * PAGE)  // GRUB's spot, after the boot info
+
+static uint8_t tar[TAR_BYTES];
+
+// Append a ustar entry; returns the new end of the archive.
+static uint64_t tar_add(uint64_t off, const char *name, char type, const void *data, uint64_t size) {
+    uint8_t *h = tar + off;
+    memset(h, 0, 512);
+    strcpy((char *)h, name);
+    snprintf((char *)h + 100, 8, "%07o", 0644);
+    snprintf((char *)h + 124, 12, "%011llo", (unsigned long long)size);
+    h[156] = (uint8_t)type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++) sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    memcpy(h + 512, data, size);
+    return off + 512 + ((size + 511) & ~511ULL);
+}
+
+// Files of 0, 1, 600 and 200000 bytes, a directory, and names with and
+// without "./"; one module, loaded just past the boot information.
+static uint64_t make_initrd(void) {
+    static uint8_t big[200000];
+    for (uint32_t i = 0; i < sizeof(big); i++) big[i] = (uint8_t)(i * 7);
+    uint64_t off = 0;
+    off = tar_add(off, "./", '5', NULL, 0);
+    off = tar_add(off, "./zeta.txt", '0', "z", 1);
+    off = tar_add(off, "./data/", '5', NULL, 0);
+    off = tar_add(off, "./data/big.bin", '0', big, sizeof(big));
+    off = tar_add(off, "alpha.txt", '0', "hello, initrd\n", 14);
+    off = tar_add(off, "./empty", 0, NULL, 0);
+    char mid[600];
+    memset(mid, 'm', sizeof(mid));
+    off = tar_add(off, "./data/mid.txt", '0', mid, sizeof(mid));
+    off += 1024;  // two zero blocks end the archive
+    host_modules[0] = (struct host_module){ MODULE_AT, tar, off, "initrd" };
+    host_module_count = 1;
+    return off;
+}
+
+static void test_pmm_modules(void) {
+    uint64_t size = make_initrd();
+    host_boot(layout, 0);
+    CHECK(pmm_metadata_end() >= MODULE_AT + size);
+    // Only the pages right next to the module get written: a stray write
+    // there is what an off-by-one in the reservation would look like.
+    uint64_t below = MODULE_AT - PAGE, above = (MODULE_AT + size + PAGE - 1) & ~(PAGE - 1);
+    void *p;
+    while ((p = pmm_alloc()) != NULL) {
+        uint64_t a = (uint64_t)(uintptr_t)p;
+        CHECK(a + PAGE <= MODULE_AT || a >= MODULE_AT + size);
+        if (a == below || a == above) memset(p, 0xEE, PAGE);
+    }
+    CHECK(memcmp((void *)(uintptr_t)MODULE_AT, tar, size) == 0);
+}
+
+// More modules than the PMM has reserved-range slots, a page apart: every
+// module page must stay reserved even once ranges get merged.
+#define MANY_MODULES 24
+#define MANY_MODULES_AT (64 * MiB)
+
+static void test_pmm_many_modules(void) {
+    static uint8_t pages[MANY_MODULES][PAGE];
+    for (uint32_t i = 0; i < MANY_MODULES; i++) {
+        memset(pages[i], (int)i + 1, PAGE);
+        host_modules[i] = (struct host_module){ MANY_MODULES_AT + 2 * i * PAGE, pages[i], PAGE, "m" };
+    }
+    host_module_count = MANY_MODULES;
+    host_boot(layout, 0);
+    void *p;
+    while ((p = pmm_alloc()) != NULL) {
+        uint64_t a = (uint64_t)(uintptr_t)p;
+        if (a >= MANY_MODULES_AT && a < MANY_MODULES_AT + 2 * MANY_MODULES * PAGE)
+            CHECK((a - MANY_MODULES_AT) / PAGE % 2 == 1);
+    }
+    for (uint32_t i = 0; i < MANY_MODULES; i++)
+        CHECK(memcmp((void *)(uintptr_t)host_modules[i].start, pages[i], PAGE) == 0);
+}
+
+static void test_initrd(void) {
+    uint64_t size = make_initrd();
+    host_boot_vm(layout);
+    CHECK(host_cpu.cr0 & (1ULL << 16));  // CR0.WP: read-only binds ring 0
+    CHECK(initrd_init(HOST_KERNEL_END) == 5);
+
+    uint32_t count;
+    const struct initrd_file *f = initrd_files(&count);
+    static const char *const names[] = { "alpha.txt", "data/big.bin", "data/mid.txt", "empty", "zeta.txt" };
+    CHECK(count == 5);
+    for (uint32_t i = 0; i < count; i++) {
+        CHECK(strcmp(f[i].name, names[i]) == 0);
+        CHECK(initrd_find(names[i]) == &f[i]);
+        // In place: pointers into the module, not copies.
+        uint64_t phys = vmm_virt_to_phys(f[i].data);
+        CHECK(phys >= MODULE_AT && phys + f[i].size <= MODULE_AT + size);
+    }
+    const struct initrd_file *a = initrd_find("/alpha.txt");
+    CHECK(a && a->size == 14 && memcmp(a->data, "hello, initrd\n", 14) == 0);
+    const struct initrd_file *b = initrd_find("data/big.bin");
+    CHECK(b && b->size == 200000 && b->data[199999] == (uint8_t)(199999 * 7));
+    CHECK(initrd_find("data") == NULL && initrd_find("nope") == NULL && initrd_find("") == NULL);
+
+    // Read-only in every kernel view of the module.
+    uint64_t *pml4 = vmm_get_pml4();
+    for (uint64_t off = 0; off < size; off += PAGE) {
+        uint64_t leaf;
+        CHECK(translate(pml4, VMM_DIRECT_MAP_BASE + MODULE_AT + off, &leaf, NULL) == MODULE_AT + off);
+        CHECK(!(leaf & VMM_WRITABLE));
+    }
+    // Its neighbours keep write access.
+    uint64_t leaf;
+    CHECK(translate(pml4, VMM_DIRECT_MAP_BASE + MODULE_AT + ((size + PAGE - 1) & ~(PAGE - 1)), &leaf, NULL));
+    CHECK(leaf & VMM_WRITABLE);
+
+    struct initrd_stats st;
+    initrd_get_stats(&st);
+    CHECK(st.modules == 1 && st.files == 5 && st.bytes == size && st.writable == 0);
+}
+
+// With no frame left for a page table, the direct map cannot be split to
+// drop write access: the files are still served and the failure counted.
+static void test_initrd_unprotected(void) {
+    make_initrd();
+    host_boot_vm(layout);
+    while (pmm_alloc() != NULL) continue;
+    CHECK(initrd_init(HOST_KERNEL_END) == 5);
+    CHECK(initrd_find("alpha.txt") != NULL);
+    struct initrd_stats st;
+    initrd_get_stats(&st);
+    CHECK(st.writable == 1);
+}
+
+// A damaged header ends the archive: what came before is still served.
+static void test_initrd_corrupt(void) {
+    uint64_t size = make_initrd();
+    uint8_t *alpha = memmem(tar, size, "alpha.txt", 9);
+    CHECK(alpha != NULL);
+    alpha[0] ^= 1;
+    host_boot_vm(layout);
+    CHECK(initrd_init(HOST_KERNEL_END) == 2);
+    CHECK(initrd_find("zeta.txt") && initrd_find("data/big.bin") && !initrd_find("alpha.txt"));
+}
+
+// --- VMM -----------------------------------------------------------------
+
+static void test_vmm_init(void) {
+    host_boot_vm(layout);
+    uint64_t *pml4 = vmm_get_pml4();
+    // Kernel image identity mapped, all RAM in the direct map.
+    CHECK(translate(pml4, HOST_KERNEL_START, NULL, NULL) == HOST_KERNEL_START);
+    uint64_t top = host_layout_top(layout) - PAGE;
+    CHECK(translate(pml4, VMM_DIRECT_MAP_BASE + top, NULL, NULL) == top);
+    CHECK(translate(pml4, VMM_FRAMEBUFFER_VIRT, NULL, NULL) == 0xB8000);
+    if (vmm_pat_enabled()) CHECK(host_cpu.msr_pat == 0x0007040100070406ULL);
+}
+
+static void test_vmm_map(void) {
+    host_boot_vm(layout);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    uint64_t seed = 42;
+    for (int i = 0; i < 2000; i++) {
+        uint64_t virt = VMM_USER_BASE + (host_rand(&seed) % (1ULL << 36)) * PAGE;
+        uint64_t phys = (host_rand(&seed) % (1ULL << 28)) * PAGE;
+        vmm_map_page(as.pml4, virt, phys, VMM_PRESENT | VMM_WRITABLE | VMM_USER);
+        uint64_t leaf, size;
+        CHECK(translate(as.pml4, virt + 123, &leaf, &size) == phys + 123);
+        CHECK(size == PAGE && (leaf & VMM_USER) && (leaf & VMM_WRITABLE));
+    }
+    // The kernel half is shared.
+    CHECK(translate(as.pml4, HOST_KERNEL_START, NULL, NULL) == HOST_KERNEL_START);
+    vmm_space_destroy(&as);
+}
+
+static void test_vmm_large(void) {
+    host_boot_vm(layout);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    struct vmm_map_stats s0, s1;
+    vmm_get_map_stats(&s0);
+
+    // 4 KiB head, 2 MiB leaves up to 1 GiB, a 1 GiB leaf, 2 MiB and 4 KiB tail.
+    uint64_t virt = VMM_USER_BASE + 1 * GiB - 2 * MiB - 3 * PAGE;
+    uint64_t phys = 16 * GiB - 2 * MiB - 3 * PAGE;
+    uint64_t len = 3 * PAGE + 2 * MiB + 1 * GiB + 2 * MiB + 5 * PAGE;
+    CHECK(vmm_map_range(as.pml4, virt, phys, len, VMM_PRESENT | VMM_WRITABLE) == 0);
+    vmm_get_map_stats(&s1);
+    CHECK(s1.leaves_4k - s0.leaves_4k == 8);
+    CHECK(s1.leaves_2m - s0.leaves_2m == (s1.leaves_1g > s0.leaves_1g ? 2 : 2 + 512));
+    for (uint64_t off = 0; off < len; off += 777 * PAGE + 5)
+        CHECK(translate(as.pml4, virt + off, NULL, NULL) == phys + off);
+    CHECK(translate(as.pml4, virt + len, NULL, NULL) == 0);
+
+    // A 4 KiB remap inside a 2 MiB leaf splits it and leaves the rest alone.
+    uint64_t big = VMM_USER_BASE + 1 * GiB - 2 * MiB;
+    vmm_map_page(as.pml4, big + 5 * PAGE, 0x1234000, VMM_PRESENT);
+    uint64_t size;
+    CHECK(translate(as.pml4, big + 5 * PAGE, NULL, &size) == 0x1234000 && size == PAGE);
+    CHECK(translate(as.pml4, big + 6 * PAGE, NULL, &size) == phys + 3 * PAGE + 6 * PAGE);
+    CHECK(size == PAGE);
+
+    // Write-combining in a large leaf moves the PAT bit to bit 12.
+    uint64_t wc = VMM_USER_BASE + 8 * GiB;
+    CHECK(vmm_map_range(as.pml4, wc, 2 * GiB, 2 * MiB, VMM_PRESENT | VMM_WRITABLE | VMM_WRITE_COMBINING) == 0);
+    uint64_t leaf;
+    CHECK(translate(as.pml4, wc + 4096, &leaf, &size) == 2 * GiB + 4096 && size == 2 * MiB);
+    CHECK((leaf & (1ULL << 12)) && (leaf & (1ULL << 7)));
+    vmm_space_destroy(&as);
+}
+
+static void test_vmm_unmap_protect(void) {
+    host_boot_vm(layout);
+    uint64_t free0 = pmm_free_bytes();
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    uint64_t base = VMM_USER_BASE + 3 * GiB;
+    for (int i = 0; i < 600; i++)
+        vmm_map_page(as.pml4, base + (uint64_t)i * 3 * PAGE, 0x200000 + (uint64_t)i * PAGE,
+                     VMM_PRESENT | VMM_WRITABLE | VMM_USER);
+
+    uint64_t inv0 = host_cpu.invlpg;
+    CHECK(vmm_protect_range(&as, base, 600 * 3 * PAGE, VMM_USER) == 0);
+    uint64_t leaf;
+    CHECK(translate(as.pml4, base + 3 * PAGE, &leaf, NULL) == 0x200000 + PAGE);
+    CHECK(!(leaf & VMM_WRITABLE) && (leaf & VMM_USER));
+    CHECK(host_cpu.invlpg >= inv0);  // not loaded: may be deferred to the switch
+
+    struct vmm_tlb_stats t0, t1;
+    vmm_get_tlb_stats(&t0);
+    CHECK(vmm_unmap_range(&as, base, 600 * 3 * PAGE) == 0);
+    vmm_get_tlb_stats(&t1);
+    CHECK(translate(as.pml4, base, NULL, NULL) == 0);
+    CHECK(t1.tables_freed > t0.tables_freed);
+    vmm_space_destroy(&as);
+    CHECK(pmm_free_bytes() == free0);
+}
+
+// Kernel-half changes go to the other CPUs; private lower-half ones do not.
+static uint64_t remote_flushes;
+
+static void count_remote_flush(void) {
+    remote_flushes++;
+}
+
+static void test_vmm_remote_flush(void) {
+    host_boot_vm(layout);
+    vmm_set_remote_flush(count_remote_flush);
+    struct vmm_space as;
+    CHECK(vmm_space_create(&as) == 0);
+    vmm_map_page(as.pml4, VMM_USER_BASE, 0x200000, VMM_PRESENT | VMM_WRITABLE | VMM_USER);
+    CHECK(vmm_unmap_range(&as, VMM_USER_BASE, PAGE) == 0);
+    CHECK(remote_flushes == 0);
+
+    uint64_t va = VMM_DIRECT_MAP_BASE + (uint64_t)(uintptr_t)pmm_alloc();
+    CHECK(vmm_protect_range(vmm_kernel_space(), va, PAGE, 0) == 0);
+    CHECK(remote_flushes == 1);
+    struct vmm_tlb_stats ts;
+    vmm_get_tlb_stats(&ts);
+    CHECK(ts.shootdowns == 1);
+    vmm_space_destroy(&as);
+}
+
+#define PF_WRITE 2
+#define PF_USER  4
+
+static void test_vmm_faults_cow(void) {
+    host_boot_vm(layout);
+    uint64_t free0 = pmm_free_bytes();
+    struct vmm_space a, b;
+    CHECK(vmm_space_create(&a) == 0);
+    uint64_t va = VMM_USER_BASE;
+    CHECK(vmm_reserve(&a, va, 16 * PAGE, VMM_WRITABLE | VMM_USER) == 0);
+    vmm_space_switch(&a);
+
+    // Outside the area: a real fault.
+    CHECK(vmm_handle_fault(va + 16 * PAGE, PF_USER) == 0);
+    // Read: shared zero page, copy-on-write.
+    CHECK(vmm_handle_fault(va, PF_USER) == 1);
+    uint64_t leaf;
+    uint64_t zero = translate(a.pml4, va, &leaf, NULL);
+    CHECK(zero && (leaf & VMM_COW) && !(leaf & VMM_WRITABLE));
+    // Write: private zeroed frame.
+    CHECK(vmm_handle_fault(va, PF_USER | PF_WRITE) == 1);
+    uint64_t frame = translate(a.pml4, va, &leaf, NULL);
+    CHECK(frame != zero && (leaf & VMM_WRITABLE) && pmm_page_refcount(frame) == 1);
+    memset(vmm_phys_to_virt(frame), 0x5A, PAGE);
+
+    // Clone: both sides read-only, sharing the frame.
+    CHECK(vmm_space_clone(&b, &a) == 0);
+    CHECK(pmm_page_refcount(frame) == 2);
+    CHECK(translate(a.pml4, va, &leaf, NULL) == frame && (leaf & VMM_COW));
+    CHECK(translate(b.pml4, va, &leaf, NULL) == frame && (leaf & VMM_COW));
+
+    // Write in the clone copies.
+    vmm_space_switch(&b);
+    CHECK(vmm_handle_fault(va, PF_USER | PF_WRITE) == 1);
+    uint64_t copy = translate(b.pml4, va, &leaf, NULL);
+    CHECK(copy != frame && (leaf & VMM_WRITABLE));
+    CHECK(memcmp(vmm_phys_to_virt(copy), vmm_phys_to_virt(frame), PAGE) == 0);
+    CHECK(pmm_page_refcount(frame) == 1 && pmm_page_refcount(copy) == 1);
+
+    // The original is the last user: write access without a copy.
+    vmm_space_switch(&a);
+    CHECK(vmm_handle_fault(va, PF_USER | PF_WRITE) == 1);
+    CHECK(translate(a.pml4, va, &leaf, NULL) == frame && (leaf & VMM_WRITABLE));
+
+    struct vmm_fault_stats fs;
+    vmm_get_fault_stats(&fs);
+    CHECK(fs.zero_fill == 1 && fs.cow == 1 && fs.minor == 2);
+
+    vmm_space_switch(vmm_kernel_space());
+    vmm_space_destroy(&b);
+    vmm_space_destroy(&a);
+    CHECK(pmm_free_bytes() == free0);
+}
+
+// A user write to a present, writable kernel 4 KiB page is a real fault,
+// not a stale TLB entry to flush and retry.
+static void test_vmm_fault_supervisor(void) {
+    host_boot_vm(layout);
+    uint64_t phys = (uint64_t)(uintptr_t)pmm_alloc();
+    uint64_t va = VMM_DIRECT_MAP_BASE + phys;
+    // Split the direct map down to a 4 KiB page, leaving it writable.
+    CHECK(vmm_protect_range(vmm_kernel_space(), va, PAGE, VMM_WRITABLE) == 0);
+    uint64_t leaf, size;
+    CHECK(translate(vmm_get_pml4(), va, &leaf, &size) == phys);
+    CHECK(size == PAGE && (leaf & VMM_WRITABLE) && !(leaf & VMM_USER));
+
+    CHECK(vmm_handle_fault(va, PF_USER | PF_WRITE) == 0);
+    CHECK(vmm_handle_fault(va, PF_USER) == 0);
+    CHECK(vmm_handle_fault(va, PF_WRITE) == 1);
+}
+
+static void test_vmm_pcid(void) {
+    host_boot_vm(layout);
+    if (!vmm_pcid_enabled()) return;
+    static struct vmm_space s[64];
+    for (int i = 0; i < 64; i++) {
+        CHECK(vmm_space_create(&s[i]) == 0);
+        CHECK(s[i].pcid != 0);
+        for (int j = 0; j < i; j++) CHECK(s[j].pcid != s[i].pcid);
+    }
+    for (int i = 0; i < 64; i++) vmm_space_destroy(&s[i]);
+}
+
+// --- driver --------------------------------------------------------------
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+    int all_layouts;  // otherwise holes-6g only
+} tests[] = {
+    { "pmm_init", test_pmm_init, 1 },
+    { "pmm_drain", test_pmm_drain, 1 },
+    { "pmm_orders", test_pmm_orders, 1 },
+    { "pmm_bad_frees", test_pmm_bad_frees, 0 },
+    { "pmm_refcount", test_pmm_refcount, 0 },
+    { "pmm_mb_gap", test_pmm_mb_gap, 0 },
+    { "pmm_metadata_placement", test_pmm_metadata_placement, 0 },
+    { "pmm_metadata_capped", test_pmm_metadata_capped, 0 },
+    { "pmm_stress", test_pmm_stress, 1 },
+    { "pmm_zero_pool", test_pmm_zero_pool, 0 },
+    { "pmm_modules", test_pmm_modules, 0 },
+    { "pmm_many_modules", test_pmm_many_modules, 0 },
+    { "initrd", test_initrd, 0 },
+    { "initrd_corrupt", test_initrd_corrupt, 0 },
+    { "initrd_unprotected", test_initrd_unprotected, 0 },
+    { "vmm_init", test_vmm_init, 1 },
+    { "vmm_map", test_vmm_map, 0 },
+    { "vmm_large", test_vmm_large, 0 },
+    { "vmm_unmap_protect", test_vmm_unmap_protect, 0 },
+    { "vmm_remote_flush", test_vmm_remote_flush, 0 },
+    { "vmm_faults_cow", test_vmm_faults_cow, 0 },
+    { "vmm_fault_supervisor", test_vmm_fault_supervisor, 0 },
+    { "vmm_pcid", test_vmm_pcid, 0 },
+};
+
+int main(int argc, char **argv) {
+    const char *only = argc > 1 ? argv[1] : NULL;
+    int failed = 0, run = 0;
+    for (uint32_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+        if (only && !strstr(tests[t].name, only)) continue;
+        for (uint32_t l = 0; l < host_layout_count; l++) {
+            if (!tests[t].all_layouts && strcmp(host_layouts[l].name, "holes-6g") != 0) continue;
+            char name[96];
+            snprintf(name, sizeof(name), "%s/%s", tests[t].name, host_layouts[l].name);
+            layout = &host_layouts[l];
+            failed += host_run(name, tests[t].fn);
+            run++;
+        }
+    }
+    printf("%d/%d passed\n", run - failed, run);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Decode a kernel trace dump captured from the serial port.
+
+The kernel's `trace dump` shell command writes lines of the form
+
+    TRACE-BEGIN <version> <tsc_hz> <cpus> <event names...>
+    R <cpu> <tsc> <event> <arg0> <arg1> <arg2>
+    TRACE-END
+
+with every number in hex, mixed in with whatever else went over serial.
+This prints the records with timestamps relative to the first one and a
+per-event summary.
+
+    trace_decode.py serial.log            # records + summary
+    trace_decode.py --summary serial.log  # summary only
+"""
+
+import argparse
+import collections
+import sys
+
+# Argument labels per event, in record order (arg0, arg1, arg2).
+ARG_NAMES = {
+    "pmm_alloc": ("order", "phys", "caller"),
+    "pmm_free": ("order", "phys", "caller"),
+    "vmm_map": ("flags", "virt", "phys"),
+    "irq": ("vector", "cycles", "rip"),
+    "kbd_irq": ("taken", "queued", None),
+}
+
+
+def parse(lines):
+    """Yield (header, records) for every dump found in `lines`."""
+    header = None
+    records = []
+    for line in lines:
+        line = line.strip()
+        start = line.find("TRACE-BEGIN")
+        if start >= 0:
+            fields = line[start:].split()
+            header = {
+                "version": int(fields[1], 16),
+                "tsc_hz": int(fields[2], 16),
+                "cpus": int(fields[3], 16),
+                "events": fields[4:],
+            }
+            records = []
+        elif header is None:
+            continue
+        elif line.startswith("TRACE-END"):
+            yield header, records
+            header = None
+        elif line.startswith("R "):
+            try:
+                cpu, tsc, event, a0, a1, a2 = (int(f, 16) for f in line.split()[1:7])
+            except ValueError:
+                continue  # garbled line
+            records.append((cpu, tsc, event, a0, a1, a2))
+
+
+def event_name(header, event):
+    events = header["events"]
+    return events[event] if event < len(events) else "event%d" % event
+
+
+def format_args(name, args):
+    labels = ARG_NAMES.get(name, ("arg0", "arg1", "arg2"))
+    parts = []
+    for label, value in zip(labels, args):
+        if label is None:
+            continue
+        if label in ("order", "vector", "taken", "queued", "cycles"):
+            parts.append("%s=%d" % (label, value))
+        else:
+            parts.append("%s=%#x" % (label, value))
+    return " ".join(parts)
+
+
+def print_records(header, records, out):
+    if not records:
+        return
+    per_us = max(header["tsc_hz"] / 1e6, 1.0)
+    t0 = records[0][1]
+    for cpu, tsc, event, a0, a1, a2 in records:
+        name = event_name(header, event)
+        out.write("%3d %12.3f  %-10s %s\n" % (cpu, (tsc - t0) / per_us, name,
+                                             format_args(name, (a0, a1, a2))))
+
+
+def print_summary(header, records, out):
+    per_us = max(header["tsc_hz"] / 1e6, 1.0)
+    counts = collections.Counter()
+    irq_cycles = collections.defaultdict(list)
+    alloc_orders = collections.Counter()
+    callers = collections.Counter()
+    for cpu, tsc, event, a0, a1, a2 in records:
+        name = event_name(header, event)
+        counts[name] += 1
+        if name == "irq":
+            irq_cycles[a0].append(a1)
+        elif name == "pmm_alloc":
+            alloc_orders[a0] += 1
+            callers[a2] += 1
+
+    span = (records[-1][1] - records[0][1]) / per_us if records else 0.0
+    out.write("\n%d records over %.1f us on %d CPU(s), TSC %d Hz\n"
+              % (len(records), span, header["cpus"], header["tsc_hz"]))
+    for name, n in counts.most_common():
+        out.write("  %-10s %8d\n" % (name, n))
+    if irq_cycles:
+        out.write("\nIRQ handler cycles per vector:\n")
+        out.write("  vector    count      avg      max\n")
+        for vec in sorted(irq_cycles):
+            c = irq_cycles[vec]
+            out.write("  %#6x %8d %8d %8d\n" % (vec, len(c), sum(c) // len(c), max(c)))
+    if alloc_orders:
+        out.write("\nPage allocations by order: %s\n"
+                  % ", ".join("%d:%d" % kv for kv in sorted(alloc_orders.items())))
+        out.write("Top allocating callers:\n")
+        for addr, n in callers.most_common(5):
+            out.write("  %#018x %8d\n" % (addr, n))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("log", nargs="?", help="serial log (default: stdin)")
+    ap.add_argument("--summary", action="store_true", help="summary only")
+    args = ap.parse_args()
+
+    src = open(args.log, errors="replace") if args.log else sys.stdin
+    found = False
+    for header, records in parse(src):
+        found = True
+        if not args.summary:
+            print_records(header, records, sys.stdout)
+        print_summary(header, records, sys.stdout)
+    if not found:
+        sys.stderr.write("no TRACE-BEGIN/TRACE-END block found\n")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())